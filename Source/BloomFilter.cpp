@@ -0,0 +1,238 @@
+
+// ---------------------------------------------------
+// The FDiffDelete Project
+// Github: https://github.com/shishir993/fdiffdelete
+// Author: Shishir Bhat
+// The MIT License (MIT)
+// Copyright (c) 2014
+//
+
+#include "BloomFilter.h"
+#include "HashFactory.h"
+
+#define BLOOM_FILE_MAGIC        0x464D4C42  // "BLMF"
+#define BLOOM_MIN_BITS          1024
+
+// Layout of a saved filter: this header followed by the bits
+typedef struct _BloomFileHeader
+{
+    DWORD dwMagic;
+    DWORD nBits;
+    DWORD nHashes;
+    DWORD nKeys;
+    UINT64 ullTag;
+
+} BLOOM_FILE_HEADER, *PBLOOM_FILE_HEADER;
+
+HRESULT CreateBloomFilter(_In_ DWORD nMaxKeys, _Out_ PBLOOM_FILTER *ppFilter)
+{
+    SB_ASSERT(ppFilter);
+
+    *ppFilter = NULL;
+
+    // Round up to a power of 2 so that a bit index is a mask away
+    UINT64 nWantBits = max((UINT64)nMaxKeys * BLOOM_BITS_PER_KEY, BLOOM_MIN_BITS);
+    DWORD nBits = BLOOM_MIN_BITS;
+    while (nBits < nWantBits)
+    {
+        if (nBits == 0x80000000)
+        {
+            return E_INVALIDARG;
+        }
+        nBits <<= 1;
+    }
+
+    PBLOOM_FILTER pFilter = (PBLOOM_FILTER)malloc(sizeof(BLOOM_FILTER));
+    if (pFilter == NULL)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    ZeroMemory(pFilter, sizeof(*pFilter));
+    pFilter->pbBits = (PBYTE)calloc(nBits / 8, 1);
+    if (pFilter->pbBits == NULL)
+    {
+        free(pFilter);
+        return E_OUTOFMEMORY;
+    }
+
+    pFilter->nBits = nBits;
+    pFilter->nHashes = BLOOM_NUM_HASHES;
+    *ppFilter = pFilter;
+    return S_OK;
+}
+
+void DestroyBloomFilter(_In_ PBLOOM_FILTER pFilter)
+{
+    SB_ASSERT(pFilter);
+
+    if (pFilter->pvView != NULL)
+    {
+        UnmapViewOfFile(pFilter->pvView);
+        CloseHandle(pFilter->hMapping);
+        CloseHandle(pFilter->hFile);
+    }
+    else
+    {
+        free(pFilter->pbBits);
+    }
+    free(pFilter);
+}
+
+// Bit i of a key is h1 + i * h2, from the two halves of one 64-bit hash
+void BloomFilterAdd(_In_ PBLOOM_FILTER pFilter, _In_bytecount_(cbKey) const void *pvKey, _In_ int cbKey)
+{
+    SB_ASSERT(pFilter->pvView == NULL);
+
+    UINT64 ullHash = HashBytesFNV1a(pvKey, cbKey);
+    DWORD h1 = (DWORD)ullHash;
+    DWORD h2 = (DWORD)(ullHash >> 32) | 1;
+    DWORD dwMask = pFilter->nBits - 1;
+
+    for (DWORD i = 0; i < pFilter->nHashes; ++i)
+    {
+        DWORD iBit = (h1 + (i * h2)) & dwMask;
+        pFilter->pbBits[iBit >> 3] |= (BYTE)(1 << (iBit & 7));
+    }
+    ++(pFilter->nKeys);
+}
+
+BOOL BloomFilterMayContain(_In_ PBLOOM_FILTER pFilter, _In_bytecount_(cbKey) const void *pvKey, _In_ int cbKey)
+{
+    UINT64 ullHash = HashBytesFNV1a(pvKey, cbKey);
+    DWORD h1 = (DWORD)ullHash;
+    DWORD h2 = (DWORD)(ullHash >> 32) | 1;
+    DWORD dwMask = pFilter->nBits - 1;
+
+    for (DWORD i = 0; i < pFilter->nHashes; ++i)
+    {
+        DWORD iBit = (h1 + (i * h2)) & dwMask;
+        if ((pFilter->pbBits[iBit >> 3] & (1 << (iBit & 7))) == 0)
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+HRESULT SaveBloomFilter(_In_ PBLOOM_FILTER pFilter, _In_z_ PCWSTR pszFilepath)
+{
+    SB_ASSERT(pFilter);
+    SB_ASSERT(pszFilepath);
+
+    HRESULT hr = S_OK;
+    DWORD cbWritten;
+
+    HANDLE hFile = CreateFileW(pszFilepath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        logerr(L"Cannot create filter file %s, hr: %x", pszFilepath, hr);
+        return hr;
+    }
+
+    BLOOM_FILE_HEADER stHeader = { BLOOM_FILE_MAGIC, pFilter->nBits, pFilter->nHashes, pFilter->nKeys, pFilter->ullTag };
+    if (!WriteFile(hFile, &stHeader, sizeof(stHeader), &cbWritten, NULL)
+        || !WriteFile(hFile, pFilter->pbBits, pFilter->nBits / 8, &cbWritten, NULL))
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        logerr(L"Cannot write filter file %s, hr: %x", pszFilepath, hr);
+    }
+
+    CloseHandle(hFile);
+    if (FAILED(hr))
+    {
+        DeleteFile(pszFilepath);
+    }
+    return hr;
+}
+
+HRESULT OpenBloomFilter(_In_z_ PCWSTR pszFilepath, _Out_ PBLOOM_FILTER *ppFilter)
+{
+    SB_ASSERT(pszFilepath);
+    SB_ASSERT(ppFilter);
+
+    HRESULT hr = S_OK;
+    HANDLE hMapping = NULL;
+    PVOID pvView = NULL;
+    PBLOOM_FILTER pFilter = NULL;
+    LARGE_INTEGER llFileSize;
+
+    HANDLE hFile = CreateFileW(pszFilepath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        logerr(L"Cannot open filter file %s, hr: %x", pszFilepath, hr);
+        goto error_return;
+    }
+
+    if (!GetFileSizeEx(hFile, &llFileSize) || (llFileSize.QuadPart < sizeof(BLOOM_FILE_HEADER)))
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        goto error_return;
+    }
+
+    hMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (hMapping == NULL)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        logerr(L"Cannot map filter file %s, hr: %x", pszFilepath, hr);
+        goto error_return;
+    }
+
+    pvView = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+    if (pvView == NULL)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        logerr(L"Cannot map view of filter file %s, hr: %x", pszFilepath, hr);
+        goto error_return;
+    }
+
+    PBLOOM_FILE_HEADER pHeader = (PBLOOM_FILE_HEADER)pvView;
+    if ((pHeader->dwMagic != BLOOM_FILE_MAGIC)
+        || (pHeader->nBits < BLOOM_MIN_BITS)
+        || ((pHeader->nBits & (pHeader->nBits - 1)) != 0)
+        || (pHeader->nHashes == 0) || (pHeader->nHashes > 32)
+        || (llFileSize.QuadPart < (LONGLONG)(sizeof(BLOOM_FILE_HEADER) + (pHeader->nBits / 8))))
+    {
+        logerr(L"Not a valid filter file: %s", pszFilepath);
+        hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        goto error_return;
+    }
+
+    pFilter = (PBLOOM_FILTER)malloc(sizeof(BLOOM_FILTER));
+    if (pFilter == NULL)
+    {
+        hr = E_OUTOFMEMORY;
+        goto error_return;
+    }
+
+    pFilter->nBits = pHeader->nBits;
+    pFilter->nHashes = pHeader->nHashes;
+    pFilter->nKeys = pHeader->nKeys;
+    pFilter->ullTag = pHeader->ullTag;
+    pFilter->pbBits = (PBYTE)(pHeader + 1);
+    pFilter->hFile = hFile;
+    pFilter->hMapping = hMapping;
+    pFilter->pvView = pvView;
+
+    *ppFilter = pFilter;
+    return S_OK;
+
+error_return:
+    if (pvView != NULL)
+    {
+        UnmapViewOfFile(pvView);
+    }
+    if (hMapping != NULL)
+    {
+        CloseHandle(hMapping);
+    }
+    if (hFile != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(hFile);
+    }
+
+    *ppFilter = NULL;
+    return hr;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+// ---------------------------------------------------
+// The FDiffDelete Project
+// Github: https://github.com/shishir993/fdiffdelete
+// Author: Shishir Bhat
+// The MIT License (MIT)
+// Copyright (c) 2014
+//
+
+#include "Common.h"
+
+// Bloom filter over byte string keys.
+// Says for sure when a key was never added, and "maybe" otherwise, using about
+// BLOOM_BITS_PER_KEY bits per key for a false positive rate of about 1%.
+// Keys cannot be removed; a filter over a set that shrinks only gets more
+// false positives, never false negatives.
+
+#define BLOOM_BITS_PER_KEY      10
+#define BLOOM_NUM_HASHES        7
+
+typedef struct _BloomFilter
+{
+    // Number of bits, a power of 2
+    DWORD nBits;
+    DWORD nHashes;
+    DWORD nKeys;
+    PBYTE pbBits;
+
+    // Saved with the filter, for the owner to tell which version of its keys the
+    // filter was built from
+    UINT64 ullTag;
+
+    // Set if the bits are a read-only view of a saved filter
+    HANDLE hFile;
+    HANDLE hMapping;
+    PVOID pvView;
+
+} BLOOM_FILTER, *PBLOOM_FILTER;
+
+// Create an empty filter sized for the specified number of keys
+HRESULT CreateBloomFilter(_In_ DWORD nMaxKeys, _Out_ PBLOOM_FILTER *ppFilter);
+void DestroyBloomFilter(_In_ PBLOOM_FILTER pFilter);
+
+void BloomFilterAdd(_In_ PBLOOM_FILTER pFilter, _In_bytecount_(cbKey) const void *pvKey, _In_ int cbKey);
+BOOL BloomFilterMayContain(_In_ PBLOOM_FILTER pFilter, _In_bytecount_(cbKey) const void *pvKey, _In_ int cbKey);
+
+// Write the filter to a file, and map a saved filter back without reading it in.
+// A mapped filter must not be added to.
+HRESULT SaveBloomFilter(_In_ PBLOOM_FILTER pFilter, _In_z_ PCWSTR pszFilepath);
+HRESULT OpenBloomFilter(_In_z_ PCWSTR pszFilepath, _Out_ PBLOOM_FILTER *ppFilter);
@@ -0,0 +1,975 @@
+
+// ---------------------------------------------------
+// The FDiffDelete Project
+// Github: https://github.com/shishir993/fdiffdelete
+// Author: Shishir Bhat
+// The MIT License (MIT)
+// Copyright (c) 2014
+//
+
+#include "ContentCatalog.h"
+#include "FileFormatUtil.h"
+#include "NameKey.h"
+
+#define INIT_CATALOG_ENTRIES        4096
+#define INIT_CATALOG_SLOTS          8192
+
+// Records are buffered up to this size before they are appended
+#define CATALOG_WRITE_BYTES         (1024 * 1024)
+
+// Longest location, a root and a path relative to it
+#define CATALOG_MAX_PATH            (MAX_PATH * 2)
+
+// Bytes at the end of the log that a checkpoint keeps the hash of
+#define CATALOG_TAIL_BYTES          4096
+
+#define CATALOG_ALIGN(cb)           (((cb) + 7) & ~((SIZE_T)7))
+
+static HRESULT _AddPath(_In_ PCONTENT_CATALOG pCatalog, _In_count_(cchPath) PCWSTR pchPath, _In_ DWORD cchPath, _Out_ DWORD *pichPath)
+{
+    HRESULT hr = GrowArray((void**)&pCatalog->pszPaths, &pCatalog->cchMaxPaths, pCatalog->cchPaths + cchPath + 1,
+        INIT_CATALOG_ENTRIES * MAX_PATH / 4, sizeof(WCHAR));
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    CopyMemory(pCatalog->pszPaths + pCatalog->cchPaths, pchPath, cchPath * sizeof(WCHAR));
+    pCatalog->pszPaths[pCatalog->cchPaths + cchPath] = 0;
+
+    *pichPath = pCatalog->cchPaths;
+    pCatalog->cchPaths += cchPath + 1;
+    return S_OK;
+}
+
+// SHA1 bits are already uniform, the first four bytes pick the slot
+static DWORD _SlotOf(_In_bytecount_(HASHLEN_SHA1) const BYTE *pbHash)
+{
+    DWORD dwSlot;
+    CopyMemory(&dwSlot, pbHash, sizeof(dwSlot));
+    return dwSlot;
+}
+
+// A location's slot is picked by both the content and the path
+static DWORD _LocationSlotOf(_In_bytecount_(HASHLEN_SHA1) const BYTE *pbHash, _In_ UINT64 ullPathKey)
+{
+    return _SlotOf(pbHash) ^ (DWORD)(ullPathKey ^ (ullPathKey >> 32));
+}
+
+static DWORD _EntrySlot(_In_ PCONTENT_CATALOG pCatalog, _In_ int iEntry)
+{
+    return _SlotOf(pCatalog->aEntries[iEntry].abHash);
+}
+
+static DWORD _LocationSlot(_In_ PCONTENT_CATALOG pCatalog, _In_ int iLocation)
+{
+    const CATALOG_LOCATION *pLocation = &pCatalog->aLocations[iLocation];
+    return _LocationSlotOf(pCatalog->aEntries[pLocation->iEntry].abHash, pLocation->ullPathKey);
+}
+
+typedef DWORD (*PFN_SLOT_OF)(_In_ PCONTENT_CATALOG pCatalog, _In_ int iIndex);
+
+static void _InsertSlot(_Inout_count_(nSlots) int *aiSlots, _In_ DWORD nSlots, _In_ DWORD dwSlot, _In_ int iIndex)
+{
+    DWORD dwMask = nSlots - 1;
+    DWORD i = dwSlot & dwMask;
+    while (aiSlots[i] != 0)
+    {
+        i = (i + 1) & dwMask;
+    }
+    aiSlots[i] = iIndex + 1;
+}
+
+// Make room in the slots for nNeeded indexes. When the slots grow, the nUsed indexes
+// already in them are inserted again.
+static HRESULT _ReserveSlots(
+    _In_ PCONTENT_CATALOG pCatalog,
+    _Inout_ int **paiSlots,
+    _Inout_ DWORD *pnSlots,
+    _In_ int nUsed,
+    _In_ int nNeeded,
+    _In_ PFN_SLOT_OF pfnSlotOf)
+{
+    if ((DWORD)nNeeded * 2 <= *pnSlots)
+    {
+        return S_OK;
+    }
+
+    DWORD nSlots = (*pnSlots > 0) ? *pnSlots : INIT_CATALOG_SLOTS;
+    while (nSlots < (DWORD)nNeeded * 2)
+    {
+        nSlots *= 2;
+    }
+
+    int *aiSlots = (int*)calloc(nSlots, sizeof(int));
+    if (aiSlots == NULL)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    free(*paiSlots);
+    *paiSlots = aiSlots;
+    *pnSlots = nSlots;
+    for (int i = 0; i < nUsed; ++i)
+    {
+        _InsertSlot(aiSlots, nSlots, pfnSlotOf(pCatalog, i), i);
+    }
+    return S_OK;
+}
+
+static int _FindEntry(_In_ PCONTENT_CATALOG pCatalog, _In_bytecount_(HASHLEN_SHA1) const BYTE *pbHash)
+{
+    if (pCatalog->nSlots == 0)
+    {
+        return -1;
+    }
+
+    DWORD dwMask = pCatalog->nSlots - 1;
+    for (DWORD i = _SlotOf(pbHash) & dwMask; pCatalog->aiSlots[i] != 0; i = (i + 1) & dwMask)
+    {
+        int iEntry = pCatalog->aiSlots[i] - 1;
+        if (memcmp(pCatalog->aEntries[iEntry].abHash, pbHash, HASHLEN_SHA1) == 0)
+        {
+            return iEntry;
+        }
+    }
+    return -1;
+}
+
+static int _FindLocation(
+    _In_ PCONTENT_CATALOG pCatalog,
+    _In_ int iEntry,
+    _In_ UINT64 ullPathKey,
+    _In_count_(cchPath) PCWSTR pchPath,
+    _In_ DWORD cchPath)
+{
+    if (pCatalog->nLocationSlots == 0)
+    {
+        return -1;
+    }
+
+    DWORD dwMask = pCatalog->nLocationSlots - 1;
+    DWORD dwSlot = _LocationSlotOf(pCatalog->aEntries[iEntry].abHash, ullPathKey);
+    for (DWORD i = dwSlot & dwMask; pCatalog->aiLocationSlots[i] != 0; i = (i + 1) & dwMask)
+    {
+        int iLocation = pCatalog->aiLocationSlots[i] - 1;
+        const CATALOG_LOCATION *pLocation = &pCatalog->aLocations[iLocation];
+        if ((pLocation->iEntry == iEntry)
+            && (pLocation->ullPathKey == ullPathKey)
+            && (CompareStringOrdinal(pCatalog->pszPaths + pLocation->ichPath, -1, pchPath, cchPath, TRUE) == CSTR_EQUAL))
+        {
+            return iLocation;
+        }
+    }
+    return -1;
+}
+
+// Key of a path of the log, which is not null terminated
+static UINT64 _GetPathKey(_In_count_(cchPath) PCWSTR pchPath, _In_ DWORD cchPath)
+{
+    WCHAR szPath[CATALOG_MAX_PATH];
+    WCHAR szFolded[CATALOG_MAX_PATH];
+
+    SB_ASSERT(cchPath < ARRAYSIZE(szPath));
+    CopyMemory(szPath, pchPath, cchPath * sizeof(WCHAR));
+    szPath[cchPath] = 0;
+
+    int cch = FoldName(szPath, szFolded, ARRAYSIZE(szFolded));
+    return HashBytesFNV1a(szFolded, cch * sizeof(WCHAR));
+}
+
+static HRESULT _ApplyScanRecord(_In_ PCONTENT_CATALOG pCatalog, _In_ const CATALOG_RECORD *pRecord, _In_count_(pRecord->cchPath) PCWSTR pchRoot)
+{
+    HRESULT hr = GrowArray((void**)&pCatalog->aScans, &pCatalog->nMaxScans, pCatalog->nScans + 1, INIT_CATALOG_ENTRIES, sizeof(CATALOG_SCAN));
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    PCATALOG_SCAN pScan = &pCatalog->aScans[pCatalog->nScans];
+    hr = _AddPath(pCatalog, pchRoot, pRecord->cchPath, &pScan->ichRoot);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    pScan->dwScanId = pRecord->dwScanId;
+    pScan->ftScanned.dwLowDateTime = (DWORD)pRecord->llValue;
+    pScan->ftScanned.dwHighDateTime = (DWORD)(pRecord->llValue >> 32);
+    ++(pCatalog->nScans);
+    return S_OK;
+}
+
+static HRESULT _ApplyFileRecord(_In_ PCONTENT_CATALOG pCatalog, _In_ const CATALOG_RECORD *pRecord, _In_count_(pRecord->cchPath) PCWSTR pchPath)
+{
+    HRESULT hr;
+    int iEntry = _FindEntry(pCatalog, pRecord->abHash);
+    if (iEntry < 0)
+    {
+        hr = GrowArray((void**)&pCatalog->aEntries, &pCatalog->nMaxEntries, pCatalog->nEntries + 1, INIT_CATALOG_ENTRIES, sizeof(CATALOG_ENTRY));
+        if (SUCCEEDED(hr))
+        {
+            hr = _ReserveSlots(pCatalog, &pCatalog->aiSlots, &pCatalog->nSlots, pCatalog->nEntries, pCatalog->nEntries + 1, _EntrySlot);
+        }
+
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+
+        iEntry = (pCatalog->nEntries)++;
+        PCATALOG_ENTRY pNew = &pCatalog->aEntries[iEntry];
+        ZeroMemory(pNew, sizeof(*pNew));
+        CopyMemory(pNew->abHash, pRecord->abHash, sizeof(pNew->abHash));
+        pNew->iFirstLocation = -1;
+        _InsertSlot(pCatalog->aiSlots, pCatalog->nSlots, _EntrySlot(pCatalog, iEntry), iEntry);
+    }
+
+    PCATALOG_ENTRY pEntry = &pCatalog->aEntries[iEntry];
+    pEntry->llSize = pRecord->llValue;
+    pEntry->dwLastScanId = max(pEntry->dwLastScanId, pRecord->dwScanId);
+
+    // The same path seen again is the same location
+    UINT64 ullPathKey = _GetPathKey(pchPath, pRecord->cchPath);
+    int iLocation = _FindLocation(pCatalog, iEntry, ullPathKey, pchPath, pRecord->cchPath);
+    if (iLocation >= 0)
+    {
+        PCATALOG_LOCATION pLocation = &pCatalog->aLocations[iLocation];
+        pLocation->dwLastScanId = max(pLocation->dwLastScanId, pRecord->dwScanId);
+        return S_OK;
+    }
+
+    hr = GrowArray((void**)&pCatalog->aLocations, &pCatalog->nMaxLocations, pCatalog->nLocations + 1, INIT_CATALOG_ENTRIES, sizeof(CATALOG_LOCATION));
+    if (SUCCEEDED(hr))
+    {
+        hr = _ReserveSlots(pCatalog, &pCatalog->aiLocationSlots, &pCatalog->nLocationSlots,
+            pCatalog->nLocations, pCatalog->nLocations + 1, _LocationSlot);
+    }
+
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    PCATALOG_LOCATION pLocation = &pCatalog->aLocations[pCatalog->nLocations];
+    hr = _AddPath(pCatalog, pchPath, pRecord->cchPath, &pLocation->ichPath);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    pLocation->dwLastScanId = pRecord->dwScanId;
+    pLocation->iNext = pEntry->iFirstLocation;
+    pLocation->iEntry = iEntry;
+    pLocation->ullPathKey = ullPathKey;
+
+    iLocation = (pCatalog->nLocations)++;
+    pEntry->iFirstLocation = iLocation;
+    ++(pEntry->nLocations);
+    _InsertSlot(pCatalog->aiLocationSlots, pCatalog->nLocationSlots, _LocationSlot(pCatalog, iLocation), iLocation);
+    return S_OK;
+}
+
+// Apply the whole records of a part of the log. *pcbApplied is where the first
+// record that is cut short or damaged starts, cbLog if there is none.
+static HRESULT _ApplyLog(_In_ PCONTENT_CATALOG pCatalog, _In_bytecount_(cbLog) const BYTE *pbLog, _In_ SIZE_T cbLog, _Out_ SIZE_T *pcbApplied)
+{
+    HRESULT hr = S_OK;
+    SIZE_T ibRecord = 0;
+    while (ibRecord + sizeof(CATALOG_RECORD) <= cbLog)
+    {
+        const CATALOG_RECORD *pRecord = (const CATALOG_RECORD*)(pbLog + ibRecord);
+        if ((pRecord->cchPath == 0) || (pRecord->cchPath >= CATALOG_MAX_PATH))
+        {
+            break;
+        }
+
+        SIZE_T cbRecord = CATALOG_ALIGN(sizeof(CATALOG_RECORD) + (pRecord->cchPath * sizeof(WCHAR)));
+        if (cbRecord > cbLog - ibRecord)
+        {
+            break;
+        }
+
+        // Records of an unknown type are from a later version, and skipped
+        PCWSTR pchPath = (PCWSTR)(pRecord + 1);
+        if (pRecord->dwType == CATREC_SCAN)
+        {
+            hr = _ApplyScanRecord(pCatalog, pRecord, pchPath);
+        }
+        else if (pRecord->dwType == CATREC_FILE)
+        {
+            hr = _ApplyFileRecord(pCatalog, pRecord, pchPath);
+        }
+
+        if (FAILED(hr))
+        {
+            break;
+        }
+        ibRecord += cbRecord;
+    }
+
+    *pcbApplied = ibRecord;
+    return hr;
+}
+
+// Hash the last bytes of the first cbLog bytes of the catalog file, which tell
+// a checkpoint of this log from one of another log
+static HRESULT _HashLogTail(_In_ PCONTENT_CATALOG pCatalog, _In_ UINT64 cbLog, _Out_ UINT64 *pullHash)
+{
+    BYTE abTail[CATALOG_TAIL_BYTES];
+    DWORD cbTail = (DWORD)min(cbLog - sizeof(CATALOG_FILE_HEADER), (UINT64)sizeof(abTail));
+    DWORD cbRead;
+
+    LARGE_INTEGER llOffset;
+    llOffset.QuadPart = (LONGLONG)(cbLog - cbTail);
+    if (!SetFilePointerEx(pCatalog->hFile, llOffset, NULL, FILE_BEGIN)
+        || !ReadFile(pCatalog->hFile, abTail, cbTail, &cbRead, NULL))
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+    if (cbRead != cbTail)
+    {
+        return HRESULT_FROM_WIN32(ERROR_HANDLE_EOF);
+    }
+
+    *pullHash = HashBytesFNV1a(abTail, (int)cbTail);
+    return S_OK;
+}
+
+// Write the tables as they are to the checkpoint file, replacing it only once it
+// is complete
+static HRESULT _WriteCheckpoint(_In_ PCONTENT_CATALOG pCatalog)
+{
+    static const BYTE abPad[8] = {};
+    HANDLE hFile = INVALID_HANDLE_VALUE;
+    CATALOG_CHECKPOINT_HEADER stHeader;
+    WCHAR szTempPath[MAX_PATH];
+
+    HRESULT hr = StringCchPrintf(szTempPath, ARRAYSIZE(szTempPath), L"%s.tmp", pCatalog->szCheckpointPath);
+    if (FAILED(hr))
+    {
+        goto fend;
+    }
+
+    ZeroMemory(&stHeader, sizeof(stHeader));
+    stHeader.dwMagic = CATALOG_CHECKPOINT_MAGIC;
+    stHeader.dwVersion = CATALOG_CHECKPOINT_VERSION;
+    stHeader.cbHeader = sizeof(CATALOG_CHECKPOINT_HEADER);
+    stHeader.cbLog = pCatalog->cbLog;
+    stHeader.nEntries = (DWORD)pCatalog->nEntries;
+    stHeader.nLocations = (DWORD)pCatalog->nLocations;
+    stHeader.nScans = (DWORD)pCatalog->nScans;
+    stHeader.cchPaths = pCatalog->cchPaths;
+    stHeader.ullEntriesOffset = CATALOG_ALIGN(sizeof(CATALOG_CHECKPOINT_HEADER));
+    stHeader.ullLocationsOffset = CATALOG_ALIGN(stHeader.ullEntriesOffset + ((UINT64)stHeader.nEntries * sizeof(CATALOG_ENTRY)));
+    stHeader.ullScansOffset = CATALOG_ALIGN(stHeader.ullLocationsOffset + ((UINT64)stHeader.nLocations * sizeof(CATALOG_LOCATION)));
+    stHeader.ullPathsOffset = CATALOG_ALIGN(stHeader.ullScansOffset + ((UINT64)stHeader.nScans * sizeof(CATALOG_SCAN)));
+
+    hr = _HashLogTail(pCatalog, pCatalog->cbLog, &stHeader.ullTailHash);
+    if (FAILED(hr))
+    {
+        goto fend;
+    }
+
+    hFile = CreateFileW(szTempPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        goto fend;
+    }
+
+    {
+        // Each section is padded up to where the next one starts
+        const void *apvSections[] = { &stHeader, pCatalog->aEntries, pCatalog->aLocations, pCatalog->aScans, pCatalog->pszPaths };
+        UINT64 aullOffsets[] = { 0, stHeader.ullEntriesOffset, stHeader.ullLocationsOffset, stHeader.ullScansOffset, stHeader.ullPathsOffset };
+        UINT64 acbSections[] = {
+            sizeof(CATALOG_CHECKPOINT_HEADER),
+            (UINT64)stHeader.nEntries * sizeof(CATALOG_ENTRY),
+            (UINT64)stHeader.nLocations * sizeof(CATALOG_LOCATION),
+            (UINT64)stHeader.nScans * sizeof(CATALOG_SCAN),
+            (UINT64)stHeader.cchPaths * sizeof(WCHAR) };
+
+        UINT64 cbWritten = 0;
+        for (int i = 0; SUCCEEDED(hr) && (i < ARRAYSIZE(apvSections)); ++i)
+        {
+            hr = WriteAllToFile(hFile, abPad, aullOffsets[i] - cbWritten);
+            if (SUCCEEDED(hr) && (acbSections[i] > 0))
+            {
+                hr = WriteAllToFile(hFile, apvSections[i], acbSections[i]);
+            }
+            cbWritten = aullOffsets[i] + acbSections[i];
+        }
+    }
+
+    CloseHandle(hFile);
+    if (FAILED(hr))
+    {
+        DeleteFile(szTempPath);
+        goto fend;
+    }
+
+    if (!MoveFileEx(szTempPath, pCatalog->szCheckpointPath, MOVEFILE_REPLACE_EXISTING))
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        DeleteFile(szTempPath);
+        goto fend;
+    }
+
+    pCatalog->cbCheckpoint = pCatalog->cbLog;
+    logdbg(L"Wrote catalog checkpoint %s of %I64u bytes of the log", pCatalog->szCheckpointPath, pCatalog->cbLog);
+
+fend:
+    if (FAILED(hr))
+    {
+        logwarn(L"Cannot write catalog checkpoint %s, hr: %x", pCatalog->szCheckpointPath, hr);
+    }
+    return hr;
+}
+
+// A checkpoint is only a shortcut, the catalog works on without a new one
+static void _CheckpointIfDue(_In_ PCONTENT_CATALOG pCatalog)
+{
+    if (pCatalog->cbLog - pCatalog->cbCheckpoint >= CATALOG_CHECKPOINT_BYTES)
+    {
+        _WriteCheckpoint(pCatalog);
+    }
+}
+
+// Do the indexes of the tables loaded from a checkpoint all point inside them? A
+// location's next is always an earlier location, so the lists cannot loop.
+static BOOL _IsCheckpointConsistent(_In_ PCONTENT_CATALOG pCatalog)
+{
+    if ((pCatalog->cchPaths > 0) && (pCatalog->pszPaths[pCatalog->cchPaths - 1] != 0))
+    {
+        return FALSE;
+    }
+
+    for (int i = 0; i < pCatalog->nEntries; ++i)
+    {
+        const CATALOG_ENTRY *pEntry = &pCatalog->aEntries[i];
+        if ((pEntry->iFirstLocation < -1) || (pEntry->iFirstLocation >= pCatalog->nLocations))
+        {
+            return FALSE;
+        }
+    }
+
+    for (int i = 0; i < pCatalog->nLocations; ++i)
+    {
+        const CATALOG_LOCATION *pLocation = &pCatalog->aLocations[i];
+        if ((pLocation->ichPath >= pCatalog->cchPaths)
+            || (pLocation->iNext < -1) || (pLocation->iNext >= i)
+            || (pLocation->iEntry < 0) || (pLocation->iEntry >= pCatalog->nEntries))
+        {
+            return FALSE;
+        }
+    }
+
+    for (int i = 0; i < pCatalog->nScans; ++i)
+    {
+        if (pCatalog->aScans[i].ichRoot >= pCatalog->cchPaths)
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// Load the tables from the checkpoint if it has the first records of this log.
+// Returns FALSE, leaving the catalog empty, if there is no checkpoint that can be used.
+static BOOL _LoadCheckpoint(_In_ PCONTENT_CATALOG pCatalog, _In_ UINT64 cbFile)
+{
+    BOOL fLoaded = FALSE;
+    HANDLE hMapping = NULL;
+    PVOID pvView = NULL;
+    LARGE_INTEGER llSize;
+    const CATALOG_CHECKPOINT_HEADER *pHeader;
+    const BYTE *pbView;
+    UINT64 ullTailHash;
+    HRESULT hr;
+
+    HANDLE hFile = CreateFileW(pCatalog->szCheckpointPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        goto fend;
+    }
+
+    if (!GetFileSizeEx(hFile, &llSize) || (llSize.QuadPart < sizeof(CATALOG_CHECKPOINT_HEADER)))
+    {
+        logwarn(L"Ignoring catalog checkpoint %s, it is cut short", pCatalog->szCheckpointPath);
+        goto fend;
+    }
+
+    hMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (hMapping != NULL)
+    {
+        pvView = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+    }
+    if (pvView == NULL)
+    {
+        logwarn(L"Cannot map catalog checkpoint %s, error: %u", pCatalog->szCheckpointPath, GetLastError());
+        goto fend;
+    }
+
+    pHeader = (const CATALOG_CHECKPOINT_HEADER*)pvView;
+    if ((pHeader->dwMagic != CATALOG_CHECKPOINT_MAGIC)
+        || (pHeader->dwVersion != CATALOG_CHECKPOINT_VERSION)
+        || (pHeader->cbHeader != sizeof(CATALOG_CHECKPOINT_HEADER))
+        || (pHeader->cbLog < sizeof(CATALOG_FILE_HEADER))
+        || (pHeader->nEntries > MAXINT) || (pHeader->nLocations > MAXINT) || (pHeader->nScans > MAXINT)
+        || !IsSectionInFile(pHeader->ullEntriesOffset, pHeader->nEntries, sizeof(CATALOG_ENTRY), sizeof(CATALOG_CHECKPOINT_HEADER), (UINT64)llSize.QuadPart)
+        || !IsSectionInFile(pHeader->ullLocationsOffset, pHeader->nLocations, sizeof(CATALOG_LOCATION), sizeof(CATALOG_CHECKPOINT_HEADER), (UINT64)llSize.QuadPart)
+        || !IsSectionInFile(pHeader->ullScansOffset, pHeader->nScans, sizeof(CATALOG_SCAN), sizeof(CATALOG_CHECKPOINT_HEADER), (UINT64)llSize.QuadPart)
+        || !IsSectionInFile(pHeader->ullPathsOffset, pHeader->cchPaths, sizeof(WCHAR), sizeof(CATALOG_CHECKPOINT_HEADER), (UINT64)llSize.QuadPart))
+    {
+        logwarn(L"Ignoring catalog checkpoint %s, it is not valid", pCatalog->szCheckpointPath);
+        goto fend;
+    }
+
+    if ((pHeader->cbLog > cbFile)
+        || FAILED(_HashLogTail(pCatalog, pHeader->cbLog, &ullTailHash))
+        || (ullTailHash != pHeader->ullTailHash))
+    {
+        logwarn(L"Ignoring catalog checkpoint %s, it is not of this catalog", pCatalog->szCheckpointPath);
+        goto fend;
+    }
+
+    hr = GrowArray((void**)&pCatalog->aEntries, &pCatalog->nMaxEntries, max((int)pHeader->nEntries, 1), INIT_CATALOG_ENTRIES, sizeof(CATALOG_ENTRY));
+    if (SUCCEEDED(hr))
+    {
+        hr = GrowArray((void**)&pCatalog->aLocations, &pCatalog->nMaxLocations, max((int)pHeader->nLocations, 1), INIT_CATALOG_ENTRIES, sizeof(CATALOG_LOCATION));
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = GrowArray((void**)&pCatalog->aScans, &pCatalog->nMaxScans, max((int)pHeader->nScans, 1), INIT_CATALOG_ENTRIES, sizeof(CATALOG_SCAN));
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = GrowArray((void**)&pCatalog->pszPaths, &pCatalog->cchMaxPaths, max(pHeader->cchPaths, 1), INIT_CATALOG_ENTRIES * MAX_PATH / 4, sizeof(WCHAR));
+    }
+    if (FAILED(hr))
+    {
+        logwarn(L"Cannot load catalog checkpoint %s, hr: %x", pCatalog->szCheckpointPath, hr);
+        goto fend;
+    }
+
+    pbView = (const BYTE*)pvView;
+    CopyMemory(pCatalog->aEntries, pbView + pHeader->ullEntriesOffset, pHeader->nEntries * sizeof(CATALOG_ENTRY));
+    CopyMemory(pCatalog->aLocations, pbView + pHeader->ullLocationsOffset, pHeader->nLocations * sizeof(CATALOG_LOCATION));
+    CopyMemory(pCatalog->aScans, pbView + pHeader->ullScansOffset, pHeader->nScans * sizeof(CATALOG_SCAN));
+    CopyMemory(pCatalog->pszPaths, pbView + pHeader->ullPathsOffset, pHeader->cchPaths * sizeof(WCHAR));
+
+    pCatalog->nEntries = (int)pHeader->nEntries;
+    pCatalog->nLocations = (int)pHeader->nLocations;
+    pCatalog->nScans = (int)pHeader->nScans;
+    pCatalog->cchPaths = pHeader->cchPaths;
+    if (!_IsCheckpointConsistent(pCatalog))
+    {
+        logwarn(L"Ignoring catalog checkpoint %s, it is not valid", pCatalog->szCheckpointPath);
+        goto fend;
+    }
+
+    // The slots are not in the checkpoint, they are made again from the tables
+    if (FAILED(_ReserveSlots(pCatalog, &pCatalog->aiSlots, &pCatalog->nSlots, pCatalog->nEntries, pCatalog->nEntries, _EntrySlot))
+        || FAILED(_ReserveSlots(pCatalog, &pCatalog->aiLocationSlots, &pCatalog->nLocationSlots, pCatalog->nLocations, pCatalog->nLocations, _LocationSlot)))
+    {
+        logwarn(L"Out of memory for the slots of catalog checkpoint %s", pCatalog->szCheckpointPath);
+        goto fend;
+    }
+
+    pCatalog->cbLog = pHeader->cbLog;
+    pCatalog->cbCheckpoint = pHeader->cbLog;
+    fLoaded = TRUE;
+
+fend:
+    if (pvView != NULL)
+    {
+        UnmapViewOfFile(pvView);
+    }
+    if (hMapping != NULL)
+    {
+        CloseHandle(hMapping);
+    }
+    if (hFile != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(hFile);
+    }
+
+    if (!fLoaded)
+    {
+        pCatalog->nEntries = 0;
+        pCatalog->nLocations = 0;
+        pCatalog->nScans = 0;
+        pCatalog->cchPaths = 0;
+
+        free(pCatalog->aiSlots);
+        pCatalog->aiSlots = NULL;
+        pCatalog->nSlots = 0;
+        free(pCatalog->aiLocationSlots);
+        pCatalog->aiLocationSlots = NULL;
+        pCatalog->nLocationSlots = 0;
+    }
+    return fLoaded;
+}
+
+// Read the records of an existing catalog, those after the checkpoint if there is
+// one, dropping a damaged tail
+static HRESULT _LoadCatalog(_In_ PCONTENT_CATALOG pCatalog, _In_z_ PCWSTR pszFilepath, _In_ UINT64 cbFile)
+{
+    HRESULT hr = S_OK;
+    PVOID pvView = NULL;
+    SIZE_T cbApplied = 0;
+    UINT64 cbStart = sizeof(CATALOG_FILE_HEADER);
+    const CATALOG_FILE_HEADER *pHeader;
+
+    HANDLE hMapping = CreateFileMapping(pCatalog->hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (hMapping == NULL)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        logerr(L"Cannot map catalog %s, hr: %x", pszFilepath, hr);
+        goto fend;
+    }
+
+    pvView = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+    if (pvView == NULL)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        logerr(L"Cannot map view of catalog %s, hr: %x", pszFilepath, hr);
+        goto fend;
+    }
+
+    pHeader = (const CATALOG_FILE_HEADER*)pvView;
+    if ((cbFile < sizeof(CATALOG_FILE_HEADER))
+        || (pHeader->dwMagic != CATALOG_MAGIC)
+        || (pHeader->dwVersion != CATALOG_VERSION)
+        || (pHeader->cbHeader != sizeof(CATALOG_FILE_HEADER)))
+    {
+        logerr(L"Not a valid catalog file: %s", pszFilepath);
+        hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        goto fend;
+    }
+
+    if (_LoadCheckpoint(pCatalog, cbFile))
+    {
+        cbStart = pCatalog->cbCheckpoint;
+    }
+
+    hr = _ApplyLog(pCatalog, (const BYTE*)pvView + cbStart, (SIZE_T)(cbFile - cbStart), &cbApplied);
+    if (FAILED(hr))
+    {
+        logerr(L"Cannot load catalog %s, hr: %x", pszFilepath, hr);
+        goto fend;
+    }
+
+fend:
+    if (pvView != NULL)
+    {
+        UnmapViewOfFile(pvView);
+    }
+    if (hMapping != NULL)
+    {
+        CloseHandle(hMapping);
+    }
+
+    // Appends go after the last whole record
+    UINT64 cbGood = cbStart + cbApplied;
+    pCatalog->cbLog = cbGood;
+    if (SUCCEEDED(hr) && (cbGood < cbFile))
+    {
+        logwarn(L"Dropping %I64u bytes of damaged records at the end of catalog %s", cbFile - cbGood, pszFilepath);
+
+        LARGE_INTEGER llGood;
+        llGood.QuadPart = (LONGLONG)cbGood;
+        if (!SetFilePointerEx(pCatalog->hFile, llGood, NULL, FILE_BEGIN) || !SetEndOfFile(pCatalog->hFile))
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            logerr(L"Cannot truncate catalog %s, hr: %x", pszFilepath, hr);
+        }
+    }
+    return hr;
+}
+
+HRESULT OpenContentCatalog(_In_z_ PCWSTR pszFilepath, _Out_ PCONTENT_CATALOG *ppCatalog)
+{
+    SB_ASSERT(pszFilepath);
+    SB_ASSERT(ppCatalog);
+
+    HRESULT hr = S_OK;
+    LARGE_INTEGER llFileSize;
+
+    PCONTENT_CATALOG pCatalog = (PCONTENT_CATALOG)malloc(sizeof(CONTENT_CATALOG));
+    if (pCatalog == NULL)
+    {
+        hr = E_OUTOFMEMORY;
+        goto error_return;
+    }
+
+    ZeroMemory(pCatalog, sizeof(*pCatalog));
+    hr = StringCchPrintf(pCatalog->szCheckpointPath, ARRAYSIZE(pCatalog->szCheckpointPath), L"%s%s", pszFilepath, CATALOG_CHECKPOINT_SUFFIX);
+    if (FAILED(hr))
+    {
+        logerr(L"Catalog path too long: %s", pszFilepath);
+        goto error_return;
+    }
+
+    pCatalog->hFile = CreateFileW(pszFilepath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (pCatalog->hFile == INVALID_HANDLE_VALUE)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        logerr(L"Cannot open catalog %s, hr: %x", pszFilepath, hr);
+        goto error_return;
+    }
+
+    if (!GetFileSizeEx(pCatalog->hFile, &llFileSize))
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        goto error_return;
+    }
+
+    if (llFileSize.QuadPart == 0)
+    {
+        CATALOG_FILE_HEADER stHeader;
+        ZeroMemory(&stHeader, sizeof(stHeader));
+        stHeader.dwMagic = CATALOG_MAGIC;
+        stHeader.dwVersion = CATALOG_VERSION;
+        stHeader.cbHeader = sizeof(stHeader);
+
+        DWORD cbWritten;
+        if (!WriteFile(pCatalog->hFile, &stHeader, sizeof(stHeader), &cbWritten, NULL))
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            logerr(L"Cannot write catalog %s, hr: %x", pszFilepath, hr);
+            goto error_return;
+        }
+        pCatalog->cbLog = sizeof(stHeader);
+        pCatalog->cbCheckpoint = sizeof(stHeader);
+    }
+    else
+    {
+        hr = _LoadCatalog(pCatalog, pszFilepath, (UINT64)llFileSize.QuadPart);
+        if (FAILED(hr))
+        {
+            goto error_return;
+        }
+        _CheckpointIfDue(pCatalog);
+    }
+
+    logdbg(L"Opened catalog %s: %d contents at %d locations from %d scans",
+        pszFilepath, pCatalog->nEntries, pCatalog->nLocations, pCatalog->nScans);
+
+    *ppCatalog = pCatalog;
+    return S_OK;
+
+error_return:
+    if (pCatalog != NULL)
+    {
+        CloseContentCatalog(pCatalog);
+    }
+    *ppCatalog = NULL;
+    return hr;
+}
+
+void CloseContentCatalog(_In_ PCONTENT_CATALOG pCatalog)
+{
+    SB_ASSERT(pCatalog);
+
+    if ((pCatalog->hFile != NULL) && (pCatalog->hFile != INVALID_HANDLE_VALUE))
+    {
+        CloseHandle(pCatalog->hFile);
+    }
+
+    free(pCatalog->aEntries);
+    free(pCatalog->aiSlots);
+    free(pCatalog->aLocations);
+    free(pCatalog->aiLocationSlots);
+    free(pCatalog->aScans);
+    free(pCatalog->pszPaths);
+    free(pCatalog);
+}
+
+// Append the buffered records, then apply them, so the catalog in memory never
+// has records that are not in the file.
+static HRESULT _FlushRecords(_In_ PCONTENT_CATALOG pCatalog, _In_bytecount_(*pcbBuffer) const BYTE *pbBuffer, _Inout_ DWORD *pcbBuffer)
+{
+    DWORD cbWritten;
+    if (!WriteFile(pCatalog->hFile, pbBuffer, *pcbBuffer, &cbWritten, NULL))
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+    if (cbWritten != *pcbBuffer)
+    {
+        return HRESULT_FROM_WIN32(ERROR_WRITE_FAULT);
+    }
+    pCatalog->cbLog += cbWritten;
+
+    SIZE_T cbApplied;
+    HRESULT hr = _ApplyLog(pCatalog, pbBuffer, *pcbBuffer, &cbApplied);
+    *pcbBuffer = 0;
+    return hr;
+}
+
+static HRESULT _BufferRecord(
+    _In_ PCONTENT_CATALOG pCatalog,
+    _In_ const CATALOG_RECORD *pRecord,
+    _In_z_ PCWSTR pszPath,
+    _Inout_ PBYTE pbBuffer,
+    _Inout_ DWORD *pcbBuffer)
+{
+    SIZE_T cbRecord = CATALOG_ALIGN(sizeof(CATALOG_RECORD) + (pRecord->cchPath * sizeof(WCHAR)));
+    if (*pcbBuffer + cbRecord > CATALOG_WRITE_BYTES)
+    {
+        HRESULT hr = _FlushRecords(pCatalog, pbBuffer, pcbBuffer);
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+    }
+
+    PBYTE pbRecord = pbBuffer + *pcbBuffer;
+    ZeroMemory(pbRecord, cbRecord);
+    CopyMemory(pbRecord, pRecord, sizeof(CATALOG_RECORD));
+    CopyMemory(pbRecord + sizeof(CATALOG_RECORD), pszPath, pRecord->cchPath * sizeof(WCHAR));
+    *pcbBuffer += (DWORD)cbRecord;
+    return S_OK;
+}
+
+HRESULT AddScanToCatalog(_In_ PCONTENT_CATALOG pCatalog, _In_ PSCAN_SNAPSHOT pSnapshot, _Out_opt_ DWORD *pdwScanId)
+{
+    SB_ASSERT(pCatalog);
+    SB_ASSERT(pSnapshot);
+
+    HRESULT hr = S_OK;
+    DWORD cbBuffer = 0;
+    int nSkipped = 0;
+    PCWSTR pszRoot = pSnapshot->pHeader->szRoot;
+    PCWSTR pszSep = ((pszRoot[0] != 0) && (pszRoot[wcslen(pszRoot) - 1] != L'\\')) ? L"\\" : L"";
+    DWORD dwScanId = (pCatalog->nScans > 0) ? (pCatalog->aScans[pCatalog->nScans - 1].dwScanId + 1) : 1;
+
+    PBYTE pbBuffer = (PBYTE)malloc(CATALOG_WRITE_BYTES);
+    if (pbBuffer == NULL)
+    {
+        hr = E_OUTOFMEMORY;
+        goto fend;
+    }
+
+    LARGE_INTEGER llZero;
+    llZero.QuadPart = 0;
+    if (!SetFilePointerEx(pCatalog->hFile, llZero, NULL, FILE_END))
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        goto fend;
+    }
+
+    CATALOG_RECORD stRecord;
+    ZeroMemory(&stRecord, sizeof(stRecord));
+    stRecord.dwType = CATREC_SCAN;
+    stRecord.dwScanId = dwScanId;
+
+    FILETIME ftNow;
+    GetSystemTimeAsFileTime(&ftNow);
+    stRecord.llValue = (LONGLONG)((((UINT64)ftNow.dwHighDateTime) << 32) | ftNow.dwLowDateTime);
+    stRecord.cchPath = (DWORD)max(wcslen(pszRoot), 1);
+    hr = _BufferRecord(pCatalog, &stRecord, (pszRoot[0] != 0) ? pszRoot : L"\\", pbBuffer, &cbBuffer);
+
+    stRecord.dwType = CATREC_FILE;
+    for (DWORD i = 0; SUCCEEDED(hr) && (i < pSnapshot->pHeader->nFiles); ++i)
+    {
+        const SNAPSHOT_FILE *pFile = &pSnapshot->aFiles[i];
+        if ((pFile->dwFlags & (SNAPSHOT_FILE_DIRECTORY | SNAPSHOT_FILE_HASH_VALID)) != SNAPSHOT_FILE_HASH_VALID)
+        {
+            continue;
+        }
+
+        WCHAR szPath[CATALOG_MAX_PATH];
+        if (FAILED(StringCchPrintf(szPath, ARRAYSIZE(szPath), L"%s%s%s%s",
+            pszRoot, pszSep, GetSnapshotFolder(pSnapshot, pFile), GetSnapshotFileName(pSnapshot, pFile))))
+        {
+            ++nSkipped;
+            continue;
+        }
+
+        stRecord.llValue = pFile->llSize;
+        CopyMemory(stRecord.abHash, pFile->abHash, sizeof(stRecord.abHash));
+        stRecord.cchPath = (DWORD)wcslen(szPath);
+        hr = _BufferRecord(pCatalog, &stRecord, szPath, pbBuffer, &cbBuffer);
+    }
+
+    if (SUCCEEDED(hr) && (cbBuffer > 0))
+    {
+        hr = _FlushRecords(pCatalog, pbBuffer, &cbBuffer);
+    }
+
+    if (FAILED(hr))
+    {
+        logerr(L"Cannot add scan of %s to catalog, hr: %x", pszRoot, hr);
+        goto fend;
+    }
+
+    if (nSkipped > 0)
+    {
+        logwarn(L"%d paths of %s too long for the catalog", nSkipped, pszRoot);
+    }
+
+    _CheckpointIfDue(pCatalog);
+
+    if (pdwScanId != NULL)
+    {
+        *pdwScanId = dwScanId;
+    }
+
+fend:
+    free(pbBuffer);
+    return hr;
+}
+
+const CATALOG_ENTRY* FindInCatalog(_In_ PCONTENT_CATALOG pCatalog, _In_bytecount_(HASHLEN_SHA1) const BYTE *pbHash)
+{
+    SB_ASSERT(pCatalog);
+    SB_ASSERT(pbHash);
+
+    int iEntry = _FindEntry(pCatalog, pbHash);
+    return (iEntry >= 0) ? &pCatalog->aEntries[iEntry] : NULL;
+}
+
+HRESULT QueryCatalog(
+    _In_ PCONTENT_CATALOG pCatalog,
+    _In_ PSCAN_SNAPSHOT pSnapshot,
+    _In_opt_ PFN_CATALOG_RESULT pfnResult,
+    _In_opt_ PVOID pvContext,
+    _Out_ int *pnFound,
+    _Out_ int *pnQueried)
+{
+    SB_ASSERT(pCatalog);
+    SB_ASSERT(pSnapshot);
+    SB_ASSERT(pnFound);
+    SB_ASSERT(pnQueried);
+
+    *pnFound = 0;
+    *pnQueried = 0;
+    if (pSnapshot->aiByHash == NULL)
+    {
+        logerr(L"Snapshot of %s has no hashes to look up", pSnapshot->pHeader->szRoot);
+        return E_INVALIDARG;
+    }
+
+    for (DWORD i = 0; i < pSnapshot->pHeader->nFiles; ++i)
+    {
+        const SNAPSHOT_FILE *pFile = &pSnapshot->aFiles[i];
+        if ((pFile->dwFlags & (SNAPSHOT_FILE_DIRECTORY | SNAPSHOT_FILE_HASH_VALID)) != SNAPSHOT_FILE_HASH_VALID)
+        {
+            continue;
+        }
+
+        const CATALOG_ENTRY *pEntry = FindInCatalog(pCatalog, pFile->abHash);
+        ++(*pnQueried);
+        if (pEntry != NULL)
+        {
+            ++(*pnFound);
+        }
+
+        if (pfnResult != NULL)
+        {
+            pfnResult(pCatalog, pSnapshot, pFile, pEntry, pvContext);
+        }
+    }
+    return S_OK;
+}
@@ -0,0 +1,200 @@
+#pragma once
+
+// ---------------------------------------------------
+// The FDiffDelete Project
+// Github: https://github.com/shishir993/fdiffdelete
+// Author: Shishir Bhat
+// The MIT License (MIT)
+// Copyright (c) 2014
+//
+
+#include "Common.h"
+#include "HashFactory.h"
+#include "ScanSnapshot.h"
+
+// Catalog of file contents across many roots and scans, by SHA1.
+// The file is a log: a header, then records that are only ever appended. Each scan
+// added appends a scan record and a record per hashed file, so adding a scan never
+// rewrites what is there. Opening the catalog reads the log into a hash table of the
+// contents, where a file seen again at the same path only updates when it was last
+// seen, found by a second hash table of the locations by content and path. A record
+// cut short by a crash while appending is dropped when opened.
+// Once the records past the last checkpoint reach CATALOG_CHECKPOINT_BYTES, the tables
+// are written as they are to a checkpoint file next to the catalog. Opening loads the
+// checkpoint and reads only the records after it, unless it does not match the log,
+// in which case the whole log is read again.
+
+#define CATALOG_MAGIC           0x43434446  // "FDCC"
+#define CATALOG_VERSION         1
+
+#define CATALOG_CHECKPOINT_MAGIC    0x4b434446  // "FDCK"
+#define CATALOG_CHECKPOINT_VERSION  1
+
+// The checkpoint file is the catalog file's path with this appended
+#define CATALOG_CHECKPOINT_SUFFIX   L".ckpt"
+
+// Bytes of records read when opening, past the checkpoint, before a new one is written
+#define CATALOG_CHECKPOINT_BYTES    (32 * 1024 * 1024)
+
+// CATALOG_RECORD.dwType
+#define CATREC_SCAN             1
+#define CATREC_FILE             2
+
+typedef struct _CatalogFileHeader
+{
+    DWORD dwMagic;
+    DWORD dwVersion;
+    DWORD cbHeader;
+    DWORD dwReserved;
+
+} CATALOG_FILE_HEADER, *PCATALOG_FILE_HEADER;
+
+// Record of the log, followed by cchPath characters without a null, padded to
+// 8 bytes: the root of a scan or the full path of a file.
+typedef struct _CatalogRecord
+{
+    DWORD dwType;
+    DWORD dwScanId;
+
+    // Size of a file, UTC time of a scan
+    LONGLONG llValue;
+
+    // Of a file only
+    BYTE abHash[HASHLEN_SHA1];
+    DWORD cchPath;
+
+} CATALOG_RECORD, *PCATALOG_RECORD;
+
+// A content, all the paths it was seen at are its locations
+typedef struct _CatalogEntry
+{
+    BYTE abHash[HASHLEN_SHA1];
+    LONGLONG llSize;
+
+    // Latest scan any of the locations was seen in
+    DWORD dwLastScanId;
+
+    // Head of the list of locations, see CATALOG_LOCATION.iNext
+    int iFirstLocation;
+    int nLocations;
+
+} CATALOG_ENTRY, *PCATALOG_ENTRY;
+
+typedef struct _CatalogLocation
+{
+    // Into CONTENT_CATALOG.pszPaths
+    DWORD ichPath;
+    DWORD dwLastScanId;
+
+    // Next location of the same entry, -1 at the end
+    int iNext;
+
+    // The entry the location is of, and the key of its path, see GetNameKey()
+    int iEntry;
+    UINT64 ullPathKey;
+
+} CATALOG_LOCATION, *PCATALOG_LOCATION;
+
+typedef struct _CatalogScan
+{
+    DWORD dwScanId;
+    FILETIME ftScanned;
+    DWORD ichRoot;
+
+} CATALOG_SCAN, *PCATALOG_SCAN;
+
+// Layout of a checkpoint file, each section 8-byte aligned:
+//  CATALOG_CHECKPOINT_HEADER
+//  CATALOG_ENTRY       [nEntries]
+//  CATALOG_LOCATION    [nLocations]
+//  CATALOG_SCAN        [nScans]
+//  WCHAR               [cchPaths]
+typedef struct _CatalogCheckpointHeader
+{
+    DWORD dwMagic;
+    DWORD dwVersion;
+    DWORD cbHeader;
+    DWORD dwReserved;
+
+    // Bytes of the catalog file the checkpoint has the records of, and the FNV-1a
+    // hash of the last of them, to tell whether the log is still the same
+    UINT64 cbLog;
+    UINT64 ullTailHash;
+
+    DWORD nEntries;
+    DWORD nLocations;
+    DWORD nScans;
+    DWORD cchPaths;
+    UINT64 ullEntriesOffset;
+    UINT64 ullLocationsOffset;
+    UINT64 ullScansOffset;
+    UINT64 ullPathsOffset;
+
+} CATALOG_CHECKPOINT_HEADER, *PCATALOG_CHECKPOINT_HEADER;
+
+typedef struct _ContentCatalog
+{
+    PCATALOG_ENTRY aEntries;
+    int nEntries;
+    int nMaxEntries;
+
+    // Open addressed by the hash, entry index + 1, 0 is a free slot. At most half
+    // of the slots are used, a power of 2 of them.
+    int *aiSlots;
+    DWORD nSlots;
+
+    PCATALOG_LOCATION aLocations;
+    int nLocations;
+    int nMaxLocations;
+
+    // Open addressed by the hash of the entry and the path key, as aiSlots
+    int *aiLocationSlots;
+    DWORD nLocationSlots;
+
+    PCATALOG_SCAN aScans;
+    int nScans;
+    int nMaxScans;
+
+    // Null terminated paths
+    PWSTR pszPaths;
+    DWORD cchPaths;
+    DWORD cchMaxPaths;
+
+    // Open for appending
+    HANDLE hFile;
+
+    // Bytes of the file that are whole records, and those the checkpoint has
+    UINT64 cbLog;
+    UINT64 cbCheckpoint;
+    WCHAR szCheckpointPath[MAX_PATH];
+
+} CONTENT_CATALOG, *PCONTENT_CATALOG;
+
+// Open a catalog file, creating an empty one if there is none
+HRESULT OpenContentCatalog(_In_z_ PCWSTR pszFilepath, _Out_ PCONTENT_CATALOG *ppCatalog);
+void CloseContentCatalog(_In_ PCONTENT_CATALOG pCatalog);
+
+// Append the hashed files of a snapshot as a new scan. The locations are the root
+// of the snapshot joined with the relative paths.
+HRESULT AddScanToCatalog(_In_ PCONTENT_CATALOG pCatalog, _In_ PSCAN_SNAPSHOT pSnapshot, _Out_opt_ DWORD *pdwScanId);
+
+// Content with the hash, NULL if none
+const CATALOG_ENTRY* FindInCatalog(_In_ PCONTENT_CATALOG pCatalog, _In_bytecount_(HASHLEN_SHA1) const BYTE *pbHash);
+
+// Called for each hashed file of a bulk query, with NULL if its content is not in the catalog
+typedef void (*PFN_CATALOG_RESULT)(
+    _In_ PCONTENT_CATALOG pCatalog,
+    _In_ PSCAN_SNAPSHOT pSnapshot,
+    _In_ const SNAPSHOT_FILE *pFile,
+    _In_opt_ const CATALOG_ENTRY *pEntry,
+    _In_opt_ PVOID pvContext);
+
+// Look up every hashed file of a snapshot, such as that of an incoming folder.
+// Files without a hash are not looked up.
+HRESULT QueryCatalog(
+    _In_ PCONTENT_CATALOG pCatalog,
+    _In_ PSCAN_SNAPSHOT pSnapshot,
+    _In_opt_ PFN_CATALOG_RESULT pfnResult,
+    _In_opt_ PVOID pvContext,
+    _Out_ int *pnFound,
+    _Out_ int *pnQueried);
@@ -12,6 +12,9 @@
 #include "Hashtable.h"
 #include "UIHelpers.h"
 #include "DirectoryWalker_Interface.h"
+#include "DupFinder.h"
+#include "TreeIdentity.h"
+#include "ScanSnapshot.h"
 
 enum {
     WM_DIFF = WM_USER + 1,
@@ -38,6 +41,15 @@ typedef struct _FDiffUiInfo
     WCHAR szFolderpathLeft[MAX_PATH];
     WCHAR szFolderpathRight[MAX_PATH];
 
+    // Match files by relative path in recursive mode (Options menu)
+    BOOL fRelPathCompare;
+
+    // Only the left folder was specified, find the duplicates within it
+    BOOL fSingleTree;
+
+    // Duplicate groups of the current view, kept up to date on delete
+    PDUPGROUPS pDupGroups;
+
     HWND hLvLeft;
     HWND hLvRight;
     HWND hStaticLeft;
@@ -65,6 +77,10 @@ static BOOL UpdateDirInfo(
     _In_ PDIRINFO* ppDirInfo,
     _In_ BOOL fRecursive,
     _In_ BOOL fCompareHashes);
+static void UpdateDirStats(_In_ HWND hStatic, _In_ PDIRINFO pDirInfo);
+static void UpdateDupGroups(_In_ FDIFFUI_INFO *pUiInfo, _In_ PDELETE_CHANGES pChanges);
+static void ShowTopDupGroups(_In_ HWND hDlg, _In_ FDIFFUI_INFO *pUiInfo);
+static void CheckFoldersIdentical(_In_ HWND hDlg);
 
 static BOOL CheckInvalidDir(_In_ HWND hDlg, _In_ PCWSTR pszFolderpath);
 
@@ -98,6 +114,12 @@ BOOL CALLBACK FolderDiffDP(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam
 
     case WM_CLOSE:
         {
+            if (uiInfo.pDupGroups)
+            {
+                DestroyDupGroups(uiInfo.pDupGroups);
+                uiInfo.pDupGroups = NULL;
+            }
+
             if (uiInfo.pLeftDirInfo)
             {
                 DestroyDirInfo(uiInfo.pLeftDirInfo);
@@ -131,6 +153,39 @@ BOOL CALLBACK FolderDiffDP(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam
                     break;
                 }
 
+            case IDM_MATCH_RELPATH:
+                {
+                    HMENU hMenu = GetMenu(hDlg);
+                    uiInfo.fRelPathCompare = !IsMenuItemChecked(hMenu, IDM_MATCH_RELPATH);
+                    CheckMenuItem(hMenu, IDM_MATCH_RELPATH, MF_BYCOMMAND | (uiInfo.fRelPathCompare ? MF_CHECKED : MF_UNCHECKED));
+                    return TRUE;
+                }
+
+            case IDM_CHECK_IDENTICAL:
+                {
+                    CheckFoldersIdentical(hDlg);
+                    return TRUE;
+                }
+
+            case IDM_SHOW_TOP_DUPS:
+                {
+                    ShowTopDupGroups(hDlg, &uiInfo);
+                    return TRUE;
+                }
+
+            case IDM_OPEN_SNAPSHOT_LEFT:
+            case IDM_OPEN_SNAPSHOT_RIGHT:
+                {
+                    // The snapshot takes the place of the folder, see BuildDirInfo()
+                    WCHAR szPath[MAX_PATH];
+                    if (SUCCEEDED(GetSnapshotToOpen(szPath)))
+                    {
+                        int iEdit = (LOWORD(wParam) == IDM_OPEN_SNAPSHOT_LEFT) ? IDC_EDIT_LEFT : IDC_EDIT_RIGHT;
+                        SendMessage(GetDlgItem(hDlg, iEdit), WM_SETTEXT, 0, (LPARAM)szPath);
+                    }
+                    return TRUE;
+                }
+
             case IDC_BTN_BRWS_LEFT:
                 {
                     WCHAR szPath[MAX_PATH];
@@ -160,7 +215,8 @@ BOOL CALLBACK FolderDiffDP(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam
                     SendMessage(GetDlgItem(hDlg, IDC_EDIT_RIGHT), WM_GETTEXT,
                         ARRAYSIZE(uiInfo.szFolderpathRight), (LPARAM)uiInfo.szFolderpathRight);
 
-                    if (uiInfo.szFolderpathLeft[0] != 0 && uiInfo.szFolderpathRight[0] != 0)
+                    // Left folder alone finds the duplicates within it
+                    if (uiInfo.szFolderpathLeft[0] != 0)
                     {
                         SendMessage(hDlg, WM_DIFF, FALSE, (LPARAM)NULL);
                         return TRUE;
@@ -172,6 +228,7 @@ BOOL CALLBACK FolderDiffDP(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam
                 {
                     int nItemsSel;
                     BOOL fSucceeded = FALSE;
+                    DELETE_CHANGES stChanges = {};
 
                     if (uiInfo.pLeftDirInfo == NULL)
                     {
@@ -184,7 +241,7 @@ BOOL CALLBACK FolderDiffDP(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam
                         if (GetSelectedLvItemsText_Hash(uiInfo.hLvLeft, &ppFiles, &nItemsSel))
                         {
                             uiInfo.pLeftDirInfo->fDeleteEmptyDirs = (IsDlgButtonChecked(hDlg, IDC_CHK_DELEMPTYDIRS) == BST_CHECKED);
-                            fSucceeded = DeleteFilesInDir(uiInfo.pLeftDirInfo, ppFiles, nItemsSel, uiInfo.pRightDirInfo);
+                            fSucceeded = DeleteFilesInDir(uiInfo.pLeftDirInfo, ppFiles, nItemsSel, uiInfo.pRightDirInfo, &stChanges);
                             free(ppFiles);
                             ppFiles = NULL;
                         }
@@ -195,7 +252,7 @@ BOOL CALLBACK FolderDiffDP(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam
                         if (GetSelectedLvItemsText(uiInfo.hLvLeft, &paszFiles, &nItemsSel, MAX_PATH))
                         {
                             uiInfo.pLeftDirInfo->fDeleteEmptyDirs = (IsDlgButtonChecked(hDlg, IDC_CHK_DELEMPTYDIRS) == BST_CHECKED);
-                            fSucceeded = DeleteFilesInDir(uiInfo.pLeftDirInfo, paszFiles, nItemsSel, uiInfo.pRightDirInfo);
+                            fSucceeded = DeleteFilesInDir(uiInfo.pLeftDirInfo, paszFiles, nItemsSel, uiInfo.pRightDirInfo, &stChanges);
                             free(paszFiles);
                             paszFiles = NULL;
                         }
@@ -204,12 +261,21 @@ BOOL CALLBACK FolderDiffDP(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam
                     if (fSucceeded)
                     {
                         // Update the list views
-                        // TODO: This function destroys dir info and rebuilds it. Not necessary.
-                        BOOL fRecursive = (IsDlgButtonChecked(hDlg, IDC_CHK_RECRS) == BST_CHECKED);
-                        BOOL fHashCompare = (IsDlgButtonChecked(hDlg, IDC_CHK_HASH) == BST_CHECKED);
-                        uiInfo.iFSpecState_Left = FSPEC_STATE_TOUPDATE;
-                        UpdateFileListViews(&uiInfo, fRecursive, fHashCompare);
+                        if (stChanges.fRebuildRequired)
+                        {
+                            BOOL fRecursive = (IsDlgButtonChecked(hDlg, IDC_CHK_RECRS) == BST_CHECKED);
+                            BOOL fHashCompare = (IsDlgButtonChecked(hDlg, IDC_CHK_HASH) == BST_CHECKED);
+                            uiInfo.iFSpecState_Left = FSPEC_STATE_TOUPDATE;
+                            UpdateFileListViews(&uiInfo, fRecursive, fHashCompare);
+                        }
+                        else
+                        {
+                            ApplyDeleteChanges(uiInfo.hLvLeft, uiInfo.hLvRight, &stChanges);
+                            UpdateDirStats(uiInfo.hStaticLeft, uiInfo.pLeftDirInfo);
+                            UpdateDupGroups(&uiInfo, &stChanges);
+                        }
                     }
+                    DestroyDeleteChanges(&stChanges);
                     return TRUE;
                 }
 
@@ -217,6 +283,7 @@ BOOL CALLBACK FolderDiffDP(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam
                 {
                     int nItemsSel;
                     BOOL fSucceeded = FALSE;
+                    DELETE_CHANGES stChanges = {};
 
                     if (uiInfo.pRightDirInfo == NULL)
                     {
@@ -229,7 +296,7 @@ BOOL CALLBACK FolderDiffDP(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam
                         if (GetSelectedLvItemsText_Hash(uiInfo.hLvRight, &ppFiles, &nItemsSel))
                         {
                             uiInfo.pRightDirInfo->fDeleteEmptyDirs = (IsDlgButtonChecked(hDlg, IDC_CHK_DELEMPTYDIRS) == BST_CHECKED);
-                            fSucceeded = DeleteFilesInDir(uiInfo.pRightDirInfo, ppFiles, nItemsSel, uiInfo.pLeftDirInfo);
+                            fSucceeded = DeleteFilesInDir(uiInfo.pRightDirInfo, ppFiles, nItemsSel, uiInfo.pLeftDirInfo, &stChanges);
                             free(ppFiles);
                             ppFiles = NULL;
                         }
@@ -240,7 +307,7 @@ BOOL CALLBACK FolderDiffDP(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam
                         if (GetSelectedLvItemsText(uiInfo.hLvRight, &paszFiles, &nItemsSel, MAX_PATH))
                         {
                             uiInfo.pRightDirInfo->fDeleteEmptyDirs = (IsDlgButtonChecked(hDlg, IDC_CHK_DELEMPTYDIRS) == BST_CHECKED);
-                            fSucceeded = DeleteFilesInDir(uiInfo.pRightDirInfo, paszFiles, nItemsSel, uiInfo.pLeftDirInfo);
+                            fSucceeded = DeleteFilesInDir(uiInfo.pRightDirInfo, paszFiles, nItemsSel, uiInfo.pLeftDirInfo, &stChanges);
                             free(paszFiles);
                             paszFiles = NULL;
                         }
@@ -249,12 +316,21 @@ BOOL CALLBACK FolderDiffDP(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam
                     if (fSucceeded)
                     {
                         // Update the list views
-                        // TODO: This function destroys dir info and rebuilds it. Not necessary.
-                        BOOL fRecursive = (IsDlgButtonChecked(hDlg, IDC_CHK_RECRS) == BST_CHECKED);
-                        BOOL fHashCompare = (IsDlgButtonChecked(hDlg, IDC_CHK_HASH) == BST_CHECKED);
-                        uiInfo.iFSpecState_Right = FSPEC_STATE_TOUPDATE;
-                        UpdateFileListViews(&uiInfo, fRecursive, fHashCompare);
+                        if (stChanges.fRebuildRequired)
+                        {
+                            BOOL fRecursive = (IsDlgButtonChecked(hDlg, IDC_CHK_RECRS) == BST_CHECKED);
+                            BOOL fHashCompare = (IsDlgButtonChecked(hDlg, IDC_CHK_HASH) == BST_CHECKED);
+                            uiInfo.iFSpecState_Right = FSPEC_STATE_TOUPDATE;
+                            UpdateFileListViews(&uiInfo, fRecursive, fHashCompare);
+                        }
+                        else
+                        {
+                            ApplyDeleteChanges(uiInfo.hLvRight, uiInfo.hLvLeft, &stChanges);
+                            UpdateDirStats(uiInfo.hStaticRight, uiInfo.pRightDirInfo);
+                            UpdateDupGroups(&uiInfo, &stChanges);
+                        }
                     }
+                    DestroyDeleteChanges(&stChanges);
                     return TRUE;
                 }
 
@@ -263,18 +339,29 @@ BOOL CALLBACK FolderDiffDP(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam
                 {
                     // NULL check for the second parameter is in the callee
                     uiInfo.pLeftDirInfo->fDeleteEmptyDirs = (IsDlgButtonChecked(hDlg, IDC_CHK_DELEMPTYDIRS) == BST_CHECKED);
-                    DeleteDupFilesInDir(uiInfo.pLeftDirInfo, uiInfo.pRightDirInfo);
-                    uiInfo.iFSpecState_Left = FSPEC_STATE_TOUPDATE;
-
-                    // Update right if it is already filled
-                    if (uiInfo.iFSpecState_Right == FSPEC_STATE_FILLED)
+                    DELETE_CHANGES stChanges = {};
+                    if (DeleteDupFilesInDir(uiInfo.pLeftDirInfo, uiInfo.pRightDirInfo, &stChanges)
+                        && !stChanges.fRebuildRequired)
                     {
-                        uiInfo.iFSpecState_Right = FSPEC_STATE_TOUPDATE;
+                        ApplyDeleteChanges(uiInfo.hLvLeft, uiInfo.hLvRight, &stChanges);
+                        UpdateDirStats(uiInfo.hStaticLeft, uiInfo.pLeftDirInfo);
+                        UpdateDupGroups(&uiInfo, &stChanges);
                     }
+                    else
+                    {
+                        uiInfo.iFSpecState_Left = FSPEC_STATE_TOUPDATE;
+
+                        // Update right if it is already filled
+                        if (uiInfo.iFSpecState_Right == FSPEC_STATE_FILLED)
+                        {
+                            uiInfo.iFSpecState_Right = FSPEC_STATE_TOUPDATE;
+                        }
 
-                    BOOL fRecursive = (IsDlgButtonChecked(hDlg, IDC_CHK_RECRS) == BST_CHECKED);
-                    BOOL fHashCompare = (IsDlgButtonChecked(hDlg, IDC_CHK_HASH) == BST_CHECKED);
-                    UpdateFileListViews(&uiInfo, fRecursive, fHashCompare);
+                        BOOL fRecursive = (IsDlgButtonChecked(hDlg, IDC_CHK_RECRS) == BST_CHECKED);
+                        BOOL fHashCompare = (IsDlgButtonChecked(hDlg, IDC_CHK_HASH) == BST_CHECKED);
+                        UpdateFileListViews(&uiInfo, fRecursive, fHashCompare);
+                    }
+                    DestroyDeleteChanges(&stChanges);
                 }
                 return TRUE;
 
@@ -283,18 +370,29 @@ BOOL CALLBACK FolderDiffDP(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam
                 {
                     // NULL check for the second parameter is in the callee
                     uiInfo.pRightDirInfo->fDeleteEmptyDirs = (IsDlgButtonChecked(hDlg, IDC_CHK_DELEMPTYDIRS) == BST_CHECKED);
-                    DeleteDupFilesInDir(uiInfo.pRightDirInfo, uiInfo.pLeftDirInfo);
-                    uiInfo.iFSpecState_Right = FSPEC_STATE_TOUPDATE;
-
-                    // Update left if it is already filled
-                    if (uiInfo.iFSpecState_Left == FSPEC_STATE_FILLED)
+                    DELETE_CHANGES stChanges = {};
+                    if (DeleteDupFilesInDir(uiInfo.pRightDirInfo, uiInfo.pLeftDirInfo, &stChanges)
+                        && !stChanges.fRebuildRequired)
                     {
-                        uiInfo.iFSpecState_Left = FSPEC_STATE_TOUPDATE;
+                        ApplyDeleteChanges(uiInfo.hLvRight, uiInfo.hLvLeft, &stChanges);
+                        UpdateDirStats(uiInfo.hStaticRight, uiInfo.pRightDirInfo);
+                        UpdateDupGroups(&uiInfo, &stChanges);
                     }
+                    else
+                    {
+                        uiInfo.iFSpecState_Right = FSPEC_STATE_TOUPDATE;
+
+                        // Update left if it is already filled
+                        if (uiInfo.iFSpecState_Left == FSPEC_STATE_FILLED)
+                        {
+                            uiInfo.iFSpecState_Left = FSPEC_STATE_TOUPDATE;
+                        }
 
-                    BOOL fRecursive = (IsDlgButtonChecked(hDlg, IDC_CHK_RECRS) == BST_CHECKED);
-                    BOOL fHashCompare = (IsDlgButtonChecked(hDlg, IDC_CHK_HASH) == BST_CHECKED);
-                    UpdateFileListViews(&uiInfo, fRecursive, fHashCompare);
+                        BOOL fRecursive = (IsDlgButtonChecked(hDlg, IDC_CHK_RECRS) == BST_CHECKED);
+                        BOOL fHashCompare = (IsDlgButtonChecked(hDlg, IDC_CHK_HASH) == BST_CHECKED);
+                        UpdateFileListViews(&uiInfo, fRecursive, fHashCompare);
+                    }
+                    DestroyDeleteChanges(&stChanges);
                 }
                 return TRUE;
             }
@@ -327,13 +425,15 @@ BOOL CALLBACK FolderDiffDP(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam
 
     case WM_DIFF:
         {
+            // Either side can be a snapshot file instead of a folder
             WCHAR szMessage[128] = {};
-            if (!CheckInvalidDir(hDlg, uiInfo.szFolderpathLeft))
+            if (!CheckInvalidDir(hDlg, uiInfo.szFolderpathLeft) && !IsScanSnapshotFile(uiInfo.szFolderpathLeft))
             {
                 wcscpy_s(szMessage, L"Left folder does not exist or is inaccessible. ");
             }
 
-            if (!CheckInvalidDir(hDlg, uiInfo.szFolderpathRight))
+            uiInfo.fSingleTree = (uiInfo.szFolderpathRight[0] == 0);
+            if (!uiInfo.fSingleTree && !CheckInvalidDir(hDlg, uiInfo.szFolderpathRight) && !IsScanSnapshotFile(uiInfo.szFolderpathRight))
             {
                 wcscat_s(szMessage, L"Right folder does not exist or is inaccessible.");
             }
@@ -343,7 +443,23 @@ BOOL CALLBACK FolderDiffDP(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam
                 BOOL fRecursive = (IsDlgButtonChecked(hDlg, IDC_CHK_RECRS) == BST_CHECKED);
                 BOOL fHashCompare = (IsDlgButtonChecked(hDlg, IDC_CHK_HASH) == BST_CHECKED);
                 uiInfo.iFSpecState_Left = FSPEC_STATE_TOUPDATE;
-                uiInfo.iFSpecState_Right = FSPEC_STATE_TOUPDATE;
+                if (uiInfo.fSingleTree)
+                {
+                    // Nothing to compare against, drop what the right side had
+                    if (uiInfo.pRightDirInfo)
+                    {
+                        DestroyDirInfo(uiInfo.pRightDirInfo);
+                        uiInfo.pRightDirInfo = NULL;
+                    }
+
+                    ListView_DeleteAllItems(uiInfo.hLvRight);
+                    SetWindowText(uiInfo.hStaticRight, L"");
+                    uiInfo.iFSpecState_Right = FSPEC_STATE_EMPTY;
+                }
+                else
+                {
+                    uiInfo.iFSpecState_Right = FSPEC_STATE_TOUPDATE;
+                }
                 UpdateFileListViews(&uiInfo, fRecursive, fHashCompare);
             }
             else
@@ -365,6 +481,20 @@ static BOOL UpdateDirInfo(
 {
     SB_ASSERT(ppDirInfo);
 
+    // Only the compare mode changed: reuse the walk instead of doing it again
+    if ((*ppDirInfo != NULL)
+        && (!(*ppDirInfo)->fHashCompare != !fCompareHashes)
+        && (!(*ppDirInfo)->fRecursive == !fRecursive)
+        && (CompareNames((*ppDirInfo)->pszPath, pszFolderpath) == 0))
+    {
+        HRESULT hr = SwitchDirInfoLayout(ppDirInfo, fCompareHashes);
+        if (SUCCEEDED(hr))
+        {
+            return TRUE;
+        }
+        logwarn(L"Cannot switch dir %s to the other compare mode, hr: %x. Walking it again.", pszFolderpath, hr);
+    }
+
     if (*ppDirInfo != NULL)
     {
         DestroyDirInfo(*ppDirInfo);
@@ -378,18 +508,39 @@ BOOL UpdateFileListViews(_In_ FDIFFUI_INFO *pUiInfo, _In_ BOOL fRecursive, _In_
 {
     SB_ASSERT(pUiInfo);
 
+    // Groups point into the dir infos that are about to be rebuilt
+    if ((pUiInfo->pDupGroups != NULL)
+        && ((pUiInfo->iFSpecState_Left == FSPEC_STATE_TOUPDATE) || (pUiInfo->iFSpecState_Right == FSPEC_STATE_TOUPDATE)))
+    {
+        DestroyDupGroups(pUiInfo->pDupGroups);
+        pUiInfo->pDupGroups = NULL;
+    }
+
     if (pUiInfo->iFSpecState_Left == FSPEC_STATE_TOUPDATE)
     {
         SB_ASSERT(pUiInfo->szFolderpathLeft);
-        if (!UpdateDirInfo(pUiInfo->szFolderpathLeft, &pUiInfo->pLeftDirInfo, fRecursive, fCompareHashes))
+
+        // A single tree is walked without hashing. The duplicate finder hashes only
+        // the files that share a size, biggest possible wins first.
+        BOOL fLeftHashes = (fCompareHashes && !pUiInfo->fSingleTree);
+        if (!UpdateDirInfo(pUiInfo->szFolderpathLeft, &pUiInfo->pLeftDirInfo, fRecursive, fLeftHashes))
         {
             goto error_return;
         }
 
+        if (pUiInfo->fSingleTree)
+        {
+            if (!FindAndMarkDupFiles(pUiInfo->pLeftDirInfo, &pUiInfo->pDupGroups))
+            {
+                goto error_return;
+            }
+        }
         // Must update the right folder, if it is already filled, when updating the left.
-        if (pUiInfo->iFSpecState_Right == FSPEC_STATE_FILLED)
+        else if (pUiInfo->iFSpecState_Right == FSPEC_STATE_FILLED)
         {
             SB_ASSERT(pUiInfo->pRightDirInfo);
+            pUiInfo->pLeftDirInfo->fRelPathCompare = (fRecursive && pUiInfo->fRelPathCompare);
+            pUiInfo->pRightDirInfo->fRelPathCompare = (fRecursive && pUiInfo->fRelPathCompare);
             ClearFilesDupFlag(pUiInfo->pRightDirInfo);
             if (!CompareDirsAndMarkFiles(pUiInfo->pLeftDirInfo, pUiInfo->pRightDirInfo))
             {
@@ -398,19 +549,15 @@ BOOL UpdateFileListViews(_In_ FDIFFUI_INFO *pUiInfo, _In_ BOOL fRecursive, _In_
 
             if (PopulateFileList(pUiInfo->hLvRight, pUiInfo->pRightDirInfo, fCompareHashes))
             {
-                WCHAR szStats[32];
-                swprintf_s(szStats, ARRAYSIZE(szStats), L"%d folders, %d files.", pUiInfo->pRightDirInfo->nDirs, pUiInfo->pRightDirInfo->nFiles);
-                SetWindowText(pUiInfo->hStaticRight, szStats);
+                UpdateDirStats(pUiInfo->hStaticRight, pUiInfo->pRightDirInfo);
             }
         }
 
-        if (PopulateFileList(pUiInfo->hLvLeft, pUiInfo->pLeftDirInfo, fCompareHashes))
+        if (PopulateFileList(pUiInfo->hLvLeft, pUiInfo->pLeftDirInfo, fLeftHashes))
         {
             pUiInfo->iFSpecState_Left = FSPEC_STATE_FILLED;
 
-            WCHAR szStats[32];
-            swprintf_s(szStats, ARRAYSIZE(szStats), L"%d folders, %d files.", pUiInfo->pLeftDirInfo->nDirs, pUiInfo->pLeftDirInfo->nFiles);
-            SetWindowText(pUiInfo->hStaticLeft, szStats);
+            UpdateDirStats(pUiInfo->hStaticLeft, pUiInfo->pLeftDirInfo);
         }
     }
 
@@ -426,6 +573,8 @@ BOOL UpdateFileListViews(_In_ FDIFFUI_INFO *pUiInfo, _In_ BOOL fRecursive, _In_
         if (pUiInfo->iFSpecState_Left == FSPEC_STATE_FILLED)
         {
             SB_ASSERT(pUiInfo->pLeftDirInfo);
+            pUiInfo->pLeftDirInfo->fRelPathCompare = (fRecursive && pUiInfo->fRelPathCompare);
+            pUiInfo->pRightDirInfo->fRelPathCompare = (fRecursive && pUiInfo->fRelPathCompare);
             ClearFilesDupFlag(pUiInfo->pLeftDirInfo);
             if (!CompareDirsAndMarkFiles(pUiInfo->pRightDirInfo, pUiInfo->pLeftDirInfo))
             {
@@ -434,9 +583,7 @@ BOOL UpdateFileListViews(_In_ FDIFFUI_INFO *pUiInfo, _In_ BOOL fRecursive, _In_
 
             if (PopulateFileList(pUiInfo->hLvLeft, pUiInfo->pLeftDirInfo, fCompareHashes))
             {
-                WCHAR szStats[32];
-                swprintf_s(szStats, ARRAYSIZE(szStats), L"%d folders, %d files.", pUiInfo->pLeftDirInfo->nDirs, pUiInfo->pLeftDirInfo->nFiles);
-                SetWindowText(pUiInfo->hStaticLeft, szStats);
+                UpdateDirStats(pUiInfo->hStaticLeft, pUiInfo->pLeftDirInfo);
             }
         }
 
@@ -444,9 +591,19 @@ BOOL UpdateFileListViews(_In_ FDIFFUI_INFO *pUiInfo, _In_ BOOL fRecursive, _In_
         {
             pUiInfo->iFSpecState_Right = FSPEC_STATE_FILLED;
 
-            WCHAR szStats[32];
-            swprintf_s(szStats, ARRAYSIZE(szStats), L"%d folders, %d files.", pUiInfo->pRightDirInfo->nDirs, pUiInfo->pRightDirInfo->nFiles);
-            SetWindowText(pUiInfo->hStaticRight, szStats);
+            UpdateDirStats(pUiInfo->hStaticRight, pUiInfo->pRightDirInfo);
+        }
+    }
+
+    if ((pUiInfo->pDupGroups == NULL)
+        && (pUiInfo->iFSpecState_Left == FSPEC_STATE_FILLED)
+        && (pUiInfo->iFSpecState_Right == FSPEC_STATE_FILLED))
+    {
+        HRESULT hr = BuildDupGroupsFromMarks(pUiInfo->pLeftDirInfo, pUiInfo->pRightDirInfo, &pUiInfo->pDupGroups);
+        if (FAILED(hr))
+        {
+            // Only the report needs the groups, the views are still good
+            logwarn(L"Cannot build duplicate groups, hr: %x", hr);
         }
     }
 
@@ -456,6 +613,89 @@ error_return:
     return FALSE;
 }
 
+static void UpdateDirStats(_In_ HWND hStatic, _In_ PDIRINFO pDirInfo)
+{
+    WCHAR szStats[32];
+    swprintf_s(szStats, ARRAYSIZE(szStats), L"%d folders, %d files.", pDirInfo->nDirs, pDirInfo->nFiles);
+    SetWindowText(hStatic, szStats);
+}
+
+// Take the deleted files out of the duplicate groups
+static void UpdateDupGroups(_In_ FDIFFUI_INFO *pUiInfo, _In_ PDELETE_CHANGES pChanges)
+{
+    if (pUiInfo->pDupGroups != NULL)
+    {
+        UpdateDupGroupsOnDelete(pUiInfo->pDupGroups, pChanges);
+    }
+}
+
+// Show the groups of the last diff that waste the most space, as they are after
+// the deletes since
+static void ShowTopDupGroups(_In_ HWND hDlg, _In_ FDIFFUI_INFO *pUiInfo)
+{
+    if (pUiInfo->pDupGroups == NULL)
+    {
+        MessageBox(hDlg, L"Diff the folders first.", L"Top Duplicates", MB_OK | MB_ICONINFORMATION);
+        return;
+    }
+
+    size_t cchText = (TOP_DUP_GROUPS * ((MAX_PATH * 2) + 64)) + 64;
+    PWSTR pszText = (PWSTR)malloc(cchText * sizeof(WCHAR));
+    if (pszText == NULL)
+    {
+        logerr(L"Out of memory for the top duplicates");
+        return;
+    }
+
+    FormatTopDupGroups(pUiInfo->pDupGroups, TOP_DUP_GROUPS, pszText, cchText);
+    MessageBox(hDlg, pszText, L"Top Duplicates", MB_OK | MB_ICONINFORMATION);
+    free(pszText);
+}
+
+// Say whether the two folders are identical without diffing them. With Hash Compare
+// the contents are compared, otherwise the names, sizes and modified dates, as in a diff.
+static void CheckFoldersIdentical(_In_ HWND hDlg)
+{
+    WCHAR szLeft[MAX_PATH];
+    WCHAR szRight[MAX_PATH];
+    WCHAR szMessage[MAX_PATH + 128];
+
+    SendMessage(GetDlgItem(hDlg, IDC_EDIT_LEFT), WM_GETTEXT, ARRAYSIZE(szLeft), (LPARAM)szLeft);
+    SendMessage(GetDlgItem(hDlg, IDC_EDIT_RIGHT), WM_GETTEXT, ARRAYSIZE(szRight), (LPARAM)szRight);
+    if (!CheckInvalidDir(hDlg, szLeft) || !CheckInvalidDir(hDlg, szRight))
+    {
+        MessageBox(hDlg, L"Both folders must exist to be checked.", L"Error", MB_OK | MB_ICONEXCLAMATION);
+        return;
+    }
+
+    DWORD dwFlags = 0;
+    if (IsDlgButtonChecked(hDlg, IDC_CHK_HASH) != BST_CHECKED)
+    {
+        dwFlags = TREEID_CHECK_MODIFIED | TREEID_SKIP_CONTENTS;
+    }
+
+    TREE_IDENTITY stIdentity;
+    HRESULT hr = CheckTreesIdentical(szLeft, szRight, dwFlags, &stIdentity);
+    if (FAILED(hr))
+    {
+        swprintf_s(szMessage, ARRAYSIZE(szMessage), L"Cannot check the folders, hr: %x", hr);
+        MessageBox(hDlg, szMessage, L"Error", MB_OK | MB_ICONEXCLAMATION);
+        return;
+    }
+
+    if (hr == S_OK)
+    {
+        swprintf_s(szMessage, ARRAYSIZE(szMessage), L"The folders are identical.\n%lld files in %d folders checked.",
+            stIdentity.nFiles, stIdentity.nFolders);
+    }
+    else
+    {
+        swprintf_s(szMessage, ARRAYSIZE(szMessage), L"The folders are not identical.\n%s: %s",
+            GetTreeIdentityResultString(stIdentity.result), stIdentity.szRelPath);
+    }
+    MessageBox(hDlg, szMessage, L"Check if Identical", MB_OK | MB_ICONINFORMATION);
+}
+
 static BOOL CheckInvalidDir(_In_ HWND hDlg, _In_ PCWSTR pszFolderpath)
 {
     BOOL fValidFolder = TRUE;
@@ -9,6 +9,7 @@
 
 #include "DirectoryWalker.h"
 #include "DirectoryWalker_Util.h"
+#include "DirectoryWalker_Walk.h"
 #include "HashFactory.h"
 
 #define DDUP_NO_MATCH       0
@@ -17,13 +18,21 @@
 
 #define INIT_DUP_WITHIN_SIZE    32
 
+// First and last index of a chain of files of the same name, see DUPFILES_WITHIN
+typedef struct _DupNameChain
+{
+    int iFirst;
+    int iLast;
+
+} DUP_NAME_CHAIN, *PDUP_NAME_CHAIN;
+
 static BOOL AddToDupWithinList(_In_ PDUPFILES_WITHIN pDupWithin, _In_ PFILEINFO pFileInfo);
-static PFILEINFO FindInDupWithinList(_In_ PCWSTR pszFilename, _In_ PDUPFILES_WITHIN pDupWithinToSearch, _Inout_ int* piStartIndex);
+static PFILEINFO FindInDupWithinList(_In_ DWORD dwNameId, _In_ PDUPFILES_WITHIN pDupWithinToSearch, _Inout_ int* piCursor);
 static BOOL RemoveFromDupWithinList(_In_ PFILEINFO pFileToDelete, _In_ PDUPFILES_WITHIN pDupWithinToSearch);
 
 static BOOL _DeleteFile(_In_ PDIRINFO pDirInfo, _Inout_opt_ CHL_HT_ITERATOR *pFromItr, _In_ PFILEINFO pFileInfo);
 static BOOL _DeleteFileUpdateDir(_In_ PFILEINFO pFileToDelete, _In_ PDIRINFO pDeleteFrom,
-    _Inout_opt_ CHL_HT_ITERATOR *pFromItr, _In_opt_ PDIRINFO pUpdateDir);
+    _Inout_opt_ CHL_HT_ITERATOR *pFromItr, _In_opt_ PDIRINFO pUpdateDir, _Inout_opt_ PDELETE_CHANGES pChanges);
 
 static HRESULT _Init(_In_ PCWSTR pszFolderpath, _In_ BOOL fRecursive, _Out_ PDIRINFO* ppDirInfo)
 {
@@ -36,20 +45,25 @@ static HRESULT _Init(_In_ PCWSTR pszFolderpath, _In_ BOOL fRecursive, _Out_ PDIR
     }
 
     ZeroMemory(pDirInfo, sizeof(*pDirInfo));
+    NameInternAddRef();
     wcscpy_s(pDirInfo->pszPath, ARRAYSIZE(pDirInfo->pszPath), pszFolderpath);
     int nEstEntries = fRecursive ? 2048 : 256;
-    if (FAILED(CHL_DsCreateHT(&pDirInfo->phtFiles, nEstEntries, CHL_KT_WSTRING, CHL_VT_POINTER, TRUE)))
+    if (FAILED(CHL_DsCreateHT(&pDirInfo->phtFiles, nEstEntries, CHL_KT_UINT32, CHL_VT_POINTER, TRUE)))
     {
         logerr(L"Couldn't create hash table for dir: %s", pszFolderpath);
         hr = E_FAIL;
         goto error_return;
     }
 
-    // Allocate an array of pointer for the dup within files
-    hr = CHL_DsCreateRA(&pDirInfo->stDupFilesInTree.aFiles, CHL_VT_USEROBJECT, INIT_DUP_WITHIN_SIZE, (MAXINT / 2));
+    hr = CHL_DsCreateHT(&pDirInfo->stDupFilesInTree.phtNameChains, INIT_DUP_WITHIN_SIZE, CHL_KT_UINT32, CHL_VT_USEROBJECT, FALSE);
+    if (SUCCEEDED(hr))
+    {
+        hr = CHL_DsCreateHT(&pDirInfo->stDupFilesInTree.phtPathIndex, INIT_DUP_WITHIN_SIZE, CHL_KT_WSTRING, CHL_VT_INT32, FALSE);
+    }
+
     if (FAILED(hr))
     {
-        logerr(L"Couldn't create resizable array for dup files, hr: %x", hr);
+        logerr(L"Couldn't create indexes of dup files, hr: %x", hr);
         goto error_return;
     }
 
@@ -65,336 +79,158 @@ error_return:
     return hr;
 }
 
-void DestroyDirInfo_NoHash(_In_ PDIRINFO pDirInfo)
+HRESULT CreateDirInfo_NoHash(_In_z_ PCWSTR pszFolderpath, _In_ BOOL fRecursive, _Out_ PDIRINFO *ppDirInfo)
 {
-    SB_ASSERT(pDirInfo);
-
-    if (pDirInfo->phtFiles != NULL)
-    {
-        CHL_DsDestroyHT(pDirInfo->phtFiles);
-    }
-
-    CHL_DsDestroyRA(&pDirInfo->stDupFilesInTree.aFiles);
-
-    free(pDirInfo);
+    return _Init(pszFolderpath, fRecursive, ppDirInfo);
 }
 
-// Build a tree 
-BOOL BuildDirTree_NoHash(_In_z_ PCWSTR pszRootpath, _Out_ PDIRINFO* ppRootDir)
+// If the file's name is already inserted, then add it to the dup within list.
+// Either way the dir owns the FILEINFO from then on.
+BOOL AddFileToDir_NoHash(_In_ PDIRINFO pDirInfo, _In_ PFILEINFO pFileInfo)
 {
-    PCHL_QUEUE pqDirsToTraverse;
-    if (FAILED(CHL_DsCreateQ(&pqDirsToTraverse, CHL_VT_POINTER, 20)))
+    BOOL fFileAdded;
+    if (SUCCEEDED(CHL_DsFindHT(pDirInfo->phtFiles, (PCVOID)(UINT_PTR)pFileInfo->dwNameId,
+        sizeof(pFileInfo->dwNameId), NULL, NULL, TRUE)))
     {
-        logerr(L"Could not create queue for BFS. Rootpath: %s", pszRootpath);
-        goto error_return;
+        fFileAdded = AddToDupWithinList(&pDirInfo->stDupFilesInTree, pFileInfo);
     }
-
-    loginfo(L"Starting traversal for root dir: %s", pszRootpath);
-
-    // Init the first dir to traverse. 
-    // ** IMP: pFirst must be NULL here so that a new object is created in callee
-    PDIRINFO pFirstDir = NULL;
-    if (!BuildFilesInDir_NoHash(pszRootpath, pqDirsToTraverse, &pFirstDir))
+    else
     {
-        logerr(L"Could not build files in dir: %s", pszRootpath);
-        goto error_return;
+        fFileAdded = SUCCEEDED(CHL_DsInsertHT(pDirInfo->phtFiles, (PCVOID)(UINT_PTR)pFileInfo->dwNameId,
+            sizeof(pFileInfo->dwNameId), pFileInfo, sizeof pFileInfo));
     }
 
-    PDIRINFO pDirToTraverse;
-    while (SUCCEEDED(pqDirsToTraverse->Delete(pqDirsToTraverse, &pDirToTraverse, NULL, FALSE)))
+    if (!fFileAdded)
     {
-        loginfo(L"Continuing traversal in dir: %s", pDirToTraverse->pszPath);
-        if (!BuildFilesInDir_NoHash(pDirToTraverse->pszPath, pqDirsToTraverse, &pFirstDir))
-        {
-            logerr(L"Could not build files in dir: %s. Continuing...", pDirToTraverse->pszPath);
-        }
+        logerr(L"Cannot add %s to file list: %s", (pFileInfo->fIsDirectory ? L"dir" : L"file"), pFileInfo->pszFilename);
+        free(pFileInfo);
+        return FALSE;
     }
 
-    pqDirsToTraverse->Destroy(pqDirsToTraverse);
-
-    *ppRootDir = pFirstDir;
+    pFileInfo->fIsDirectory ? ++(pDirInfo->nDirs) : ++(pDirInfo->nFiles);
     return TRUE;
-
-error_return:
-    if (pqDirsToTraverse)
-    {
-        pqDirsToTraverse->Destroy(pqDirsToTraverse);
-    }
-    *ppRootDir = NULL;
-    return FALSE;
 }
 
-// Build the list of files in the given folder.
-BOOL BuildFilesInDir_NoHash(
-    _In_ PCWSTR pszFolderpath,
-    _In_opt_ PCHL_QUEUE pqDirsToTraverse,
-    _Inout_ PDIRINFO* ppDirInfo)
+void DestroyDirInfo_NoHash(_In_ PDIRINFO pDirInfo)
 {
-    SB_ASSERT(pszFolderpath);
-    SB_ASSERT(ppDirInfo);
-
-    HANDLE hFindFile = NULL;
+    SB_ASSERT(pDirInfo);
 
-    loginfo(L"Building dir: %s", pszFolderpath);
-    if (*ppDirInfo == NULL && FAILED(_Init(pszFolderpath, (pqDirsToTraverse != NULL), ppDirInfo)))
+    if (pDirInfo->phtFiles != NULL)
     {
-        logerr(L"Init failed for dir: %s", pszFolderpath);
-        goto error_return;
+        CHL_DsDestroyHT(pDirInfo->phtFiles);
     }
 
-    // Derefernce just to make it easier to code
-    PDIRINFO pCurDirInfo = *ppDirInfo;
-
-    // In order to list all files within the specified directory,
-    // path sent to FindFirstFile must end with a "\\*"
-    WCHAR szSearchpath[MAX_PATH] = L"";
-    wcscpy_s(szSearchpath, ARRAYSIZE(szSearchpath), pszFolderpath);
-
-    int nLen = wcsnlen(pszFolderpath, MAX_PATH);
-    if (nLen > 2 && wcsncmp(pszFolderpath + nLen - 2, L"\\*", MAX_PATH) != 0)
+    for (int i = 0; i < pDirInfo->stDupFilesInTree.nCurFiles; ++i)
     {
-        PathCchCombine(szSearchpath, ARRAYSIZE(szSearchpath), pszFolderpath, L"*");
+        free(pDirInfo->stDupFilesInTree.apFiles[i]);
     }
+    free(pDirInfo->stDupFilesInTree.apFiles);
 
-    // Initialize search for files in folder
-    WIN32_FIND_DATA findData;
-    hFindFile = FindFirstFile(szSearchpath, &findData);
-    if (hFindFile == INVALID_HANDLE_VALUE && GetLastError() == ERROR_FILE_NOT_FOUND)
+    if (pDirInfo->stDupFilesInTree.phtNameChains != NULL)
     {
-        // No files found under the folder. Just return.
-        return TRUE;
+        CHL_DsDestroyHT(pDirInfo->stDupFilesInTree.phtNameChains);
     }
 
-    if (hFindFile == INVALID_HANDLE_VALUE)
+    if (pDirInfo->stDupFilesInTree.phtPathIndex != NULL)
     {
-        logerr(L"FindFirstFile().");
-        goto error_return;
+        CHL_DsDestroyHT(pDirInfo->stDupFilesInTree.phtPathIndex);
     }
 
-    do
-    {
-        // Skip banned files and folders
-        if (IsFileFolderBanned(findData.cFileName, ARRAYSIZE(findData.cFileName)))
-        {
-            continue;
-        }
-
-        szSearchpath[0] = 0;
-        if (FAILED(PathCchCombine(szSearchpath, ARRAYSIZE(szSearchpath), pszFolderpath, findData.cFileName) == NULL))
-        {
-            logerr(L"PathCchCombine() failed for %s and %s", pszFolderpath, findData.cFileName);
-            goto error_return;
-        }
-
-        PFILEINFO pFileInfo;
-        if (!CreateFileInfo(szSearchpath, FALSE, &pFileInfo))
-        {
-            // Treat as warning and move on.
-            logwarn(L"Unable to get file info for: %s", szSearchpath);
-            continue;
-        }
-
-        if (pFileInfo->fIsDirectory && pqDirsToTraverse)
-        {
-            // If pqDirsToTraverse is not null, it means caller wants recursive directory traversal
-            PDIRINFO pSubDir;
-            if (FAILED(_Init(szSearchpath, TRUE, &pSubDir)))
-            {
-                logwarn(L"Unable to init dir info for: %s", szSearchpath);
-                free(pFileInfo);
-                continue;
-            }
-
-            // Insert pSubDir into the queue so that it will be traversed later
-            if (FAILED(pqDirsToTraverse->Insert(pqDirsToTraverse, pSubDir, sizeof pSubDir)))
-            {
-                logwarn(L"Unable to add sub dir [%s] to traversal queue, cur dir: %s", findData.cFileName, pszFolderpath);
-                free(pFileInfo);
-                continue;
-            }
-            ++(pCurDirInfo->nDirs);
-        }
-        else
-        {
-            // Either this is a file or a directory but the folder must be considered as a file
-            // because recursion is not enabled and we want to enable comparison of some attributes of a folder.
-            // If the current file's name is already inserted, then add it to the dup within list
-            BOOL fFileAdded;
-            if (SUCCEEDED(CHL_DsFindHT(pCurDirInfo->phtFiles, findData.cFileName,
-                StringSizeBytes(findData.cFileName), NULL, NULL, TRUE)))
-            {
-                fFileAdded = AddToDupWithinList(&pCurDirInfo->stDupFilesInTree, pFileInfo);
-            }
-            else
-            {
-                fFileAdded = SUCCEEDED(CHL_DsInsertHT(pCurDirInfo->phtFiles, findData.cFileName,
-                    StringSizeBytes(findData.cFileName), pFileInfo, sizeof pFileInfo));
-            }
+    free(pDirInfo->stDupFilesInTree.aiNextSameName);
+    free(pDirInfo);
+    NameInternRelease();
+}
 
-            if (!fFileAdded)
-            {
-                logerr(L"Cannot add %s to file list: %s", (pFileInfo->fIsDirectory ? L"dir" : L"file"), findData.cFileName);
-                free(pFileInfo);
-            }
-            else
-            {
-                pFileInfo->fIsDirectory ? ++(pCurDirInfo->nDirs) : ++(pCurDirInfo->nFiles);
-                logdbg(L"Added %s: %s", (pFileInfo->fIsDirectory ? L"dir" : L"file"), findData.cFileName);
-            }
-        }
-    } while (FindNextFile(hFindFile, &findData));
+// Files keyed by the name id, see DIRINFO.phtFiles
+struct _NameLayout
+{
+    static const BOOL fComputeHash = FALSE;
+    // Folders are listed when not recursive, to compare their attributes
+    static const BOOL fKeepFolders = TRUE;
 
-    if (GetLastError() != ERROR_NO_MORE_FILES)
+    static HRESULT Init(_In_ PCWSTR pszFolderpath, _In_ BOOL fRecursive, _Out_ PDIRINFO* ppDirInfo)
     {
-        logerr(L"Failed in enumerating files in directory: %s", pszFolderpath);
-        goto error_return;
+        return _Init(pszFolderpath, fRecursive, ppDirInfo);
     }
 
-    FindClose(hFindFile);
-    return TRUE;
-
-error_return:
-    if (hFindFile != INVALID_HANDLE_VALUE)
+    static void Destroy(_In_ PDIRINFO pDirInfo)
     {
-        FindClose(hFindFile);
+        DestroyDirInfo_NoHash(pDirInfo);
     }
 
-    if (*ppDirInfo != NULL)
+    static BOOL AddFile(_In_ PDIRINFO pDirInfo, _In_ PFILEINFO pFileInfo)
     {
-        DestroyDirInfo_NoHash(*ppDirInfo);
-        *ppDirInfo = NULL;
+        return AddFileToDir_NoHash(pDirInfo, pFileInfo);
     }
+};
 
-    return FALSE;
+// Build a tree 
+BOOL BuildDirTree_NoHash(_In_z_ PCWSTR pszRootpath, _Out_ PDIRINFO* ppRootDir)
+{
+    return WalkDirTree<_NameLayout>(pszRootpath, ppRootDir);
 }
 
-// Given two DIRINFO objects, compare the files in them and set each file's
-// duplicate flag to indicate that the file is present in both dirs.
-BOOL CompareDirsAndMarkFiles_NoHash(_In_ PDIRINFO pLeftDir, _In_ PDIRINFO pRightDir)
+// Build the list of files in the given folder.
+BOOL BuildFilesInDir_NoHash(
+    _In_ PCWSTR pszFolderpath,
+    _In_opt_ PCHL_QUEUE pqDirsToTraverse,
+    _Inout_ PDIRINFO* ppDirInfo)
 {
-    SB_ASSERT(pLeftDir);
-    SB_ASSERT(pRightDir);
-
-    // For each file in the left dir, search for the same in the right dir
-    // If found, pass both to the CompareFileInfoAndMark().
-
-    CHL_HT_ITERATOR itrLeft;
-    if (FAILED(CHL_DsInitIteratorHT(pLeftDir->phtFiles, &itrLeft)))
-    {
-        return TRUE;
-    }
-
-    WCHAR* pszLeftFile;
-    PFILEINFO pLeftFile, pRightFile;
-    int nLeftKeySize;
-
-    logdbg(L"Comparing dirs: %s and %s", pLeftDir->pszPath, pRightDir->pszPath);
-    do
-    {
-        itrLeft.GetCurrent(&itrLeft, &pszLeftFile, &nLeftKeySize, &pLeftFile, NULL, TRUE);
-        if (SUCCEEDED(CHL_DsFindHT(pRightDir->phtFiles, (void*)pszLeftFile, nLeftKeySize, &pRightFile, NULL, TRUE)))
-        {
-            // Same file found in right dir, compare and mark as duplicate
-            if (CompareFileInfoAndMark(pLeftFile, pRightFile, FALSE))
-            {
-                logdbg(L"Duplicate %s: %s", (pLeftFile->fIsDirectory ? L"dir" : L"file"), pszLeftFile);
-            }
-        }
-
-        int index = 0;
-        while ((pRightFile = FindInDupWithinList(pLeftFile->szFilename, &pRightDir->stDupFilesInTree, &index)) != NULL)
-        {
-            // Same file found in right dir, compare and mark as duplicate
-            if (CompareFileInfoAndMark(pLeftFile, pRightFile, FALSE))
-            {
-                logdbg(L"DupWithin Duplicate %s: %s", (pLeftFile->fIsDirectory ? L"dir" : L"file"), pszLeftFile);
-            }
-        }
-    } while (SUCCEEDED(itrLeft.MoveNext(&itrLeft)));
-
-    // See if dup within files are duplicate
-    for (int i = 0; i < pLeftDir->stDupFilesInTree.nCurFiles; ++i)
-    {
-        // Check if this file is in the right dir by checking both its hashtable and the dupwithin list
-        if (FAILED(CHL_DsReadRA(&pLeftDir->stDupFilesInTree.aFiles, i, &pLeftFile, NULL, TRUE)))
-        {
-            continue;
-        }
-
-        // Hashtable first
-        if (SUCCEEDED(CHL_DsFindHT(pRightDir->phtFiles, pLeftFile->szFilename, StringSizeBytes(pLeftFile->szFilename), &pRightFile, NULL, TRUE)))
-        {
-            // Same file found in right dir, compare and mark as duplicate
-            if (CompareFileInfoAndMark(pLeftFile, pRightFile, FALSE))
-            {
-                logdbg(L"Duplicate file: %s", pLeftFile->szFilename);
-            }
-        }
-
-        // Now, the dup-within
-        int index = 0;
-        while ((pRightFile = FindInDupWithinList(pLeftFile->szFilename, &pRightDir->stDupFilesInTree, &index)) != NULL)
-        {
-            // Same file found in right dir, compare and mark as duplicate
-            if (CompareFileInfoAndMark(pLeftFile, pRightFile, FALSE))
-            {
-                logdbg(L"DupWithin Duplicate file: %s", pLeftFile->szFilename);
-            }
-        }
-    }
-
-    return TRUE;
+    return WalkFilesInDir<_NameLayout>(pszFolderpath, pqDirsToTraverse, ppDirInfo);
 }
 
 #pragma region FileOperations
 
-void ClearFilesDupFlag_NoHash(_In_ PDIRINFO pDirInfo)
-{
-    SB_ASSERT(pDirInfo);
-    if (pDirInfo->nFiles > 0)
-    {
-        CHL_HT_ITERATOR itr;
-        if (SUCCEEDED(CHL_DsInitIteratorHT(pDirInfo->phtFiles, &itr)))
-        {
-            PFILEINFO pFileInfo;
-            int nValSize;
-            while (SUCCEEDED(itr.GetCurrent(&itr, NULL, NULL, &pFileInfo, &nValSize, TRUE)))
-            {
-                ClearDuplicateAttr(pFileInfo);
-                (void)itr.MoveNext(&itr);
-            }
-        }
-    }
-}
-
 BOOL _DeleteFile(_In_ PDIRINFO pDirInfo, _Inout_opt_ CHL_HT_ITERATOR *pFromItr, _In_ PFILEINFO pFileInfo)
 {
     BOOL fRetVal = TRUE;
 
     WCHAR szFilepath[MAX_PATH];
-    loginfo(L"Deleting file = %s\\%s", pFileInfo->szPath, pFileInfo->szFilename);
-    if (FAILED(PathCchCombine(szFilepath, ARRAYSIZE(szFilepath), pFileInfo->szPath, pFileInfo->szFilename) == NULL))
+    loginfo(L"Deleting file = %s\\%s", pFileInfo->pszPath, pFileInfo->pszFilename);
+    if (FAILED(PathCchCombine(szFilepath, ARRAYSIZE(szFilepath), pFileInfo->pszPath, pFileInfo->pszFilename) == NULL))
     {
-        logerr(L"PathCchCombine() failed for %s + %s", pFileInfo->szPath, pFileInfo->szFilename);
+        logerr(L"PathCchCombine() failed for %s + %s", pFileInfo->pszPath, pFileInfo->pszFilename);
         fRetVal = FALSE;
         goto done;
     }
 
     if (!DeleteFile(szFilepath))
     {
+        // File is still there, keep it in the file list. Caller expects
+        // the iterator to have moved past this file.
         logerr(L"DeleteFile failed, err: %u", GetLastError());
+        if (pFromItr != NULL)
+        {
+            (void)pFromItr->MoveNext(pFromItr);
+        }
         fRetVal = FALSE;
+        goto done;
+    }
+
+    // Remove from file list. The hashtable entry with this name may be a different
+    // file of the same name, in which case this file is in the dup within list.
+    HRESULT hr;
+    PFILEINFO pFileInTable;
+    if (pFromItr != NULL)
+    {
+        hr = pDirInfo->phtFiles->RemoveAt(pFromItr);
+    }
+    else if (SUCCEEDED(CHL_DsFindHT(pDirInfo->phtFiles, (PCVOID)(UINT_PTR)pFileInfo->dwNameId, sizeof(pFileInfo->dwNameId),
+        &pFileInTable, NULL, TRUE)) && (pFileInTable == pFileInfo))
+    {
+        hr = CHL_DsRemoveHT(pDirInfo->phtFiles, (PCVOID)(UINT_PTR)pFileInfo->dwNameId, sizeof(pFileInfo->dwNameId));
+    }
+    else
+    {
+        hr = E_NOT_SET;
     }
 
-    // Remove from file list
-    HRESULT hr = (pFromItr != NULL) ? pDirInfo->phtFiles->RemoveAt(pFromItr)
-        : CHL_DsRemoveHT(pDirInfo->phtFiles, pFileInfo->szFilename, StringSizeBytes(pFileInfo->szFilename));
     if (FAILED(hr))
     {
         // See if file is present in the dup within list
         if (!(RemoveFromDupWithinList(pFileInfo, &pDirInfo->stDupFilesInTree)))
         {
-            logerr(L"Failed to remove file from hashtable/list: %s", pFileInfo->szFilename);
+            logerr(L"Failed to remove file from hashtable/list: %s", pFileInfo->pszFilename);
             fRetVal = FALSE;
             goto done;
         }
@@ -407,33 +243,50 @@ done:
 }
 
 BOOL _DeleteFileUpdateDir(_In_ PFILEINFO pFileToDelete, _In_ PDIRINFO pDeleteFrom,
-    _Inout_opt_ CHL_HT_ITERATOR *pFromItr, _In_opt_ PDIRINFO pUpdateDir)
+    _Inout_opt_ CHL_HT_ITERATOR *pFromItr, _In_opt_ PDIRINFO pUpdateDir, _Inout_opt_ PDELETE_CHANGES pChanges)
 {
     SB_ASSERT(pFileToDelete->fIsDirectory == FALSE);
-    if (pUpdateDir) // BUG Why is this _In_opt_
-    {
-        // Find this file in the other directory and update that file info
-        // to say that it is not a duplicate any more.
-        PFILEINFO pFileToUpdate;
-        BOOL fFound = SUCCEEDED(CHL_DsFindHT(pUpdateDir->phtFiles, pFileToDelete->szFilename,
-            StringSizeBytes(pFileToDelete->szFilename), &pFileToUpdate, NULL, TRUE));
 
-        // Must find in the other dir also.
-        SB_ASSERT(fFound);
-        ClearDuplicateAttr(pFileToUpdate);
+    // Find this file in the other directory, if there is one, before the
+    // FILEINFO of the file to delete is freed.
+    PFILEINFO pFileToUpdate = NULL;
+    if (pUpdateDir && IsDuplicateFile(pFileToDelete))
+    {
+        if (FAILED(CHL_DsFindHT(pUpdateDir->phtFiles, (PCVOID)(UINT_PTR)pFileToDelete->dwNameId,
+            sizeof(pFileToDelete->dwNameId), &pFileToUpdate, NULL, TRUE)))
+        {
+            pFileToUpdate = NULL;
+        }
     }
 
+    DELETED_FILE stDeleted;
+    DelChanges_GetDeleted(pFileToDelete, &stDeleted);
+
     // Now, delete file from the specified dir and from file lists
-    return _DeleteFile(pDeleteFrom, pFromItr, pFileToDelete);
+    if (!_DeleteFile(pDeleteFrom, pFromItr, pFileToDelete))
+    {
+        return FALSE;
+    }
+    DelChanges_AddDeleted(pChanges, &stDeleted);
+
+    // Update the other dir's file info to say that it is not a duplicate any more.
+    if (pFileToUpdate != NULL)
+    {
+        ClearDuplicateAttr(pFileToUpdate);
+        DelChanges_AddUpdated(pChanges, pFileToUpdate);
+    }
+    return TRUE;
 }
 
 // Inplace delete of files in a directory. This deletes duplicate files from
 // the pDirDeleteFrom directory and removes the duplicate flag of the deleted
 // files in the pDirToUpdate directory.
-BOOL DeleteDupFilesInDir_NoHash(_In_ PDIRINFO pDirDeleteFrom, _In_ PDIRINFO pDirToUpdate)
+BOOL DeleteDupFilesInDir_NoHash(_In_ PDIRINFO pDirDeleteFrom, _In_ PDIRINFO pDirToUpdate, _Inout_opt_ PDELETE_CHANGES pChanges)
 {
     SB_ASSERT(pDirDeleteFrom);
 
+    PCHL_HTABLE phtFoldersSeen = NULL;
+
     loginfo(L"In folder = %s", pDirDeleteFrom->pszPath);
     if (pDirDeleteFrom->nFiles <= 0)
     {
@@ -447,7 +300,6 @@ BOOL DeleteDupFilesInDir_NoHash(_In_ PDIRINFO pDirDeleteFrom, _In_ PDIRINFO pDir
         goto error_return;
     }
 
-    PCHL_HTABLE phtFoldersSeen;
     if (FAILED(DelEmptyFolders_Init(pDirDeleteFrom, &phtFoldersSeen)))
     {
         goto error_return;
@@ -461,7 +313,7 @@ BOOL DeleteDupFilesInDir_NoHash(_In_ PDIRINFO pDirDeleteFrom, _In_ PDIRINFO pDir
         if ((pFileInfo->fIsDirectory == FALSE) && IsDuplicateFile(pFileInfo))
         {
             // itr will be incremented by callee
-            _DeleteFileUpdateDir(pFileInfo, pDirDeleteFrom, &itr, pDirToUpdate);
+            _DeleteFileUpdateDir(pFileInfo, pDirDeleteFrom, &itr, pDirToUpdate, pChanges);
         }
         else
         {
@@ -469,7 +321,27 @@ BOOL DeleteDupFilesInDir_NoHash(_In_ PDIRINFO pDirDeleteFrom, _In_ PDIRINFO pDir
         }
     }
 
-    DelEmptyFolders_Delete(phtFoldersSeen);
+    // Duplicates can also be among the files whose names were already taken in the hashtable
+    for (int i = 0; i < pDirDeleteFrom->stDupFilesInTree.nCurFiles; ++i)
+    {
+        pFileInfo = pDirDeleteFrom->stDupFilesInTree.apFiles[i];
+        if (pFileInfo == NULL)
+        {
+            continue;
+        }
+
+        DelEmptyFolders_Add(phtFoldersSeen, pFileInfo);
+
+        if ((pFileInfo->fIsDirectory == FALSE) && IsDuplicateFile(pFileInfo))
+        {
+            _DeleteFileUpdateDir(pFileInfo, pDirDeleteFrom, NULL, pDirToUpdate, pChanges);
+        }
+    }
+
+    if ((DelEmptyFolders_Delete(phtFoldersSeen) > 0) && (pChanges != NULL))
+    {
+        pChanges->fRebuildRequired = TRUE;
+    }
     return TRUE;
 
 error_return:
@@ -485,7 +357,8 @@ BOOL DeleteFilesInDir_NoHash(
     _In_ PDIRINFO pDirDeleteFrom,
     _In_ PCWSTR paszFileNamesToDelete,
     _In_ int nFileNames,
-    _In_opt_ PDIRINFO pDirToUpdate)
+    _In_opt_ PDIRINFO pDirToUpdate,
+    _Inout_opt_ PDELETE_CHANGES pChanges)
 {
     SB_ASSERT(pDirDeleteFrom);
     SB_ASSERT(paszFileNamesToDelete);
@@ -506,14 +379,15 @@ BOOL DeleteFilesInDir_NoHash(
         ++index;
 
         PFILEINFO pFileToDelete;
-        if (SUCCEEDED(CHL_DsFindHT(pDirDeleteFrom->phtFiles, (PCVOID)pszFileName,
-            StringSizeBytes(pszFileName), &pFileToDelete, NULL, TRUE)))
+        DWORD dwNameId = FindNameId(pszFileName);
+        if ((dwNameId != 0) && SUCCEEDED(CHL_DsFindHT(pDirDeleteFrom->phtFiles, (PCVOID)(UINT_PTR)dwNameId,
+            sizeof(dwNameId), &pFileToDelete, NULL, TRUE)))
         {
             DelEmptyFolders_Add(phtFoldersSeen, pFileToDelete);
 
             if (pFileToDelete->fIsDirectory == FALSE)
             {
-                _DeleteFileUpdateDir(pFileToDelete, pDirDeleteFrom, NULL, pDirToUpdate);
+                _DeleteFileUpdateDir(pFileToDelete, pDirDeleteFrom, NULL, pDirToUpdate, pChanges);
             }
         }
         else
@@ -522,12 +396,99 @@ BOOL DeleteFilesInDir_NoHash(
         }
     }
 
-    DelEmptyFolders_Delete(phtFoldersSeen);
+    if ((DelEmptyFolders_Delete(phtFoldersSeen) > 0) && (pChanges != NULL))
+    {
+        pChanges->fRebuildRequired = TRUE;
+    }
     return TRUE;
 }
 
 #pragma endregion FileOperations
 
+// Collect pointers to all FILEINFOs in the hashtable and the dup within list.
+HRESULT GetAllFilesInDir_NoHash(_In_ PDIRINFO pDirInfo, _Out_ PFILEINFO **ppaFiles, _Out_ int *pnFiles)
+{
+    SB_ASSERT(pDirInfo);
+
+    HRESULT hr = S_OK;
+    PFILEINFO *paFiles = NULL;
+    int nFiles = 0;
+    int nCapacity = 0;
+
+    CHL_HT_ITERATOR itr;
+    if (SUCCEEDED(CHL_DsInitIteratorHT(pDirInfo->phtFiles, &itr)))
+    {
+        PFILEINFO pFileInfo;
+        while (SUCCEEDED(itr.GetCurrent(&itr, NULL, NULL, &pFileInfo, NULL, TRUE)))
+        {
+            (void)itr.MoveNext(&itr);
+            hr = AppendToFileArray(&paFiles, &nFiles, &nCapacity, pFileInfo);
+            if (FAILED(hr))
+            {
+                goto error_return;
+            }
+        }
+    }
+
+    for (int i = 0; i < pDirInfo->stDupFilesInTree.nCurFiles; ++i)
+    {
+        PFILEINFO pFileInfo;
+        pFileInfo = pDirInfo->stDupFilesInTree.apFiles[i];
+        if (pFileInfo == NULL)
+        {
+            continue;
+        }
+
+        hr = AppendToFileArray(&paFiles, &nFiles, &nCapacity, pFileInfo);
+        if (FAILED(hr))
+        {
+            goto error_return;
+        }
+    }
+
+    *ppaFiles = paFiles;
+    *pnFiles = nFiles;
+    return S_OK;
+
+error_return:
+    free(paFiles);
+    *ppaFiles = NULL;
+    *pnFiles = 0;
+    return hr;
+}
+
+HRESULT AppendFilesWithName_NoHash(
+    _In_ PDIRINFO pDirInfo,
+    _In_z_ PCWSTR pszFilename,
+    _Inout_ PFILEINFO **ppaFiles,
+    _Inout_ int *pnFiles,
+    _Inout_ int *pnCapacity)
+{
+    SB_ASSERT(pDirInfo);
+    SB_ASSERT(pszFilename);
+
+    // No file of any tree has a name that is not in the pool
+    DWORD dwNameId = FindNameId(pszFilename);
+    if (dwNameId == 0)
+    {
+        return S_OK;
+    }
+
+    HRESULT hr = S_OK;
+    PFILEINFO pFileInfo;
+    if (SUCCEEDED(CHL_DsFindHT(pDirInfo->phtFiles, (PCVOID)(UINT_PTR)dwNameId, sizeof(dwNameId), &pFileInfo, NULL, TRUE)))
+    {
+        hr = AppendToFileArray(ppaFiles, pnFiles, pnCapacity, pFileInfo);
+    }
+
+    int index = 0;
+    while (SUCCEEDED(hr) && ((pFileInfo = FindInDupWithinList(dwNameId, &pDirInfo->stDupFilesInTree, &index)) != NULL))
+    {
+        hr = AppendToFileArray(ppaFiles, pnFiles, pnCapacity, pFileInfo);
+    }
+    return hr;
+}
+
 // Print the dir tree in BFS order, two blank lines separating
 // file listing of each directory
 void PrintDirTree_NoHash(_In_ PDIRINFO pRootDir)
@@ -541,7 +502,8 @@ void PrintDirTree_NoHash(_In_ PDIRINFO pRootDir)
         for (int i = 0; i < pRootDir->stDupFilesInTree.nCurFiles; ++i)
         {
             PFILEINFO pFileInfo;
-            if (FAILED(CHL_DsReadRA(&pRootDir->stDupFilesInTree.aFiles, i, &pFileInfo, NULL, TRUE)))
+            pFileInfo = pRootDir->stDupFilesInTree.apFiles[i];
+            if (pFileInfo == NULL)
             {
                 continue;
             }
@@ -550,7 +512,7 @@ void PrintDirTree_NoHash(_In_ PDIRINFO pRootDir)
                 pFileInfo->llFilesize.LowPart,
                 pFileInfo->fIsDirectory ? L'D' : L'F',
                 IsDuplicateFile(pFileInfo) ? 1 : 0,
-                pFileInfo->szFilename);
+                pFileInfo->pszFilename);
         }
     }
     return;
@@ -577,73 +539,147 @@ void PrintFilesInDir_NoHash(_In_ PDIRINFO pDirInfo)
             pFileInfo->llFilesize.LowPart,
             pFileInfo->fIsDirectory ? L'D' : L'F',
             IsDuplicateFile(pFileInfo) ? 1 : 0,
-            pFileInfo->szFilename);
+            pFileInfo->pszFilename);
     }
 
     return;
 }
 
-BOOL AddToDupWithinList(_In_ PDUPFILES_WITHIN pDupWithin, _In_ PFILEINFO pFileInfo)
+// Upper cased full path of a file, the key of the path index
+static HRESULT _GetPathIndexKey(_In_ PFILEINFO pFileInfo, _Out_writes_(cchKey) PWSTR pszKey, _In_ int cchKey)
 {
-    HRESULT hr = pDupWithin->aFiles.Write(&pDupWithin->aFiles, pDupWithin->nCurFiles, pFileInfo, sizeof(*pFileInfo));
-    if (SUCCEEDED(hr))
+    WCHAR szFullpath[MAX_PATH];
+    HRESULT hr = PathCchCombine(szFullpath, ARRAYSIZE(szFullpath), pFileInfo->pszPath, pFileInfo->pszFilename);
+    if (FAILED(hr))
     {
-        ++(pDupWithin->nCurFiles);
+        logerr(L"PathCchCombine() failed for %s and %s", pFileInfo->pszPath, pFileInfo->pszFilename);
+        return hr;
     }
-    return SUCCEEDED(hr);
+
+    (void)FoldName(szFullpath, pszKey, cchKey);
+    return S_OK;
 }
 
-PFILEINFO FindInDupWithinList(_In_ PCWSTR pszFilename, _In_ PDUPFILES_WITHIN pDupWithinToSearch, _Inout_ int* piStartIndex)
+BOOL AddToDupWithinList(_In_ PDUPFILES_WITHIN pDupWithin, _In_ PFILEINFO pFileInfo)
 {
-    SB_ASSERT(0 <= *piStartIndex && *piStartIndex <= pDupWithinToSearch->nCurFiles);
+    int iNew = pDupWithin->nCurFiles;
 
-    while (*piStartIndex < pDupWithinToSearch->nCurFiles)
+    WCHAR szPathKey[MAX_PATH];
+    HRESULT hr = _GetPathIndexKey(pFileInfo, szPathKey, ARRAYSIZE(szPathKey));
+    if (FAILED(hr))
     {
-        ++(*piStartIndex);
+        goto fend;
+    }
 
-        PFILEINFO pFile;
-        if (FAILED(CHL_DsReadRA(&pDupWithinToSearch->aFiles, (*piStartIndex) - 1, &pFile, NULL, TRUE)))
+    if (iNew >= pDupWithin->nCapacity)
+    {
+        int nNewCapacity = (pDupWithin->nCapacity > 0) ? (pDupWithin->nCapacity * 2) : INIT_DUP_WITHIN_SIZE;
+        PFILEINFO *apNew = (PFILEINFO*)realloc(pDupWithin->apFiles, nNewCapacity * sizeof(PFILEINFO));
+        if (apNew != NULL)
         {
-            continue;
+            pDupWithin->apFiles = apNew;
         }
 
-        if (_wcsnicmp(pszFilename, pFile->szFilename, MAX_PATH) == 0)
+        int *aiNew = (apNew != NULL) ? (int*)realloc(pDupWithin->aiNextSameName, nNewCapacity * sizeof(int)) : NULL;
+        if (aiNew == NULL)
         {
-            return pFile;
+            logerr(L"Out of memory growing dup within list to %d entries", nNewCapacity);
+            hr = E_OUTOFMEMORY;
+            goto fend;
         }
+
+        pDupWithin->aiNextSameName = aiNew;
+        pDupWithin->nCapacity = nNewCapacity;
     }
-    return NULL;
-}
 
-BOOL RemoveFromDupWithinList(_In_ PFILEINFO pFileToDelete, _In_ PDUPFILES_WITHIN pDupWithinToSearch)
-{
-    WCHAR szCompareFromPath[MAX_PATH];
-    if (FAILED(PathCchCombine(szCompareFromPath, ARRAYSIZE(szCompareFromPath), pFileToDelete->szPath, pFileToDelete->szFilename) == NULL))
+    hr = CHL_DsInsertHT(pDupWithin->phtPathIndex, szPathKey, StringSizeBytes(szPathKey), (PCVOID)(INT_PTR)iNew, sizeof(iNew));
+    if (FAILED(hr))
     {
-        logerr(L"PathCchCombine() failed for %s + %s", pFileToDelete->szPath, pFileToDelete->szFilename);
-        return FALSE;
+        goto fend;
     }
 
-    WCHAR szCompareToPath[MAX_PATH];
-    for (int i = 0; i < pDupWithinToSearch->nCurFiles; ++i)
+    // Append to the end of the chain of this name, so that files of the same
+    // name are found in the order they were added.
+    pDupWithin->aiNextSameName[iNew] = -1;
+
+    PDUP_NAME_CHAIN pChain;
+    if (SUCCEEDED(CHL_DsFindHT(pDupWithin->phtNameChains, (PCVOID)(UINT_PTR)pFileInfo->dwNameId, sizeof(pFileInfo->dwNameId), &pChain, NULL, TRUE)))
     {
-        PFILEINFO pFile;
-        if (FAILED(CHL_DsReadRA(&pDupWithinToSearch->aFiles, i, &pFile, NULL, TRUE)))
+        pDupWithin->aiNextSameName[pChain->iLast] = iNew;
+        pChain->iLast = iNew;
+    }
+    else
+    {
+        DUP_NAME_CHAIN stChain = { iNew, iNew };
+        hr = CHL_DsInsertHT(pDupWithin->phtNameChains, (PCVOID)(UINT_PTR)pFileInfo->dwNameId, sizeof(pFileInfo->dwNameId), &stChain, sizeof(stChain));
+        if (FAILED(hr))
         {
-            continue;
+            CHL_DsRemoveHT(pDupWithin->phtPathIndex, szPathKey, StringSizeBytes(szPathKey));
+            goto fend;
         }
+    }
+
+    // Even a cleared index is counted, indexes of files are never reused
+    pDupWithin->apFiles[iNew] = pFileInfo;
+    ++(pDupWithin->nCurFiles);
 
-        if (FAILED(PathCchCombine(szCompareToPath, ARRAYSIZE(szCompareToPath), pFile->szPath, pFile->szFilename) == NULL))
+fend:
+    return SUCCEEDED(hr);
+}
+
+// Find the files of the given name one at a time. *piCursor must be 0 for the
+// first call, each call moves it past the file returned.
+PFILEINFO FindInDupWithinList(_In_ DWORD dwNameId, _In_ PDUPFILES_WITHIN pDupWithinToSearch, _Inout_ int* piCursor)
+{
+    // Cursor is the next index to look at plus one, or -1 past the end of the chain
+    int iFile = *piCursor - 1;
+    if (*piCursor == 0)
+    {
+        PDUP_NAME_CHAIN pChain;
+        iFile = -1;
+        if (SUCCEEDED(CHL_DsFindHT(pDupWithinToSearch->phtNameChains, (PCVOID)(UINT_PTR)dwNameId, sizeof(dwNameId), &pChain, NULL, TRUE)))
         {
-            logerr(L"PathCchCombine() failed for %s + %s", pFile->szPath, pFile->szFilename);
-            return FALSE;
+            iFile = pChain->iFirst;
         }
+    }
+
+    while (iFile >= 0)
+    {
+        SB_ASSERT(iFile < pDupWithinToSearch->nCurFiles);
+
+        int iNext = pDupWithinToSearch->aiNextSameName[iFile];
 
-        if (_wcsnicmp(szCompareFromPath, szCompareToPath, MAX_PATH) == 0)
+        // Removed files are skipped
+        PFILEINFO pFile = pDupWithinToSearch->apFiles[iFile];
+        if (pFile != NULL)
         {
-            CHL_DsClearAtRA(&pDupWithinToSearch->aFiles, i);
-            return TRUE;
+            *piCursor = (iNext >= 0) ? (iNext + 1) : -1;
+            return pFile;
         }
+        iFile = iNext;
     }
-    return FALSE;
+
+    *piCursor = -1;
+    return NULL;
+}
+
+BOOL RemoveFromDupWithinList(_In_ PFILEINFO pFileToDelete, _In_ PDUPFILES_WITHIN pDupWithinToSearch)
+{
+    WCHAR szPathKey[MAX_PATH];
+    if (FAILED(_GetPathIndexKey(pFileToDelete, szPathKey, ARRAYSIZE(szPathKey))))
+    {
+        return FALSE;
+    }
+
+    int iFile;
+    if (FAILED(CHL_DsFindHT(pDupWithinToSearch->phtPathIndex, szPathKey, StringSizeBytes(szPathKey), &iFile, NULL, FALSE)))
+    {
+        return FALSE;
+    }
+
+    // The file stays in its name chain, where a cleared index is skipped
+    CHL_DsRemoveHT(pDupWithinToSearch->phtPathIndex, szPathKey, StringSizeBytes(szPathKey));
+    free(pDupWithinToSearch->apFiles[iFile]);
+    pDupWithinToSearch->apFiles[iFile] = NULL;
+    return TRUE;
 }
@@ -0,0 +1,196 @@
+
+// ---------------------------------------------------
+// The FDiffDelete Project
+// Github: https://github.com/shishir993/fdiffdelete
+// Author: Shishir Bhat
+// The MIT License (MIT)
+// Copyright (c) 2014
+//
+
+#include "DirectoryWalker_Bloom.h"
+#include "DirectoryWalker_Util.h"
+#include "NameIntern.h"
+
+static BOOL _MayBeInDir(_In_ PDIRINFO pDirInfo, _In_ PFILEINFO pFileInfo);
+static void _AddFileToFilter(_In_ PBLOOM_FILTER pFilter, _In_ BOOL fHashKeys, _In_ PFILEINFO pFileInfo);
+static BOOL _IsSameLookupKey(_In_ BOOL fHashKeys, _In_ PFILEINFO pLeftFile, _In_ PFILEINFO pRightFile);
+static int _RemoveRepeatedFiles(_Inout_count_(nFiles) PFILEINFO *apFiles, _In_ int nFiles);
+static int __cdecl _CmpFilePointers(const void *pvLeft, const void *pvRight);
+
+BOOL IsLopsidedCompare(_In_ PDIRINFO pLeftDir, _In_ PDIRINFO pRightDir)
+{
+    int nSmall = min(pLeftDir->nFiles, pRightDir->nFiles);
+    int nBig = max(pLeftDir->nFiles, pRightDir->nFiles);
+    return (nBig >= BLOOM_MIN_BIG_FILES) && ((LONGLONG)nSmall * BLOOM_LOPSIDED_RATIO <= nBig);
+}
+
+HRESULT BuildDirBloomFilter(_In_ PDIRINFO pDirInfo)
+{
+    SB_ASSERT(pDirInfo);
+
+    if (pDirInfo->pBloomFilter != NULL)
+    {
+        return S_OK;
+    }
+
+    PFILEINFO *apFiles;
+    int nFiles;
+    HRESULT hr = GetAllFilesInDir(pDirInfo, &apFiles, &nFiles);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    PBLOOM_FILTER pFilter;
+    hr = CreateBloomFilter(nFiles, &pFilter);
+    if (SUCCEEDED(hr))
+    {
+        for (int i = 0; i < nFiles; ++i)
+        {
+            _AddFileToFilter(pFilter, pDirInfo->fHashCompare, apFiles[i]);
+        }
+
+        pDirInfo->pBloomFilter = pFilter;
+        logdbg(L"Built filter of %u bits over %d files of dir: %s", pFilter->nBits, nFiles, pDirInfo->pszPath);
+    }
+
+    free(apFiles);
+    return hr;
+}
+
+BOOL CompareDirsAndMarkFiles_Bloom(_In_ PDIRINFO pLeftDir, _In_ PDIRINFO pRightDir, _In_ SORTMERGE_KEY key)
+{
+    SB_ASSERT(pLeftDir);
+    SB_ASSERT(pRightDir);
+    SB_ASSERT(key != SMKEY_RELPATH);
+
+    BOOL fRetVal = FALSE;
+    BOOL fCompareHashes = (pLeftDir->fHashCompare && pRightDir->fHashCompare);
+    BOOL fLeftIsBig = (pLeftDir->nFiles > pRightDir->nFiles);
+    PDIRINFO pBigDir = fLeftIsBig ? pLeftDir : pRightDir;
+    PDIRINFO pSmallDir = fLeftIsBig ? pRightDir : pLeftDir;
+
+    SORTED_FILES stSmall = {};
+    SORTED_FILES stBig = {};
+    int nBigCapacity = 0;
+    int nSmallFiles;
+
+    logdbg(L"Comparing dirs: %s and %s, big side filtered", pLeftDir->pszPath, pRightDir->pszPath);
+    if (FAILED(BuildDirBloomFilter(pBigDir)))
+    {
+        goto done;
+    }
+
+    stSmall.key = key;
+    stSmall.cchRootPath = (int)wcsnlen(pSmallDir->pszPath, ARRAYSIZE(pSmallDir->pszPath));
+    stBig.key = key;
+    stBig.cchRootPath = (int)wcsnlen(pBigDir->pszPath, ARRAYSIZE(pBigDir->pszPath));
+
+    if (FAILED(GetAllFilesInDir(pSmallDir, &stSmall.apFiles, &nSmallFiles)))
+    {
+        goto done;
+    }
+
+    // Keep only the files of the small side that may be in the big side
+    for (int i = 0; i < nSmallFiles; ++i)
+    {
+        if (_MayBeInDir(pBigDir, stSmall.apFiles[i]))
+        {
+            stSmall.apFiles[(stSmall.nFiles)++] = stSmall.apFiles[i];
+        }
+    }
+
+    logdbg(L"%d of %d files passed the filter", stSmall.nFiles, nSmallFiles);
+    SortFiles(&stSmall);
+
+    // Look up each distinct key once. Lookups that differ only in case can find the
+    // same dup within file twice, so the repeats are removed before the merge.
+    for (int i = 0; i < stSmall.nFiles; ++i)
+    {
+        if ((i > 0) && _IsSameLookupKey(pBigDir->fHashCompare, stSmall.apFiles[i - 1], stSmall.apFiles[i]))
+        {
+            continue;
+        }
+
+        if (FAILED(AppendFilesWithKey(pBigDir, stSmall.apFiles[i], &stBig.apFiles, &stBig.nFiles, &nBigCapacity)))
+        {
+            goto done;
+        }
+    }
+
+    stBig.nFiles = _RemoveRepeatedFiles(stBig.apFiles, stBig.nFiles);
+    SortFiles(&stBig);
+
+    // The merge compares left with right, keep the sides in order
+    if (FAILED(fLeftIsBig ? MergeSortedFiles(&stBig, &stSmall, fCompareHashes) : MergeSortedFiles(&stSmall, &stBig, fCompareHashes)))
+    {
+        goto done;
+    }
+
+    fRetVal = TRUE;
+
+done:
+    DestroySortedFiles(&stSmall);
+    DestroySortedFiles(&stBig);
+    return fRetVal;
+}
+
+static BOOL _MayBeInDir(_In_ PDIRINFO pDirInfo, _In_ PFILEINFO pFileInfo)
+{
+    if (pDirInfo->fHashCompare)
+    {
+        return BloomFilterMayContain(pDirInfo->pBloomFilter, pFileInfo->abHash, HASHLEN_SHA1);
+    }
+
+    // The key of the name id, which a filter saved by another run has too
+    UINT64 ullNameKey = GetNameIdKey(pFileInfo->dwNameId);
+    return BloomFilterMayContain(pDirInfo->pBloomFilter, &ullNameKey, sizeof(ullNameKey));
+}
+
+static void _AddFileToFilter(_In_ PBLOOM_FILTER pFilter, _In_ BOOL fHashKeys, _In_ PFILEINFO pFileInfo)
+{
+    if (fHashKeys)
+    {
+        BloomFilterAdd(pFilter, pFileInfo->abHash, HASHLEN_SHA1);
+        return;
+    }
+
+    UINT64 ullNameKey = GetNameIdKey(pFileInfo->dwNameId);
+    BloomFilterAdd(pFilter, &ullNameKey, sizeof(ullNameKey));
+}
+
+// Would both files find the same files in the hashtable of the big side?
+static BOOL _IsSameLookupKey(_In_ BOOL fHashKeys, _In_ PFILEINFO pLeftFile, _In_ PFILEINFO pRightFile)
+{
+    if (fHashKeys)
+    {
+        return (memcmp(pLeftFile->abHash, pRightFile->abHash, HASHLEN_SHA1) == 0);
+    }
+    return (pLeftFile->dwNameId == pRightFile->dwNameId);
+}
+
+static int _RemoveRepeatedFiles(_Inout_count_(nFiles) PFILEINFO *apFiles, _In_ int nFiles)
+{
+    qsort(apFiles, nFiles, sizeof(PFILEINFO), _CmpFilePointers);
+
+    int nUnique = 0;
+    for (int i = 0; i < nFiles; ++i)
+    {
+        if ((nUnique == 0) || (apFiles[nUnique - 1] != apFiles[i]))
+        {
+            apFiles[nUnique++] = apFiles[i];
+        }
+    }
+    return nUnique;
+}
+
+static int __cdecl _CmpFilePointers(const void *pvLeft, const void *pvRight)
+{
+    UINT_PTR uLeft = (UINT_PTR)*(PFILEINFO*)pvLeft;
+    UINT_PTR uRight = (UINT_PTR)*(PFILEINFO*)pvRight;
+    if (uLeft == uRight)
+    {
+        return 0;
+    }
+    return (uLeft < uRight) ? -1 : 1;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+// ---------------------------------------------------
+// The FDiffDelete Project
+// Github: https://github.com/shishir993/fdiffdelete
+// Author: Shishir Bhat
+// The MIT License (MIT)
+// Copyright (c) 2014
+//
+
+#include "Common.h"
+#include "FileInfo.h"
+#include "DirectoryWalker_Interface.h"
+#include "DirectoryWalker_SortMerge.h"
+#include "BloomFilter.h"
+
+// Compare engine for lopsided compares, such as a small incoming folder against a big archive.
+// The keys of the big side (name keys, see NameKey.h, or hashes with hash compare) are
+// summarized in a Bloom filter that stays with the big DIRINFO for later compares. Both keys
+// are the same from run to run, so a dir loaded from a snapshot uses the filter saved with
+// the snapshot, see ScanSnapshot.h. Each file of the small side is checked against the filter
+// and only the possible hits are looked up in the big side's hashtable. The files found on
+// both sides then go through the sort-merge engine, so the marks are the same as a full
+// compare without sorting the big side.
+
+// The big side must have this many times the files of the small side
+#define BLOOM_LOPSIDED_RATIO    16
+#define BLOOM_MIN_BIG_FILES     10000
+
+BOOL IsLopsidedCompare(_In_ PDIRINFO pLeftDir, _In_ PDIRINFO pRightDir);
+
+// Build the filter of the dir, if it doesn't have one yet.
+HRESULT BuildDirBloomFilter(_In_ PDIRINFO pDirInfo);
+
+// Given two DIRINFO objects, compare the files in them and set each file's
+// duplicate flag to indicate that the file is present in both dirs.
+BOOL CompareDirsAndMarkFiles_Bloom(_In_ PDIRINFO pLeftDir, _In_ PDIRINFO pRightDir, _In_ SORTMERGE_KEY key);
@@ -9,9 +9,11 @@
 
 #include "DirectoryWalker_Hashes.h"
 #include "DirectoryWalker_Util.h"
+#include "DirectoryWalker_Walk.h"
 #include "HashFactory.h"
 
 static BOOL InsertIntoFileList(_In_ PDIRINFO pDirInfo, _In_opt_ PCWSTR pszKey, _In_ PFILEINFO pFile);
+static void _ClearDupsInOtherDir(_In_opt_ PDIRINFO pDirToUpdate, _In_z_ PCSTR pszKey, _Inout_opt_ PDELETE_CHANGES pChanges);
 
 static HRESULT _Init(_In_ PCWSTR pszFolderpath, _In_ BOOL fRecursive, _Out_ PDIRINFO* ppDirInfo)
 {
@@ -24,6 +26,7 @@ static HRESULT _Init(_In_ PCWSTR pszFolderpath, _In_ BOOL fRecursive, _Out_ PDIR
     }
 
     ZeroMemory(pDirInfo, sizeof(*pDirInfo));
+    NameInternAddRef();
     wcscpy_s(pDirInfo->pszPath, ARRAYSIZE(pDirInfo->pszPath), pszFolderpath);
 
     // Last parameter is FALSE indicating that the value is not be free'd by the hashtable
@@ -50,6 +53,17 @@ error_return:
     return hr;
 }
 
+HRESULT CreateDirInfo_Hash(_In_z_ PCWSTR pszFolderpath, _In_ BOOL fRecursive, _Out_ PDIRINFO *ppDirInfo)
+{
+    return _Init(pszFolderpath, fRecursive, ppDirInfo);
+}
+
+BOOL AddFileToDir_Hash(_In_ PDIRINFO pDirInfo, _In_ PFILEINFO pFileInfo)
+{
+    SB_ASSERT(pFileInfo->fHashValid);
+    return InsertIntoFileList(pDirInfo, pFileInfo->pszFilename, pFileInfo);
+}
+
 void DestroyDirInfo_Hash(_In_ PDIRINFO pDirInfo)
 {
     SB_ASSERT(pDirInfo);
@@ -78,51 +92,36 @@ void DestroyDirInfo_Hash(_In_ PDIRINFO pDirInfo)
 
     // Finally finally, the DIRINFO itself
     free(pDirInfo);
+    NameInternRelease();
 }
 
-// Build a tree 
-BOOL BuildDirTree_Hash(_In_z_ PCWSTR pszRootpath, _Out_ PDIRINFO* ppRootDir)
+// Files keyed by the file hash, see DIRINFO.phtFiles
+struct _HashLayout
 {
-    PCHL_QUEUE pqDirsToTraverse;
-    if (FAILED(CHL_DsCreateQ(&pqDirsToTraverse, CHL_VT_POINTER, 20)))
-    {
-        logerr(L"Could not create queue for BFS. Rootpath: %s", pszRootpath);
-        goto error_return;
-    }
-
-    loginfo(L"Starting traversal for root dir: %s", pszRootpath);
+    static const BOOL fComputeHash = TRUE;
+    // Folders have no hash, and are not listed when not recursive
+    static const BOOL fKeepFolders = FALSE;
 
-    // Init the first dir to traverse. 
-    // ** IMP: pFirst must be NULL here so that a new object is created in callee
-    PDIRINFO pFirstDir = NULL;
-    if (!BuildFilesInDir_Hash(pszRootpath, pqDirsToTraverse, &pFirstDir))
+    static HRESULT Init(_In_ PCWSTR pszFolderpath, _In_ BOOL fRecursive, _Out_ PDIRINFO* ppDirInfo)
     {
-        logerr(L"Could not build files in dir: %s", pszRootpath);
-        goto error_return;
+        return _Init(pszFolderpath, fRecursive, ppDirInfo);
     }
 
-    PDIRINFO pDirToTraverse;
-    while (SUCCEEDED(pqDirsToTraverse->Delete(pqDirsToTraverse, &pDirToTraverse, NULL, FALSE)))
+    static void Destroy(_In_ PDIRINFO pDirInfo)
     {
-        loginfo(L"Continuing traversal in dir: %s", pDirToTraverse->pszPath);
-        if (!BuildFilesInDir_Hash(pDirToTraverse->pszPath, pqDirsToTraverse, &pFirstDir))
-        {
-            logerr(L"Could not build files in dir: %s. Continuing...", pDirToTraverse->pszPath);
-        }
+        DestroyDirInfo_Hash(pDirInfo);
     }
 
-    pqDirsToTraverse->Destroy(pqDirsToTraverse);
-
-    *ppRootDir = pFirstDir;
-    return TRUE;
-
-error_return:
-    if (pqDirsToTraverse)
+    static BOOL AddFile(_In_ PDIRINFO pDirInfo, _In_ PFILEINFO pFileInfo)
     {
-        pqDirsToTraverse->Destroy(pqDirsToTraverse);
+        return AddFileToDir_Hash(pDirInfo, pFileInfo);
     }
-    *ppRootDir = NULL;
-    return FALSE;
+};
+
+// Build a tree 
+BOOL BuildDirTree_Hash(_In_z_ PCWSTR pszRootpath, _Out_ PDIRINFO* ppRootDir)
+{
+    return WalkDirTree<_HashLayout>(pszRootpath, ppRootDir);
 }
 
 // Build the list of files in the given folder.
@@ -131,198 +130,7 @@ BOOL BuildFilesInDir_Hash(
     _In_opt_ PCHL_QUEUE pqDirsToTraverse,
     _Inout_ PDIRINFO* ppDirInfo)
 {
-    SB_ASSERT(pszFolderpath);
-    SB_ASSERT(ppDirInfo);
-
-    WIN32_FIND_DATA findData;
-    HANDLE hFindFile = INVALID_HANDLE_VALUE;
-    PDIRINFO pCurDirInfo = NULL;
-
-    if (*ppDirInfo == NULL && FAILED(_Init(pszFolderpath, (pqDirsToTraverse != NULL), ppDirInfo)))
-    {
-        logerr(L"Init failed for dir: %s", pszFolderpath);
-        goto error_return;
-    }
-
-    // Derefernce just to make it easier to code
-    pCurDirInfo = *ppDirInfo;
-
-    // In order to list all files within the specified directory,
-    // path sent to FindFirstFile must end with a "\\*"
-    WCHAR szSearchpath[MAX_PATH] = L"";
-    wcscpy_s(szSearchpath, ARRAYSIZE(szSearchpath), pszFolderpath);
-
-    int nLen = wcsnlen(pszFolderpath, MAX_PATH);
-    if (nLen > 2 && wcsncmp(pszFolderpath + nLen - 2, L"\\*", MAX_PATH) != 0)
-    {
-        PathCchCombine(szSearchpath, ARRAYSIZE(szSearchpath), pszFolderpath, L"*");
-    }
-
-    // Initialize search for files in folder
-    hFindFile = FindFirstFile(szSearchpath, &findData);
-    if (hFindFile == INVALID_HANDLE_VALUE && GetLastError() == ERROR_FILE_NOT_FOUND)
-    {
-        // No files found under the folder. Just return.
-        return TRUE;
-    }
-
-    if (hFindFile == INVALID_HANDLE_VALUE)
-    {
-        logerr(L"FindFirstFile().");
-        goto error_return;
-    }
-
-    do
-    {
-        // Skip banned files and folders
-        if (IsFileFolderBanned(findData.cFileName, ARRAYSIZE(findData.cFileName)))
-        {
-            continue;
-        }
-
-        szSearchpath[0] = 0;
-        if (FAILED(PathCchCombine(szSearchpath, ARRAYSIZE(szSearchpath), pszFolderpath, findData.cFileName) == NULL))
-        {
-            logerr(L"PathCchCombine() failed for %s and %s", pszFolderpath, findData.cFileName);
-            goto error_return;
-        }
-
-        PFILEINFO pFileInfo;
-        if (!CreateFileInfo(szSearchpath, TRUE, &pFileInfo))
-        {
-            // Treat as warning and move on.
-            logwarn(L"Unable to get file info for: %s", szSearchpath);
-            continue;
-        }
-
-        if (pFileInfo->fIsDirectory)
-        {
-            // If pqDirsToTraverse is not null, it means caller wants recursive directory traversal
-            if (pqDirsToTraverse)
-            {
-                PDIRINFO pSubDir;
-                if (FAILED(_Init(szSearchpath, TRUE, &pSubDir)))
-                {
-                    logwarn(L"Unable to init dir info for: %s", szSearchpath);
-                    free(pFileInfo);
-                    continue;
-                }
-
-                // Insert pSubDir into the queue so that it will be traversed later
-                if (FAILED(pqDirsToTraverse->Insert(pqDirsToTraverse, pSubDir, sizeof pSubDir)))
-                {
-                    logwarn(L"Unable to add sub dir [%s] to traversal queue, cur dir: %s", findData.cFileName, pszFolderpath);
-                    free(pFileInfo);
-                    continue;
-                }
-                ++(pCurDirInfo->nDirs);
-            }
-            else
-            {
-                // Ignore directories when recursive mode is turned OFF
-                free(pFileInfo);
-                logdbg(L"Skipped adding dir: %s", findData.cFileName);
-            }
-        }
-        else
-        {
-            if (!InsertIntoFileList(pCurDirInfo, findData.cFileName, pFileInfo))
-            {
-                logerr(L"Cannot add file to file list: %s", findData.cFileName);
-                free(pFileInfo);
-            }
-#ifdef _DEBUG
-            else
-            {
-                logdbg(L"Added file: %s", findData.cFileName);
-            }
-#endif
-        }
-
-    } while (FindNextFile(hFindFile, &findData));
-
-    if (GetLastError() != ERROR_NO_MORE_FILES)
-    {
-        logerr(L"Failed in enumerating files in directory: %s", pszFolderpath);
-        goto error_return;
-    }
-
-    FindClose(hFindFile);
-    return TRUE;
-
-error_return:
-    if (hFindFile != INVALID_HANDLE_VALUE)
-    {
-        FindClose(hFindFile);
-    }
-
-    if (*ppDirInfo != NULL)
-    {
-        DestroyDirInfo_Hash(*ppDirInfo);
-        *ppDirInfo = NULL;
-    }
-
-    return FALSE;
-}
-
-// Given two DIRINFO objects, compare the files in them and set each file's
-// duplicate flag to indicate that the file is present in both dirs.
-BOOL CompareDirsAndMarkFiles_Hash(_In_ PDIRINFO pLeftDir, _In_ PDIRINFO pRightDir)
-{
-    // For each file in the left dir, search for the same in the right dir
-    // If found, pass both to the CompareFileInfoAndMark().
-
-    CHL_HT_ITERATOR itrLeft;
-    if (FAILED(CHL_DsInitIteratorHT(pLeftDir->phtFiles, &itrLeft)))
-    {
-        return TRUE;
-    }
-
-    char* pszLeftHash;
-    int nLeftKeySize;
-
-    PCHL_LLIST pLeftList, pRightList;
-
-    logdbg(L"Comparing dirs: %s and %s", pLeftDir->pszPath, pRightDir->pszPath);
-    while (SUCCEEDED(itrLeft.GetCurrent(&itrLeft, &pszLeftHash, &nLeftKeySize, &pLeftList, NULL, TRUE)))
-    {
-        (void)itrLeft.MoveNext(&itrLeft);
-
-        PCHL_LLIST pTemp;   // TODO: why is this here?
-        CHL_DsFindHT(pLeftDir->phtFiles, pszLeftHash, nLeftKeySize, &pTemp, NULL, TRUE);
-
-        if (SUCCEEDED(CHL_DsFindHT(pRightDir->phtFiles, pszLeftHash, nLeftKeySize, &pRightList, NULL, TRUE)))
-        {
-            // Not supporting duplicate files in same directory scenario
-
-            PFILEINFO pLeftFile, pRightFile;
-            if (FAILED(CHL_DsPeekAtLL(pLeftList, 0, &pLeftFile, NULL, TRUE)))
-            {
-                SB_ASSERT(FALSE);
-            }
-
-            if (FAILED(CHL_DsPeekAtLL(pRightList, 0, &pRightFile, NULL, TRUE)))
-            {
-                SB_ASSERT(FALSE);
-            }
-
-#ifdef _DEBUG
-            if (CompareFileInfoAndMark(pLeftFile, pRightFile, TRUE))
-            {
-                loginfo(L"Hash duplicate files: %s, %s", pLeftFile->szFilename, pRightFile->szFilename);
-            }
-            else
-            {
-                // Must be duplicate files since their hash values match
-                SB_ASSERT(FALSE);
-            }
-#else
-            CompareFileInfoAndMark(pLeftFile, pRightFile, TRUE);
-#endif
-        }
-    }
-
-    return TRUE;
+    return WalkFilesInDir<_HashLayout>(pszFolderpath, pqDirsToTraverse, ppDirInfo);
 }
 
 #pragma region FileOperations
@@ -334,9 +142,9 @@ static BOOL _DeleteFile(_In_ PDIRINFO pDirInfo, _In_ PFILEINFO pFileInfo)
     BOOL fRetVal = TRUE;
 
     WCHAR szFilepath[MAX_PATH];
-    if (FAILED(PathCchCombine(szFilepath, ARRAYSIZE(szFilepath), pFileInfo->szPath, pFileInfo->szFilename) == NULL))
+    if (FAILED(PathCchCombine(szFilepath, ARRAYSIZE(szFilepath), pFileInfo->pszPath, pFileInfo->pszFilename) == NULL))
     {
-        logerr(L"PathCchCombine() failed for %s + %s", pFileInfo->szPath, pFileInfo->szFilename);
+        logerr(L"PathCchCombine() failed for %s + %s", pFileInfo->pszPath, pFileInfo->pszFilename);
         fRetVal = FALSE;
         goto done;
     }
@@ -352,45 +160,15 @@ done:
     return fRetVal;
 }
 
-void ClearFilesDupFlag_Hash(_In_ PDIRINFO pDirInfo)
-{
-    SB_ASSERT(pDirInfo);
-
-    if (pDirInfo->nFiles > 0)
-    {
-        CHL_HT_ITERATOR itr;
-        if (SUCCEEDED(CHL_DsInitIteratorHT(pDirInfo->phtFiles, &itr)))
-        {
-            char* pszKey;
-            PCHL_LLIST pList;
-            while (SUCCEEDED(itr.GetCurrent(&itr, &pszKey, NULL, &pList, NULL, TRUE)))
-            {
-                (void)itr.MoveNext(&itr);
-
-                // Foreach file in the linked list...
-                PFILEINFO pFileInfo;
-                for (int i = 0; i < pList->nCurNodes; ++i)
-                {
-                    if (FAILED(CHL_DsPeekAtLL(pList, i, &pFileInfo, NULL, TRUE)))
-                    {
-                        logerr(L"Cannot get item %d for hash string %S", i, pszKey);
-                        continue;
-                    }
-
-                    ClearDuplicateAttr(pFileInfo);
-                }
-            }
-        }
-    }
-}
-
 // Inplace delete of files in a directory. This deletes duplicate files from
 // the pDirDeleteFrom directory and removes the duplicate flag of the deleted
 // files in the pDirToUpdate directory.
-BOOL DeleteDupFilesInDir_Hash(_In_ PDIRINFO pDirDeleteFrom, _In_ PDIRINFO pDirToUpdate)
+BOOL DeleteDupFilesInDir_Hash(_In_ PDIRINFO pDirDeleteFrom, _In_ PDIRINFO pDirToUpdate, _Inout_opt_ PDELETE_CHANGES pChanges)
 {
     SB_ASSERT(pDirDeleteFrom);
 
+    PCHL_HTABLE phtFoldersSeen = NULL;
+
     loginfo(L"In folder = %s", pDirDeleteFrom->pszPath);
     if (pDirDeleteFrom->nFiles <= 0)
     {
@@ -404,7 +182,6 @@ BOOL DeleteDupFilesInDir_Hash(_In_ PDIRINFO pDirDeleteFrom, _In_ PDIRINFO pDirTo
         goto error_return;
     }
 
-    PCHL_HTABLE phtFoldersSeen;
     if (FAILED(DelEmptyFolders_Init(pDirDeleteFrom, &phtFoldersSeen)))
     {
         goto error_return;
@@ -428,15 +205,25 @@ BOOL DeleteDupFilesInDir_Hash(_In_ PDIRINFO pDirDeleteFrom, _In_ PDIRINFO pDirTo
 
             if ((pFileInfo->fIsDirectory == FALSE) && (IsDuplicateFile(pFileInfo) == TRUE))
             {
-                _DeleteFile(pDirDeleteFrom, pFileInfo);
+                // File that couldn't be deleted stays in the list
+                if (!_DeleteFile(pDirDeleteFrom, pFileInfo))
+                {
+                    continue;
+                }
+
+                DELETED_FILE stDeleted;
+                DelChanges_GetDeleted(pFileInfo, &stDeleted);
 
                 // Linked list frees up memory when third param is NULL
                 if (FAILED(CHL_DsRemoveAtLL(pList, i, NULL, NULL, TRUE)))
                 {
-                    logerr(L"Cannot remove file %s from linked list", pFileInfo->szFilename);
+                    logerr(L"Cannot remove file %s from linked list", pFileInfo->pszFilename);
                 }
                 else
                 {
+                    DelChanges_AddDeleted(pChanges, &stDeleted);
+                    --(pDirDeleteFrom->nFiles);
+
                     // When we remove a node from linked list, next iteration will
                     // start from the current index itself.
                     --i;
@@ -447,27 +234,13 @@ BOOL DeleteDupFilesInDir_Hash(_In_ PDIRINFO pDirDeleteFrom, _In_ PDIRINFO pDirTo
         if (pList->nCurNodes == 0)
         {
             CHL_DsDestroyLL(pList);
-            
-            if (pDirToUpdate) // BUG _In_ param, why check for NULL here?
-            {
-                // Find this file in the other directory and update that file info
-                // to say that it is not a duplicate any more.
-                PCHL_LLIST pRightList;
-                PFILEINFO pFileToUpdate;
-
-                BOOL fFound = SUCCEEDED(CHL_DsFindHT(pDirToUpdate->phtFiles, pszKey, strnlen_s(pszKey, MAX_PATH) + 1,
-                    &pRightList, NULL, TRUE));
-                SB_ASSERT(fFound);    // Must find in the other dir also.
-
-                fFound = SUCCEEDED(CHL_DsPeekAtLL(pRightList, 0, &pFileToUpdate, NULL, TRUE));
-                SB_ASSERT(fFound);
 
-                ClearDuplicateAttr(pFileToUpdate);
-            }
+            // No file with this hash is left, so none of the other dir's is a duplicate now
+            _ClearDupsInOtherDir(pDirToUpdate, pszKey, pChanges);
 
             if (FAILED(CHL_DsRemoveAtHT(&itr)))
             {
-                logerr(L"Cannot remove key %s from hashtable", pszKey);
+                logerr(L"Cannot remove key %S from hashtable", pszKey);
                 SB_ASSERT(FALSE);
             }
         }
@@ -477,7 +250,10 @@ BOOL DeleteDupFilesInDir_Hash(_In_ PDIRINFO pDirDeleteFrom, _In_ PDIRINFO pDirTo
         }
     }
 
-    DelEmptyFolders_Delete(phtFoldersSeen);
+    if ((DelEmptyFolders_Delete(phtFoldersSeen) > 0) && (pChanges != NULL))
+    {
+        pChanges->fRebuildRequired = TRUE;
+    }
     return TRUE;
 
 error_return:
@@ -487,13 +263,13 @@ error_return:
 
 // Similar to the DeleteDupFilesInDir() function but it deletes only the specified files
 // from the pDirDeleteFrom directory and update the other directory files'. The files to
-// be deleted are specified in a list of strings that are the file names.
-// ** Assuming that paszFileNamesToDelete is an array of MAX_PATH strings.
+// be deleted are specified as FILEINFO pointers held by pDirDeleteFrom.
 BOOL DeleteFilesInDir_Hash(
     _In_ PDIRINFO pDirDeleteFrom,
     _In_ PFILEINFO *paFilesToDelete,
     _In_ int nFiles,
-    _In_opt_ PDIRINFO pDirToUpdate)
+    _In_opt_ PDIRINFO pDirToUpdate,
+    _Inout_opt_ PDELETE_CHANGES pChanges)
 {
     SB_ASSERT(pDirDeleteFrom);
     SB_ASSERT(paFilesToDelete);
@@ -524,57 +300,178 @@ BOOL DeleteFilesInDir_Hash(
         nKeySize = strnlen_s(szKey, ARRAYSIZE(szKey)) + 1;
 
         PCHL_LLIST pLeftList;
-        if (SUCCEEDED(CHL_DsFindHT(pDirDeleteFrom->phtFiles, szKey, nKeySize, &pLeftList, NULL, TRUE)))
+        if (FAILED(CHL_DsFindHT(pDirDeleteFrom->phtFiles, szKey, nKeySize, &pLeftList, NULL, TRUE)))
         {
-            // Find the file in the linked list
-            if (FAILED(CHL_DsFindLL(pLeftList, pFileToDelete, CompareFilesByName, NULL, NULL, TRUE)))
+            logwarn(L"Couldn't find file in dir");
+            continue;
+        }
+
+        // Find the file's own node in the linked list, there may be
+        // other files of the same name and contents.
+        int iNode = -1;
+        for (int i = 0; i < pLeftList->nCurNodes; ++i)
+        {
+            PFILEINFO pFile;
+            if (SUCCEEDED(CHL_DsPeekAtLL(pLeftList, i, &pFile, NULL, TRUE)) && (pFile == pFileToDelete))
             {
-                logerr(L"File to delete %s not found under hash string: %S", pFileToDelete->szFilename, szKey);
-                SB_ASSERT(FALSE);
+                iNode = i;
+                break;
             }
-            else
+        }
+
+        if (iNode < 0)
+        {
+            logerr(L"File to delete %s not found under hash string: %S", pFileToDelete->pszFilename, szKey);
+            SB_ASSERT(FALSE);
+            continue;
+        }
+
+        // Delete file from file system and remove from linkedlist (and hashtable)
+        if (!_DeleteFile(pDirDeleteFrom, pFileToDelete))
+        {
+            continue;
+        }
+
+        DELETED_FILE stDeleted;
+        DelChanges_GetDeleted(pFileToDelete, &stDeleted);
+
+        if (FAILED(CHL_DsRemoveAtLL(pLeftList, iNode, NULL, NULL, TRUE)))
+        {
+            logerr(L"Cannot remove file %s from linked list", pFileToDelete->pszFilename);
+            continue;
+        }
+
+        DelChanges_AddDeleted(pChanges, &stDeleted);
+        --(pDirDeleteFrom->nFiles);
+
+        if (pLeftList->nCurNodes == 0)
+        {
+            CHL_DsDestroyLL(pLeftList);
+            CHL_DsRemoveHT(pDirDeleteFrom->phtFiles, szKey, nKeySize);
+
+            // No file with this hash is left, so none of the other dir's is a duplicate now
+            _ClearDupsInOtherDir(pDirToUpdate, szKey, pChanges);
+        }
+    }
+
+    if ((DelEmptyFolders_Delete(phtFoldersSeen) > 0) && (pChanges != NULL))
+    {
+        pChanges->fRebuildRequired = TRUE;
+    }
+    return TRUE;
+}
+
+// Clear the duplicate flag of all files of the other dir with the specified hash string.
+static void _ClearDupsInOtherDir(_In_opt_ PDIRINFO pDirToUpdate, _In_z_ PCSTR pszKey, _Inout_opt_ PDELETE_CHANGES pChanges)
+{
+    if (pDirToUpdate == NULL)
+    {
+        return;
+    }
+
+    PCHL_LLIST pRightList;
+    if (FAILED(CHL_DsFindHT(pDirToUpdate->phtFiles, pszKey, strnlen_s(pszKey, MAX_PATH) + 1, &pRightList, NULL, TRUE)))
+    {
+        return;
+    }
+
+    for (int i = 0; i < pRightList->nCurNodes; ++i)
+    {
+        PFILEINFO pFileToUpdate;
+        if (SUCCEEDED(CHL_DsPeekAtLL(pRightList, i, &pFileToUpdate, NULL, TRUE)) && IsDuplicateFile(pFileToUpdate))
+        {
+            ClearDuplicateAttr(pFileToUpdate);
+            DelChanges_AddUpdated(pChanges, pFileToUpdate);
+        }
+    }
+}
+
+#pragma endregion FileOperations
+
+// Collect pointers to all FILEINFOs in every hash string's linked list.
+HRESULT GetAllFilesInDir_Hash(_In_ PDIRINFO pDirInfo, _Out_ PFILEINFO **ppaFiles, _Out_ int *pnFiles)
+{
+    SB_ASSERT(pDirInfo);
+
+    HRESULT hr = S_OK;
+    PFILEINFO *paFiles = NULL;
+    int nFiles = 0;
+    int nCapacity = 0;
+
+    CHL_HT_ITERATOR itr;
+    if (SUCCEEDED(CHL_DsInitIteratorHT(pDirInfo->phtFiles, &itr)))
+    {
+        char* pszKey;
+        PCHL_LLIST pList;
+        while (SUCCEEDED(itr.GetCurrent(&itr, &pszKey, NULL, &pList, NULL, TRUE)))
+        {
+            (void)itr.MoveNext(&itr);
+
+            for (int i = 0; i < pList->nCurNodes; ++i)
             {
-                // File found in from-dir
-                // If file is present in to-update-dir, then clear it's duplicate flag
-                // TODO: Better logic; don't check this inside the loop, every iteration
-                if (pDirToUpdate && (pFileToDelete->fIsDirectory == FALSE))
+                PFILEINFO pFileInfo;
+                if (FAILED(CHL_DsPeekAtLL(pList, i, &pFileInfo, NULL, TRUE)))
                 {
-                    PCHL_LLIST pRightList;
-                    if (SUCCEEDED(CHL_DsFindHT(pDirToUpdate->phtFiles, szKey, nKeySize, &pRightList, NULL, TRUE)))
-                    {
-                        // Find the file in the linked list
-                        if (SUCCEEDED(CHL_DsFindLL(pRightList, pFileToDelete, CompareFilesByName, NULL, NULL, TRUE)))
-                        {
-                            // Don't care what kind of duplicacy it was, now there will be no duplicate.
-                            ClearDuplicateAttr(pFileToDelete);
-                        }
-                    }
+                    logerr(L"Cannot get item %d for hash string %S", i, pszKey);
+                    continue;
                 }
-            }
-
-            // Delete file from file system and remove from linkedlist (and hashtable)
-            if (_DeleteFile(pDirDeleteFrom, pFileToDelete) == TRUE)
-            {
-                --(pLeftList->nCurNodes);
 
-                if (pLeftList->nCurNodes == 0)
+                hr = AppendToFileArray(&paFiles, &nFiles, &nCapacity, pFileInfo);
+                if (FAILED(hr))
                 {
-                    CHL_DsDestroyLL(pLeftList);
-                    CHL_DsRemoveHT(pDirDeleteFrom->phtFiles, szKey, nKeySize);
+                    goto error_return;
                 }
             }
         }
-        else
-        {
-            logwarn(L"Couldn't find file in dir");
-        }
     }
 
-    DelEmptyFolders_Delete(phtFoldersSeen);
-    return TRUE;
+    *ppaFiles = paFiles;
+    *pnFiles = nFiles;
+    return S_OK;
+
+error_return:
+    free(paFiles);
+    *ppaFiles = NULL;
+    *pnFiles = 0;
+    return hr;
 }
 
-#pragma endregion FileOperations
+HRESULT AppendFilesWithHash_Hash(
+    _In_ PDIRINFO pDirInfo,
+    _In_bytecount_c_(HASHLEN_SHA1) const BYTE *pbHash,
+    _Inout_ PFILEINFO **ppaFiles,
+    _Inout_ int *pnFiles,
+    _Inout_ int *pnCapacity)
+{
+    SB_ASSERT(pDirInfo);
+    SB_ASSERT(pbHash);
+
+    CHAR szHash[STRLEN_SHA1];
+    HashValueToString((PBYTE)pbHash, szHash);
+
+    PCHL_LLIST pList;
+    if (FAILED(CHL_DsFindHT(pDirInfo->phtFiles, szHash, STRLEN_SHA1, &pList, NULL, TRUE)))
+    {
+        return S_OK;
+    }
+
+    for (int i = 0; i < pList->nCurNodes; ++i)
+    {
+        PFILEINFO pFileInfo;
+        if (FAILED(CHL_DsPeekAtLL(pList, i, &pFileInfo, NULL, TRUE)))
+        {
+            logerr(L"Cannot get item %d for hash string %S", i, szHash);
+            continue;
+        }
+
+        HRESULT hr = AppendToFileArray(ppaFiles, pnFiles, pnCapacity, pFileInfo);
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+    }
+    return S_OK;
+}
 
 // Print the dir tree
 void PrintDirTree_Hash(_In_ PDIRINFO pRootDir)
@@ -616,7 +513,7 @@ void PrintFilesInDir_Hash(_In_ PDIRINFO pDirInfo)
                 pFileInfo->llFilesize.LowPart,
                 pFileInfo->fIsDirectory ? L'D' : L'F',
                 IsDuplicateFile(pFileInfo) ? 1 : 0,
-                pFileInfo->szFilename);
+                pFileInfo->pszFilename);
         }
     }
 
@@ -22,17 +22,15 @@ BOOL BuildFilesInDir_Hash(
     _In_opt_ PCHL_QUEUE pqDirsToTraverse,
     _Inout_ PDIRINFO* ppDirInfo);
 
-// Given two DIRINFO objects, compare the files in them and set each file's
-// duplicate flag to indicate that the file is present in both dirs.
-BOOL CompareDirsAndMarkFiles_Hash(_In_ PDIRINFO pLeftDir, _In_ PDIRINFO pRightDir);
-
-// Clear the duplicate flag of all files in the specified directory
-void ClearFilesDupFlag_Hash(_In_ PDIRINFO pDirInfo);
+// Create an empty dir, and add a FILEINFO created elsewhere to it. The file's hash
+// must be valid. The dir takes over the FILEINFO, which is freed if it cannot be added.
+HRESULT CreateDirInfo_Hash(_In_z_ PCWSTR pszFolderpath, _In_ BOOL fRecursive, _Out_ PDIRINFO *ppDirInfo);
+BOOL AddFileToDir_Hash(_In_ PDIRINFO pDirInfo, _In_ PFILEINFO pFileInfo);
 
 // Inplace delete of files in a directory. This deletes duplicate files from
 // the pDirDeleteFrom directory and removes the duplicate flag of the deleted
 // files in the pDirToUpdate directory.
-BOOL DeleteDupFilesInDir_Hash(_In_ PDIRINFO pDirDeleteFrom, _In_ PDIRINFO pDirToUpdate);
+BOOL DeleteDupFilesInDir_Hash(_In_ PDIRINFO pDirDeleteFrom, _In_ PDIRINFO pDirToUpdate, _Inout_opt_ PDELETE_CHANGES pChanges);
 
 // Similar to the DeleteDupFilesInDir() function but it deletes only the specified files
 // from the pDirDeleteFrom directory and update the other directory files'. The files to
@@ -41,7 +39,19 @@ BOOL DeleteFilesInDir_Hash(
     _In_ PDIRINFO pDirDeleteFrom,
     _In_ PFILEINFO *paFilesToDelete,
     _In_ int nFiles,
-    _In_ PDIRINFO pDirToUpdate);
+    _In_ PDIRINFO pDirToUpdate,
+    _Inout_opt_ PDELETE_CHANGES pChanges);
+
+// Collect pointers to all FILEINFOs held by the DIRINFO. Caller must free() the array.
+HRESULT GetAllFilesInDir_Hash(_In_ PDIRINFO pDirInfo, _Out_ PFILEINFO **ppaFiles, _Out_ int *pnFiles);
+
+// Append the files with the specified hash.
+HRESULT AppendFilesWithHash_Hash(
+    _In_ PDIRINFO pDirInfo,
+    _In_bytecount_c_(HASHLEN_SHA1) const BYTE *pbHash,
+    _Inout_ PFILEINFO **ppaFiles,
+    _Inout_ int *pnFiles,
+    _Inout_ int *pnCapacity);
 
 // Print the dir tree in BFS order, two blank lines separating 
 // file listing of each directory
@@ -10,9 +10,24 @@
 #include "DirectoryWalker_Interface.h"
 #include "DirectoryWalker.h"
 #include "DirectoryWalker_Hashes.h"
+#include "DirectoryWalker_SortMerge.h"
+#include "DirectoryWalker_TreeDiff.h"
+#include "DirectoryWalker_Merkle.h"
+#include "DirectoryWalker_Bloom.h"
+
+static void _DropDirDigests(_In_ PDIRINFO pDirInfo);
+static void _CheckDupFolders(_In_ PDIRINFO pDirDeleteFrom, _In_opt_ PDIRINFO pDirToUpdate, _Inout_opt_ PDELETE_CHANGES pChanges);
 
 void DestroyDirInfo(_In_ PDIRINFO pDirInfo)
 {
+    _DropDirDigests(pDirInfo);
+
+    if (pDirInfo->pBloomFilter != NULL)
+    {
+        DestroyBloomFilter(pDirInfo->pBloomFilter);
+        pDirInfo->pBloomFilter = NULL;
+    }
+
     if (pDirInfo->fHashCompare)
     {
         DestroyDirInfo_Hash(pDirInfo);
@@ -34,6 +49,18 @@ BOOL BuildDirTree(_In_z_ PCWSTR pszRootpath, _In_ BOOL fCompareHashes, _Out_ PDI
     {
         fRetVal = BuildDirTree_NoHash(pszRootpath, ppRootDir);
     }
+
+    if (fRetVal)
+    {
+        (*ppRootDir)->fRecursive = TRUE;
+
+        // Digests only speed up compare, carry on without them if they cannot be computed.
+        HRESULT hr = BuildDirDigests(*ppRootDir, &(*ppRootDir)->pDirDigests);
+        if (FAILED(hr))
+        {
+            logwarn(L"Cannot compute folder digests of %s, hr: %x", pszRootpath, hr);
+        }
+    }
     return fRetVal;
 }
 
@@ -56,6 +83,133 @@ BOOL BuildFilesInDir(
     return fRetVal;
 }
 
+HRESULT SwitchDirInfoLayout(_Inout_ PDIRINFO *ppDirInfo, _In_ BOOL fCompareHashes)
+{
+    SB_ASSERT(ppDirInfo);
+    SB_ASSERT(*ppDirInfo);
+
+    HRESULT hr;
+    PDIRINFO pOldDir = *ppDirInfo;
+    PDIRINFO pNewDir = NULL;
+    PFILEINFO *apFiles = NULL;
+    int nFiles = 0;
+    int nHashed = 0;
+
+    if (!pOldDir->fHashCompare == !fCompareHashes)
+    {
+        return S_OK;
+    }
+
+    if (!fCompareHashes && !pOldDir->fRecursive)
+    {
+        return HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED);
+    }
+
+    if (fCompareHashes)
+    {
+        hr = FileInfoInit(TRUE);
+        if (FAILED(hr))
+        {
+            logerr(L"Cannot initialize FileInfo for hash comparisons.");
+            return hr;
+        }
+    }
+
+    hr = GetAllFilesInDir(pOldDir, &apFiles, &nFiles);
+    if (FAILED(hr))
+    {
+        goto error_return;
+    }
+
+    if (fCompareHashes)
+    {
+        hr = CreateDirInfo_Hash(pOldDir->pszPath, pOldDir->fRecursive, &pNewDir);
+    }
+    else
+    {
+        hr = CreateDirInfo_NoHash(pOldDir->pszPath, pOldDir->fRecursive, &pNewDir);
+    }
+
+    if (FAILED(hr))
+    {
+        goto error_return;
+    }
+
+    pNewDir->fRecursive = pOldDir->fRecursive;
+    pNewDir->fDeleteEmptyDirs = pOldDir->fDeleteEmptyDirs;
+    pNewDir->fRelPathCompare = pOldDir->fRelPathCompare;
+
+    // Sub folders of a tree are counted by the walk, folders of a single
+    // folder are counted as they are added, like in BuildFilesInDir()
+    pNewDir->nDirs = pOldDir->fRecursive ? pOldDir->nDirs : 0;
+
+    for (int i = 0; i < nFiles; ++i)
+    {
+        // A hash dir has no folder entries
+        if (fCompareHashes && apFiles[i]->fIsDirectory)
+        {
+            continue;
+        }
+
+        PFILEINFO pFile = (PFILEINFO)malloc(sizeof(FILEINFO));
+        if (pFile == NULL)
+        {
+            hr = E_OUTOFMEMORY;
+            goto error_return;
+        }
+        CopyMemory(pFile, apFiles[i], sizeof(FILEINFO));
+        pFile->dwListItemId = 0;
+
+        if (fCompareHashes && !pFile->fHashValid)
+        {
+            // Same as a file that cannot be hashed during the walk
+            if (FAILED(EnsureFileHash(pFile)))
+            {
+                logwarn(L"Unable to hash file: %s\\%s", pFile->pszPath, pFile->pszFilename);
+                free(pFile);
+                continue;
+            }
+            ++nHashed;
+        }
+
+        // The file is freed if it cannot be added
+        if (fCompareHashes)
+        {
+            (void)AddFileToDir_Hash(pNewDir, pFile);
+        }
+        else
+        {
+            (void)AddFileToDir_NoHash(pNewDir, pFile);
+        }
+    }
+
+    if (pNewDir->fRecursive)
+    {
+        // Folder digests are keyed by the layout, see BuildDirTree()
+        hr = BuildDirDigests(pNewDir, &pNewDir->pDirDigests);
+        if (FAILED(hr))
+        {
+            logwarn(L"Cannot compute folder digests of %s, hr: %x", pNewDir->pszPath, hr);
+        }
+    }
+
+    loginfo(L"Switched dir %s to %s compare, hashed %d of %d files", pNewDir->pszPath,
+        (fCompareHashes ? L"hash" : L"name"), nHashed, nFiles);
+
+    free(apFiles);
+    DestroyDirInfo(pOldDir);
+    *ppDirInfo = pNewDir;
+    return S_OK;
+
+error_return:
+    free(apFiles);
+    if (pNewDir != NULL)
+    {
+        DestroyDirInfo(pNewDir);
+    }
+    return hr;
+}
+
 // Given two DIRINFO objects, compare the files in them and set each file's
 // duplicate flag to indicate that the file is present in both dirs.
 BOOL CompareDirsAndMarkFiles(_In_ PDIRINFO pLeftDir, _In_ PDIRINFO pRightDir)
@@ -74,61 +228,98 @@ BOOL CompareDirsAndMarkFiles(_In_ PDIRINFO pLeftDir, _In_ PDIRINFO pRightDir)
         return FALSE;
     }
 
-    BOOL fRetVal;
-    if (numHashEnabled == 2)
+    // Flags of any earlier compare are stale now
+    NewDupEpoch();
+
+    if (pLeftDir->fRelPathCompare && pRightDir->fRelPathCompare)
     {
-        fRetVal = CompareDirsAndMarkFiles_Hash(pLeftDir, pRightDir);
+        PTREEDIFF pTreeDiff;
+        if (FAILED(DiffDirTrees(pLeftDir, pRightDir, &pTreeDiff)))
+        {
+            return FALSE;
+        }
+
+        PrintTreeDiff(pTreeDiff);
+        DestroyTreeDiff(pTreeDiff);
+        return TRUE;
     }
-    else
+
+    SORTMERGE_KEY key = (numHashEnabled == 2) ? SMKEY_DIGEST : SMKEY_FILENAME;
+
+    // A few files against very many: look up only the files that may be on the big side.
+    // This is checked first, matching sub trees would still visit every folder of the big side.
+    if (IsLopsidedCompare(pLeftDir, pRightDir))
     {
-        fRetVal = CompareDirsAndMarkFiles_NoHash(pLeftDir, pRightDir);
+        // No sub trees are matched, drop those of an earlier compare
+        if (pLeftDir->pDirDigests != NULL)
+        {
+            ResetDirDigestMatches(pLeftDir->pDirDigests);
+        }
+
+        if (pRightDir->pDirDigests != NULL)
+        {
+            ResetDirDigestMatches(pRightDir->pDirDigests);
+        }
+
+        return CompareDirsAndMarkFiles_Bloom(pLeftDir, pRightDir, key);
     }
 
-    return fRetVal;
+    // Identical sub trees are matched wholesale by their digests, only the rest is
+    // compared file by file.
+    if ((pLeftDir->pDirDigests != NULL) && (pRightDir->pDirDigests != NULL))
+    {
+        return CompareDirsAndMarkFiles_Merkle(pLeftDir, pRightDir, key);
+    }
+
+    // Use the sort-merge engine for both layouts. It sorts each side once and
+    // walks them together, instead of probing the other dir for every file.
+    return CompareDirsAndMarkFiles_SortMerge(pLeftDir, pRightDir, key);
 }
 
-// Clear the duplicate flag of all files in the specified directory
+// Clear the duplicate flag of all files in the specified directory. Starting a new
+// epoch clears the flags of the files of all dirs, without visiting them.
 void ClearFilesDupFlag(_In_ PDIRINFO pDirInfo)
 {
-    if (pDirInfo->fHashCompare)
+    if (pDirInfo->pDirDigests != NULL)
     {
-        ClearFilesDupFlag_Hash(pDirInfo);
-    }
-    else
-    {
-        ClearFilesDupFlag_NoHash(pDirInfo);
+        ResetDirDigestMatches(pDirInfo->pDirDigests);
     }
+
+    NewDupEpoch();
 }
 
 // Inplace delete of files in a directory. This deletes duplicate files from
 // the pDirDeleteFrom directory and removes the duplicate flag of the deleted
-// files in the pDirToUpdate directory.
-BOOL DeleteDupFilesInDir(_In_ PDIRINFO pDirDeleteFrom, _In_ PDIRINFO pDirToUpdate)
+// files in the pDirToUpdate directory, if any.
+BOOL DeleteDupFilesInDir(_In_ PDIRINFO pDirDeleteFrom, _In_opt_ PDIRINFO pDirToUpdate, _Inout_opt_ PDELETE_CHANGES pChanges)
 {
-    // Both dirs must have been built with or without hash compare
-    int numHashEnabled = 0;
-    if (pDirDeleteFrom->fHashCompare)
-        ++numHashEnabled;
-
-    if (pDirToUpdate->fHashCompare)
-        ++numHashEnabled;
-
-    if (numHashEnabled == 1)
+    // Both dirs must have been built with or without hash compare. There is no
+    // other dir when the duplicates were found within pDirDeleteFrom itself.
+    if ((pDirToUpdate != NULL) && (pDirDeleteFrom->fHashCompare != pDirToUpdate->fHashCompare))
     {
         logerr(L"Only one of the dirs has hash compare enabled!");
         return FALSE;
     }
 
+    _CheckDupFolders(pDirDeleteFrom, pDirToUpdate, pChanges);
+
     BOOL fRetVal;
-    if (numHashEnabled == 2)
+    if (pDirDeleteFrom->fHashCompare)
     {
-        fRetVal = DeleteDupFilesInDir_Hash(pDirDeleteFrom, pDirToUpdate);
+        fRetVal = DeleteDupFilesInDir_Hash(pDirDeleteFrom, pDirToUpdate, pChanges);
     }
     else
     {
-        fRetVal = DeleteDupFilesInDir_NoHash(pDirDeleteFrom, pDirToUpdate);
+        fRetVal = DeleteDupFilesInDir_NoHash(pDirDeleteFrom, pDirToUpdate, pChanges);
+    }
+
+    // All files of a duplicate folder were duplicates and are gone now; remove the folder itself.
+    if (fRetVal)
+    {
+        DeleteDupFolders(pDirDeleteFrom);
     }
 
+    _DropDirDigests(pDirDeleteFrom);
     return fRetVal;
 }
 
@@ -139,20 +330,70 @@ BOOL DeleteFilesInDir(
     _In_ PDIRINFO pDirDeleteFrom,
     _In_ PCWSTR paszFileNamesToDelete,
     _In_ int nFileNames,
-    _In_ PDIRINFO pDirToUpdate)
+    _In_ PDIRINFO pDirToUpdate,
+    _Inout_opt_ PDELETE_CHANGES pChanges)
 {
     SB_ASSERT(!pDirDeleteFrom->fHashCompare && (pDirToUpdate == NULL || !pDirToUpdate->fHashCompare));
-    return DeleteFilesInDir_NoHash(pDirDeleteFrom, paszFileNamesToDelete, nFileNames, pDirToUpdate);
+    _CheckDupFolders(pDirDeleteFrom, pDirToUpdate, pChanges);
+    _DropDirDigests(pDirDeleteFrom);
+    return DeleteFilesInDir_NoHash(pDirDeleteFrom, paszFileNamesToDelete, nFileNames, pDirToUpdate, pChanges);
 }
 
 BOOL DeleteFilesInDir(
     _In_ PDIRINFO pDirDeleteFrom,
     _In_ PFILEINFO *paFilesToDelete,
     _In_ int nFiles,
-    _In_ PDIRINFO pDirToUpdate)
+    _In_ PDIRINFO pDirToUpdate,
+    _Inout_opt_ PDELETE_CHANGES pChanges)
 {
     SB_ASSERT(pDirDeleteFrom->fHashCompare && (pDirToUpdate == NULL || pDirToUpdate->fHashCompare));
-    return DeleteFilesInDir_Hash(pDirDeleteFrom, paFilesToDelete, nFiles, pDirToUpdate);
+    _CheckDupFolders(pDirDeleteFrom, pDirToUpdate, pChanges);
+    _DropDirDigests(pDirDeleteFrom);
+    return DeleteFilesInDir_Hash(pDirDeleteFrom, paFilesToDelete, nFiles, pDirToUpdate, pChanges);
+}
+
+void DestroyDeleteChanges(_In_ PDELETE_CHANGES pChanges)
+{
+    SB_ASSERT(pChanges);
+
+    free(pChanges->aDeleted);
+    free(pChanges->apUpdated);
+    ZeroMemory(pChanges, sizeof(*pChanges));
+}
+
+// Collect pointers to all FILEINFOs held by the DIRINFO, irrespective of how
+// the DIRINFO stores them. Caller must free() the returned array.
+HRESULT GetAllFilesInDir(_In_ PDIRINFO pDirInfo, _Out_ PFILEINFO **ppaFiles, _Out_ int *pnFiles)
+{
+    HRESULT hr;
+    if (pDirInfo->fHashCompare)
+    {
+        hr = GetAllFilesInDir_Hash(pDirInfo, ppaFiles, pnFiles);
+    }
+    else
+    {
+        hr = GetAllFilesInDir_NoHash(pDirInfo, ppaFiles, pnFiles);
+    }
+    return hr;
+}
+
+HRESULT AppendFilesWithKey(
+    _In_ PDIRINFO pDirInfo,
+    _In_ PFILEINFO pKeyFile,
+    _Inout_ PFILEINFO **ppaFiles,
+    _Inout_ int *pnFiles,
+    _Inout_ int *pnCapacity)
+{
+    HRESULT hr;
+    if (pDirInfo->fHashCompare)
+    {
+        hr = AppendFilesWithHash_Hash(pDirInfo, pKeyFile->abHash, ppaFiles, pnFiles, pnCapacity);
+    }
+    else
+    {
+        hr = AppendFilesWithName_NoHash(pDirInfo, pKeyFile->pszFilename, ppaFiles, pnFiles, pnCapacity);
+    }
+    return hr;
 }
 
 // Print the dir tree in BFS order, two blank lines separating 
@@ -181,3 +422,29 @@ void PrintFilesInDir(_In_ PDIRINFO pDirInfo)
         PrintFilesInDir_NoHash(pDirInfo);
     }
 }
+
+// Digests describe the dir as it was scanned. They are dropped once files are deleted from the dir.
+static void _DropDirDigests(_In_ PDIRINFO pDirInfo)
+{
+    if (pDirInfo->pDirDigests != NULL)
+    {
+        DestroyDirDigests(pDirInfo->pDirDigests);
+        pDirInfo->pDirDigests = NULL;
+    }
+}
+
+// Duplicate folder rows and the matches behind them are not tracked by the change
+// set. If either dir has any, the views must be rebuilt after the delete.
+static void _CheckDupFolders(_In_ PDIRINFO pDirDeleteFrom, _In_opt_ PDIRINFO pDirToUpdate, _Inout_opt_ PDELETE_CHANGES pChanges)
+{
+    if (pChanges == NULL)
+    {
+        return;
+    }
+
+    if (((pDirDeleteFrom->pDirDigests != NULL) && HasDupFolders(pDirDeleteFrom->pDirDigests))
+        || ((pDirToUpdate != NULL) && (pDirToUpdate->pDirDigests != NULL) && HasDupFolders(pDirToUpdate->pDirDigests)))
+    {
+        pChanges->fRebuildRequired = TRUE;
+    }
+}
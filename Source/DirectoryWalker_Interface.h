@@ -15,10 +15,24 @@
 // the same directory tree. This is required because the hashtable
 // in DIRINFO uses filename as key, which means there will be name
 // conflicts.
+// The list owns the FILEINFOs it holds. Files are never moved within
+// apFiles, a removed file is freed and leaves its index NULL. The two
+// indexes below refer to files by that index.
 typedef struct _dupWithin
 {
     int nCurFiles;
-    CHL_RARRAY aFiles;
+    int nCapacity;
+    PFILEINFO *apFiles;
+
+    // Files of the same name as a chain of indexes in the order they were added.
+    // phtNameChains maps the name id (see NameIntern.h) to the first and last
+    // index of its chain, aiNextSameName[i] is the index after file i or -1.
+    PCHL_HTABLE phtNameChains;
+    int *aiNextSameName;
+
+    // Upper cased full path of each file to its index, for removal
+    PCHL_HTABLE phtPathIndex;
+
 } DUPFILES_WITHIN, *PDUPFILES_WITHIN;
 
 typedef struct _DirectoryInfo
@@ -30,11 +44,18 @@ typedef struct _DirectoryInfo
     // Was hash comapre used when this DIRINFO was built?
     BOOL fHashCompare;
 
+    // Was the whole dir tree walked?
+    BOOL fRecursive;
+
     // When deleting files, should empty folders be deleted?
     BOOL fDeleteEmptyDirs;
 
+    // Should files be matched by path relative to this root dir
+    // instead of only by name? Applies to recursive compare.
+    BOOL fRelPathCompare;
+
     // Use a hashtable to store file list.
-    // Key is the filename, value is a FILEINFO structure - if hash compare is turned OFF
+    // Key is the name id of the file (see NameIntern.h), value is a FILEINFO structure - if hash compare is turned OFF
     // Key is hash string, value is a PCHL_LLIST that is the
     // linked list of files with the same hash string - if hash compare is turned ON
     CHL_HTABLE *phtFiles;
@@ -43,30 +64,81 @@ typedef struct _DirectoryInfo
     // the same dir tree. - if hash compare is turned OFF
     DUPFILES_WITHIN stDupFilesInTree;
 
+    // Digests of the folders in the dir tree, computed after a recursive
+    // build. NULL if not recursive. See DirectoryWalker_Merkle.h
+    struct _DirDigests *pDirDigests;
+
+    // Filter over the hashtable keys of the files, built by the first lopsided
+    // compare this dir is the big side of. See DirectoryWalker_Bloom.h
+    struct _BloomFilter *pBloomFilter;
+
 }DIRINFO, *PDIRINFO;
 
+// A file removed by a delete. Its FILEINFO is freed by the time the delete
+// returns, so the file is known by what is copied here.
+typedef struct _DeletedFile
+{
+    // Folder and name of the file, see FILEINFO. Both are in the name pool.
+    PCWSTR pszPath;
+    DWORD dwNameId;
+
+    // See FILEINFO.dwListItemId
+    DWORD dwListItemId;
+
+}DELETED_FILE, *PDELETED_FILE;
+
+// Files affected by a delete, so that the views of both dirs can be
+// updated in place instead of rebuilding the dirs.
+typedef struct _DeleteChanges
+{
+    // Files removed from the dir deleted from
+    int nDeleted;
+    int nDeletedCapacity;
+    PDELETED_FILE aDeleted;
+
+    // Files of the other dir that are not duplicates any more
+    int nUpdated;
+    int nUpdatedCapacity;
+    PFILEINFO *apUpdated;
+
+    // Folders were removed along with the files, or duplicate folders were
+    // involved. The lists above are incomplete and the dirs must be rebuilt.
+    BOOL fRebuildRequired;
+
+}DELETE_CHANGES, *PDELETE_CHANGES;
+
 // ** Functions **
 
 BOOL BuildDirTree(_In_z_ PCWSTR pszRootpath, _In_ BOOL fCompareHashes, _Out_ PDIRINFO* ppRootDir);
 
-// Build the list of files in the given folder
+// Build the list of files in the given folder. If pqDirsToTraverse is given, the
+// paths of the sub folders are queued to it as heap strings, see DirectoryWalker_Walk.h
 BOOL BuildFilesInDir(
     _In_ PCWSTR pszFolderpath,
     _In_opt_ PCHL_QUEUE pqDirsToTraverse,
     _In_ BOOL fCompareHashes,
     _Inout_ PDIRINFO* ppDirInfo);
 
+// Switch a built dir to the other layout (see phtFiles) without walking it again.
+// The new dir gets copies of the FILEINFOs, and a file is hashed only if it never
+// was before. A non-recursive hash dir has no folder entries, which the name compare
+// needs, so switching it to a name dir fails with ERROR_NOT_SUPPORTED.
+HRESULT SwitchDirInfoLayout(_Inout_ PDIRINFO *ppDirInfo, _In_ BOOL fCompareHashes);
+
 // Given two DIRINFO objects, compare the files in them and set each file's
-// duplicate flag to indicate that the file is present in both dirs.
+// duplicate flag to indicate that the file is present in both dirs. The flags
+// of any earlier compare are invalidated first.
 BOOL CompareDirsAndMarkFiles(_In_ PDIRINFO pLeftDir, _In_ PDIRINFO pRightDir);
 
-// Clear the duplicate flag of all files in the specified directory
+// Clear the duplicate flag of all files in the specified directory. This is O(1) for
+// the files, see NewDupEpoch(), and also clears the flags of the files of other dirs.
 void ClearFilesDupFlag(_In_ PDIRINFO pDirInfo);
 
 // Inplace delete of files in a directory. This deletes duplicate files from
 // the pDirDeleteFrom directory and removes the duplicate flag of the deleted
-// files in the pDirToUpdate directory.
-BOOL DeleteDupFilesInDir(_In_ PDIRINFO pDirDeleteFrom, _In_ PDIRINFO pDirToUpdate);
+// files in the pDirToUpdate directory, if any. The files deleted and updated
+// are added to pChanges, if specified.
+BOOL DeleteDupFilesInDir(_In_ PDIRINFO pDirDeleteFrom, _In_opt_ PDIRINFO pDirToUpdate, _Inout_opt_ PDELETE_CHANGES pChanges);
 
 // Similar to the DeleteDupFilesInDir() function but it deletes only the specified files
 // from the pDirDeleteFrom directory and update the other directory files'. The files to
@@ -75,13 +147,32 @@ BOOL DeleteFilesInDir(
     _In_ PDIRINFO pDirDeleteFrom,
     _In_ PCWSTR paszFileNamesToDelete,
     _In_ int nFileNames,
-    _In_ PDIRINFO pDirToUpdate);
+    _In_ PDIRINFO pDirToUpdate,
+    _Inout_opt_ PDELETE_CHANGES pChanges);
 
 BOOL DeleteFilesInDir(
     _In_ PDIRINFO pDirDeleteFrom,
     _In_ PFILEINFO *paFilesToDelete,
     _In_ int nFiles,
-    _In_ PDIRINFO pDirToUpdate);
+    _In_ PDIRINFO pDirToUpdate,
+    _Inout_opt_ PDELETE_CHANGES pChanges);
+
+// Free the lists of the change set and reset it to empty.
+void DestroyDeleteChanges(_In_ PDELETE_CHANGES pChanges);
+
+// Collect pointers to all FILEINFOs held by the DIRINFO, irrespective of how
+// the DIRINFO stores them. Caller must free() the returned array. The FILEINFOs
+// themselves are still owned by the DIRINFO.
+HRESULT GetAllFilesInDir(_In_ PDIRINFO pDirInfo, _Out_ PFILEINFO **ppaFiles, _Out_ int *pnFiles);
+
+// Append the files of the dir that the dir itself would find for pKeyFile: the files
+// with the same name, or with the same hash if the dir was built with hash compare.
+HRESULT AppendFilesWithKey(
+    _In_ PDIRINFO pDirInfo,
+    _In_ PFILEINFO pKeyFile,
+    _Inout_ PFILEINFO **ppaFiles,
+    _Inout_ int *pnFiles,
+    _Inout_ int *pnCapacity);
 
 // Print the dir tree in BFS order, two blank lines separating 
 // file listing of each directory
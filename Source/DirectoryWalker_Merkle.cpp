@@ -0,0 +1,1056 @@
+
+// ---------------------------------------------------
+// The FDiffDelete Project
+// Github: https://github.com/shishir993/fdiffdelete
+// Author: Shishir Bhat
+// The MIT License (MIT)
+// Copyright (c) 2014
+//
+
+#include "DirectoryWalker_Merkle.h"
+#include "DirectoryWalker_Util.h"
+#include "HashFactory.h"
+#include "NameKey.h"
+#include "FileFormatUtil.h"
+
+#define INIT_DIGEST_FOLDERS     64
+
+#define DIGESTS_ALIGN(cb)       (((cb) + 7) & ~((UINT64)7))
+
+// Hashed for each entry of a folder, after the entry's folded name, see NameKey.h
+// Content is the file hash or modified time for a file and the digest for a folder.
+typedef struct _DigestRecord
+{
+    BYTE bIsFolder;
+    LONGLONG llSize;
+    BYTE abContent[HASHLEN_SHA1];
+} DIGEST_RECORD;
+
+static HRESULT _GetFolderIndex(
+    _In_ PDIRDIGESTS pDigests,
+    _In_ PCHL_HTABLE phtFolderIndex,
+    _In_z_ PCWSTR pszRelFolder,
+    _In_ int iFile,
+    _Out_ int *piFolder);
+
+static HRESULT _ComputeDigest(_In_ HCRYPTPROV hCrypt, _In_ PDIRDIGESTS pDigests, _In_ int iFolder, _In_ BOOL fHashCompare);
+static HRESULT _HashEntry(_In_ HCRYPTHASH hHash, _In_z_ PCWSTR pszName, _In_ const DIGEST_RECORD *pRecord);
+static PCWSTR _GetFolderName(_In_ PDIRDIGEST pFolder, _Out_writes_(cchName) PWSTR pszName, _In_ int cchName);
+static BOOL _IsSubtreeUnmatched(_In_ PDIRDIGESTS pDigests, _In_ int iFolder);
+
+static void _MatchSubtrees(_In_ PDIRINFO pLeftDir, _In_ int iLeft, _In_ PDIRINFO pRightDir, _In_ int iRight);
+
+static void _MarkSubtreeFiles(
+    _In_ PDIRINFO pLeftDir,
+    _In_ int iLeft,
+    _In_ PDIRINFO pRightDir,
+    _In_ int iRight,
+    _In_ BOOL fCompareHashes);
+
+static void _SetDupFolder(_In_ PDIRINFO pDirInfo, _In_ PDIRDIGEST pFolder, _In_ PDIRDIGEST pOtherFolder);
+
+static HRESULT _CollectFiles(
+    _In_ PDIRDIGESTS pDigests,
+    _In_ BOOL fMatched,
+    _In_count_(nOtherKeys) const DWORD *adwOtherKeys,
+    _In_ int nOtherKeys,
+    _Inout_ PSORTED_FILES pFiles,
+    _Inout_ int *pnCapacity);
+
+static DWORD _GetKeyHash(_In_ SORTMERGE_KEY key, _In_ PFILEINFO pFile);
+static HRESULT _BuildKeySet(_In_ PSORTED_FILES pFiles, _In_ SORTMERGE_KEY key, _Out_ DWORD **padwKeys);
+static int __cdecl _CmpKeyHashes(_In_ const void *pvLeft, _In_ const void *pvRight);
+
+HRESULT BuildDirDigests(_In_ PDIRINFO pDirInfo, _Out_ PDIRDIGESTS *ppDigests)
+{
+    SB_ASSERT(pDirInfo);
+    SB_ASSERT(ppDigests);
+
+    HRESULT hr = S_OK;
+    HCRYPTPROV hCrypt = NULL;
+    PCHL_HTABLE phtFolderIndex = NULL;
+
+    PDIRDIGESTS pDigests = (PDIRDIGESTS)malloc(sizeof(DIRDIGESTS));
+    if (pDigests == NULL)
+    {
+        hr = E_OUTOFMEMORY;
+        goto error_return;
+    }
+
+    ZeroMemory(pDigests, sizeof(*pDigests));
+    hr = BuildSortedFiles(pDirInfo, SMKEY_RELPATH, &pDigests->stFiles);
+    if (FAILED(hr))
+    {
+        goto error_return;
+    }
+
+    // Folded relative folder path to index into aFolders, only needed while building
+    hr = CHL_DsCreateHT(&phtFolderIndex, INIT_DIGEST_FOLDERS, CHL_KT_WSTRING, CHL_VT_INT32, FALSE);
+    if (FAILED(hr))
+    {
+        logerr(L"Couldn't create folder index hashtable, hr: %x", hr);
+        goto error_return;
+    }
+
+    // Root folder is always the first one
+    int iFolder;
+    hr = _GetFolderIndex(pDigests, phtFolderIndex, L"", 0, &iFolder);
+    if (FAILED(hr))
+    {
+        goto error_return;
+    }
+
+    // In relative path order the files of a folder are contiguous, and so are all
+    // the files of a sub tree. Folders get created in the same order, parent first.
+    for (int iFile = 0; iFile < pDigests->stFiles.nFiles; ++iFile)
+    {
+        PFILEINFO pFile = pDigests->stFiles.apFiles[iFile];
+        hr = _GetFolderIndex(pDigests, phtFolderIndex, GetRelativeFolder(pFile, pDigests->stFiles.cchRootPath), iFile, &iFolder);
+        if (FAILED(hr))
+        {
+            goto error_return;
+        }
+
+        ++(pDigests->aFolders[iFolder].nDirectFiles);
+    }
+
+    hr = HashFactoryInit(&hCrypt);
+    if (FAILED(hr))
+    {
+        goto error_return;
+    }
+
+    // Bottom-up: children always have a higher index than their parent
+    for (iFolder = pDigests->nFolders - 1; iFolder >= 0; --iFolder)
+    {
+        hr = _ComputeDigest(hCrypt, pDigests, iFolder, pDirInfo->fHashCompare);
+        if (FAILED(hr))
+        {
+            logerr(L"Cannot compute digest of folder %s, hr: %x", pDigests->aFolders[iFolder].szRelPath, hr);
+            goto error_return;
+        }
+    }
+
+    HashFactoryDestroy(hCrypt);
+    CHL_DsDestroyHT(phtFolderIndex);
+
+    logdbg(L"Computed digests of %d folders in %s", pDigests->nFolders, pDirInfo->pszPath);
+    *ppDigests = pDigests;
+    return S_OK;
+
+error_return:
+    if (hCrypt != NULL)
+    {
+        HashFactoryDestroy(hCrypt);
+    }
+
+    if (phtFolderIndex != NULL)
+    {
+        CHL_DsDestroyHT(phtFolderIndex);
+    }
+
+    if (pDigests != NULL)
+    {
+        DestroyDirDigests(pDigests);
+    }
+
+    *ppDigests = NULL;
+    return hr;
+}
+
+void DestroyDirDigests(_In_ PDIRDIGESTS pDigests)
+{
+    SB_ASSERT(pDigests);
+
+    DestroySortedFiles(&pDigests->stFiles);
+    free(pDigests->aFolders);
+    free(pDigests);
+}
+
+// Clear the match state set by a previous compare
+void ResetDirDigestMatches(_In_ PDIRDIGESTS pDigests)
+{
+    SB_ASSERT(pDigests);
+
+    for (int i = 0; i < pDigests->nFolders; ++i)
+    {
+        pDigests->aFolders[i].fInMatchedTree = FALSE;
+        pDigests->aFolders[i].iMatch = -1;
+        ClearDuplicateAttr((&pDigests->aFolders[i].stFolderInfo));
+    }
+}
+
+BOOL HasDupFolders(_In_ PDIRDIGESTS pDigests)
+{
+    SB_ASSERT(pDigests);
+
+    for (int i = 0; i < pDigests->nFolders; ++i)
+    {
+        if (pDigests->aFolders[i].fInMatchedTree)
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+BOOL CompareDirsAndMarkFiles_Merkle(_In_ PDIRINFO pLeftDir, _In_ PDIRINFO pRightDir, _In_ SORTMERGE_KEY key)
+{
+    SB_ASSERT(pLeftDir && pLeftDir->pDirDigests);
+    SB_ASSERT(pRightDir && pRightDir->pDirDigests);
+
+    BOOL fRetVal = FALSE;
+    BOOL fCompareHashes = (pLeftDir->fHashCompare && pRightDir->fHashCompare);
+
+    PDIRDIGESTS pLeft = pLeftDir->pDirDigests;
+    PDIRDIGESTS pRight = pRightDir->pDirDigests;
+
+    PCHL_HTABLE phtRight = NULL;
+    int *aiChainTail = NULL;
+    int *aiChainCursor = NULL;
+    DWORD *adwLeftKeys = NULL;
+    DWORD *adwRightKeys = NULL;
+    int nLeftRest = 0;
+    int nRightRest = 0;
+    int nLeftCapacity = 0;
+    int nRightCapacity = 0;
+    SORTED_FILES stLeftRest = {};
+    SORTED_FILES stRightRest = {};
+
+    ResetDirDigestMatches(pLeft);
+    ResetDirDigestMatches(pRight);
+
+    // Index the right folders by digest. Folders with the same digest are chained; the
+    // chain tail and the first folder that can still be matched are kept by chain head.
+    HRESULT hr = CHL_DsCreateHT(&phtRight, max(pRight->nFolders, INIT_DIGEST_FOLDERS), CHL_KT_STRING, CHL_VT_INT32, FALSE);
+    if (FAILED(hr))
+    {
+        logerr(L"Couldn't create digest hashtable, hr: %x", hr);
+        goto done;
+    }
+
+    aiChainTail = (int*)malloc(max(pRight->nFolders, 1) * 2 * sizeof(int));
+    if (aiChainTail == NULL)
+    {
+        logerr(L"Out of memory for digest chains of %d folders", pRight->nFolders);
+        goto done;
+    }
+    aiChainCursor = aiChainTail + max(pRight->nFolders, 1);
+
+    char szDigest[STRLEN_SHA1];
+    for (int iRight = 0; iRight < pRight->nFolders; ++iRight)
+    {
+        HashValueToString(pRight->aFolders[iRight].abDigest, szDigest);
+
+        int iHead;
+        if (SUCCEEDED(CHL_DsFindHT(phtRight, szDigest, STRLEN_SHA1, &iHead, NULL, FALSE)))
+        {
+            pRight->aFolders[aiChainTail[iHead]].iNextSameDigest = iRight;
+            aiChainTail[iHead] = iRight;
+        }
+        else
+        {
+            hr = CHL_DsInsertHT(phtRight, szDigest, STRLEN_SHA1, (PCVOID)(INT_PTR)iRight, sizeof(iRight));
+            if (FAILED(hr))
+            {
+                logerr(L"Cannot add digest of folder %s, hr: %x", pRight->aFolders[iRight].szRelPath, hr);
+                goto done;
+            }
+
+            aiChainTail[iRight] = iRight;
+            aiChainCursor[iRight] = iRight;
+        }
+    }
+
+    // Parents come before their children, so the largest identical sub trees are matched
+    // first and everything under a matched folder is skipped without a lookup.
+    int nMatchedFiles = 0;
+    for (int iLeft = 0; iLeft < pLeft->nFolders; ++iLeft)
+    {
+        PDIRDIGEST pLeftFolder = &pLeft->aFolders[iLeft];
+        if (pLeftFolder->fInMatchedTree)
+        {
+            continue;
+        }
+
+        HashValueToString(pLeftFolder->abDigest, szDigest);
+
+        int iHead;
+        if (FAILED(CHL_DsFindHT(phtRight, szDigest, STRLEN_SHA1, &iHead, NULL, FALSE)))
+        {
+            continue;
+        }
+
+        // Matches are never undone during a compare, so a folder that cannot be matched
+        // now never can be later and the cursor only moves forward.
+        int iRight = aiChainCursor[iHead];
+        while ((iRight != -1) && !_IsSubtreeUnmatched(pRight, iRight))
+        {
+            iRight = pRight->aFolders[iRight].iNextSameDigest;
+        }
+
+        if (iRight != -1)
+        {
+            _MatchSubtrees(pLeftDir, iLeft, pRightDir, iRight);
+            nMatchedFiles += pLeftFolder->nSubtreeFiles;
+            iRight = pRight->aFolders[iRight].iNextSameDigest;
+        }
+        aiChainCursor[iHead] = iRight;
+    }
+
+    logdbg(L"%d of %d files in %s are in identical sub trees", nMatchedFiles, pLeft->stFiles.nFiles, pLeftDir->pszPath);
+
+    stLeftRest.key = key;
+    stRightRest.key = key;
+    stLeftRest.cchRootPath = pLeft->stFiles.cchRootPath;
+    stRightRest.cchRootPath = pRight->stFiles.cchRootPath;
+
+    // Whatever is left is compared file by file, against all files of the other side
+    // with the same key, matched or not. Files of the matched sub trees with a key that
+    // is not among the rest of the other side cannot pair with a rest file and are
+    // not merged at all.
+    if (FAILED(_CollectFiles(pLeft, FALSE, NULL, 0, &stLeftRest, &nLeftCapacity))
+        || FAILED(_CollectFiles(pRight, FALSE, NULL, 0, &stRightRest, &nRightCapacity)))
+    {
+        goto done;
+    }
+
+    nLeftRest = stLeftRest.nFiles;
+    nRightRest = stRightRest.nFiles;
+    if ((nLeftRest > 0) || (nRightRest > 0))
+    {
+        if (FAILED(_BuildKeySet(&stLeftRest, key, &adwLeftKeys)) || FAILED(_BuildKeySet(&stRightRest, key, &adwRightKeys)))
+        {
+            goto done;
+        }
+
+        if (FAILED(_CollectFiles(pLeft, TRUE, adwRightKeys, nRightRest, &stLeftRest, &nLeftCapacity))
+            || FAILED(_CollectFiles(pRight, TRUE, adwLeftKeys, nLeftRest, &stRightRest, &nRightCapacity)))
+        {
+            goto done;
+        }
+
+        SortFiles(&stLeftRest);
+        SortFiles(&stRightRest);
+        if (FAILED(MergeSortedFiles(&stLeftRest, &stRightRest, fCompareHashes)))
+        {
+            goto done;
+        }
+    }
+
+    // The merge may have paired two files of matched sub trees, and set the flags of a file
+    // of a matched sub tree from its pair with a rest file. Mark the matched sub trees last,
+    // so their files end up with the flags of their identical file in the other tree.
+    for (int iLeft = 0; iLeft < pLeft->nFolders; ++iLeft)
+    {
+        if (pLeft->aFolders[iLeft].iMatch != -1)
+        {
+            _MarkSubtreeFiles(pLeftDir, iLeft, pRightDir, pLeft->aFolders[iLeft].iMatch, fCompareHashes);
+        }
+    }
+
+    fRetVal = TRUE;
+
+done:
+    if (phtRight != NULL)
+    {
+        CHL_DsDestroyHT(phtRight);
+    }
+
+    free(aiChainTail);
+    free(adwLeftKeys);
+    free(adwRightKeys);
+    DestroySortedFiles(&stLeftRest);
+    DestroySortedFiles(&stRightRest);
+    return fRetVal;
+}
+
+// Remove the (now empty) folders of the duplicate folders of the dir. Must be
+// called after the duplicate files have been deleted.
+void DeleteDupFolders(_In_ PDIRINFO pDirInfo)
+{
+    SB_ASSERT(pDirInfo);
+
+    PDIRDIGESTS pDigests = pDirInfo->pDirDigests;
+    if (pDigests == NULL)
+    {
+        return;
+    }
+
+    WCHAR szFolderPath[MAX_PATH];
+
+    // Root is never a duplicate folder
+    int iFolder = 1;
+    while (iFolder < pDigests->nFolders)
+    {
+        PDIRDIGEST pFolder = &pDigests->aFolders[iFolder];
+        if (!(GetDupInfo(&pFolder->stFolderInfo) & FDUP_TREE_MATCH))
+        {
+            ++iFolder;
+            continue;
+        }
+
+        loginfo(L"Removing duplicate folder %s in %s", pFolder->szRelPath, pDirInfo->pszPath);
+
+        // Sub folders have higher indexes than their parent, so remove in reverse order
+        for (int i = iFolder + pFolder->nSubtreeFolders - 1; i >= iFolder; --i)
+        {
+            if (FAILED(PathCchCombine(szFolderPath, ARRAYSIZE(szFolderPath), pDirInfo->pszPath, pDigests->aFolders[i].szRelPath)))
+            {
+                logerr(L"PathCchCombine() failed for %s + %s", pDirInfo->pszPath, pDigests->aFolders[i].szRelPath);
+                continue;
+            }
+
+            if (!IsDirectoryEmpty(szFolderPath))
+            {
+                logwarn(L"Folder is not empty, not removing: %s", szFolderPath);
+            }
+            else if (!RemoveDirectory(szFolderPath))
+            {
+                logerr(L"RemoveDirectory failed, err: %u, %s", GetLastError(), szFolderPath);
+            }
+        }
+
+        iFolder += pFolder->nSubtreeFolders;
+    }
+}
+
+HRESULT SaveDirDigests(
+    _In_ PDIRINFO pDirInfo,
+    _In_ const DWORD *aiFileIndexes,
+    _In_ UINT64 ullTag,
+    _In_z_ PCWSTR pszFilepath)
+{
+    SB_ASSERT(pDirInfo && pDirInfo->pDirDigests);
+    SB_ASSERT(aiFileIndexes);
+    SB_ASSERT(pszFilepath);
+
+    HRESULT hr = S_OK;
+    PDIRDIGESTS pDigests = pDirInfo->pDirDigests;
+
+    DIGESTS_FILE_HEADER stHeader;
+    ZeroMemory(&stHeader, sizeof(stHeader));
+    stHeader.dwMagic = DIGESTS_FILE_MAGIC;
+    stHeader.dwVersion = DIGESTS_FILE_VERSION;
+    stHeader.cbHeader = sizeof(stHeader);
+    stHeader.fHashCompare = pDirInfo->fHashCompare;
+    stHeader.ullTag = ullTag;
+    stHeader.nFiles = (DWORD)pDigests->stFiles.nFiles;
+    stHeader.nFolders = (DWORD)pDigests->nFolders;
+
+    UINT64 cbImage = DIGESTS_ALIGN(sizeof(stHeader));
+    stHeader.ullFilesOffset = cbImage;
+    cbImage += DIGESTS_ALIGN((UINT64)stHeader.nFiles * sizeof(DWORD));
+    stHeader.ullFoldersOffset = cbImage;
+    cbImage += (UINT64)stHeader.nFolders * sizeof(DIGESTS_FOLDER);
+
+    // Padding between the sections is zero
+    PBYTE pbImage = (cbImage <= (SIZE_T)-1) ? (PBYTE)calloc((SIZE_T)cbImage, 1) : NULL;
+    if (pbImage == NULL)
+    {
+        logerr(L"Out of memory for digests of %I64u bytes", cbImage);
+        return E_OUTOFMEMORY;
+    }
+
+    CopyMemory(pbImage, &stHeader, sizeof(stHeader));
+    CopyMemory(pbImage + stHeader.ullFilesOffset, aiFileIndexes, (SIZE_T)stHeader.nFiles * sizeof(DWORD));
+
+    PDIGESTS_FOLDER aSaved = (PDIGESTS_FOLDER)(pbImage + stHeader.ullFoldersOffset);
+    for (int i = 0; i < pDigests->nFolders; ++i)
+    {
+        PDIRDIGEST pFolder = &pDigests->aFolders[i];
+        PDIGESTS_FOLDER pSaved = &aSaved[i];
+
+        wcscpy_s(pSaved->szRelPath, ARRAYSIZE(pSaved->szRelPath), pFolder->szRelPath);
+        pSaved->iParent = pFolder->iParent;
+        pSaved->iFirstChild = pFolder->iFirstChild;
+        pSaved->iLastChild = pFolder->iLastChild;
+        pSaved->iNextSibling = pFolder->iNextSibling;
+        pSaved->nSubtreeFolders = pFolder->nSubtreeFolders;
+        pSaved->iFirstFile = pFolder->iFirstFile;
+        pSaved->nSubtreeFiles = pFolder->nSubtreeFiles;
+        pSaved->nDirectFiles = pFolder->nDirectFiles;
+        pSaved->llSubtreeSize = pFolder->llSubtreeSize;
+        CopyMemory(pSaved->abDigest, pFolder->abDigest, sizeof(pSaved->abDigest));
+        pSaved->iNextSameDigest = pFolder->iNextSameDigest;
+    }
+
+    HANDLE hFile = CreateFileW(pszFilepath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        logerr(L"Cannot create digests file %s, hr: %x", pszFilepath, hr);
+        goto fend;
+    }
+
+    hr = WriteAllToFile(hFile, pbImage, cbImage);
+    CloseHandle(hFile);
+    if (FAILED(hr))
+    {
+        logerr(L"Cannot write digests file %s, hr: %x", pszFilepath, hr);
+        DeleteFile(pszFilepath);
+    }
+
+fend:
+    free(pbImage);
+    return hr;
+}
+
+// Are the links and ranges of a saved folder within the saved digests?
+static BOOL _IsSavedFolderValid(_In_ const DIGESTS_FOLDER *pSaved, _In_ int iFolder, _In_ int nFolders, _In_ int nFiles)
+{
+    return (wcsnlen(pSaved->szRelPath, ARRAYSIZE(pSaved->szRelPath)) < ARRAYSIZE(pSaved->szRelPath))
+        && (pSaved->iParent >= -1) && (pSaved->iParent < iFolder)
+        && (pSaved->iFirstChild >= -1) && (pSaved->iFirstChild < nFolders)
+        && (pSaved->iLastChild >= -1) && (pSaved->iLastChild < nFolders)
+        && (pSaved->iNextSibling >= -1) && (pSaved->iNextSibling < nFolders)
+        && (pSaved->iNextSameDigest >= -1) && (pSaved->iNextSameDigest < nFolders)
+        && (pSaved->nSubtreeFolders >= 1) && (pSaved->nSubtreeFolders <= nFolders - iFolder)
+        && (pSaved->iFirstFile >= 0) && (pSaved->nDirectFiles >= 0)
+        && (pSaved->nSubtreeFiles >= pSaved->nDirectFiles) && (pSaved->nSubtreeFiles <= nFiles - pSaved->iFirstFile);
+}
+
+HRESULT LoadDirDigests(
+    _In_z_ PCWSTR pszFilepath,
+    _In_ PDIRINFO pDirInfo,
+    _In_ UINT64 ullTag,
+    _In_count_(nFiles) PFILEINFO *apFiles,
+    _In_ DWORD nFiles,
+    _Out_ PDIRDIGESTS *ppDigests)
+{
+    SB_ASSERT(pszFilepath);
+    SB_ASSERT(pDirInfo);
+    SB_ASSERT(ppDigests);
+
+    HRESULT hr = S_OK;
+    HANDLE hMapping = NULL;
+    PVOID pvView = NULL;
+    PDIRDIGESTS pDigests = NULL;
+    LARGE_INTEGER llFileSize;
+    const DIGESTS_FILE_HEADER *pHeader;
+    const DWORD *aiFileIndexes;
+    const DIGESTS_FOLDER *aSaved;
+    PBYTE abSeen = NULL;
+    DWORD nDirFiles = 0;
+
+    *ppDigests = NULL;
+
+    HANDLE hFile = CreateFileW(pszFilepath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        logerr(L"Cannot open digests file %s, hr: %x", pszFilepath, hr);
+        goto fend;
+    }
+
+    if (!GetFileSizeEx(hFile, &llFileSize) || (llFileSize.QuadPart < sizeof(DIGESTS_FILE_HEADER)))
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        goto fend;
+    }
+
+    hMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (hMapping == NULL)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        logerr(L"Cannot map digests file %s, hr: %x", pszFilepath, hr);
+        goto fend;
+    }
+
+    pvView = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+    if (pvView == NULL)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        logerr(L"Cannot map view of digests file %s, hr: %x", pszFilepath, hr);
+        goto fend;
+    }
+
+    for (DWORD i = 0; i < nFiles; ++i)
+    {
+        nDirFiles += (apFiles[i] != NULL) ? 1 : 0;
+    }
+
+    // The digests must be of every file the dir has, and of nothing else
+    pHeader = (const DIGESTS_FILE_HEADER*)pvView;
+    if ((pHeader->dwMagic != DIGESTS_FILE_MAGIC)
+        || (pHeader->dwVersion != DIGESTS_FILE_VERSION)
+        || (pHeader->cbHeader != sizeof(DIGESTS_FILE_HEADER))
+        || (pHeader->ullTag != ullTag)
+        || (!pHeader->fHashCompare != !pDirInfo->fHashCompare)
+        || (pHeader->nFiles != nDirFiles)
+        || (pHeader->nFolders == 0) || (pHeader->nFolders > MAXINT)
+        || !IsSectionInFile(pHeader->ullFilesOffset, pHeader->nFiles, sizeof(DWORD), sizeof(DIGESTS_FILE_HEADER), (UINT64)llFileSize.QuadPart)
+        || !IsSectionInFile(pHeader->ullFoldersOffset, pHeader->nFolders, sizeof(DIGESTS_FOLDER), sizeof(DIGESTS_FILE_HEADER), (UINT64)llFileSize.QuadPart))
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        goto fend;
+    }
+
+    pDigests = (PDIRDIGESTS)malloc(sizeof(DIRDIGESTS));
+    if (pDigests == NULL)
+    {
+        hr = E_OUTOFMEMORY;
+        goto fend;
+    }
+
+    ZeroMemory(pDigests, sizeof(*pDigests));
+    pDigests->stFiles.key = SMKEY_RELPATH;
+    pDigests->stFiles.cchRootPath = (int)wcsnlen(pDirInfo->pszPath, ARRAYSIZE(pDirInfo->pszPath));
+    pDigests->stFiles.apFiles = (PFILEINFO*)malloc(max((int)pHeader->nFiles, 1) * sizeof(PFILEINFO));
+    pDigests->aFolders = (PDIRDIGEST)malloc(pHeader->nFolders * sizeof(DIRDIGEST));
+    abSeen = (PBYTE)calloc(max((int)nFiles, 1), 1);
+    if ((pDigests->stFiles.apFiles == NULL) || (pDigests->aFolders == NULL) || (abSeen == NULL))
+    {
+        hr = E_OUTOFMEMORY;
+        goto fend;
+    }
+
+    // Each file of the dir once, since the count matches and no index is repeated
+    aiFileIndexes = (const DWORD*)((const BYTE*)pvView + pHeader->ullFilesOffset);
+    for (DWORD i = 0; i < pHeader->nFiles; ++i)
+    {
+        DWORD iFile = aiFileIndexes[i];
+        if ((iFile >= nFiles) || (apFiles[iFile] == NULL) || abSeen[iFile])
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+            goto fend;
+        }
+        abSeen[iFile] = TRUE;
+        pDigests->stFiles.apFiles[i] = apFiles[iFile];
+    }
+    pDigests->stFiles.nFiles = (int)pHeader->nFiles;
+
+    aSaved = (const DIGESTS_FOLDER*)((const BYTE*)pvView + pHeader->ullFoldersOffset);
+    for (int i = 0; i < (int)pHeader->nFolders; ++i)
+    {
+        const DIGESTS_FOLDER *pSaved = &aSaved[i];
+        if (!_IsSavedFolderValid(pSaved, i, (int)pHeader->nFolders, (int)pHeader->nFiles))
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+            goto fend;
+        }
+
+        PDIRDIGEST pFolder = &pDigests->aFolders[i];
+        ZeroMemory(pFolder, sizeof(*pFolder));
+        wcscpy_s(pFolder->szRelPath, ARRAYSIZE(pFolder->szRelPath), pSaved->szRelPath);
+        pFolder->iParent = pSaved->iParent;
+        pFolder->iFirstChild = pSaved->iFirstChild;
+        pFolder->iLastChild = pSaved->iLastChild;
+        pFolder->iNextSibling = pSaved->iNextSibling;
+        pFolder->nSubtreeFolders = pSaved->nSubtreeFolders;
+        pFolder->iFirstFile = pSaved->iFirstFile;
+        pFolder->nSubtreeFiles = pSaved->nSubtreeFiles;
+        pFolder->nDirectFiles = pSaved->nDirectFiles;
+        pFolder->llSubtreeSize = pSaved->llSubtreeSize;
+        CopyMemory(pFolder->abDigest, pSaved->abDigest, sizeof(pFolder->abDigest));
+        pFolder->iNextSameDigest = pSaved->iNextSameDigest;
+        pFolder->iMatch = -1;
+    }
+    pDigests->nFolders = (int)pHeader->nFolders;
+    pDigests->nMaxFolders = (int)pHeader->nFolders;
+
+    logdbg(L"Loaded digests of %d folders in %s", pDigests->nFolders, pDirInfo->pszPath);
+    *ppDigests = pDigests;
+    pDigests = NULL;
+
+fend:
+    free(abSeen);
+    if (pDigests != NULL)
+    {
+        DestroyDirDigests(pDigests);
+    }
+    if (pvView != NULL)
+    {
+        UnmapViewOfFile(pvView);
+    }
+    if (hMapping != NULL)
+    {
+        CloseHandle(hMapping);
+    }
+    if (hFile != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(hFile);
+    }
+    return hr;
+}
+
+// Find the index of the specified relative folder, adding it (and its ancestors,
+// if not seen yet) to the folder array if required. iFile is the index of the
+// file being added, which is the first file of any folder created now.
+static HRESULT _GetFolderIndex(
+    _In_ PDIRDIGESTS pDigests,
+    _In_ PCHL_HTABLE phtFolderIndex,
+    _In_z_ PCWSTR pszRelFolder,
+    _In_ int iFile,
+    _Out_ int *piFolder)
+{
+    HRESULT hr = S_OK;
+
+    if (wcsnlen(pszRelFolder, MAX_PATH) >= MAX_PATH)
+    {
+        logerr(L"Relative folder path too long: %s", pszRelFolder);
+        return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+    }
+
+    WCHAR szKey[MAX_PATH];
+    int cchKey = FoldName(pszRelFolder, szKey, ARRAYSIZE(szKey));
+
+    int iFolder;
+    if (SUCCEEDED(CHL_DsFindHT(phtFolderIndex, szKey, StringSizeBytes(szKey), &iFolder, NULL, FALSE)))
+    {
+        *piFolder = iFolder;
+        return S_OK;
+    }
+
+    // Parent is the path without the last component, e.g. "a\b\" -> "a\"
+    int iParent = -1;
+    if (cchKey > 0)
+    {
+        WCHAR szParent[MAX_PATH];
+        wcscpy_s(szParent, ARRAYSIZE(szParent), pszRelFolder);
+
+        int iSep = cchKey - 1;
+        SB_ASSERT(szParent[iSep] == L'\\');
+        do
+        {
+            --iSep;
+        } while ((iSep >= 0) && (szParent[iSep] != L'\\'));
+        szParent[iSep + 1] = 0;
+
+        hr = _GetFolderIndex(pDigests, phtFolderIndex, szParent, iFile, &iParent);
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+    }
+
+    if (pDigests->nFolders >= pDigests->nMaxFolders)
+    {
+        int nNewMax = (pDigests->nMaxFolders > 0) ? (pDigests->nMaxFolders * 2) : INIT_DIGEST_FOLDERS;
+        PDIRDIGEST aNew = (PDIRDIGEST)realloc(pDigests->aFolders, nNewMax * sizeof(DIRDIGEST));
+        if (aNew == NULL)
+        {
+            return E_OUTOFMEMORY;
+        }
+
+        pDigests->aFolders = aNew;
+        pDigests->nMaxFolders = nNewMax;
+    }
+
+    iFolder = (pDigests->nFolders)++;
+    PDIRDIGEST pFolder = &pDigests->aFolders[iFolder];
+    ZeroMemory(pFolder, sizeof(*pFolder));
+    wcscpy_s(pFolder->szRelPath, ARRAYSIZE(pFolder->szRelPath), pszRelFolder);
+    pFolder->iParent = iParent;
+    pFolder->iFirstChild = -1;
+    pFolder->iLastChild = -1;
+    pFolder->iNextSibling = -1;
+    pFolder->iNextSameDigest = -1;
+    pFolder->iMatch = -1;
+    pFolder->iFirstFile = iFile;
+
+    if (iParent != -1)
+    {
+        PDIRDIGEST pParent = &pDigests->aFolders[iParent];
+        if (pParent->iLastChild == -1)
+        {
+            pParent->iFirstChild = iFolder;
+        }
+        else
+        {
+            pDigests->aFolders[pParent->iLastChild].iNextSibling = iFolder;
+        }
+        pParent->iLastChild = iFolder;
+    }
+
+    hr = CHL_DsInsertHT(phtFolderIndex, szKey, StringSizeBytes(szKey), (PCVOID)(INT_PTR)iFolder, sizeof(iFolder));
+    if (FAILED(hr))
+    {
+        logerr(L"Cannot add folder %s to folder index, hr: %x", pszRelFolder, hr);
+        return hr;
+    }
+
+    *piFolder = iFolder;
+    return S_OK;
+}
+
+// Compute the digest and sub tree totals of a folder whose children are already done.
+// Children are visited in the order they were created, which only depends on the relative
+// paths within the sub tree; so identical sub trees produce identical digests wherever they are.
+static HRESULT _ComputeDigest(_In_ HCRYPTPROV hCrypt, _In_ PDIRDIGESTS pDigests, _In_ int iFolder, _In_ BOOL fHashCompare)
+{
+    PDIRDIGEST pFolder = &pDigests->aFolders[iFolder];
+
+    HCRYPTHASH hHash;
+    HRESULT hr = BeginSHA1(hCrypt, &hHash);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    pFolder->nSubtreeFolders = 1;
+    pFolder->nSubtreeFiles = pFolder->nDirectFiles;
+    pFolder->llSubtreeSize = 0;
+
+    DIGEST_RECORD stRecord;
+    for (int i = 0; (i < pFolder->nDirectFiles) && SUCCEEDED(hr); ++i)
+    {
+        PFILEINFO pFile = pDigests->stFiles.apFiles[pFolder->iFirstFile + i];
+
+        ZeroMemory(&stRecord, sizeof(stRecord));
+        stRecord.bIsFolder = FALSE;
+        stRecord.llSize = pFile->llFilesize.QuadPart;
+        if (fHashCompare)
+        {
+            memcpy(stRecord.abContent, pFile->abHash, sizeof(pFile->abHash));
+        }
+        else
+        {
+            memcpy(stRecord.abContent, &pFile->ftModifiedTime, sizeof(pFile->ftModifiedTime));
+        }
+
+        pFolder->llSubtreeSize += stRecord.llSize;
+        hr = _HashEntry(hHash, pFile->pszFilename, &stRecord);
+    }
+
+    WCHAR szName[MAX_PATH];
+    for (int iChild = pFolder->iFirstChild; (iChild != -1) && SUCCEEDED(hr); iChild = pDigests->aFolders[iChild].iNextSibling)
+    {
+        PDIRDIGEST pChild = &pDigests->aFolders[iChild];
+        pFolder->nSubtreeFolders += pChild->nSubtreeFolders;
+        pFolder->nSubtreeFiles += pChild->nSubtreeFiles;
+        pFolder->llSubtreeSize += pChild->llSubtreeSize;
+
+        ZeroMemory(&stRecord, sizeof(stRecord));
+        stRecord.bIsFolder = TRUE;
+        stRecord.llSize = pChild->llSubtreeSize;
+        memcpy(stRecord.abContent, pChild->abDigest, sizeof(pChild->abDigest));
+
+        hr = _HashEntry(hHash, _GetFolderName(pChild, szName, ARRAYSIZE(szName)), &stRecord);
+    }
+
+    // Finish in any case, it destroys the hash object
+    HRESULT hrFinish = FinishSHA1(hHash, pFolder->abDigest);
+    return FAILED(hr) ? hr : hrFinish;
+}
+
+static HRESULT _HashEntry(_In_ HCRYPTHASH hHash, _In_z_ PCWSTR pszName, _In_ const DIGEST_RECORD *pRecord)
+{
+    // Names are matched case insensitively everywhere else too
+    WCHAR szName[MAX_PATH];
+    (void)FoldName(pszName, szName, ARRAYSIZE(szName));
+
+    HRESULT hr = UpdateSHA1(hHash, (const BYTE*)szName, StringSizeBytes(szName));
+    if (SUCCEEDED(hr))
+    {
+        hr = UpdateSHA1(hHash, (const BYTE*)pRecord, sizeof(*pRecord));
+    }
+    return hr;
+}
+
+// Last component of the folder's relative path, without the trailing '\'
+static PCWSTR _GetFolderName(_In_ PDIRDIGEST pFolder, _Out_writes_(cchName) PWSTR pszName, _In_ int cchName)
+{
+    wcscpy_s(pszName, cchName, pFolder->szRelPath);
+
+    int cch = (int)wcslen(pszName);
+    if ((cch > 0) && (pszName[cch - 1] == L'\\'))
+    {
+        pszName[--cch] = 0;
+    }
+
+    PCWSTR pszLastSep = wcsrchr(pszName, L'\\');
+    return (pszLastSep != NULL) ? (pszLastSep + 1) : pszName;
+}
+
+// A folder can be matched only if nothing in its sub tree is matched already
+static BOOL _IsSubtreeUnmatched(_In_ PDIRDIGESTS pDigests, _In_ int iFolder)
+{
+    int iEnd = iFolder + pDigests->aFolders[iFolder].nSubtreeFolders;
+    for (int i = iFolder; i < iEnd; ++i)
+    {
+        if (pDigests->aFolders[i].fInMatchedTree)
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static void _MatchSubtrees(_In_ PDIRINFO pLeftDir, _In_ int iLeft, _In_ PDIRINFO pRightDir, _In_ int iRight)
+{
+    PDIRDIGESTS pLeft = pLeftDir->pDirDigests;
+    PDIRDIGESTS pRight = pRightDir->pDirDigests;
+    PDIRDIGEST pLeftFolder = &pLeft->aFolders[iLeft];
+    PDIRDIGEST pRightFolder = &pRight->aFolders[iRight];
+
+    SB_ASSERT(pLeftFolder->nSubtreeFiles == pRightFolder->nSubtreeFiles);
+
+    logdbg(L"Identical sub trees: %s%s and %s%s", pLeftDir->pszPath, pLeftFolder->szRelPath,
+        pRightDir->pszPath, pRightFolder->szRelPath);
+
+    pLeftFolder->iMatch = iRight;
+    pRightFolder->iMatch = iLeft;
+
+    for (int i = 0; i < pLeftFolder->nSubtreeFolders; ++i)
+    {
+        pLeft->aFolders[iLeft + i].fInMatchedTree = TRUE;
+    }
+
+    for (int i = 0; i < pRightFolder->nSubtreeFolders; ++i)
+    {
+        pRight->aFolders[iRight + i].fInMatchedTree = TRUE;
+    }
+
+    if (iLeft != 0)
+    {
+        _SetDupFolder(pLeftDir, pLeftFolder, pRightFolder);
+    }
+
+    if (iRight != 0)
+    {
+        _SetDupFolder(pRightDir, pRightFolder, pLeftFolder);
+    }
+}
+
+// Same digest means the same entries in the same order, so the files pair up by position.
+// A root dir cannot be removed as a duplicate folder, so files directly under a matched
+// root are shown and deleted as individual files.
+static void _MarkSubtreeFiles(
+    _In_ PDIRINFO pLeftDir,
+    _In_ int iLeft,
+    _In_ PDIRINFO pRightDir,
+    _In_ int iRight,
+    _In_ BOOL fCompareHashes)
+{
+    PDIRDIGESTS pLeft = pLeftDir->pDirDigests;
+    PDIRDIGESTS pRight = pRightDir->pDirDigests;
+    PDIRDIGEST pLeftFolder = &pLeft->aFolders[iLeft];
+    PDIRDIGEST pRightFolder = &pRight->aFolders[iRight];
+
+    BYTE bLeftTree = (iLeft != 0) ? FDUP_TREE_MATCH : FDUP_NO_MATCH;
+    BYTE bRightTree = (iRight != 0) ? FDUP_TREE_MATCH : FDUP_NO_MATCH;
+    for (int i = 0; i < pLeftFolder->nSubtreeFiles; ++i)
+    {
+        PFILEINFO pLeftFile = pLeft->stFiles.apFiles[pLeftFolder->iFirstFile + i];
+        PFILEINFO pRightFile = pRight->stFiles.apFiles[pRightFolder->iFirstFile + i];
+
+        CompareFileInfoAndMark(pLeftFile, pRightFile, fCompareHashes);
+        AddDupInfo(pLeftFile, bLeftTree);
+        AddDupInfo(pRightFile, bRightTree);
+    }
+}
+
+// Fill in the FILEINFO that stands for the whole duplicate folder in the file list
+static void _SetDupFolder(_In_ PDIRINFO pDirInfo, _In_ PDIRDIGEST pFolder, _In_ PDIRDIGEST pOtherFolder)
+{
+    PFILEINFO pFolderInfo = &pFolder->stFolderInfo;
+
+    WCHAR szFolderPath[MAX_PATH];
+    if (SUCCEEDED(PathCchCombine(szFolderPath, ARRAYSIZE(szFolderPath), pDirInfo->pszPath, pFolder->szRelPath)))
+    {
+        PathCchRemoveBackslash(szFolderPath, ARRAYSIZE(szFolderPath));
+        if (!CreateFileInfo(szFolderPath, FALSE, pFolderInfo))
+        {
+            // Path and name are filled in even on failure
+            logwarn(L"Unable to get folder info for: %s", szFolderPath);
+        }
+    }
+
+    pFolderInfo->fIsDirectory = TRUE;
+    pFolderInfo->llFilesize.QuadPart = pFolder->llSubtreeSize;
+    SetDupInfo(pFolderInfo, FDUP_TREE_MATCH);
+
+    WCHAR szName[MAX_PATH];
+    WCHAR szOtherName[MAX_PATH];
+    if (CompareNames(_GetFolderName(pFolder, szName, ARRAYSIZE(szName)),
+        _GetFolderName(pOtherFolder, szOtherName, ARRAYSIZE(szOtherName))) == 0)
+    {
+        AddDupInfo(pFolderInfo, FDUP_NAME_MATCH);
+    }
+}
+
+// Append the files that are not under a matched sub tree or, if fMatched, the files
+// under a matched sub tree whose key hash is among adwOtherKeys. Unsorted.
+static HRESULT _CollectFiles(
+    _In_ PDIRDIGESTS pDigests,
+    _In_ BOOL fMatched,
+    _In_count_(nOtherKeys) const DWORD *adwOtherKeys,
+    _In_ int nOtherKeys,
+    _Inout_ PSORTED_FILES pFiles,
+    _Inout_ int *pnCapacity)
+{
+    if (fMatched && (nOtherKeys == 0))
+    {
+        return S_OK;
+    }
+
+    for (int iFolder = 0; iFolder < pDigests->nFolders; ++iFolder)
+    {
+        PDIRDIGEST pFolder = &pDigests->aFolders[iFolder];
+        if (!pFolder->fInMatchedTree != !fMatched)
+        {
+            continue;
+        }
+
+        for (int i = 0; i < pFolder->nDirectFiles; ++i)
+        {
+            PFILEINFO pFile = pDigests->stFiles.apFiles[pFolder->iFirstFile + i];
+            if (fMatched)
+            {
+                DWORD dwKey = _GetKeyHash(pFiles->key, pFile);
+                if (bsearch(&dwKey, adwOtherKeys, nOtherKeys, sizeof(DWORD), _CmpKeyHashes) == NULL)
+                {
+                    continue;
+                }
+            }
+
+            HRESULT hr = AppendToFileArray(&pFiles->apFiles, &pFiles->nFiles, pnCapacity, pFile);
+            if (FAILED(hr))
+            {
+                return hr;
+            }
+        }
+    }
+    return S_OK;
+}
+
+// Files with equal keys have equal key hashes for all keys: files with the same name
+// or path have the same name id.
+static DWORD _GetKeyHash(_In_ SORTMERGE_KEY key, _In_ PFILEINFO pFile)
+{
+    DWORD dwKey = pFile->dwNameId;
+    if (key == SMKEY_DIGEST)
+    {
+        CopyMemory(&dwKey, pFile->abHash, sizeof(dwKey));
+    }
+    return dwKey;
+}
+
+// Sorted key hashes of the files
+static HRESULT _BuildKeySet(_In_ PSORTED_FILES pFiles, _In_ SORTMERGE_KEY key, _Out_ DWORD **padwKeys)
+{
+    DWORD *adwKeys = (DWORD*)malloc(max(pFiles->nFiles, 1) * sizeof(DWORD));
+    if (adwKeys == NULL)
+    {
+        logerr(L"Out of memory for keys of %d files", pFiles->nFiles);
+        *padwKeys = NULL;
+        return E_OUTOFMEMORY;
+    }
+
+    for (int i = 0; i < pFiles->nFiles; ++i)
+    {
+        adwKeys[i] = _GetKeyHash(key, pFiles->apFiles[i]);
+    }
+
+    qsort(adwKeys, pFiles->nFiles, sizeof(DWORD), _CmpKeyHashes);
+    *padwKeys = adwKeys;
+    return S_OK;
+}
+
+static int __cdecl _CmpKeyHashes(_In_ const void *pvLeft, _In_ const void *pvRight)
+{
+    DWORD dwLeft = *(const DWORD*)pvLeft;
+    DWORD dwRight = *(const DWORD*)pvRight;
+    return (dwLeft < dwRight) ? -1 : ((dwLeft > dwRight) ? 1 : 0);
+}
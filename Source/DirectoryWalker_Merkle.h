@@ -0,0 +1,159 @@
+#pragma once
+
+// ---------------------------------------------------
+// The FDiffDelete Project
+// Github: https://github.com/shishir993/fdiffdelete
+// Author: Shishir Bhat
+// The MIT License (MIT)
+// Copyright (c) 2014
+//
+
+#include "Common.h"
+#include "FileInfo.h"
+#include "DirectoryWalker_Interface.h"
+#include "DirectoryWalker_SortMerge.h"
+
+// Merkle digests of the folders in a dir tree.
+// Each folder's digest is computed bottom-up from the names, sizes and contents of its
+// files and the names and digests of its sub folders. Contents are the file hash when hash
+// compare is ON, else the modified time. Two folders with the same digest hold identical
+// sub trees, whatever the folders themselves are named, so a whole sub tree can be matched
+// by a single lookup instead of comparing every file under it.
+// Folders without any file in their sub tree are not part of the digest tree.
+
+typedef struct _DirDigest
+{
+    // Folder path relative to the root, with a trailing '\'. Empty for the root itself.
+    WCHAR szRelPath[MAX_PATH];
+
+    // Indexes into the DIRDIGESTS folder array, -1 if none.
+    int iParent;
+    int iFirstChild;
+    int iLastChild;
+    int iNextSibling;
+
+    // The sub tree of this folder occupies the index range
+    // [this, this + nSubtreeFolders) of the folder array and the range
+    // [iFirstFile, iFirstFile + nSubtreeFiles) of the sorted file array.
+    // The folder's own files come first in its file range.
+    int nSubtreeFolders;
+    int iFirstFile;
+    int nSubtreeFiles;
+    int nDirectFiles;
+    LONGLONG llSubtreeSize;
+
+    BYTE abDigest[HASHLEN_SHA1];
+
+    // Next folder in this tree with the same digest, -1 if none.
+    int iNextSameDigest;
+
+    // Set by compare: this folder is part of a sub tree that matched a sub tree
+    // of the other dir, and the index of the matched folder in the other dir if
+    // this folder is the top of that sub tree (-1 otherwise).
+    BOOL fInMatchedTree;
+    int iMatch;
+
+    // Represents the whole folder in the file list when it is a duplicate folder.
+    // bDupInfo has FDUP_TREE_MATCH set then. llFilesize is the sub tree size.
+    FILEINFO stFolderInfo;
+
+} DIRDIGEST, *PDIRDIGEST;
+
+typedef struct _DirDigests
+{
+    // All files of the dir, sorted by relative path
+    SORTED_FILES stFiles;
+
+    // Folders in sorted order, parent before its children. Root is at index 0.
+    int nFolders;
+    int nMaxFolders;
+    PDIRDIGEST aFolders;
+
+} DIRDIGESTS, *PDIRDIGESTS;
+
+// Compute the digests of all folders of the (recursively built) dir.
+HRESULT BuildDirDigests(_In_ PDIRINFO pDirInfo, _Out_ PDIRDIGESTS *ppDigests);
+void DestroyDirDigests(_In_ PDIRDIGESTS pDigests);
+
+// Clear the match state set by a previous compare
+void ResetDirDigestMatches(_In_ PDIRDIGESTS pDigests);
+
+// Did the last compare match any sub tree of this dir?
+BOOL HasDupFolders(_In_ PDIRDIGESTS pDigests);
+
+// Compare two dirs that have digests. Identical sub trees are found by digest and their
+// files are marked as duplicates pairwise, without any further comparison. Only the files
+// outside of those sub trees go through the sort-merge compare on the specified key.
+BOOL CompareDirsAndMarkFiles_Merkle(_In_ PDIRINFO pLeftDir, _In_ PDIRINFO pRightDir, _In_ SORTMERGE_KEY key);
+
+// Remove the (now empty) folders of the duplicate folders of the dir. Must be
+// called after the duplicate files have been deleted. Folders that still have
+// files that weren't part of the scan are left as they are.
+void DeleteDupFolders(_In_ PDIRINFO pDirInfo);
+
+// Saved digests of a dir, in a file of their own, so that a dir loaded from saved
+// files (see LoadDirInfoFromSnapshot()) need not compute them again:
+//
+//  DIGESTS_FILE_HEADER
+//  DWORD           [nFiles]    index of each file, in relative path order, in the
+//                              owner's list of the files, such as the snapshot records
+//  DIGESTS_FOLDER  [nFolders]  the folders as in DIRDIGESTS.aFolders
+//
+// Each section starts 8-byte aligned. The digests are only of the layout they were
+// computed for, see DIGESTS_FILE_HEADER.fHashCompare.
+#define DIGESTS_FILE_MAGIC      0x44444446  // "FDDD"
+#define DIGESTS_FILE_VERSION    1
+
+typedef struct _DigestsFileHeader
+{
+    DWORD dwMagic;
+    DWORD dwVersion;
+    DWORD cbHeader;
+    BOOL fHashCompare;
+
+    // For the owner to tell which version of its files the digests are of
+    UINT64 ullTag;
+
+    DWORD nFiles;
+    DWORD nFolders;
+    UINT64 ullFilesOffset;
+    UINT64 ullFoldersOffset;
+
+} DIGESTS_FILE_HEADER, *PDIGESTS_FILE_HEADER;
+
+// DIRDIGEST without the match state
+typedef struct _DigestsFolder
+{
+    WCHAR szRelPath[MAX_PATH];
+    int iParent;
+    int iFirstChild;
+    int iLastChild;
+    int iNextSibling;
+    int nSubtreeFolders;
+    int iFirstFile;
+    int nSubtreeFiles;
+    int nDirectFiles;
+    LONGLONG llSubtreeSize;
+    BYTE abDigest[HASHLEN_SHA1];
+    int iNextSameDigest;
+
+} DIGESTS_FOLDER, *PDIGESTS_FOLDER;
+
+// Write the digests of the dir. aiFileIndexes has the owner's index of each file of
+// the digests, in the order of DIRDIGESTS.stFiles.
+HRESULT SaveDirDigests(
+    _In_ PDIRINFO pDirInfo,
+    _In_ const DWORD *aiFileIndexes,
+    _In_ UINT64 ullTag,
+    _In_z_ PCWSTR pszFilepath);
+
+// Read saved digests into the dir, whose files by the owner's index are apFiles, NULL
+// for an index with no file in the dir. Fails with ERROR_INVALID_DATA if the digests
+// are not of ullTag, of the layout of the dir or of exactly the files of apFiles.
+HRESULT LoadDirDigests(
+    _In_z_ PCWSTR pszFilepath,
+    _In_ PDIRINFO pDirInfo,
+    _In_ UINT64 ullTag,
+    _In_count_(nFiles) PFILEINFO *apFiles,
+    _In_ DWORD nFiles,
+    _Out_ PDIRDIGESTS *ppDigests);
@@ -0,0 +1,422 @@
+
+// ---------------------------------------------------
+// The FDiffDelete Project
+// Github: https://github.com/shishir993/fdiffdelete
+// Author: Shishir Bhat
+// The MIT License (MIT)
+// Copyright (c) 2014
+//
+
+#include "DirectoryWalker_SortMerge.h"
+#include "FileColumns.h"
+#include "NameKey.h"
+
+// Context passed to the sort callback
+typedef struct _SortContext
+{
+    SORTMERGE_KEY key;
+    int cchRootPath;
+} SORT_CONTEXT;
+
+static int _CompareNameIds(_In_ PFILEINFO pLeftFile, _In_ PFILEINFO pRightFile);
+static int _CompareSizeAndTime(_In_ PFILEINFO pLeftFile, _In_ PFILEINFO pRightFile);
+static int _CompareMatchKeys(_In_ PSORTED_FILES pLeft, _In_ int iLeft, _In_ PSORTED_FILES pRight, _In_ int iRight);
+static int __cdecl _SortCallback(_In_ void *pvContext, _In_ const void *pvLeft, _In_ const void *pvRight);
+
+static HRESULT _AddNameRunPairs(
+    _In_ PFILE_COLUMNS pLeft,
+    _In_ int iLeftStart,
+    _In_ int nLeft,
+    _In_ PFILE_COLUMNS pRight,
+    _In_ int iRightStart,
+    _In_ int nRight,
+    _Inout_ PFILE_PAIRS pPairs);
+
+static HRESULT _AddRunPairs(
+    _In_ int iLeftStart,
+    _In_ int nLeft,
+    _In_ int iRightStart,
+    _In_ int nRight,
+    _Inout_ PFILE_PAIRS pPairs);
+
+HRESULT BuildSortedFiles(_In_ PDIRINFO pDirInfo, _In_ SORTMERGE_KEY key, _Out_ PSORTED_FILES pSorted)
+{
+    SB_ASSERT(pDirInfo);
+    SB_ASSERT(pSorted);
+
+    ZeroMemory(pSorted, sizeof(*pSorted));
+    pSorted->key = key;
+    pSorted->cchRootPath = (int)wcsnlen(pDirInfo->pszPath, ARRAYSIZE(pDirInfo->pszPath));
+
+    HRESULT hr = GetAllFilesInDir(pDirInfo, &pSorted->apFiles, &pSorted->nFiles);
+    if (FAILED(hr))
+    {
+        logerr(L"Cannot list files of dir: %s, hr: %x", pDirInfo->pszPath, hr);
+        return hr;
+    }
+
+    SortFiles(pSorted);
+
+    logdbg(L"Sorted %d files of dir: %s", pSorted->nFiles, pDirInfo->pszPath);
+    return S_OK;
+}
+
+void SortFiles(_Inout_ PSORTED_FILES pSorted)
+{
+    SB_ASSERT(pSorted);
+
+    SORT_CONTEXT stContext = { pSorted->key, pSorted->cchRootPath };
+    qsort_s(pSorted->apFiles, pSorted->nFiles, sizeof(PFILEINFO), _SortCallback, &stContext);
+}
+
+void DestroySortedFiles(_In_ PSORTED_FILES pSorted)
+{
+    SB_ASSERT(pSorted);
+
+    free(pSorted->apFiles);
+    pSorted->apFiles = NULL;
+    pSorted->nFiles = 0;
+}
+
+PCWSTR GetRelativeFolder(_In_ PFILEINFO pFileInfo, _In_ int cchRootPath)
+{
+    PCWSTR pszRelative = pFileInfo->pszPath;
+    if ((int)wcsnlen(pszRelative, MAX_PATH) >= cchRootPath)
+    {
+        pszRelative += cchRootPath;
+    }
+
+    while (*pszRelative == L'\\')
+    {
+        ++pszRelative;
+    }
+    return pszRelative;
+}
+
+int CompareSortKeys(
+    _In_ SORTMERGE_KEY key,
+    _In_ PFILEINFO pLeftFile,
+    _In_ int cchLeftRoot,
+    _In_ PFILEINFO pRightFile,
+    _In_ int cchRightRoot)
+{
+    int cmp;
+    switch (key)
+    {
+    case SMKEY_FILENAME:
+        // Same name exactly when the name ids are equal, see NameIntern.h
+        cmp = _CompareNameIds(pLeftFile, pRightFile);
+        if (cmp == 0)
+        {
+            cmp = _CompareSizeAndTime(pLeftFile, pRightFile);
+        }
+        break;
+
+    case SMKEY_RELPATH:
+        cmp = CompareNames(GetRelativeFolder(pLeftFile, cchLeftRoot), GetRelativeFolder(pRightFile, cchRightRoot));
+        if (cmp == 0)
+        {
+            cmp = CompareNames(pLeftFile->pszFilename, pRightFile->pszFilename);
+        }
+        break;
+
+    case SMKEY_DIGEST:
+        cmp = memcmp(pLeftFile->abHash, pRightFile->abHash, sizeof(pLeftFile->abHash));
+        break;
+
+    default:
+        SB_ASSERT(FALSE);
+        cmp = 0;
+        break;
+    }
+    return cmp;
+}
+
+// Given two DIRINFO objects, compare the files in them and set each file's
+// duplicate flag to indicate that the file is present in both dirs.
+BOOL CompareDirsAndMarkFiles_SortMerge(_In_ PDIRINFO pLeftDir, _In_ PDIRINFO pRightDir, _In_ SORTMERGE_KEY key)
+{
+    SB_ASSERT(pLeftDir);
+    SB_ASSERT(pRightDir);
+
+    BOOL fRetVal = FALSE;
+    BOOL fCompareHashes = (pLeftDir->fHashCompare && pRightDir->fHashCompare);
+    SB_ASSERT((key != SMKEY_DIGEST) || fCompareHashes);
+
+    SORTED_FILES stLeft = {};
+    SORTED_FILES stRight = {};
+
+    logdbg(L"Comparing dirs: %s and %s", pLeftDir->pszPath, pRightDir->pszPath);
+    if (FAILED(BuildSortedFiles(pLeftDir, key, &stLeft)) || FAILED(BuildSortedFiles(pRightDir, key, &stRight)))
+    {
+        goto done;
+    }
+
+    if (FAILED(MergeSortedFiles(&stLeft, &stRight, fCompareHashes)))
+    {
+        goto done;
+    }
+
+    fRetVal = TRUE;
+
+done:
+    DestroySortedFiles(&stLeft);
+    DestroySortedFiles(&stRight);
+    return fRetVal;
+}
+
+// Walk two sorted sides together and mark the files with matching keys.
+// Both sides must be sorted by the same key.
+HRESULT MergeSortedFiles(_In_ PSORTED_FILES pLeft, _In_ PSORTED_FILES pRight, _In_ BOOL fCompareHashes)
+{
+    SB_ASSERT(pLeft && pRight);
+    SB_ASSERT(pLeft->key == pRight->key);
+
+    HRESULT hr;
+    FILE_COLUMNS stLeftColumns = {};
+    FILE_COLUMNS stRightColumns = {};
+    FILE_PAIRS stPairs = {};
+
+    // A file is in at most one run, so a side never has more rows than files
+    hr = CreateFileColumns(pLeft->nFiles, &stLeftColumns);
+    if (SUCCEEDED(hr))
+    {
+        hr = CreateFileColumns(pRight->nFiles, &stRightColumns);
+    }
+
+    if (FAILED(hr))
+    {
+        goto done;
+    }
+
+    // Single linear pass over both sorted arrays. When the keys are equal, find the
+    // run of equal keys on each side, copy the values of the runs into the columns
+    // and collect the pairs of rows to compare. Files without a match on the other
+    // side are never copied. All pairs are compared together at the end, see FileColumns.h
+    int iLeft = 0;
+    int iRight = 0;
+    while ((iLeft < pLeft->nFiles) && (iRight < pRight->nFiles))
+    {
+        int cmp = _CompareMatchKeys(pLeft, iLeft, pRight, iRight);
+        if (cmp < 0)
+        {
+            ++iLeft;
+        }
+        else if (cmp > 0)
+        {
+            ++iRight;
+        }
+        else
+        {
+            int iLeftEnd = iLeft + 1;
+            while ((iLeftEnd < pLeft->nFiles) && (_CompareMatchKeys(pLeft, iLeftEnd, pRight, iRight) == 0))
+            {
+                ++iLeftEnd;
+            }
+
+            int iRightEnd = iRight + 1;
+            while ((iRightEnd < pRight->nFiles) && (_CompareMatchKeys(pLeft, iLeft, pRight, iRightEnd) == 0))
+            {
+                ++iRightEnd;
+            }
+
+            int iLeftRow, iRightRow;
+            hr = AddFileColumnRows(&stLeftColumns, pLeft->apFiles + iLeft, iLeftEnd - iLeft, &iLeftRow);
+            if (SUCCEEDED(hr))
+            {
+                hr = AddFileColumnRows(&stRightColumns, pRight->apFiles + iRight, iRightEnd - iRight, &iRightRow);
+            }
+
+            if (FAILED(hr))
+            {
+                goto done;
+            }
+
+            if (pLeft->key == SMKEY_FILENAME)
+            {
+                hr = _AddNameRunPairs(&stLeftColumns, iLeftRow, iLeftEnd - iLeft, &stRightColumns, iRightRow, iRightEnd - iRight, &stPairs);
+            }
+            else
+            {
+                hr = _AddRunPairs(iLeftRow, iLeftEnd - iLeft, iRightRow, iRightEnd - iRight, &stPairs);
+            }
+
+            if (FAILED(hr))
+            {
+                goto done;
+            }
+
+            iLeft = iLeftEnd;
+            iRight = iRightEnd;
+        }
+    }
+
+    logdbg(L"Comparing %d pairs of %d of %d and %d of %d files", stPairs.nPairs,
+        stLeftColumns.nRows, pLeft->nFiles, stRightColumns.nRows, pRight->nFiles);
+    CompareAndMarkFilePairs(&stLeftColumns, &stRightColumns, &stPairs, fCompareHashes);
+
+done:
+    if (FAILED(hr))
+    {
+        logerr(L"Cannot merge %d and %d files, hr: %x", pLeft->nFiles, pRight->nFiles, hr);
+    }
+
+    DestroyFilePairs(&stPairs);
+    DestroyFileColumns(&stLeftColumns);
+    DestroyFileColumns(&stRightColumns);
+    return hr;
+}
+
+static int _CompareNameIds(_In_ PFILEINFO pLeftFile, _In_ PFILEINFO pRightFile)
+{
+    if (pLeftFile->dwNameId != pRightFile->dwNameId)
+    {
+        return (pLeftFile->dwNameId < pRightFile->dwNameId) ? -1 : 1;
+    }
+    return 0;
+}
+
+static int _CompareSizeAndTime(_In_ PFILEINFO pLeftFile, _In_ PFILEINFO pRightFile)
+{
+    if (pLeftFile->llFilesize.QuadPart != pRightFile->llFilesize.QuadPart)
+    {
+        return (pLeftFile->llFilesize.QuadPart < pRightFile->llFilesize.QuadPart) ? -1 : 1;
+    }
+
+    ULARGE_INTEGER ullLeft, ullRight;
+    ullLeft.LowPart = pLeftFile->ftModifiedTime.dwLowDateTime;
+    ullLeft.HighPart = pLeftFile->ftModifiedTime.dwHighDateTime;
+    ullRight.LowPart = pRightFile->ftModifiedTime.dwLowDateTime;
+    ullRight.HighPart = pRightFile->ftModifiedTime.dwHighDateTime;
+
+    if (ullLeft.QuadPart != ullRight.QuadPart)
+    {
+        return (ullLeft.QuadPart < ullRight.QuadPart) ? -1 : 1;
+    }
+    return 0;
+}
+
+// The merge matches on a prefix of the sort key: files with the same name
+// (but different size or date) still get a partial match.
+static int _CompareMatchKeys(_In_ PSORTED_FILES pLeft, _In_ int iLeft, _In_ PSORTED_FILES pRight, _In_ int iRight)
+{
+    PFILEINFO pLeftFile = pLeft->apFiles[iLeft];
+    PFILEINFO pRightFile = pRight->apFiles[iRight];
+
+    if (pLeft->key == SMKEY_FILENAME)
+    {
+        return _CompareNameIds(pLeftFile, pRightFile);
+    }
+
+    return CompareSortKeys(pLeft->key, pLeftFile, pLeft->cchRootPath, pRightFile, pRight->cchRootPath);
+}
+
+static int __cdecl _SortCallback(_In_ void *pvContext, _In_ const void *pvLeft, _In_ const void *pvRight)
+{
+    SORT_CONTEXT *pContext = (SORT_CONTEXT*)pvContext;
+    PFILEINFO pLeftFile = *(PFILEINFO*)pvLeft;
+    PFILEINFO pRightFile = *(PFILEINFO*)pvRight;
+
+    return CompareSortKeys(pContext->key, pLeftFile, pContext->cchRootPath, pRightFile, pContext->cchRootPath);
+}
+
+// Pairs of a run of same-named files. Both runs are sorted by size and then modified time,
+// so instead of comparing every left file with every right file:
+//  1. Each file is compared with one file of the other side, one of the same size if present.
+//  2. Files with identical size and modified time are compared last, so that a full match wins.
+static HRESULT _AddNameRunPairs(
+    _In_ PFILE_COLUMNS pLeft,
+    _In_ int iLeftStart,
+    _In_ int nLeft,
+    _In_ PFILE_COLUMNS pRight,
+    _In_ int iRightStart,
+    _In_ int nRight,
+    _Inout_ PFILE_PAIRS pPairs)
+{
+    SB_ASSERT(nLeft > 0 && nRight > 0);
+
+    HRESULT hr = S_OK;
+    PFILEINFO *apLeft = pLeft->apFiles + iLeftStart;
+    PFILEINFO *apRight = pRight->apFiles + iRightStart;
+    const LONGLONG *allLeftSize = pLeft->allSize + iLeftStart;
+    const LONGLONG *allRightSize = pRight->allSize + iRightStart;
+    int iLeft, iRight;
+
+    for (iLeft = 0, iRight = 0; SUCCEEDED(hr) && (iLeft < nLeft); ++iLeft)
+    {
+        while ((iRight < nRight - 1) && (allRightSize[iRight] < allLeftSize[iLeft]))
+        {
+            ++iRight;
+        }
+        hr = AddFilePair(pPairs, iLeftStart + iLeft, iRightStart + iRight);
+    }
+
+    for (iRight = 0, iLeft = 0; SUCCEEDED(hr) && (iRight < nRight); ++iRight)
+    {
+        while ((iLeft < nLeft - 1) && (allLeftSize[iLeft] < allRightSize[iRight]))
+        {
+            ++iLeft;
+        }
+        hr = AddFilePair(pPairs, iLeftStart + iLeft, iRightStart + iRight);
+    }
+
+    iLeft = 0;
+    iRight = 0;
+    while (SUCCEEDED(hr) && (iLeft < nLeft) && (iRight < nRight))
+    {
+        int cmp = _CompareSizeAndTime(apLeft[iLeft], apRight[iRight]);
+        if (cmp < 0)
+        {
+            ++iLeft;
+        }
+        else if (cmp > 0)
+        {
+            ++iRight;
+        }
+        else
+        {
+            int iLeftEnd = iLeft + 1;
+            while ((iLeftEnd < nLeft) && (_CompareSizeAndTime(apLeft[iLeftEnd], apRight[iRight]) == 0))
+            {
+                ++iLeftEnd;
+            }
+
+            int iRightEnd = iRight + 1;
+            while ((iRightEnd < nRight) && (_CompareSizeAndTime(apLeft[iLeft], apRight[iRightEnd]) == 0))
+            {
+                ++iRightEnd;
+            }
+
+            hr = _AddRunPairs(iLeftStart + iLeft, iLeftEnd - iLeft, iRightStart + iRight, iRightEnd - iRight, pPairs);
+
+            iLeft = iLeftEnd;
+            iRight = iRightEnd;
+        }
+    }
+    return hr;
+}
+
+// Pairs of two runs of files with equal keys. Every file in a run matches every file
+// in the other run equally, so comparing against the first file of the other run
+// is sufficient and keeps this linear in the run lengths.
+static HRESULT _AddRunPairs(
+    _In_ int iLeftStart,
+    _In_ int nLeft,
+    _In_ int iRightStart,
+    _In_ int nRight,
+    _Inout_ PFILE_PAIRS pPairs)
+{
+    SB_ASSERT(nLeft > 0 && nRight > 0);
+
+    HRESULT hr = S_OK;
+    for (int i = 0; SUCCEEDED(hr) && (i < nLeft); ++i)
+    {
+        hr = AddFilePair(pPairs, iLeftStart + i, iRightStart);
+    }
+
+    for (int i = 1; SUCCEEDED(hr) && (i < nRight); ++i)
+    {
+        hr = AddFilePair(pPairs, iLeftStart, iRightStart + i);
+    }
+    return hr;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+// ---------------------------------------------------
+// The FDiffDelete Project
+// Github: https://github.com/shishir993/fdiffdelete
+// Author: Shishir Bhat
+// The MIT License (MIT)
+// Copyright (c) 2014
+//
+
+#include "Common.h"
+#include "FileInfo.h"
+#include "DirectoryWalker_Interface.h"
+
+// Sort-merge compare engine.
+// Instead of probing the other dir's hashtable for every file (and linearly
+// scanning its dup within list), each side is flattened into an array of
+// FILEINFO pointers, sorted once by the match key and then both arrays are
+// walked together in a single linear merge.
+
+// Key on which the files are ordered and matched
+typedef enum
+{
+    // Filename by its name id (see NameIntern.h), then size, then modified time.
+    SMKEY_FILENAME,
+
+    // Folder path relative to the root dir, then filename.
+    SMKEY_RELPATH,
+
+    // File hash (SHA1).
+    SMKEY_DIGEST
+
+} SORTMERGE_KEY;
+
+// One side of the merge: the files of a DIRINFO, sorted by key
+typedef struct _SortedFiles
+{
+    SORTMERGE_KEY key;
+
+    // Number of characters of the root dir path, used to get the relative path of a file
+    int cchRootPath;
+
+    int nFiles;
+    PFILEINFO *apFiles;
+
+} SORTED_FILES, *PSORTED_FILES;
+
+// Flatten and sort the files of the specified dir
+HRESULT BuildSortedFiles(_In_ PDIRINFO pDirInfo, _In_ SORTMERGE_KEY key, _Out_ PSORTED_FILES pSorted);
+void DestroySortedFiles(_In_ PSORTED_FILES pSorted);
+
+// Sort an already filled SORTED_FILES by its key
+void SortFiles(_Inout_ PSORTED_FILES pSorted);
+
+// Walk two sorted sides together and mark the files with matching keys.
+// Both sides must be sorted by the same key.
+HRESULT MergeSortedFiles(_In_ PSORTED_FILES pLeft, _In_ PSORTED_FILES pRight, _In_ BOOL fCompareHashes);
+
+// Returns a pointer to the folder path of the file relative to the root of the dir tree.
+// Empty string for files directly under the root.
+PCWSTR GetRelativeFolder(_In_ PFILEINFO pFileInfo, _In_ int cchRootPath);
+
+// Order two files, possibly from different dir trees, by the specified key.
+int CompareSortKeys(
+    _In_ SORTMERGE_KEY key,
+    _In_ PFILEINFO pLeftFile,
+    _In_ int cchLeftRoot,
+    _In_ PFILEINFO pRightFile,
+    _In_ int cchRightRoot);
+
+// Given two DIRINFO objects, compare the files in them and set each file's
+// duplicate flag to indicate that the file is present in both dirs.
+BOOL CompareDirsAndMarkFiles_SortMerge(_In_ PDIRINFO pLeftDir, _In_ PDIRINFO pRightDir, _In_ SORTMERGE_KEY key);
@@ -0,0 +1,313 @@
+
+// ---------------------------------------------------
+// The FDiffDelete Project
+// Github: https://github.com/shishir993/fdiffdelete
+// Author: Shishir Bhat
+// The MIT License (MIT)
+// Copyright (c) 2014
+//
+
+#include "DirectoryWalker_TreeDiff.h"
+#include "DirectoryWalker_SortMerge.h"
+#include "DirectoryWalker_Util.h"
+#include "NameKey.h"
+
+#define INIT_TREEDIFF_FOLDERS   64
+
+static HRESULT _GetFolderIndex(_In_ PTREEDIFF pTreeDiff, _In_z_ PCWSTR pszRelFolder, _Out_ int *piFolder);
+
+HRESULT DiffDirTrees(_In_ PDIRINFO pLeftDir, _In_ PDIRINFO pRightDir, _Out_ PTREEDIFF *ppTreeDiff)
+{
+    SB_ASSERT(pLeftDir);
+    SB_ASSERT(pRightDir);
+    SB_ASSERT(ppTreeDiff);
+
+    HRESULT hr = S_OK;
+    BOOL fCompareHashes = (pLeftDir->fHashCompare && pRightDir->fHashCompare);
+
+    SORTED_FILES stLeft = {};
+    SORTED_FILES stRight = {};
+
+    PTREEDIFF pTreeDiff = NULL;
+
+    hr = CreateTreeDiff(&pTreeDiff);
+    if (SUCCEEDED(hr))
+    {
+        hr = BuildSortedFiles(pLeftDir, SMKEY_RELPATH, &stLeft);
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = BuildSortedFiles(pRightDir, SMKEY_RELPATH, &stRight);
+    }
+
+    if (FAILED(hr))
+    {
+        goto error_return;
+    }
+
+    logdbg(L"Tree diff of dirs: %s and %s", pLeftDir->pszPath, pRightDir->pszPath);
+
+    // One aligned walk over both trees in relative path order
+    int iLeft = 0;
+    int iRight = 0;
+    while ((iLeft < stLeft.nFiles) || (iRight < stRight.nFiles))
+    {
+        PFILEINFO pLeftFile = (iLeft < stLeft.nFiles) ? stLeft.apFiles[iLeft] : NULL;
+        PFILEINFO pRightFile = (iRight < stRight.nFiles) ? stRight.apFiles[iRight] : NULL;
+
+        int cmp;
+        if (pLeftFile == NULL)
+        {
+            cmp = 1;
+        }
+        else if (pRightFile == NULL)
+        {
+            cmp = -1;
+        }
+        else
+        {
+            cmp = CompareSortKeys(SMKEY_RELPATH, pLeftFile, stLeft.cchRootPath, pRightFile, stRight.cchRootPath);
+        }
+
+        PCWSTR pszRelFolder = (cmp <= 0) ? GetRelativeFolder(pLeftFile, stLeft.cchRootPath)
+            : GetRelativeFolder(pRightFile, stRight.cchRootPath);
+
+        TREEDIFF_RESULT result;
+        if (cmp < 0)
+        {
+            result = TDR_REMOVED;
+            ++iLeft;
+        }
+        else if (cmp > 0)
+        {
+            result = TDR_ADDED;
+            ++iRight;
+        }
+        else
+        {
+            result = CompareFileInfoAndMark(pLeftFile, pRightFile, fCompareHashes) ? TDR_IDENTICAL : TDR_CHANGED;
+            ++iLeft;
+            ++iRight;
+        }
+
+        hr = CountTreeDiffFile(pTreeDiff, pszRelFolder, result);
+        if (FAILED(hr))
+        {
+            goto error_return;
+        }
+    }
+
+    DestroySortedFiles(&stLeft);
+    DestroySortedFiles(&stRight);
+
+    *ppTreeDiff = pTreeDiff;
+    return S_OK;
+
+error_return:
+    DestroySortedFiles(&stLeft);
+    DestroySortedFiles(&stRight);
+    if (pTreeDiff != NULL)
+    {
+        DestroyTreeDiff(pTreeDiff);
+    }
+    *ppTreeDiff = NULL;
+    return hr;
+}
+
+HRESULT CreateTreeDiff(_Out_ PTREEDIFF *ppTreeDiff)
+{
+    SB_ASSERT(ppTreeDiff);
+
+    HRESULT hr = S_OK;
+    PTREEDIFF pTreeDiff = (PTREEDIFF)malloc(sizeof(TREEDIFF));
+    if (pTreeDiff == NULL)
+    {
+        hr = E_OUTOFMEMORY;
+        goto error_return;
+    }
+
+    ZeroMemory(pTreeDiff, sizeof(*pTreeDiff));
+    hr = CHL_DsCreateHT(&pTreeDiff->phtFolderIndex, INIT_TREEDIFF_FOLDERS, CHL_KT_WSTRING, CHL_VT_INT32, FALSE);
+    if (FAILED(hr))
+    {
+        logerr(L"Couldn't create folder index hashtable, hr: %x", hr);
+        goto error_return;
+    }
+
+    // Root folder is always the first one
+    int iFolder;
+    hr = _GetFolderIndex(pTreeDiff, L"", &iFolder);
+    if (FAILED(hr))
+    {
+        goto error_return;
+    }
+
+    *ppTreeDiff = pTreeDiff;
+    return S_OK;
+
+error_return:
+    if (pTreeDiff != NULL)
+    {
+        DestroyTreeDiff(pTreeDiff);
+    }
+    *ppTreeDiff = NULL;
+    return hr;
+}
+
+HRESULT CountTreeDiffFile(_In_ PTREEDIFF pTreeDiff, _In_z_ PCWSTR pszRelFolder, _In_ TREEDIFF_RESULT result)
+{
+    SB_ASSERT(pTreeDiff);
+    SB_ASSERT(pszRelFolder);
+
+    int iFolder;
+    HRESULT hr = _GetFolderIndex(pTreeDiff, pszRelFolder, &iFolder);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    PTREEDIFF_FOLDER pFolder = &pTreeDiff->aFolders[iFolder];
+    switch (result)
+    {
+    case TDR_ADDED:
+        ++(pFolder->nAdded);
+        ++(pTreeDiff->nAdded);
+        break;
+
+    case TDR_REMOVED:
+        ++(pFolder->nRemoved);
+        ++(pTreeDiff->nRemoved);
+        break;
+
+    case TDR_CHANGED:
+        ++(pFolder->nChanged);
+        ++(pTreeDiff->nChanged);
+        break;
+
+    default:
+        SB_ASSERT(result == TDR_IDENTICAL);
+        ++(pFolder->nIdentical);
+        ++(pTreeDiff->nIdentical);
+        break;
+    }
+    return S_OK;
+}
+
+void DestroyTreeDiff(_In_ PTREEDIFF pTreeDiff)
+{
+    SB_ASSERT(pTreeDiff);
+
+    if (pTreeDiff->phtFolderIndex != NULL)
+    {
+        CHL_DsDestroyHT(pTreeDiff->phtFolderIndex);
+    }
+
+    free(pTreeDiff->aFolders);
+    free(pTreeDiff);
+}
+
+// Print the per folder report, indented by folder depth, skipping folders without files.
+void PrintTreeDiff(_In_ PTREEDIFF pTreeDiff)
+{
+    SB_ASSERT(pTreeDiff);
+
+    wprintf(L"  Added Removed Changed Identical  Folder\n");
+    for (int i = 0; i < pTreeDiff->nFolders; ++i)
+    {
+        PTREEDIFF_FOLDER pFolder = &pTreeDiff->aFolders[i];
+        if ((pFolder->nAdded + pFolder->nRemoved + pFolder->nChanged + pFolder->nIdentical) == 0)
+        {
+            continue;
+        }
+
+        wprintf(L"%7d %7d %7d %9d  %*s%s\n",
+            pFolder->nAdded,
+            pFolder->nRemoved,
+            pFolder->nChanged,
+            pFolder->nIdentical,
+            pFolder->nDepth * 2, L"",
+            (pFolder->szRelPath[0] != 0) ? pFolder->szRelPath : L".\\");
+    }
+
+    wprintf(L"%7d %7d %7d %9d  Total\n\n",
+        pTreeDiff->nAdded, pTreeDiff->nRemoved, pTreeDiff->nChanged, pTreeDiff->nIdentical);
+}
+
+// Find the index of the specified relative folder, adding it (and its
+// ancestors, if not seen yet) to the folder array if required.
+static HRESULT _GetFolderIndex(_In_ PTREEDIFF pTreeDiff, _In_z_ PCWSTR pszRelFolder, _Out_ int *piFolder)
+{
+    HRESULT hr = S_OK;
+
+    // Key is the folded path since both trees are matched case insensitively
+    if (wcsnlen(pszRelFolder, MAX_PATH) >= MAX_PATH)
+    {
+        logerr(L"Relative folder path too long: %s", pszRelFolder);
+        return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+    }
+
+    WCHAR szKey[MAX_PATH];
+    int cchKey = FoldName(pszRelFolder, szKey, ARRAYSIZE(szKey));
+
+    int iFolder;
+    if (SUCCEEDED(CHL_DsFindHT(pTreeDiff->phtFolderIndex, szKey, StringSizeBytes(szKey), &iFolder, NULL, FALSE)))
+    {
+        *piFolder = iFolder;
+        return S_OK;
+    }
+
+    // Parent is the path without the last component, e.g. "a\b\" -> "a\"
+    int iParent = -1;
+    int nDepth = 0;
+    if (cchKey > 0)
+    {
+        WCHAR szParent[MAX_PATH];
+        wcscpy_s(szParent, ARRAYSIZE(szParent), pszRelFolder);
+
+        int iSep = cchKey - 1;
+        SB_ASSERT(szParent[iSep] == L'\\');
+        do
+        {
+            --iSep;
+        } while ((iSep >= 0) && (szParent[iSep] != L'\\'));
+        szParent[iSep + 1] = 0;
+
+        hr = _GetFolderIndex(pTreeDiff, szParent, &iParent);
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+        nDepth = pTreeDiff->aFolders[iParent].nDepth + 1;
+    }
+
+    if (pTreeDiff->nFolders >= pTreeDiff->nMaxFolders)
+    {
+        int nNewMax = (pTreeDiff->nMaxFolders > 0) ? (pTreeDiff->nMaxFolders * 2) : INIT_TREEDIFF_FOLDERS;
+        PTREEDIFF_FOLDER aNew = (PTREEDIFF_FOLDER)realloc(pTreeDiff->aFolders, nNewMax * sizeof(TREEDIFF_FOLDER));
+        if (aNew == NULL)
+        {
+            return E_OUTOFMEMORY;
+        }
+
+        pTreeDiff->aFolders = aNew;
+        pTreeDiff->nMaxFolders = nNewMax;
+    }
+
+    iFolder = (pTreeDiff->nFolders)++;
+    PTREEDIFF_FOLDER pFolder = &pTreeDiff->aFolders[iFolder];
+    ZeroMemory(pFolder, sizeof(*pFolder));
+    wcscpy_s(pFolder->szRelPath, ARRAYSIZE(pFolder->szRelPath), pszRelFolder);
+    pFolder->iParent = iParent;
+    pFolder->nDepth = nDepth;
+
+    hr = CHL_DsInsertHT(pTreeDiff->phtFolderIndex, szKey, StringSizeBytes(szKey), (PCVOID)(INT_PTR)iFolder, sizeof(iFolder));
+    if (FAILED(hr))
+    {
+        logerr(L"Cannot add folder %s to folder index, hr: %x", pszRelFolder, hr);
+        --(pTreeDiff->nFolders);
+        return hr;
+    }
+
+    *piFolder = iFolder;
+    return S_OK;
+}
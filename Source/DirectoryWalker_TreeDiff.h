@@ -0,0 +1,79 @@
+#pragma once
+
+// ---------------------------------------------------
+// The FDiffDelete Project
+// Github: https://github.com/shishir993/fdiffdelete
+// Author: Shishir Bhat
+// The MIT License (MIT)
+// Copyright (c) 2014
+//
+
+#include "Common.h"
+#include "FileInfo.h"
+#include "DirectoryWalker_Interface.h"
+
+// Path-structured diff of two dir trees.
+// Files are matched by their path relative to the root dir instead of by the bare
+// filename, so same-named files in unrelated sub folders are never compared with
+// each other. The result is reported per folder of the (merged) dir hierarchy.
+
+// Per folder counts. Removed means present only in the left tree and
+// added means present only in the right tree.
+typedef struct _TreeDiffFolder
+{
+    // Folder path relative to the root, with a trailing '\'. Empty for the root itself.
+    WCHAR szRelPath[MAX_PATH];
+
+    // Index of the parent folder in the TREEDIFF folder array, -1 for the root.
+    int iParent;
+    int nDepth;
+
+    int nAdded;
+    int nRemoved;
+    int nChanged;
+    int nIdentical;
+
+} TREEDIFF_FOLDER, *PTREEDIFF_FOLDER;
+
+typedef struct _TreeDiff
+{
+    int nFolders;
+    int nMaxFolders;
+
+    // Folders in sorted order, parent before its children.
+    PTREEDIFF_FOLDER aFolders;
+
+    // Lower-cased relative folder path to index into aFolders
+    PCHL_HTABLE phtFolderIndex;
+
+    // Totals across the tree
+    int nAdded;
+    int nRemoved;
+    int nChanged;
+    int nIdentical;
+
+} TREEDIFF, *PTREEDIFF;
+
+// How a file of one tree compares with the file at the same path in the other
+typedef enum _TreeDiffResult
+{
+    TDR_ADDED,
+    TDR_REMOVED,
+    TDR_CHANGED,
+    TDR_IDENTICAL
+
+} TREEDIFF_RESULT;
+
+// Walk both dir trees in relative path order, mark the files matched by path as
+// duplicates and count added, removed, changed and identical files per folder.
+HRESULT DiffDirTrees(_In_ PDIRINFO pLeftDir, _In_ PDIRINFO pRightDir, _Out_ PTREEDIFF *ppTreeDiff);
+
+// An empty diff, for callers that match the files themselves and count each
+// result with CountTreeDiffFile().
+HRESULT CreateTreeDiff(_Out_ PTREEDIFF *ppTreeDiff);
+HRESULT CountTreeDiffFile(_In_ PTREEDIFF pTreeDiff, _In_z_ PCWSTR pszRelFolder, _In_ TREEDIFF_RESULT result);
+
+void DestroyTreeDiff(_In_ PTREEDIFF pTreeDiff);
+
+// Print the per folder report, indented by folder depth, skipping folders without files.
+void PrintTreeDiff(_In_ PTREEDIFF pTreeDiff);
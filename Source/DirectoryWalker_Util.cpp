@@ -8,15 +8,24 @@
 //
 
 #include "DirectoryWalker_Util.h"
+#include "FileFormatUtil.h"
 
-static WCHAR *g_apszBannedFilesFolders[] =
+#define BANNED_NAME(psz)    { psz, ARRAYSIZE(psz) - 1 }
+
+// Names with their lengths, so that most names are passed over by length alone
+static const struct
+{
+    PCWSTR pszName;
+    int cchName;
+
+} g_aBannedFilesFolders[] =
 {
-    L".",
-    L"..",
-    L"$RECYCLE.BIN",
-    L"System Volume Information",
+    BANNED_NAME(L"."),
+    BANNED_NAME(L".."),
+    BANNED_NAME(L"$RECYCLE.BIN"),
+    BANNED_NAME(L"System Volume Information"),
 
-    L"desktop.ini"
+    BANNED_NAME(L"desktop.ini")
 };
 
 int StringSizeBytes(_In_ PCWSTR pwsz)
@@ -27,9 +36,11 @@ int StringSizeBytes(_In_ PCWSTR pwsz)
 
 BOOL IsFileFolderBanned(_In_z_ PWSTR pszFilename, _In_ int nMaxChars)
 {
-    for (int i = 0; i < ARRAYSIZE(g_apszBannedFilesFolders); ++i)
+    int cchFilename = (int)wcsnlen(pszFilename, nMaxChars);
+    for (int i = 0; i < ARRAYSIZE(g_aBannedFilesFolders); ++i)
     {
-        if (_wcsnicmp(pszFilename, g_apszBannedFilesFolders[i], nMaxChars) == 0)
+        if ((cchFilename == g_aBannedFilesFolders[i].cchName)
+            && (CompareStringOrdinal(pszFilename, cchFilename, g_aBannedFilesFolders[i].pszName, cchFilename, TRUE) == CSTR_EQUAL))
         {
             return TRUE;
         }
@@ -80,6 +91,26 @@ BOOL IsDirectoryEmpty(_In_z_ PCWSTR pszPath)
     return fEmpty;
 }
 
+HRESULT AppendToFileArray(_Inout_ PFILEINFO **ppaFiles, _Inout_ int *pnFiles, _Inout_ int *pnCapacity, _In_ PFILEINFO pFile)
+{
+    if (*pnFiles >= *pnCapacity)
+    {
+        int nNewCapacity = (*pnCapacity > 0) ? (*pnCapacity * 2) : 256;
+        PFILEINFO *paNew = (PFILEINFO*)realloc(*ppaFiles, nNewCapacity * sizeof(PFILEINFO));
+        if (paNew == NULL)
+        {
+            logerr(L"Out of memory growing file array to %d entries", nNewCapacity);
+            return E_OUTOFMEMORY;
+        }
+
+        *ppaFiles = paNew;
+        *pnCapacity = nNewCapacity;
+    }
+
+    (*ppaFiles)[(*pnFiles)++] = pFile;
+    return S_OK;
+}
+
 HRESULT DelEmptyFolders_Init(_In_ PDIRINFO pDirDeleteFrom, _Out_ PCHL_HTABLE* pphtFoldersSeen)
 {
     HRESULT hr = S_OK;
@@ -103,11 +134,11 @@ void DelEmptyFolders_Add(_In_opt_ PCHL_HTABLE phtFoldersSeen, _In_ PFILEINFO pFi
     HRESULT hr;
     if (pFile->fIsDirectory == TRUE)
     {
-        hr = PathCchCombine(szDir, ARRAYSIZE(szDir), pFile->szPath, pFile->szFilename);
+        hr = PathCchCombine(szDir, ARRAYSIZE(szDir), pFile->pszPath, pFile->pszFilename);
     }
     else
     {
-        hr = StringCchCopy(szDir, ARRAYSIZE(szDir), pFile->szPath);
+        hr = StringCchCopy(szDir, ARRAYSIZE(szDir), pFile->pszPath);
     }
 
     if (SUCCEEDED(hr))
@@ -117,15 +148,15 @@ void DelEmptyFolders_Add(_In_opt_ PCHL_HTABLE phtFoldersSeen, _In_ PFILEINFO pFi
 
     if (FAILED(hr))
     {
-        logwarn(L"Failed to record as a seen dir, hr: %x, %s\\%s", hr, pFile->szPath, pFile->szFilename);
+        logwarn(L"Failed to record as a seen dir, hr: %x, %s\\%s", hr, pFile->pszPath, pFile->pszFilename);
     }
 }
 
-void DelEmptyFolders_Delete(_In_opt_ PCHL_HTABLE phtFoldersSeen)
+int DelEmptyFolders_Delete(_In_opt_ PCHL_HTABLE phtFoldersSeen)
 {
     if (phtFoldersSeen == NULL)
     {
-        return;
+        return 0;
     }
 
     /*
@@ -134,6 +165,7 @@ void DelEmptyFolders_Delete(_In_opt_ PCHL_HTABLE phtFoldersSeen)
      an iteration where we do not find any empty folders.
     */
 
+    int nTotalRemoved = 0;
     int nFoldersRemoved;
     do
     {
@@ -176,7 +208,46 @@ void DelEmptyFolders_Delete(_In_opt_ PCHL_HTABLE phtFoldersSeen)
         {
             phtFoldersSeen->Remove(phtFoldersSeen, (PCVOID)pszPrevDir, 0);
         }
+        nTotalRemoved += nFoldersRemoved;
     } while (0 < nFoldersRemoved);
 
     phtFoldersSeen->Destroy(phtFoldersSeen);
+    return nTotalRemoved;
+}
+
+void DelChanges_GetDeleted(_In_ PFILEINFO pFile, _Out_ PDELETED_FILE pDeleted)
+{
+    pDeleted->pszPath = pFile->pszPath;
+    pDeleted->dwNameId = pFile->dwNameId;
+    pDeleted->dwListItemId = pFile->dwListItemId;
+}
+
+void DelChanges_AddDeleted(_Inout_opt_ PDELETE_CHANGES pChanges, _In_ const DELETED_FILE *pDeleted)
+{
+    if (pChanges == NULL)
+    {
+        return;
+    }
+
+    // Without a complete list the views cannot be updated in place
+    if (FAILED(GrowArray((void**)&pChanges->aDeleted, &pChanges->nDeletedCapacity, pChanges->nDeleted + 1, 256, sizeof(DELETED_FILE))))
+    {
+        pChanges->fRebuildRequired = TRUE;
+        return;
+    }
+
+    pChanges->aDeleted[pChanges->nDeleted++] = *pDeleted;
+}
+
+void DelChanges_AddUpdated(_Inout_opt_ PDELETE_CHANGES pChanges, _In_ PFILEINFO pFile)
+{
+    if (pChanges == NULL)
+    {
+        return;
+    }
+
+    if (FAILED(AppendToFileArray(&pChanges->apUpdated, &pChanges->nUpdated, &pChanges->nUpdatedCapacity, pFile)))
+    {
+        pChanges->fRebuildRequired = TRUE;
+    }
 }
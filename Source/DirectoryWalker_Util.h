@@ -16,6 +16,18 @@ int StringSizeBytes(_In_ PCWSTR pwsz);
 BOOL IsFileFolderBanned(_In_z_ PWSTR pszFilename, _In_ int nMaxChars);
 BOOL IsDirectoryEmpty(_In_z_ PCWSTR pszPath);
 
+// Append a FILEINFO pointer to a heap-allocated array, growing the array as required.
+HRESULT AppendToFileArray(_Inout_ PFILEINFO **ppaFiles, _Inout_ int *pnFiles, _Inout_ int *pnCapacity, _In_ PFILEINFO pFile);
+
 HRESULT DelEmptyFolders_Init(_In_ PDIRINFO pDirDeleteFrom, _Out_ PCHL_HTABLE* pphtFoldersSeen);
 void DelEmptyFolders_Add(_In_opt_ PCHL_HTABLE phtFoldersSeen, _In_ PFILEINFO pFile);
-void DelEmptyFolders_Delete(_In_opt_ PCHL_HTABLE phtFoldersSeen);
+// Returns the number of folders removed
+int DelEmptyFolders_Delete(_In_opt_ PCHL_HTABLE phtFoldersSeen);
+
+// What a change set keeps of a file to be deleted, taken before its FILEINFO is freed
+void DelChanges_GetDeleted(_In_ PFILEINFO pFile, _Out_ PDELETED_FILE pDeleted);
+
+// Record a deleted file of the dir deleted from, and a file of the other
+// dir whose duplicate flag was cleared. The change set is optional.
+void DelChanges_AddDeleted(_Inout_opt_ PDELETE_CHANGES pChanges, _In_ const DELETED_FILE *pDeleted);
+void DelChanges_AddUpdated(_Inout_opt_ PDELETE_CHANGES pChanges, _In_ PFILEINFO pFile);
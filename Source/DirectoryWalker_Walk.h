@@ -0,0 +1,225 @@
+#pragma once
+
+// ---------------------------------------------------
+// The FDiffDelete Project
+// Github: https://github.com/shishir993/fdiffdelete
+// Author: Shishir Bhat
+// The MIT License (MIT)
+// Copyright (c) 2014
+//
+
+#include "Common.h"
+#include "FileInfo.h"
+#include "DirectoryWalker_Interface.h"
+#include "DirectoryWalker_Util.h"
+
+// The folder walk shared by all DIRINFO layouts. A layout (see phtFiles) only
+// decides how a file is stored, so it is passed as a struct of static members and
+// everything it decides is resolved when the walk is compiled:
+//
+//  struct _XxxLayout
+//  {
+//      // Hash the contents of the files as they are walked?
+//      static const BOOL fComputeHash = ...;
+//
+//      // Add the folders of a non-recursive walk as entries?
+//      static const BOOL fKeepFolders = ...;
+//
+//      static HRESULT Init(_In_ PCWSTR pszFolderpath, _In_ BOOL fRecursive, _Out_ PDIRINFO* ppDirInfo);
+//      static void Destroy(_In_ PDIRINFO pDirInfo);
+//
+//      // Takes over pFileInfo, frees it if it cannot be added
+//      static BOOL AddFile(_In_ PDIRINFO pDirInfo, _In_ PFILEINFO pFileInfo);
+//  };
+//
+// A new layout needs only such a struct and the two one line wrappers, see
+// BuildDirTree_NoHash() and BuildFilesInDir_NoHash().
+
+// Build the list of files in the given folder. If pqDirsToTraverse is not NULL,
+// the walk is recursive and the sub folders are added to it as heap copies of
+// their paths, to be walked by the caller and freed.
+template <class TLayout>
+BOOL WalkFilesInDir(
+    _In_ PCWSTR pszFolderpath,
+    _In_opt_ PCHL_QUEUE pqDirsToTraverse,
+    _Inout_ PDIRINFO* ppDirInfo)
+{
+    SB_ASSERT(pszFolderpath);
+    SB_ASSERT(ppDirInfo);
+
+    WIN32_FIND_DATA findData;
+    HANDLE hFindFile = INVALID_HANDLE_VALUE;
+    PDIRINFO pCurDirInfo = NULL;
+    BOOL fCreatedDir = (*ppDirInfo == NULL);
+
+    loginfo(L"Building dir: %s", pszFolderpath);
+    if (fCreatedDir && FAILED(TLayout::Init(pszFolderpath, (pqDirsToTraverse != NULL), ppDirInfo)))
+    {
+        logerr(L"Init failed for dir: %s", pszFolderpath);
+        goto error_return;
+    }
+
+    // Derefernce just to make it easier to code
+    pCurDirInfo = *ppDirInfo;
+
+    // In order to list all files within the specified directory,
+    // path sent to FindFirstFile must end with a "\\*"
+    WCHAR szSearchpath[MAX_PATH] = L"";
+    wcscpy_s(szSearchpath, ARRAYSIZE(szSearchpath), pszFolderpath);
+
+    int nLen = wcsnlen(pszFolderpath, MAX_PATH);
+    if (nLen > 2 && wcsncmp(pszFolderpath + nLen - 2, L"\\*", MAX_PATH) != 0)
+    {
+        PathCchCombine(szSearchpath, ARRAYSIZE(szSearchpath), pszFolderpath, L"*");
+    }
+
+    // Initialize search for files in folder
+    hFindFile = FindFirstFile(szSearchpath, &findData);
+    if (hFindFile == INVALID_HANDLE_VALUE && GetLastError() == ERROR_FILE_NOT_FOUND)
+    {
+        // No files found under the folder. Just return.
+        return TRUE;
+    }
+
+    if (hFindFile == INVALID_HANDLE_VALUE)
+    {
+        logerr(L"FindFirstFile().");
+        goto error_return;
+    }
+
+    do
+    {
+        // Skip banned files and folders
+        if (IsFileFolderBanned(findData.cFileName, ARRAYSIZE(findData.cFileName)))
+        {
+            continue;
+        }
+
+        szSearchpath[0] = 0;
+        if (FAILED(PathCchCombine(szSearchpath, ARRAYSIZE(szSearchpath), pszFolderpath, findData.cFileName)))
+        {
+            logerr(L"PathCchCombine() failed for %s and %s", pszFolderpath, findData.cFileName);
+            goto error_return;
+        }
+
+        // Sub folders of a recursive walk are not entries, need not build a FILEINFO
+        if ((pqDirsToTraverse != NULL) && (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+        {
+            PWSTR pszSubDir = _wcsdup(szSearchpath);
+            if (pszSubDir == NULL)
+            {
+                logwarn(L"Unable to copy path of sub dir: %s", szSearchpath);
+                continue;
+            }
+
+            // Insert the sub dir into the queue so that it will be traversed later
+            if (FAILED(pqDirsToTraverse->Insert(pqDirsToTraverse, pszSubDir, sizeof pszSubDir)))
+            {
+                logwarn(L"Unable to add sub dir [%s] to traversal queue, cur dir: %s", findData.cFileName, pszFolderpath);
+                free(pszSubDir);
+                continue;
+            }
+            ++(pCurDirInfo->nDirs);
+            continue;
+        }
+
+        if (!TLayout::fKeepFolders && (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+        {
+            // Ignore directories when recursive mode is turned OFF
+            logdbg(L"Skipped adding dir: %s", findData.cFileName);
+            continue;
+        }
+
+        PFILEINFO pFileInfo;
+        if (!CreateFileInfo(szSearchpath, TLayout::fComputeHash, &pFileInfo))
+        {
+            // Treat as warning and move on.
+            logwarn(L"Unable to get file info for: %s", szSearchpath);
+            continue;
+        }
+
+        // Either this is a file or a directory but the folder must be considered as a file
+        // because recursion is not enabled and we want to enable comparison of some attributes of a folder.
+        if (TLayout::AddFile(pCurDirInfo, pFileInfo))
+        {
+            logdbg(L"Added: %s", findData.cFileName);
+        }
+
+    } while (FindNextFile(hFindFile, &findData));
+
+    if (GetLastError() != ERROR_NO_MORE_FILES)
+    {
+        logerr(L"Failed in enumerating files in directory: %s", pszFolderpath);
+        goto error_return;
+    }
+
+    FindClose(hFindFile);
+    return TRUE;
+
+error_return:
+    if (hFindFile != INVALID_HANDLE_VALUE)
+    {
+        FindClose(hFindFile);
+    }
+
+    // A sub folder that cannot be listed must not take the tree down with it
+    if (fCreatedDir && (*ppDirInfo != NULL))
+    {
+        TLayout::Destroy(*ppDirInfo);
+        *ppDirInfo = NULL;
+    }
+
+    return FALSE;
+}
+
+// Build a tree, breadth first. All files of the tree go into the one DIRINFO.
+template <class TLayout>
+BOOL WalkDirTree(_In_z_ PCWSTR pszRootpath, _Out_ PDIRINFO* ppRootDir)
+{
+    PCHL_QUEUE pqDirsToTraverse = NULL;
+    PDIRINFO pFirstDir = NULL;
+    PWSTR pszDirToTraverse;
+
+    if (FAILED(CHL_DsCreateQ(&pqDirsToTraverse, CHL_VT_POINTER, 20)))
+    {
+        logerr(L"Could not create queue for BFS. Rootpath: %s", pszRootpath);
+        goto error_return;
+    }
+
+    loginfo(L"Starting traversal for root dir: %s", pszRootpath);
+
+    // Init the first dir to traverse.
+    // ** IMP: pFirst must be NULL here so that a new object is created in callee
+    if (!WalkFilesInDir<TLayout>(pszRootpath, pqDirsToTraverse, &pFirstDir))
+    {
+        logerr(L"Could not build files in dir: %s", pszRootpath);
+        goto error_return;
+    }
+
+    while (SUCCEEDED(pqDirsToTraverse->Delete(pqDirsToTraverse, &pszDirToTraverse, NULL, FALSE)))
+    {
+        loginfo(L"Continuing traversal in dir: %s", pszDirToTraverse);
+        if (!WalkFilesInDir<TLayout>(pszDirToTraverse, pqDirsToTraverse, &pFirstDir))
+        {
+            logerr(L"Could not build files in dir: %s. Continuing...", pszDirToTraverse);
+        }
+        free(pszDirToTraverse);
+    }
+
+    pqDirsToTraverse->Destroy(pqDirsToTraverse);
+
+    *ppRootDir = pFirstDir;
+    return TRUE;
+
+error_return:
+    if (pqDirsToTraverse)
+    {
+        while (SUCCEEDED(pqDirsToTraverse->Delete(pqDirsToTraverse, &pszDirToTraverse, NULL, FALSE)))
+        {
+            free(pszDirToTraverse);
+        }
+        pqDirsToTraverse->Destroy(pqDirsToTraverse);
+    }
+    *ppRootDir = NULL;
+    return FALSE;
+}
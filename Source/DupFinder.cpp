@@ -0,0 +1,910 @@
+
+// ---------------------------------------------------
+// The FDiffDelete Project
+// Github: https://github.com/shishir993/fdiffdelete
+// Author: Shishir Bhat
+// The MIT License (MIT)
+// Copyright (c) 2014
+//
+
+#include "DupFinder.h"
+
+#define INIT_DUP_GROUPS     256
+
+// A file that may still have a duplicate. fHashed says whether hashing the file
+// succeeded in the current stage; files that couldn't be hashed sort last.
+typedef struct _DupCandidate
+{
+    PFILEINFO pFile;
+    int iRoot;
+    BOOL fHashed;
+    BYTE abPartialHash[HASHLEN_SHA1];
+
+} DUP_CANDIDATE, *PDUP_CANDIDATE;
+
+// A run of candidates of the same size, and the bytes it could free at most
+typedef struct _SizeRun
+{
+    int iStart;
+    int nRun;
+    LONGLONG llPotential;
+
+} SIZE_RUN, *PSIZE_RUN;
+
+// State of one search, passed down through the stages
+typedef struct _DupSearch
+{
+    PDUPGROUPS pGroups;
+    int nFileCapacity;
+    PDUPSEARCH_OPTIONS pOptions;
+
+} DUP_SEARCH, *PDUP_SEARCH;
+
+typedef int (__cdecl *PFN_CANDIDATE_CMP)(const void *pvLeft, const void *pvRight);
+
+static int __cdecl _CmpSize(const void *pvLeft, const void *pvRight);
+static int __cdecl _CmpPartialHash(const void *pvLeft, const void *pvRight);
+static int __cdecl _CmpFullHash(const void *pvLeft, const void *pvRight);
+static int __cdecl _CmpPath(const void *pvLeft, const void *pvRight);
+static int __cdecl _CmpNameSizeTime(const void *pvLeft, const void *pvRight);
+static int __cdecl _CmpMemberKey(const void *pvLeft, const void *pvRight);
+static int __cdecl _CmpWasted(const void *pvLeft, const void *pvRight);
+static int __cdecl _CmpPotential(const void *pvLeft, const void *pvRight);
+
+static int _RunEnd(_In_count_(nCandidates) PDUP_CANDIDATE aCandidates, _In_ int iStart, _In_ int nCandidates, _In_ PFN_CANDIDATE_CMP pfnCmp);
+
+static HRESULT _ProcessSizeRun(
+    _In_ PDUP_SEARCH pSearch,
+    _Inout_count_(nRun) PDUP_CANDIDATE aRun,
+    _In_ int nRun,
+    _In_ BOOL fHashesKnown);
+
+static HRESULT _EmitHashRuns(
+    _In_ PDUP_SEARCH pSearch,
+    _Inout_count_(nRun) PDUP_CANDIDATE aRun,
+    _In_ int nRun);
+
+static HRESULT _AddGroup(
+    _In_ PDUPGROUPS pGroups,
+    _In_count_(nRun) PDUP_CANDIDATE aRun,
+    _In_ int nRun,
+    _In_ BYTE bMatch,
+    _Inout_ int *pnFileCapacity);
+
+static HRESULT _PublishGroup(_In_ PDUP_SEARCH pSearch, _In_count_(nRun) PDUP_CANDIDATE aRun, _In_ int nRun);
+static int _KeepSameBytes(_Inout_count_(nRun) PDUP_CANDIDATE aRun, _In_ int nRun);
+
+static HRESULT _FinishDupGroups(_In_ PDUPGROUPS pGroups);
+
+HRESULT FindDupFilesInDir(_In_ PDIRINFO pDirInfo, _Out_ PDUPGROUPS *ppGroups)
+{
+    SB_ASSERT(pDirInfo);
+    return FindDupFilesInDirs(&pDirInfo, 1, NULL, ppGroups);
+}
+
+HRESULT FindDupFilesInDirs(
+    _In_count_(nDirs) PDIRINFO *apDirs,
+    _In_ int nDirs,
+    _In_opt_ PDUPSEARCH_OPTIONS pOptions,
+    _Out_ PDUPGROUPS *ppGroups)
+{
+    SB_ASSERT(apDirs);
+    SB_ASSERT((nDirs > 0) && (nDirs <= MAX_DUP_ROOTS));
+    SB_ASSERT(ppGroups);
+
+    HRESULT hr = S_OK;
+    PFILEINFO *apAll = NULL;
+    int nAll = 0;
+    int nMaxCandidates = 0;
+    PDUP_CANDIDATE aCandidates = NULL;
+    int nCandidates = 0;
+    PSIZE_RUN aRuns = NULL;
+    int nRuns = 0;
+    BOOL fStopped = FALSE;
+    DUP_SEARCH stSearch = {};
+
+    PDUPGROUPS pGroups = (PDUPGROUPS)malloc(sizeof(DUPGROUPS));
+    if (pGroups == NULL)
+    {
+        hr = E_OUTOFMEMORY;
+        goto error_return;
+    }
+    ZeroMemory(pGroups, sizeof(*pGroups));
+
+    stSearch.pGroups = pGroups;
+    stSearch.pOptions = pOptions;
+
+    // Hashes are computed only for the files that need them
+    BOOL fHashesKnown = TRUE;
+    for (int iDir = 0; iDir < nDirs; ++iDir)
+    {
+        fHashesKnown = fHashesKnown && apDirs[iDir]->fHashCompare;
+    }
+
+    if (!fHashesKnown)
+    {
+        hr = FileInfoInit(TRUE);
+        if (FAILED(hr))
+        {
+            logerr(L"Cannot initialize FileInfo for hashing, hr: %x", hr);
+            goto error_return;
+        }
+    }
+
+    for (int iDir = 0; iDir < nDirs; ++iDir)
+    {
+        hr = GetAllFilesInDir(apDirs[iDir], &apAll, &nAll);
+        if (FAILED(hr))
+        {
+            goto error_return;
+        }
+
+        if ((nCandidates + nAll) > nMaxCandidates)
+        {
+            int nNewMax = max(nCandidates + nAll, 1);
+            PDUP_CANDIDATE aNew = (PDUP_CANDIDATE)realloc(aCandidates, nNewMax * sizeof(DUP_CANDIDATE));
+            if (aNew == NULL)
+            {
+                hr = E_OUTOFMEMORY;
+                goto error_return;
+            }
+
+            aCandidates = aNew;
+            nMaxCandidates = nNewMax;
+        }
+
+        for (int i = 0; i < nAll; ++i)
+        {
+            if (apAll[i]->fIsDirectory || (apAll[i]->llFilesize.QuadPart == 0))
+            {
+                continue;
+            }
+
+            aCandidates[nCandidates].pFile = apAll[i];
+            aCandidates[nCandidates].iRoot = iDir;
+            aCandidates[nCandidates].fHashed = FALSE;
+            ++nCandidates;
+        }
+
+        free(apAll);
+        apAll = NULL;
+    }
+
+    loginfo(L"Finding duplicates among %d files in %d folders", nCandidates, nDirs);
+
+    // Stage 1: only runs of equal size go any further
+    qsort(aCandidates, nCandidates, sizeof(DUP_CANDIDATE), _CmpSize);
+
+    aRuns = (PSIZE_RUN)malloc(max(nCandidates / 2, 1) * sizeof(SIZE_RUN));
+    if (aRuns == NULL)
+    {
+        hr = E_OUTOFMEMORY;
+        goto error_return;
+    }
+
+    int iEnd;
+    for (int i = 0; i < nCandidates; i = iEnd)
+    {
+        iEnd = _RunEnd(aCandidates, i, nCandidates, _CmpSize);
+        if ((iEnd - i) >= 2)
+        {
+            aRuns[nRuns].iStart = i;
+            aRuns[nRuns].nRun = iEnd - i;
+            aRuns[nRuns].llPotential = aCandidates[i].pFile->llFilesize.QuadPart * (iEnd - i - 1);
+            ++nRuns;
+        }
+    }
+
+    // Largest possible wins are hashed first
+    qsort(aRuns, nRuns, sizeof(SIZE_RUN), _CmpPotential);
+
+    for (int iRun = 0; iRun < nRuns; ++iRun)
+    {
+        if ((pOptions != NULL) && (pOptions->plStop != NULL) && (*pOptions->plStop != 0))
+        {
+            loginfo(L"Duplicate search stopped with %d of %d size runs done", iRun, nRuns);
+            fStopped = TRUE;
+            break;
+        }
+
+        hr = _ProcessSizeRun(&stSearch, aCandidates + aRuns[iRun].iStart, aRuns[iRun].nRun, fHashesKnown);
+        if (FAILED(hr))
+        {
+            goto error_return;
+        }
+    }
+
+    free(aRuns);
+    aRuns = NULL;
+    free(aCandidates);
+    aCandidates = NULL;
+
+    hr = _FinishDupGroups(pGroups);
+    if (FAILED(hr))
+    {
+        goto error_return;
+    }
+
+    loginfo(L"Found %d duplicate groups, %lld bytes reclaimable", pGroups->nGroups, pGroups->llReclaimable);
+    *ppGroups = pGroups;
+    return fStopped ? S_FALSE : S_OK;
+
+error_return:
+    free(apAll);
+    free(aRuns);
+    free(aCandidates);
+    if (pGroups != NULL)
+    {
+        DestroyDupGroups(pGroups);
+    }
+
+    *ppGroups = NULL;
+    return hr;
+}
+
+HRESULT BuildDupGroupsFromMarks(_In_ PDIRINFO pLeftDir, _In_ PDIRINFO pRightDir, _Out_ PDUPGROUPS *ppGroups)
+{
+    SB_ASSERT(pLeftDir);
+    SB_ASSERT(pRightDir);
+    SB_ASSERT(ppGroups);
+
+    HRESULT hr = S_OK;
+    PDIRINFO apDirs[] = { pLeftDir, pRightDir };
+    PFILEINFO *apAll = NULL;
+    int nAll = 0;
+    PDUP_CANDIDATE aCandidates = NULL;
+    int nCandidates = 0;
+    int nFileCapacity = 0;
+
+    BOOL fCompareHashes = (pLeftDir->fHashCompare && pRightDir->fHashCompare);
+    PFN_CANDIDATE_CMP pfnCmp = fCompareHashes ? _CmpFullHash : _CmpNameSizeTime;
+
+    PDUPGROUPS pGroups = (PDUPGROUPS)malloc(sizeof(DUPGROUPS));
+    if (pGroups == NULL)
+    {
+        hr = E_OUTOFMEMORY;
+        goto error_return;
+    }
+    ZeroMemory(pGroups, sizeof(*pGroups));
+
+    for (int iDir = 0; iDir < ARRAYSIZE(apDirs); ++iDir)
+    {
+        hr = GetAllFilesInDir(apDirs[iDir], &apAll, &nAll);
+        if (FAILED(hr))
+        {
+            goto error_return;
+        }
+
+        PDUP_CANDIDATE aNew = (PDUP_CANDIDATE)realloc(aCandidates, max(nCandidates + nAll, 1) * sizeof(DUP_CANDIDATE));
+        if (aNew == NULL)
+        {
+            hr = E_OUTOFMEMORY;
+            goto error_return;
+        }
+        aCandidates = aNew;
+
+        for (int i = 0; i < nAll; ++i)
+        {
+            if (apAll[i]->fIsDirectory || !IsDuplicateFile(apAll[i]))
+            {
+                continue;
+            }
+
+            aCandidates[nCandidates].pFile = apAll[i];
+            aCandidates[nCandidates].iRoot = iDir;
+            aCandidates[nCandidates].fHashed = TRUE;
+            ++nCandidates;
+        }
+
+        free(apAll);
+        apAll = NULL;
+    }
+
+    qsort(aCandidates, nCandidates, sizeof(DUP_CANDIDATE), pfnCmp);
+
+    int iEnd;
+    for (int i = 0; i < nCandidates; i = iEnd)
+    {
+        iEnd = _RunEnd(aCandidates, i, nCandidates, pfnCmp);
+        if ((iEnd - i) < 2)
+        {
+            continue;
+        }
+
+        // Criteria every member matched its counterpart on
+        BYTE bMatch = 0xFF;
+        for (int j = i; j < iEnd; ++j)
+        {
+            bMatch &= GetDupInfo(aCandidates[j].pFile);
+        }
+
+        hr = _AddGroup(pGroups, aCandidates + i, iEnd - i, bMatch, &nFileCapacity);
+        if (FAILED(hr))
+        {
+            goto error_return;
+        }
+    }
+
+    free(aCandidates);
+    aCandidates = NULL;
+
+    hr = _FinishDupGroups(pGroups);
+    if (FAILED(hr))
+    {
+        goto error_return;
+    }
+
+    logdbg(L"%d duplicate groups from compare, %lld bytes reclaimable", pGroups->nGroups, pGroups->llReclaimable);
+    *ppGroups = pGroups;
+    return S_OK;
+
+error_return:
+    free(apAll);
+    free(aCandidates);
+    if (pGroups != NULL)
+    {
+        DestroyDupGroups(pGroups);
+    }
+
+    *ppGroups = NULL;
+    return hr;
+}
+
+void DestroyDupGroups(_In_ PDUPGROUPS pGroups)
+{
+    SB_ASSERT(pGroups);
+
+    free(pGroups->apFiles);
+    free(pGroups->abRoots);
+    free(pGroups->aGroups);
+    free(pGroups->aiByWasted);
+    free(pGroups->aMembers);
+    free(pGroups);
+}
+
+void UpdateDupGroupsOnDelete(_In_ PDUPGROUPS pGroups, _In_ PDELETE_CHANGES pChanges)
+{
+    SB_ASSERT(pGroups);
+    SB_ASSERT(pChanges);
+
+    for (int i = 0; i < pChanges->nDeleted; ++i)
+    {
+        DUPMEMBER stKey = {};
+        stKey.pszPath = pChanges->aDeleted[i].pszPath;
+        stKey.dwNameId = pChanges->aDeleted[i].dwNameId;
+
+        PDUPMEMBER pMember = (PDUPMEMBER)bsearch(&stKey, pGroups->aMembers, pGroups->nFiles, sizeof(DUPMEMBER), _CmpMemberKey);
+        if (pMember == NULL)
+        {
+            continue;
+        }
+
+        PDUPGROUP pGroup = &pGroups->aGroups[pMember->iGroup];
+        PFILEINFO *ppSlot = &pGroups->apFiles[pGroup->iFirst + pMember->iMember];
+        if (*ppSlot == NULL)
+        {
+            continue;
+        }
+
+        *ppSlot = NULL;
+        --(pGroup->nLive);
+
+        LONGLONG llWasted = (pGroup->nLive > 1) ? (pGroup->llFilesize * (pGroup->nLive - 1)) : 0;
+        pGroups->llReclaimable -= (pGroup->llWasted - llWasted);
+        pGroup->llWasted = llWasted;
+
+        // Wasted bytes only go down, so the group can only move towards the end
+        int iRank = pGroup->iRank;
+        while ((iRank + 1 < pGroups->nGroups)
+            && (pGroups->aGroups[pGroups->aiByWasted[iRank + 1]].llWasted > llWasted))
+        {
+            int iNext = pGroups->aiByWasted[iRank + 1];
+            pGroups->aiByWasted[iRank] = iNext;
+            pGroups->aGroups[iNext].iRank = iRank;
+            ++iRank;
+        }
+
+        pGroups->aiByWasted[iRank] = pMember->iGroup;
+        pGroup->iRank = iRank;
+    }
+}
+
+PDUPGROUP GetDupGroupByRank(_In_ PDUPGROUPS pGroups, _In_ int iRank)
+{
+    SB_ASSERT(pGroups);
+
+    if ((iRank < 0) || (iRank >= pGroups->nGroups))
+    {
+        return NULL;
+    }
+    return &pGroups->aGroups[pGroups->aiByWasted[iRank]];
+}
+
+// Mark every member of each group except the first as a duplicate.
+void MarkDupGroups(_In_ PDIRINFO pDirInfo, _In_ PDUPGROUPS pGroups)
+{
+    SB_ASSERT(pDirInfo);
+    SB_ASSERT(pGroups);
+
+    ClearFilesDupFlag(pDirInfo);
+
+    for (int iGroup = 0; iGroup < pGroups->nGroups; ++iGroup)
+    {
+        PDUPGROUP pGroup = &pGroups->aGroups[iGroup];
+        BOOL fKept = FALSE;
+
+        for (int i = 0; i < pGroup->nFiles; ++i)
+        {
+            PFILEINFO pFile = pGroups->apFiles[pGroup->iFirst + i];
+            if (pFile == NULL)
+            {
+                continue;
+            }
+
+            if (fKept)
+            {
+                SetDupInfo(pFile, pGroup->bMatch);
+            }
+            else
+            {
+                ClearDuplicateAttr(pFile);
+                fKept = TRUE;
+            }
+        }
+    }
+}
+
+// Text of the nTop groups that waste the most bytes, one line each, and the total.
+// Groups that do not fit in the text are left out.
+void FormatTopDupGroups(_In_ PDUPGROUPS pGroups, _In_ int nTop, _Out_writes_(cchText) PWSTR pszText, _In_ size_t cchText)
+{
+    SB_ASSERT(pGroups);
+    SB_ASSERT(pszText && (cchText > 0));
+
+    WCHAR szTotal[64];
+    StringCchPrintf(szTotal, ARRAYSIZE(szTotal), L"\n%d duplicate groups, %lld bytes reclaimable", pGroups->nGroups, pGroups->llReclaimable);
+    size_t cchTotal = wcslen(szTotal);
+
+    // Room is kept for the total after the groups
+    size_t cchUsed = 0;
+    pszText[0] = 0;
+    for (int iRank = 0; iRank < nTop; ++iRank)
+    {
+        PDUPGROUP pGroup = GetDupGroupByRank(pGroups, iRank);
+        if ((pGroup == NULL) || (pGroup->llWasted == 0))
+        {
+            break;
+        }
+
+        PFILEINFO pFile = NULL;
+        for (int i = 0; (pFile == NULL) && (i < pGroup->nFiles); ++i)
+        {
+            pFile = pGroups->apFiles[pGroup->iFirst + i];
+        }
+        SB_ASSERT(pFile);
+
+        WCHAR szLine[(MAX_PATH * 2) + 64];
+        if (FAILED(StringCchPrintf(szLine, ARRAYSIZE(szLine), L"%lld bytes wasted by %d files of %lld bytes: %s%s\n",
+            pGroup->llWasted, pGroup->nLive, pGroup->llFilesize, pFile->pszPath, pFile->pszFilename)))
+        {
+            continue;
+        }
+
+        size_t cchLine = wcslen(szLine);
+        if (cchUsed + cchLine + cchTotal >= cchText)
+        {
+            break;
+        }
+        CopyMemory(pszText + cchUsed, szLine, (cchLine + 1) * sizeof(WCHAR));
+        cchUsed += cchLine;
+    }
+
+    StringCchCopy(pszText + cchUsed, cchText - cchUsed, szTotal);
+}
+
+// Find and mark the duplicate files within the dir. The caller owns the returned groups.
+BOOL FindAndMarkDupFiles(_In_ PDIRINFO pDirInfo, _Out_ PDUPGROUPS *ppGroups)
+{
+    SB_ASSERT(ppGroups);
+
+    // Files are deleted based on these groups, so don't trust the hash alone
+    DUPSEARCH_OPTIONS stOptions = {};
+    stOptions.fVerifyBytes = TRUE;
+
+    PDUPGROUPS pGroups;
+    HRESULT hr = FindDupFilesInDirs(&pDirInfo, 1, &stOptions, &pGroups);
+    if (FAILED(hr))
+    {
+        logerr(L"Cannot find duplicate files in %s, hr: %x", pDirInfo->pszPath, hr);
+        *ppGroups = NULL;
+        return FALSE;
+    }
+
+    MarkDupGroups(pDirInfo, pGroups);
+    logdbg(L"%d duplicate groups in %s, %lld bytes reclaimable", pGroups->nGroups, pDirInfo->pszPath, pGroups->llReclaimable);
+    *ppGroups = pGroups;
+    return TRUE;
+}
+
+// Stages 2 and 3 for a run of files of the same size
+static HRESULT _ProcessSizeRun(
+    _In_ PDUP_SEARCH pSearch,
+    _Inout_count_(nRun) PDUP_CANDIDATE aRun,
+    _In_ int nRun,
+    _In_ BOOL fHashesKnown)
+{
+    if (fHashesKnown)
+    {
+        // A file that could not be hashed during the walk has no hash to group by
+        for (int i = 0; i < nRun; ++i)
+        {
+            aRun[i].fHashed = aRun[i].pFile->fHashValid;
+        }
+        return _EmitHashRuns(pSearch, aRun, nRun);
+    }
+
+    // Two files are read at most once each by a direct compare, and
+    // not even that far if they differ early
+    if (nRun == 2)
+    {
+        BOOL fEqual;
+        if (SUCCEEDED(CompareFileContents(aRun[0].pFile, aRun[1].pFile, &fEqual)) && fEqual)
+        {
+            return _PublishGroup(pSearch, aRun, nRun);
+        }
+        return S_OK;
+    }
+
+    // Stage 2: the first few KB tell most same-sized files apart
+    for (int i = 0; i < nRun; ++i)
+    {
+        aRun[i].fHashed = SUCCEEDED(HashFileContents(aRun[i].pFile, PARTIAL_HASH_BYTES, aRun[i].abPartialHash));
+    }
+
+    qsort(aRun, nRun, sizeof(DUP_CANDIDATE), _CmpPartialHash);
+
+    LONGLONG llFilesize = aRun[0].pFile->llFilesize.QuadPart;
+
+    HRESULT hr = S_OK;
+    int iEnd;
+    for (int i = 0; (i < nRun) && aRun[i].fHashed; i = iEnd)
+    {
+        iEnd = _RunEnd(aRun, i, nRun, _CmpPartialHash);
+        if ((iEnd - i) < 2)
+        {
+            continue;
+        }
+
+        // Stage 3: full hash. Not needed if the partial hash already covered the whole file,
+        // or if the file was hashed before.
+        for (int j = i; j < iEnd; ++j)
+        {
+            if (aRun[j].pFile->fHashValid)
+            {
+                continue;
+            }
+
+            if (llFilesize <= PARTIAL_HASH_BYTES)
+            {
+                memcpy(aRun[j].pFile->abHash, aRun[j].abPartialHash, HASHLEN_SHA1);
+                aRun[j].pFile->fHashValid = TRUE;
+            }
+            else
+            {
+                aRun[j].fHashed = SUCCEEDED(EnsureFileHash(aRun[j].pFile));
+            }
+        }
+
+        hr = _EmitHashRuns(pSearch, aRun + i, iEnd - i);
+        if (FAILED(hr))
+        {
+            break;
+        }
+    }
+    return hr;
+}
+
+// Sort by full hash and add each run of two or more files as a group
+static HRESULT _EmitHashRuns(
+    _In_ PDUP_SEARCH pSearch,
+    _Inout_count_(nRun) PDUP_CANDIDATE aRun,
+    _In_ int nRun)
+{
+    BOOL fVerifyBytes = (pSearch->pOptions != NULL) && pSearch->pOptions->fVerifyBytes;
+
+    qsort(aRun, nRun, sizeof(DUP_CANDIDATE), _CmpFullHash);
+
+    HRESULT hr = S_OK;
+    int iEnd;
+    for (int i = 0; (i < nRun) && aRun[i].fHashed; i = iEnd)
+    {
+        iEnd = _RunEnd(aRun, i, nRun, _CmpFullHash);
+
+        int nSame = iEnd - i;
+        if ((nSame >= 2) && fVerifyBytes)
+        {
+            nSame = _KeepSameBytes(aRun + i, nSame);
+        }
+
+        if (nSame >= 2)
+        {
+            hr = _PublishGroup(pSearch, aRun + i, nSame);
+            if (FAILED(hr))
+            {
+                break;
+            }
+        }
+    }
+    return hr;
+}
+
+// Add the group and tell the caller about it
+static HRESULT _PublishGroup(_In_ PDUP_SEARCH pSearch, _In_count_(nRun) PDUP_CANDIDATE aRun, _In_ int nRun)
+{
+    PDUPGROUPS pGroups = pSearch->pGroups;
+
+    HRESULT hr = _AddGroup(pGroups, aRun, nRun, FDUP_SIZE_MATCH | FDUP_HASH_MATCH, &pSearch->nFileCapacity);
+    if (SUCCEEDED(hr) && (pSearch->pOptions != NULL) && (pSearch->pOptions->pfnGroupFound != NULL))
+    {
+        pSearch->pOptions->pfnGroupFound(pGroups, &pGroups->aGroups[pGroups->nGroups - 1], pSearch->pOptions->pvContext);
+    }
+    return hr;
+}
+
+// Move the files whose bytes are the same as the first file's to the front of the
+// run and return how many there are. Others had a hash collision or changed since
+// they were hashed, and are left out of the group.
+static int _KeepSameBytes(_Inout_count_(nRun) PDUP_CANDIDATE aRun, _In_ int nRun)
+{
+    int nSame = 1;
+    for (int i = 1; i < nRun; ++i)
+    {
+        BOOL fEqual;
+        if (SUCCEEDED(CompareFileContents(aRun[0].pFile, aRun[i].pFile, &fEqual)) && fEqual)
+        {
+            DUP_CANDIDATE stTemp = aRun[nSame];
+            aRun[nSame] = aRun[i];
+            aRun[i] = stTemp;
+            ++nSame;
+        }
+        else
+        {
+            logwarn(L"Same hash but different contents: %s%s and %s%s",
+                aRun[0].pFile->pszPath, aRun[0].pFile->pszFilename, aRun[i].pFile->pszPath, aRun[i].pFile->pszFilename);
+        }
+    }
+    return nSame;
+}
+
+static HRESULT _AddGroup(
+    _In_ PDUPGROUPS pGroups,
+    _In_count_(nRun) PDUP_CANDIDATE aRun,
+    _In_ int nRun,
+    _In_ BYTE bMatch,
+    _Inout_ int *pnFileCapacity)
+{
+    if (pGroups->nGroups >= pGroups->nMaxGroups)
+    {
+        int nNewMax = (pGroups->nMaxGroups > 0) ? (pGroups->nMaxGroups * 2) : INIT_DUP_GROUPS;
+        PDUPGROUP aNew = (PDUPGROUP)realloc(pGroups->aGroups, nNewMax * sizeof(DUPGROUP));
+        if (aNew == NULL)
+        {
+            return E_OUTOFMEMORY;
+        }
+
+        pGroups->aGroups = aNew;
+        pGroups->nMaxGroups = nNewMax;
+    }
+
+    PDUPGROUP pGroup = &pGroups->aGroups[pGroups->nGroups];
+    pGroup->iFirst = pGroups->nFiles;
+    pGroup->nFiles = nRun;
+    pGroup->nLive = nRun;
+    pGroup->iRank = -1;
+    pGroup->llFilesize = aRun[0].pFile->llFilesize.QuadPart;
+    pGroup->llWasted = pGroup->llFilesize * (nRun - 1);
+    pGroup->dwRootMask = 0;
+    pGroup->bMatch = bMatch;
+
+    if ((pGroups->nFiles + nRun) > *pnFileCapacity)
+    {
+        int nNewCapacity = max(*pnFileCapacity * 2, pGroups->nFiles + nRun);
+        PFILEINFO *apNew = (PFILEINFO*)realloc(pGroups->apFiles, nNewCapacity * sizeof(PFILEINFO));
+        if (apNew == NULL)
+        {
+            return E_OUTOFMEMORY;
+        }
+        pGroups->apFiles = apNew;
+
+        PBYTE abNew = (PBYTE)realloc(pGroups->abRoots, nNewCapacity * sizeof(BYTE));
+        if (abNew == NULL)
+        {
+            return E_OUTOFMEMORY;
+        }
+        pGroups->abRoots = abNew;
+        *pnFileCapacity = nNewCapacity;
+    }
+
+    // Members in path order, so the file kept is predictable
+    qsort(aRun, nRun, sizeof(DUP_CANDIDATE), _CmpPath);
+
+    for (int i = 0; i < nRun; ++i)
+    {
+        pGroup->dwRootMask |= (1UL << aRun[i].iRoot);
+        pGroups->apFiles[pGroups->nFiles] = aRun[i].pFile;
+        pGroups->abRoots[pGroups->nFiles] = (BYTE)aRun[i].iRoot;
+        ++(pGroups->nFiles);
+    }
+
+    ++(pGroups->nGroups);
+    pGroups->llReclaimable += pGroup->llWasted;
+    return S_OK;
+}
+
+// Order the groups by wasted bytes and build the member lookup once all groups are added
+static HRESULT _FinishDupGroups(_In_ PDUPGROUPS pGroups)
+{
+    if (pGroups->nGroups == 0)
+    {
+        return S_OK;
+    }
+
+    pGroups->aMembers = (PDUPMEMBER)malloc(pGroups->nFiles * sizeof(DUPMEMBER));
+    pGroups->aiByWasted = (int*)malloc(pGroups->nGroups * sizeof(int));
+    if ((pGroups->aMembers == NULL) || (pGroups->aiByWasted == NULL))
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    // Groups only refer to their members by range, so they can be reordered freely.
+    // The order only changes on delete after this.
+    qsort(pGroups->aGroups, pGroups->nGroups, sizeof(DUPGROUP), _CmpWasted);
+
+    for (int iGroup = 0; iGroup < pGroups->nGroups; ++iGroup)
+    {
+        PDUPGROUP pGroup = &pGroups->aGroups[iGroup];
+        pGroup->iRank = iGroup;
+        pGroups->aiByWasted[iGroup] = iGroup;
+
+        for (int i = 0; i < pGroup->nFiles; ++i)
+        {
+            PDUPMEMBER pMember = &pGroups->aMembers[pGroup->iFirst + i];
+            pMember->pszPath = pGroups->apFiles[pGroup->iFirst + i]->pszPath;
+            pMember->dwNameId = pGroups->apFiles[pGroup->iFirst + i]->dwNameId;
+            pMember->iGroup = iGroup;
+            pMember->iMember = i;
+        }
+    }
+
+    qsort(pGroups->aMembers, pGroups->nFiles, sizeof(DUPMEMBER), _CmpMemberKey);
+    return S_OK;
+}
+
+static int _RunEnd(_In_count_(nCandidates) PDUP_CANDIDATE aCandidates, _In_ int iStart, _In_ int nCandidates, _In_ PFN_CANDIDATE_CMP pfnCmp)
+{
+    int iEnd = iStart + 1;
+    while ((iEnd < nCandidates) && (pfnCmp(&aCandidates[iStart], &aCandidates[iEnd]) == 0))
+    {
+        ++iEnd;
+    }
+    return iEnd;
+}
+
+static int __cdecl _CmpSize(const void *pvLeft, const void *pvRight)
+{
+    LONGLONG llLeft = ((PDUP_CANDIDATE)pvLeft)->pFile->llFilesize.QuadPart;
+    LONGLONG llRight = ((PDUP_CANDIDATE)pvRight)->pFile->llFilesize.QuadPart;
+    if (llLeft == llRight)
+    {
+        return 0;
+    }
+    return (llLeft < llRight) ? -1 : 1;
+}
+
+// Files that could not be hashed sort last and are never put in a group
+static int __cdecl _CmpPartialHash(const void *pvLeft, const void *pvRight)
+{
+    PDUP_CANDIDATE pLeft = (PDUP_CANDIDATE)pvLeft;
+    PDUP_CANDIDATE pRight = (PDUP_CANDIDATE)pvRight;
+    if (pLeft->fHashed != pRight->fHashed)
+    {
+        return (pLeft->fHashed ? -1 : 1);
+    }
+
+    if (!pLeft->fHashed)
+    {
+        return 0;
+    }
+    return memcmp(pLeft->abPartialHash, pRight->abPartialHash, HASHLEN_SHA1);
+}
+
+static int __cdecl _CmpFullHash(const void *pvLeft, const void *pvRight)
+{
+    PDUP_CANDIDATE pLeft = (PDUP_CANDIDATE)pvLeft;
+    PDUP_CANDIDATE pRight = (PDUP_CANDIDATE)pvRight;
+    if (pLeft->fHashed != pRight->fHashed)
+    {
+        return (pLeft->fHashed ? -1 : 1);
+    }
+
+    if (!pLeft->fHashed)
+    {
+        return 0;
+    }
+    return memcmp(pLeft->pFile->abHash, pRight->pFile->abHash, HASHLEN_SHA1);
+}
+
+static int __cdecl _CmpPath(const void *pvLeft, const void *pvRight)
+{
+    PFILEINFO pLeft = ((PDUP_CANDIDATE)pvLeft)->pFile;
+    PFILEINFO pRight = ((PDUP_CANDIDATE)pvRight)->pFile;
+
+    int cmp = CompareNames(pLeft->pszPath, pRight->pszPath);
+    if (cmp == 0)
+    {
+        cmp = CompareNames(pLeft->pszFilename, pRight->pszFilename);
+    }
+    return cmp;
+}
+
+static int __cdecl _CmpNameSizeTime(const void *pvLeft, const void *pvRight)
+{
+    PFILEINFO pLeft = ((PDUP_CANDIDATE)pvLeft)->pFile;
+    PFILEINFO pRight = ((PDUP_CANDIDATE)pvRight)->pFile;
+
+    int cmp = CompareNames(pLeft->pszFilename, pRight->pszFilename);
+    if (cmp != 0)
+    {
+        return cmp;
+    }
+
+    if (pLeft->llFilesize.QuadPart != pRight->llFilesize.QuadPart)
+    {
+        return (pLeft->llFilesize.QuadPart < pRight->llFilesize.QuadPart) ? -1 : 1;
+    }
+    if (GetModifiedTimeMs(pLeft) != GetModifiedTimeMs(pRight))
+    {
+        return (GetModifiedTimeMs(pLeft) < GetModifiedTimeMs(pRight)) ? -1 : 1;
+    }
+    return 0;
+}
+
+// Paths are in the name pool once per spelling, so they are compared by address
+static int __cdecl _CmpMemberKey(const void *pvLeft, const void *pvRight)
+{
+    PDUPMEMBER pLeft = (PDUPMEMBER)pvLeft;
+    PDUPMEMBER pRight = (PDUPMEMBER)pvRight;
+    if (pLeft->pszPath != pRight->pszPath)
+    {
+        return ((UINT_PTR)pLeft->pszPath < (UINT_PTR)pRight->pszPath) ? -1 : 1;
+    }
+    if (pLeft->dwNameId != pRight->dwNameId)
+    {
+        return (pLeft->dwNameId < pRight->dwNameId) ? -1 : 1;
+    }
+    return 0;
+}
+
+// Most wasted bytes first, ties in the order the groups were found
+static int __cdecl _CmpWasted(const void *pvLeft, const void *pvRight)
+{
+    PDUPGROUP pLeft = (PDUPGROUP)pvLeft;
+    PDUPGROUP pRight = (PDUPGROUP)pvRight;
+    if (pLeft->llWasted != pRight->llWasted)
+    {
+        return (pLeft->llWasted > pRight->llWasted) ? -1 : 1;
+    }
+    return pLeft->iFirst - pRight->iFirst;
+}
+
+// Most bytes that could be freed first
+static int __cdecl _CmpPotential(const void *pvLeft, const void *pvRight)
+{
+    PSIZE_RUN pLeft = (PSIZE_RUN)pvLeft;
+    PSIZE_RUN pRight = (PSIZE_RUN)pvRight;
+    if (pLeft->llPotential != pRight->llPotential)
+    {
+        return (pLeft->llPotential > pRight->llPotential) ? -1 : 1;
+    }
+    return pLeft->iStart - pRight->iStart;
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+// ---------------------------------------------------
+// The FDiffDelete Project
+// Github: https://github.com/shishir993/fdiffdelete
+// Author: Shishir Bhat
+// The MIT License (MIT)
+// Copyright (c) 2014
+//
+
+#include "Common.h"
+#include "FileInfo.h"
+#include "DirectoryWalker_Interface.h"
+
+// Duplicate finder within a single dir tree.
+// Files are narrowed down in stages, each stage only looking at the files that
+// are still candidates after the previous one:
+//  1. Group by file size. A file with a unique size cannot have a duplicate.
+//  2. Hash the first PARTIAL_HASH_BYTES of each file and group by that.
+//  3. Hash the whole file and group by the full hash.
+// A run of exactly two same-sized files skips the hashing and compares the two files
+// side by side instead, which reads each file at most once and stops at the first
+// difference. Hashing wins from three files up, as each file is then read only once
+// instead of once per pair.
+// Grouping is done by sorting arrays of small candidate entries, so memory use
+// stays proportional to the number of files and no hashtable is needed.
+// Empty files are not considered duplicates of each other.
+// Stage 1 needs only the metadata from the walk. The runs of equal size are then
+// hashed in order of the bytes they could reclaim, largest first, so the biggest
+// duplicates are confirmed early and a search that is stopped midway has already
+// found most of the reclaimable space.
+
+#define PARTIAL_HASH_BYTES      (4 * 1024)
+
+// Number of dir trees that can be searched together, one bit each in a root mask
+#define MAX_DUP_ROOTS           32
+
+// Number of groups shown by Options > Show Top Duplicates, largest wasters first
+#define TOP_DUP_GROUPS          20
+
+// A set of files with identical contents. Members are sorted by path.
+typedef struct _DupGroup
+{
+    // Range of the members in DUPGROUPS apFiles
+    int iFirst;
+    int nFiles;
+
+    // Members not deleted yet. A deleted member's apFiles entry is NULL.
+    int nLive;
+
+    // Position of this group in DUPGROUPS aiByWasted
+    int iRank;
+
+    // Size of each member
+    LONGLONG llFilesize;
+
+    // Bytes freed by keeping only one of the live members
+    LONGLONG llWasted;
+
+    // Bit i is set if the group has a file under root i
+    DWORD dwRootMask;
+
+    // FDUP_* criteria all members matched on
+    BYTE bMatch;
+
+} DUPGROUP, *PDUPGROUP;
+
+// Lookup entry from a member file to its group. The file is known by its folder
+// and name id, as a deleted file is (see DELETED_FILE).
+typedef struct _DupMember
+{
+    PCWSTR pszPath;
+    DWORD dwNameId;
+    int iGroup;
+    int iMember;
+
+} DUPMEMBER, *PDUPMEMBER;
+
+typedef struct _DupGroups DUPGROUPS, *PDUPGROUPS;
+
+// Called as soon as a group is confirmed. pGroup is only valid during the call.
+typedef void (*PFN_DUPGROUP_FOUND)(_In_ PDUPGROUPS pGroups, _In_ PDUPGROUP pGroup, _In_opt_ PVOID pvContext);
+
+typedef struct _DupSearchOptions
+{
+    // Optional, to publish the groups while the search is still running
+    PFN_DUPGROUP_FOUND pfnGroupFound;
+    PVOID pvContext;
+
+    // Optional, the search stops before hashing the next run of files once this is non-zero
+    volatile LONG *plStop;
+
+    // Compare the bytes of files whose hashes match before grouping them
+    BOOL fVerifyBytes;
+
+} DUPSEARCH_OPTIONS, *PDUPSEARCH_OPTIONS;
+
+struct _DupGroups
+{
+    // Members of all groups, group after group
+    int nFiles;
+    PFILEINFO *apFiles;
+
+    // Index of the root each member was found under, parallel to apFiles
+    PBYTE abRoots;
+
+    // Groups in order of wasted bytes at the time they were found
+    int nGroups;
+    int nMaxGroups;
+    PDUPGROUP aGroups;
+
+    // Group indexes, largest llWasted first
+    int *aiByWasted;
+
+    // One entry per member, sorted by FILEINFO pointer
+    PDUPMEMBER aMembers;
+
+    // Bytes freed by keeping only one file of each group
+    LONGLONG llReclaimable;
+
+};
+
+// Find all groups of duplicate files within the dir. If the dir was built with hash
+// compare, the file hashes are already known and only the size stage is needed.
+HRESULT FindDupFilesInDir(_In_ PDIRINFO pDirInfo, _Out_ PDUPGROUPS *ppGroups);
+
+// Same as FindDupFilesInDir() but across all the specified dirs at once. The files
+// of all dirs go through a single pass of the stages, so the cost grows with the
+// total number of files and not with the number of pairs of dirs.
+// Returns S_FALSE with the groups found so far if the search was stopped.
+HRESULT FindDupFilesInDirs(
+    _In_count_(nDirs) PDIRINFO *apDirs,
+    _In_ int nDirs,
+    _In_opt_ PDUPSEARCH_OPTIONS pOptions,
+    _Out_ PDUPGROUPS *ppGroups);
+
+// Build the groups from the duplicate flags set by CompareDirsAndMarkFiles(). Files
+// are grouped by hash if both dirs were built with hash compare, else by name, size
+// and modified time, which is what a non-hash duplicate matched on.
+HRESULT BuildDupGroupsFromMarks(_In_ PDIRINFO pLeftDir, _In_ PDIRINFO pRightDir, _Out_ PDUPGROUPS *ppGroups);
+
+void DestroyDupGroups(_In_ PDUPGROUPS pGroups);
+
+// Take the deleted files out of their groups and update the wasted bytes
+// and the group order. Cost is proportional to the number of files deleted
+// and how far each group moves in the order.
+void UpdateDupGroupsOnDelete(_In_ PDUPGROUPS pGroups, _In_ PDELETE_CHANGES pChanges);
+
+// The group that wastes the iRank-th most bytes, NULL if there are fewer groups
+PDUPGROUP GetDupGroupByRank(_In_ PDUPGROUPS pGroups, _In_ int iRank);
+
+// Mark every member of each group except the first as a duplicate, so that
+// DeleteDupFilesInDir() keeps exactly one file of each group.
+void MarkDupGroups(_In_ PDIRINFO pDirInfo, _In_ PDUPGROUPS pGroups);
+
+// Text of the nTop groups that waste the most bytes, one line each, and the total.
+// Groups that do not fit in the text are left out.
+void FormatTopDupGroups(_In_ PDUPGROUPS pGroups, _In_ int nTop, _Out_writes_(cchText) PWSTR pszText, _In_ size_t cchText);
+
+// Find and mark the duplicate files within the dir. The caller owns the returned groups.
+BOOL FindAndMarkDupFiles(_In_ PDIRINFO pDirInfo, _Out_ PDUPGROUPS *ppGroups);
@@ -0,0 +1,185 @@
+
+// ---------------------------------------------------
+// The FDiffDelete Project
+// Github: https://github.com/shishir993/fdiffdelete
+// Author: Shishir Bhat
+// The MIT License (MIT)
+// Copyright (c) 2014
+//
+
+#include "FileColumns.h"
+
+// Flags that a pair can get, by (left is dir | right is dir << 1). Two folders
+// match only by name, a file and a folder do not match at all.
+static const BYTE g_abPairMask[4] = { 0xFF, FDUP_NO_MATCH, FDUP_NO_MATCH, FDUP_NAME_MATCH };
+
+// Flags of the files that a pair keeps, by the same index. A file and a folder
+// lose all their flags, otherwise the tree match stays.
+static const BYTE g_abKeepMask[4] = { FDUP_TREE_MATCH, FDUP_NO_MATCH, FDUP_NO_MATCH, FDUP_TREE_MATCH };
+
+// All pairs in one loop without a branch per value. Whether hashes are compared
+// is a template argument, so that it is decided once, not once per pair.
+template <BOOL fCompareHashes>
+static void _ComparePairs(
+    _In_ PFILE_COLUMNS pLeft,
+    _In_ PFILE_COLUMNS pRight,
+    _In_count_(nPairs) const FILE_PAIR *aPairs,
+    _In_ int nPairs)
+{
+    for (int i = 0; i < nPairs; ++i)
+    {
+        int iLeft = aPairs[i].iLeft;
+        int iRight = aPairs[i].iRight;
+
+        BYTE bDupInfo = (BYTE)
+            (((pLeft->adwNameId[iLeft] == pRight->adwNameId[iRight]) ? FDUP_NAME_MATCH : 0)
+            | ((pLeft->allSize[iLeft] == pRight->allSize[iRight]) ? FDUP_SIZE_MATCH : 0)
+            | ((pLeft->aullModified[iLeft] == pRight->aullModified[iRight]) ? FDUP_DATE_MATCH : 0));
+
+        if (fCompareHashes)
+        {
+            bDupInfo |= (memcmp(pLeft->aabHash[iLeft], pRight->aabHash[iRight], HASHLEN_SHA1) == 0) ? FDUP_HASH_MATCH : 0;
+        }
+
+        int iMask = pLeft->abIsDir[iLeft] | (pRight->abIsDir[iRight] << 1);
+        bDupInfo &= g_abPairMask[iMask];
+
+        pLeft->abDupInfo[iLeft] = (pLeft->abDupInfo[iLeft] & g_abKeepMask[iMask]) | bDupInfo;
+        pRight->abDupInfo[iRight] = (pRight->abDupInfo[iRight] & g_abKeepMask[iMask]) | bDupInfo;
+    }
+}
+
+// Write the flags that the compare changed to the files
+static void _WriteBackDupInfo(_In_ PFILE_COLUMNS pColumns)
+{
+    for (int i = 0; i < pColumns->nRows; ++i)
+    {
+        if (pColumns->abDupInfo[i] != pColumns->abOldDupInfo[i])
+        {
+            SetDupInfo(pColumns->apFiles[i], pColumns->abDupInfo[i]);
+        }
+    }
+}
+
+HRESULT CreateFileColumns(_In_ int nMaxRows, _Out_ PFILE_COLUMNS pColumns)
+{
+    SB_ASSERT(pColumns);
+    SB_ASSERT(nMaxRows >= 0);
+
+    ZeroMemory(pColumns, sizeof(*pColumns));
+
+    // One block for all the columns, 8-byte columns first to keep them aligned.
+    // Only the rows that are added are ever written.
+    SIZE_T cbPerRow = sizeof(LONGLONG) + sizeof(UINT64) + sizeof(PFILEINFO) + sizeof(DWORD)
+        + HASHLEN_SHA1 + (3 * sizeof(BYTE));
+    PBYTE pbBlock = (PBYTE)malloc(max(nMaxRows, 1) * cbPerRow);
+    if (pbBlock == NULL)
+    {
+        logerr(L"Out of memory for compare columns of %d files", nMaxRows);
+        return E_OUTOFMEMORY;
+    }
+
+    pColumns->nMaxRows = nMaxRows;
+    pColumns->allSize = (LONGLONG*)pbBlock;
+    pColumns->aullModified = (UINT64*)(pColumns->allSize + nMaxRows);
+    pColumns->apFiles = (PFILEINFO*)(pColumns->aullModified + nMaxRows);
+    pColumns->adwNameId = (DWORD*)(pColumns->apFiles + nMaxRows);
+    pColumns->aabHash = (BYTE(*)[HASHLEN_SHA1])(pColumns->adwNameId + nMaxRows);
+    pColumns->abIsDir = (PBYTE)(pColumns->aabHash + nMaxRows);
+    pColumns->abDupInfo = pColumns->abIsDir + nMaxRows;
+    pColumns->abOldDupInfo = pColumns->abDupInfo + nMaxRows;
+    return S_OK;
+}
+
+void DestroyFileColumns(_In_ PFILE_COLUMNS pColumns)
+{
+    SB_ASSERT(pColumns);
+
+    // The other columns are in the same block
+    free(pColumns->allSize);
+    ZeroMemory(pColumns, sizeof(*pColumns));
+}
+
+HRESULT AddFileColumnRows(
+    _Inout_ PFILE_COLUMNS pColumns,
+    _In_count_(nFiles) PFILEINFO *apFiles,
+    _In_ int nFiles,
+    _Out_ int *piFirstRow)
+{
+    SB_ASSERT(pColumns && apFiles && piFirstRow);
+
+    *piFirstRow = pColumns->nRows;
+    if (nFiles > pColumns->nMaxRows - pColumns->nRows)
+    {
+        logerr(L"No room for %d more compare rows, %d of %d used", nFiles, pColumns->nRows, pColumns->nMaxRows);
+        return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+    }
+
+    for (int i = 0, iRow = pColumns->nRows; i < nFiles; ++i, ++iRow)
+    {
+        PFILEINFO pFile = apFiles[i];
+
+        pColumns->apFiles[iRow] = pFile;
+        pColumns->adwNameId[iRow] = pFile->dwNameId;
+        pColumns->allSize[iRow] = pFile->llFilesize.QuadPart;
+        pColumns->aullModified[iRow] = GetModifiedTimeMs(pFile);
+        CopyMemory(pColumns->aabHash[iRow], pFile->abHash, HASHLEN_SHA1);
+        pColumns->abIsDir[iRow] = pFile->fIsDirectory ? 1 : 0;
+        pColumns->abDupInfo[iRow] = GetDupInfo(pFile);
+        pColumns->abOldDupInfo[iRow] = pColumns->abDupInfo[iRow];
+    }
+
+    pColumns->nRows += nFiles;
+    return S_OK;
+}
+
+HRESULT AddFilePair(_Inout_ PFILE_PAIRS pPairs, _In_ int iLeft, _In_ int iRight)
+{
+    if (pPairs->nPairs >= pPairs->nCapacity)
+    {
+        int nNewCapacity = (pPairs->nCapacity > 0) ? (pPairs->nCapacity * 2) : 256;
+        PFILE_PAIR aNew = (PFILE_PAIR)realloc(pPairs->aPairs, nNewCapacity * sizeof(FILE_PAIR));
+        if (aNew == NULL)
+        {
+            logerr(L"Out of memory growing pair array to %d entries", nNewCapacity);
+            return E_OUTOFMEMORY;
+        }
+
+        pPairs->aPairs = aNew;
+        pPairs->nCapacity = nNewCapacity;
+    }
+
+    pPairs->aPairs[pPairs->nPairs].iLeft = iLeft;
+    pPairs->aPairs[pPairs->nPairs].iRight = iRight;
+    ++(pPairs->nPairs);
+    return S_OK;
+}
+
+void DestroyFilePairs(_In_ PFILE_PAIRS pPairs)
+{
+    SB_ASSERT(pPairs);
+
+    free(pPairs->aPairs);
+    ZeroMemory(pPairs, sizeof(*pPairs));
+}
+
+void CompareAndMarkFilePairs(
+    _In_ PFILE_COLUMNS pLeft,
+    _In_ PFILE_COLUMNS pRight,
+    _In_ PFILE_PAIRS pPairs,
+    _In_ BOOL fCompareHashes)
+{
+    SB_ASSERT(pLeft && pRight && pPairs);
+
+    if (fCompareHashes)
+    {
+        _ComparePairs<TRUE>(pLeft, pRight, pPairs->aPairs, pPairs->nPairs);
+    }
+    else
+    {
+        _ComparePairs<FALSE>(pLeft, pRight, pPairs->aPairs, pPairs->nPairs);
+    }
+
+    _WriteBackDupInfo(pLeft);
+    _WriteBackDupInfo(pRight);
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+// ---------------------------------------------------
+// The FDiffDelete Project
+// Github: https://github.com/shishir993/fdiffdelete
+// Author: Shishir Bhat
+// The MIT License (MIT)
+// Copyright (c) 2014
+//
+
+#include "Common.h"
+#include "FileInfo.h"
+
+// Batched compare of file pairs.
+// CompareFileInfoAndMark() reads each pair out of two FILEINFOs and writes the
+// flags of both files right away.
+// Instead, the few values that the compare needs are copied into arrays (one per
+// value, a row per file), only for the files that have a file to compare with on
+// the other side. The pairs to compare are collected first and then all of them
+// are compared in one tight loop that reads and writes only the arrays:
+//  - names by their ids, see NameIntern.h
+//  - sizes
+//  - modified times in milliseconds, see GetModifiedTimeMs()
+//  - file hashes
+//  - whether the file is a folder
+//  - the duplicate flags
+// The flags are updated in pair order, so the result is the same as calling
+// CompareFileInfoAndMark() for each pair in that order. Only the files whose flags
+// changed are written back to their FILEINFOs.
+
+// Compare values of the files of a side
+typedef struct _FileColumns
+{
+    int nRows;
+    int nMaxRows;
+
+    LONGLONG *allSize;
+    UINT64 *aullModified;
+
+    // Not owned, the file of each row
+    PFILEINFO *apFiles;
+
+    DWORD *adwNameId;
+    BYTE (*aabHash)[HASHLEN_SHA1];
+    BYTE *abIsDir;
+
+    // Flags of the file as the compare goes, and as they were before it
+    BYTE *abDupInfo;
+    BYTE *abOldDupInfo;
+
+} FILE_COLUMNS, *PFILE_COLUMNS;
+
+// Rows of a left file and a right file to be compared
+typedef struct _FilePair
+{
+    int iLeft;
+    int iRight;
+
+} FILE_PAIR, *PFILE_PAIR;
+
+typedef struct _FilePairs
+{
+    int nPairs;
+    int nCapacity;
+    PFILE_PAIR aPairs;
+
+} FILE_PAIRS, *PFILE_PAIRS;
+
+HRESULT CreateFileColumns(_In_ int nMaxRows, _Out_ PFILE_COLUMNS pColumns);
+void DestroyFileColumns(_In_ PFILE_COLUMNS pColumns);
+
+// Copy the values of the files into the next rows, the first of which is *piFirstRow
+HRESULT AddFileColumnRows(
+    _Inout_ PFILE_COLUMNS pColumns,
+    _In_count_(nFiles) PFILEINFO *apFiles,
+    _In_ int nFiles,
+    _Out_ int *piFirstRow);
+
+HRESULT AddFilePair(_Inout_ PFILE_PAIRS pPairs, _In_ int iLeft, _In_ int iRight);
+void DestroyFilePairs(_In_ PFILE_PAIRS pPairs);
+
+// Compare all the pairs and set the duplicate flags of both files of each pair
+void CompareAndMarkFilePairs(
+    _In_ PFILE_COLUMNS pLeft,
+    _In_ PFILE_COLUMNS pRight,
+    _In_ PFILE_PAIRS pPairs,
+    _In_ BOOL fCompareHashes);
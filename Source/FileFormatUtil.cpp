@@ -0,0 +1,100 @@
+
+// ---------------------------------------------------
+// The FDiffDelete Project
+// Github: https://github.com/shishir993/fdiffdelete
+// Author: Shishir Bhat
+// The MIT License (MIT)
+// Copyright (c) 2014
+//
+
+#include "FileFormatUtil.h"
+
+// Both overloads, with the largest capacity of their count type
+static HRESULT _GrowArray(
+    _Inout_ void **ppvArray,
+    _In_ UINT64 nMax,
+    _In_ UINT64 nNeeded,
+    _In_ UINT64 nInitial,
+    _In_ UINT64 nLimit,
+    _In_ SIZE_T cbEntry,
+    _Out_ UINT64 *pnNewMax)
+{
+    *pnNewMax = nMax;
+    if (nNeeded <= nMax)
+    {
+        return S_OK;
+    }
+
+    UINT64 nNewMax = max(max(nMax, nInitial), 1);
+    while (nNewMax < nNeeded)
+    {
+        if (nNewMax >= nLimit / 2)
+        {
+            return E_OUTOFMEMORY;
+        }
+        nNewMax *= 2;
+    }
+
+    if (nNewMax > ((SIZE_T)-1) / cbEntry)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    void *pvNew = realloc(*ppvArray, (SIZE_T)nNewMax * cbEntry);
+    if (pvNew == NULL)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    *ppvArray = pvNew;
+    *pnNewMax = nNewMax;
+    return S_OK;
+}
+
+HRESULT GrowArray(_Inout_ void **ppvArray, _Inout_ DWORD *pnMax, _In_ DWORD nNeeded, _In_ DWORD nInitial, _In_ SIZE_T cbEntry)
+{
+    UINT64 nNewMax;
+    HRESULT hr = _GrowArray(ppvArray, *pnMax, nNeeded, nInitial, MAXDWORD, cbEntry, &nNewMax);
+    *pnMax = (DWORD)nNewMax;
+    return hr;
+}
+
+HRESULT GrowArray(_Inout_ void **ppvArray, _Inout_ int *pnMax, _In_ int nNeeded, _In_ int nInitial, _In_ SIZE_T cbEntry)
+{
+    SB_ASSERT((*pnMax >= 0) && (nNeeded >= 0) && (nInitial >= 0));
+
+    UINT64 nNewMax;
+    HRESULT hr = _GrowArray(ppvArray, (UINT64)*pnMax, (UINT64)nNeeded, (UINT64)nInitial, MAXINT, cbEntry, &nNewMax);
+    *pnMax = (int)nNewMax;
+    return hr;
+}
+
+HRESULT WriteAllToFile(_In_ HANDLE hFile, _In_bytecount_(cbData) const void *pvData, _In_ UINT64 cbData)
+{
+    const BYTE *pb = (const BYTE*)pvData;
+    while (cbData > 0)
+    {
+        DWORD cbChunk = (DWORD)min(cbData, FILE_IO_CHUNK_BYTES);
+        DWORD cbWritten;
+        if (!WriteFile(hFile, pb, cbChunk, &cbWritten, NULL))
+        {
+            return HRESULT_FROM_WIN32(GetLastError());
+        }
+        if (cbWritten != cbChunk)
+        {
+            return HRESULT_FROM_WIN32(ERROR_WRITE_FAULT);
+        }
+
+        pb += cbChunk;
+        cbData -= cbChunk;
+    }
+    return S_OK;
+}
+
+BOOL IsSectionInFile(_In_ UINT64 ullOffset, _In_ DWORD nEntries, _In_ SIZE_T cbEntry, _In_ UINT64 cbHeader, _In_ UINT64 cbFile)
+{
+    return ((ullOffset % 8) == 0)
+        && (ullOffset >= cbHeader)
+        && (ullOffset <= cbFile)
+        && ((UINT64)nEntries * cbEntry <= cbFile - ullOffset);
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+// ---------------------------------------------------
+// The FDiffDelete Project
+// Github: https://github.com/shishir993/fdiffdelete
+// Author: Shishir Bhat
+// The MIT License (MIT)
+// Copyright (c) 2014
+//
+
+#include "Common.h"
+
+// Helpers shared by the files this program writes and maps: snapshots, shards,
+// the catalog and the runs of the out of core compare.
+
+// Largest single write of WriteAllToFile()
+#define FILE_IO_CHUNK_BYTES     (16 * 1024 * 1024)
+
+// Make a heap array of cbEntry byte entries hold at least nNeeded entries. The
+// capacity *pnMax starts at nInitial and doubles. The array is left as it was if
+// it cannot grow.
+HRESULT GrowArray(_Inout_ void **ppvArray, _Inout_ DWORD *pnMax, _In_ DWORD nNeeded, _In_ DWORD nInitial, _In_ SIZE_T cbEntry);
+HRESULT GrowArray(_Inout_ void **ppvArray, _Inout_ int *pnMax, _In_ int nNeeded, _In_ int nInitial, _In_ SIZE_T cbEntry);
+
+// Write all the bytes, in chunks since WriteFile() takes at most a DWORD of bytes
+HRESULT WriteAllToFile(_In_ HANDLE hFile, _In_bytecount_(cbData) const void *pvData, _In_ UINT64 cbData);
+
+// Is a section of nEntries entries of cbEntry bytes inside the file, 8-byte aligned
+// and after the cbHeader bytes of the file's header?
+BOOL IsSectionInFile(_In_ UINT64 ullOffset, _In_ DWORD nEntries, _In_ SIZE_T cbEntry, _In_ UINT64 cbHeader, _In_ UINT64 cbFile);
@@ -9,8 +9,16 @@
 
 #include "FileInfo.h"
 
+static_assert(offsetof(FILEINFO, pszFilename) <= FILEINFO_HOT_BYTES, "Values read by every pass come first");
+
 static HCRYPTPROV g_hCrypt = NULL;
 
+static HRESULT _OpenFileForRead(_In_ PFILEINFO pFileInfo, _Out_ HANDLE *phFile);
+static HRESULT _OpenPathForRead(_In_z_ PCWSTR pszFilepath, _Out_ HANDLE *phFile);
+
+// FILEINFOs are created zeroed, so epoch 0 is never current
+DWORD g_dwDupEpoch = 1;
+
 HRESULT FileInfoInit(_In_ BOOL fComputeHash)
 {
     HRESULT hr = S_OK;
@@ -28,6 +36,17 @@ void FileInfoDestroy()
         HashFactoryDestroy(g_hCrypt);
         g_hCrypt = NULL;
     }
+
+    // The names of all FILEINFOs, which must all be freed by now
+    NameInternDestroy();
+}
+
+void NewDupEpoch()
+{
+    if (++g_dwDupEpoch == 0)
+    {
+        g_dwDupEpoch = 1;
+    }
 }
 
 // Populate file info for the specified file in the caller specified memory location
@@ -44,11 +63,22 @@ BOOL CreateFileInfo(_In_ PCWSTR pszFullpathToFile, _In_ BOOL fComputeHash, _In_
     for (const WCHAR* pch = pszFullpathToFile; pch != pszFilename; ++pch, ++nCharsInRoot)
         ;
 
-    // Copy folder path first (we've calculate the length to copy)
-    wcsncpy_s(pFileInfo->szPath, ARRAYSIZE(pFileInfo->szPath), pszFullpathToFile, nCharsInRoot);
+    // The folder path is shared with all files of the same folder
+    WCHAR szFolder[MAX_PATH];
+    wcsncpy_s(szFolder, ARRAYSIZE(szFolder), pszFullpathToFile, nCharsInRoot);
+    if (FAILED(InternPath(szFolder, &pFileInfo->pszPath)))
+    {
+        logerr(L"Unable to add folder of file: %s", pszFullpathToFile);
+        pFileInfo->pszPath = L"";
+        goto error_return;
+    }
 
-    // Now copy the filename
-    wcscpy_s(pFileInfo->szFilename, ARRAYSIZE(pFileInfo->szFilename), pszFilename);
+    // The filename is shared with all files of the same name
+    if (FAILED(InternName(pszFilename, &pFileInfo->pszFilename, &pFileInfo->dwNameId)))
+    {
+        logerr(L"Unable to add name of file: %s", pszFullpathToFile);
+        goto error_return;
+    }
 
     // Check if file is a directory
     // TODO: To extend this limit to 32,767 wide characters, 
@@ -60,14 +90,10 @@ BOOL CreateFileInfo(_In_ PCWSTR pszFullpathToFile, _In_ BOOL fComputeHash, _In_
         goto error_return;
     }
 
-    // Store FILETIME in fileinfo for easy comparison in sorting the listview rows
+    // Store FILETIME in fileinfo for easy comparison in sorting the listview rows.
+    // The local time is computed only when shown, see GetModifiedLocalTime().
     CopyMemory(&pFileInfo->ftModifiedTime, &fileAttr.ftLastWriteTime, sizeof(pFileInfo->ftModifiedTime));
 
-    // Convert filetime to localtime and store in fileinfo
-    SYSTEMTIME stUTC;
-    FileTimeToSystemTime(&pFileInfo->ftModifiedTime, &stUTC);
-    SystemTimeToTzSpecificLocalTime(NULL, &stUTC, &pFileInfo->stModifiedTime);
-
     if (fileAttr.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
     {
         pFileInfo->fIsDirectory = TRUE;
@@ -94,6 +120,7 @@ BOOL CreateFileInfo(_In_ PCWSTR pszFullpathToFile, _In_ BOOL fComputeHash, _In_
                 logerr(L"Failed to compute hash (0x%08x) for file: %s", hr, pszFullpathToFile);
                 goto error_return;
             }
+            pFileInfo->fHashValid = TRUE;
         }
     }
 
@@ -135,6 +162,166 @@ error_return:
     return FALSE;
 }
 
+// Hash the contents of a file whose file info was created without the hash. If cbMax is
+// non-zero, only the first cbMax bytes are hashed.
+HRESULT HashFileContents(_In_ PFILEINFO pFileInfo, _In_ DWORD cbMax, _Out_bytecap_c_(HASHLEN_SHA1) PBYTE pbHash)
+{
+    SB_ASSERT(pFileInfo);
+    SB_ASSERT(g_hCrypt != NULL);
+
+    HANDLE hFile;
+    HRESULT hr = _OpenFileForRead(pFileInfo, &hFile);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    hr = (cbMax > 0) ? CalculatePartialSHA1(g_hCrypt, hFile, cbMax, pbHash) : CalculateSHA1(g_hCrypt, hFile, pbHash);
+    CloseHandle(hFile);
+    if (FAILED(hr))
+    {
+        logerr(L"Failed to compute hash (0x%08x) for file: %s%s", hr, pFileInfo->pszPath, pFileInfo->pszFilename);
+    }
+    return hr;
+}
+
+// Hash the whole file into abHash unless fHashValid says it already is
+HRESULT EnsureFileHash(_In_ PFILEINFO pFileInfo)
+{
+    SB_ASSERT(pFileInfo);
+
+    if (pFileInfo->fHashValid || pFileInfo->fIsDirectory)
+    {
+        return S_OK;
+    }
+
+    HRESULT hr = HashFileContents(pFileInfo, 0, pFileInfo->abHash);
+    if (SUCCEEDED(hr))
+    {
+        pFileInfo->fHashValid = TRUE;
+    }
+    return hr;
+}
+
+// Byte by byte compare of the contents of two files, reading both side by side in
+// COMPARE_CHUNK_BYTES chunks and stopping at the first chunk that differs.
+HRESULT CompareFileContents(_In_ PFILEINFO pLeftFile, _In_ PFILEINFO pRightFile, _Out_ BOOL *pfEqual)
+{
+    SB_ASSERT(pLeftFile);
+    SB_ASSERT(pRightFile);
+    SB_ASSERT(pfEqual);
+
+    HRESULT hr;
+    WCHAR szLeftFile[MAX_PATH];
+    WCHAR szRightFile[MAX_PATH];
+
+    *pfEqual = FALSE;
+    if (pLeftFile->llFilesize.QuadPart != pRightFile->llFilesize.QuadPart)
+    {
+        return S_OK;
+    }
+
+    hr = PathCchCombine(szLeftFile, ARRAYSIZE(szLeftFile), pLeftFile->pszPath, pLeftFile->pszFilename);
+    if (SUCCEEDED(hr))
+    {
+        hr = PathCchCombine(szRightFile, ARRAYSIZE(szRightFile), pRightFile->pszPath, pRightFile->pszFilename);
+    }
+
+    if (FAILED(hr))
+    {
+        logerr(L"PathCchCombine() failed for %s or %s", pLeftFile->pszFilename, pRightFile->pszFilename);
+        return hr;
+    }
+
+    return CompareFileContentsByPath(szLeftFile, szRightFile, pfEqual);
+}
+
+HRESULT CompareFileContentsByPath(_In_z_ PCWSTR pszLeftFile, _In_z_ PCWSTR pszRightFile, _Out_ BOOL *pfEqual)
+{
+    SB_ASSERT(pszLeftFile);
+    SB_ASSERT(pszRightFile);
+    SB_ASSERT(pfEqual);
+
+    HRESULT hr = S_OK;
+    HANDLE hLeft = INVALID_HANDLE_VALUE;
+    HANDLE hRight = INVALID_HANDLE_VALUE;
+    PBYTE pbBuffers = NULL;
+
+    *pfEqual = FALSE;
+
+    hr = _OpenPathForRead(pszLeftFile, &hLeft);
+    if (SUCCEEDED(hr))
+    {
+        hr = _OpenPathForRead(pszRightFile, &hRight);
+    }
+
+    if (FAILED(hr))
+    {
+        goto fend;
+    }
+
+    // Page aligned, so the reads go straight into the buffers
+    pbBuffers = (PBYTE)VirtualAlloc(NULL, 2 * COMPARE_CHUNK_BYTES, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (pbBuffers == NULL)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        logerr(L"VirtualAlloc() failed, hr: %x", hr);
+        goto fend;
+    }
+
+    PBYTE pbLeft = pbBuffers;
+    PBYTE pbRight = pbBuffers + COMPARE_CHUNK_BYTES;
+    for (;;)
+    {
+        DWORD cbLeft;
+        DWORD cbRight;
+        if (!ReadFile(hLeft, pbLeft, COMPARE_CHUNK_BYTES, &cbLeft, NULL)
+            || !ReadFile(hRight, pbRight, COMPARE_CHUNK_BYTES, &cbRight, NULL))
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            logerr(L"ReadFile failed, hr: %x", hr);
+            goto fend;
+        }
+
+        // Files of different sizes differ at the end of the shorter one
+        if ((cbLeft != cbRight) || (memcmp(pbLeft, pbRight, cbLeft) != 0))
+        {
+            break;
+        }
+
+        if (cbLeft == 0)
+        {
+            *pfEqual = TRUE;
+            break;
+        }
+    }
+
+fend:
+    if (pbBuffers != NULL)
+    {
+        VirtualFree(pbBuffers, 0, MEM_RELEASE);
+    }
+    if (hLeft != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(hLeft);
+    }
+    if (hRight != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(hRight);
+    }
+    return hr;
+}
+
+void GetModifiedLocalTime(_In_ PFILEINFO pFileInfo, _Out_ SYSTEMTIME *pstLocal)
+{
+    SYSTEMTIME stUTC;
+    if (!FileTimeToSystemTime(&pFileInfo->ftModifiedTime, &stUTC)
+        || !SystemTimeToTzSpecificLocalTime(NULL, &stUTC, pstLocal))
+    {
+        ZeroMemory(pstLocal, sizeof(*pstLocal));
+    }
+}
+
 // Compare two file info structs and say whether they are equal or not
 // also set duplicate flag in the file info structs.
 BOOL CompareFileInfoAndMark(_In_ const PFILEINFO pLeftFile, _In_ const PFILEINFO pRightFile, _In_ BOOL fCompareHashes)
@@ -142,94 +329,62 @@ BOOL CompareFileInfoAndMark(_In_ const PFILEINFO pLeftFile, _In_ const PFILEINFO
     SB_ASSERT(pLeftFile);
     SB_ASSERT(pRightFile);
 
-    // Along with setting bits, must also clear bits 
-    // in case of no match because:
-    // User could have chosen two folders first and then
-    // changed one of the folders which would invaliate
-    // the unchanged folder's files' duplicacy.
+    // Flags from an earlier compare are already invalid by epoch. The result of
+    // this pair replaces all but the tree match, which is set by the caller.
+    BYTE bDupInfo = FDUP_NO_MATCH;
 
     // Two directories match only if their names are the same
     if (pLeftFile->fIsDirectory && pRightFile->fIsDirectory)
     {
-        if (_wcsnicmp(pLeftFile->szFilename, pRightFile->szFilename, MAX_PATH) == 0)
-        {
-            pLeftFile->bDupInfo |= FDUP_NAME_MATCH;
-            pRightFile->bDupInfo |= FDUP_NAME_MATCH;
-        }
-        else
+        if (IsSameFilename(pLeftFile, pRightFile))
         {
-            pLeftFile->bDupInfo &= (~FDUP_NAME_MATCH);
-            pRightFile->bDupInfo &= (~FDUP_NAME_MATCH);
+            bDupInfo |= FDUP_NAME_MATCH;
         }
     }
     else if (pLeftFile->fIsDirectory || pRightFile->fIsDirectory)
     {
         // Only one of them is a directory, there can be no match except a
         // name match between a file and directory but it isn't very useful.
-        pLeftFile->bDupInfo = FDUP_NO_MATCH;
-        pRightFile->bDupInfo = FDUP_NO_MATCH;
+        SetDupInfo(pLeftFile, FDUP_NO_MATCH);
+        SetDupInfo(pRightFile, FDUP_NO_MATCH);
+        return FALSE;
     }
     else
     {
         // Both are files, perform the various match checks
 
-        if (_wcsnicmp(pLeftFile->szFilename, pRightFile->szFilename, MAX_PATH) == 0)
-        {
-            pLeftFile->bDupInfo |= FDUP_NAME_MATCH;
-            pRightFile->bDupInfo |= FDUP_NAME_MATCH;
-        }
-        else
+        if (IsSameFilename(pLeftFile, pRightFile))
         {
-            pLeftFile->bDupInfo &= (~FDUP_NAME_MATCH);
-            pRightFile->bDupInfo &= (~FDUP_NAME_MATCH);
+            bDupInfo |= FDUP_NAME_MATCH;
         }
 
         if (pLeftFile->llFilesize.QuadPart == pRightFile->llFilesize.QuadPart)
         {
-            pLeftFile->bDupInfo |= FDUP_SIZE_MATCH;
-            pRightFile->bDupInfo |= FDUP_SIZE_MATCH;
-        }
-        else
-        {
-            pLeftFile->bDupInfo &= (~FDUP_SIZE_MATCH);
-            pRightFile->bDupInfo &= (~FDUP_SIZE_MATCH);
+            bDupInfo |= FDUP_SIZE_MATCH;
         }
 
-        if (memcmp(&pLeftFile->stModifiedTime, &pRightFile->stModifiedTime, sizeof(pLeftFile->stModifiedTime)) == 0)
-        {
-            pLeftFile->bDupInfo |= FDUP_DATE_MATCH;
-            pRightFile->bDupInfo |= FDUP_DATE_MATCH;
-        }
-        else
+        if (GetModifiedTimeMs(pLeftFile) == GetModifiedTimeMs(pRightFile))
         {
-            pLeftFile->bDupInfo &= (~FDUP_DATE_MATCH);
-            pRightFile->bDupInfo &= (~FDUP_DATE_MATCH);
+            bDupInfo |= FDUP_DATE_MATCH;
         }
 
-        if (fCompareHashes)
+        if (fCompareHashes && (memcmp(&pLeftFile->abHash, &pRightFile->abHash, sizeof(pLeftFile->abHash)) == 0))
         {
-            if (memcmp(&pLeftFile->abHash, &pRightFile->abHash, sizeof(pLeftFile->abHash)) == 0)
-            {
-                pLeftFile->bDupInfo |= FDUP_HASH_MATCH;
-                pRightFile->bDupInfo |= FDUP_HASH_MATCH;
-            }
-            else
-            {
-                pLeftFile->bDupInfo &= (~FDUP_HASH_MATCH);
-                pRightFile->bDupInfo &= (~FDUP_HASH_MATCH);
-            }
+            bDupInfo |= FDUP_HASH_MATCH;
         }
     }
 
+    SetDupInfo(pLeftFile, (GetDupInfo(pLeftFile) & FDUP_TREE_MATCH) | bDupInfo);
+    SetDupInfo(pRightFile, (GetDupInfo(pRightFile) & FDUP_TREE_MATCH) | bDupInfo);
     return IsDuplicateFile(pLeftFile);
 }
 
 inline BOOL IsDuplicateFile(_In_ const PFILEINFO pFileInfo)
 {
-    BYTE bDupInfo = pFileInfo->bDupInfo;
+    BYTE bDupInfo = GetDupInfo(pFileInfo);
     if (pFileInfo->fIsDirectory)
     {
-        return (bDupInfo & FDUP_NAME_MATCH);
+        return (bDupInfo & (FDUP_NAME_MATCH | FDUP_TREE_MATCH));
     }
 
     return (bDupInfo & FDUP_HASH_MATCH) ||
@@ -244,7 +399,7 @@ void GetDupTypeString(_In_ PFILEINFO pFileInfo, _Inout_z_ PWSTR pszDupType)
 
     *pch = 0;
 
-    BYTE bDupInfo = pFileInfo->bDupInfo;
+    BYTE bDupInfo = GetDupInfo(pFileInfo);
     if (bDupInfo != FDUP_NO_MATCH)
     {
         if (bDupInfo & FDUP_NAME_MATCH)
@@ -271,6 +426,12 @@ void GetDupTypeString(_In_ PFILEINFO pFileInfo, _Inout_z_ PWSTR pszDupType)
             *pch++ = L',';
         }
 
+        if (bDupInfo & FDUP_TREE_MATCH)
+        {
+            *pch++ = L'T';
+            *pch++ = L',';
+        }
+
         // To remove trailing ','
         --pch;
 
@@ -284,6 +445,38 @@ int CompareFilesByName(_In_ PVOID pLeftFile, _In_ PVOID pRightFile)
     PFILEINFO pLeft = (PFILEINFO)pLeftFile;
     PFILEINFO pRight = (PFILEINFO)pRightFile;
 
-    size_t count = wcsnlen(pLeft->szFilename, ARRAYSIZE(pLeft->szFilename));
-    return _wcsnicmp(pLeft->szFilename, pRight->szFilename, count);
+    size_t count = wcsnlen(pLeft->pszFilename, MAX_PATH);
+    return _wcsnicmp(pLeft->pszFilename, pRight->pszFilename, count);
+}
+
+static HRESULT _OpenFileForRead(_In_ PFILEINFO pFileInfo, _Out_ HANDLE *phFile)
+{
+    *phFile = INVALID_HANDLE_VALUE;
+
+    WCHAR szFilepath[MAX_PATH];
+    HRESULT hr = PathCchCombine(szFilepath, ARRAYSIZE(szFilepath), pFileInfo->pszPath, pFileInfo->pszFilename);
+    if (FAILED(hr))
+    {
+        logerr(L"PathCchCombine() failed for %s + %s", pFileInfo->pszPath, pFileInfo->pszFilename);
+        return hr;
+    }
+
+    return _OpenPathForRead(szFilepath, phFile);
+}
+
+static HRESULT _OpenPathForRead(_In_z_ PCWSTR pszFilepath, _Out_ HANDLE *phFile)
+{
+    *phFile = INVALID_HANDLE_VALUE;
+
+    HANDLE hFile = CreateFileW(pszFilepath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+        logerr(L"Failed to open file %s, hr: %x", pszFilepath, hr);
+        return hr;
+    }
+
+    *phFile = hFile;
+    return S_OK;
 }
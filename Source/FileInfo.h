@@ -11,6 +11,8 @@
 #include "common.h"
 #include "StringFunctions.h"
 #include "HashFactory.h"
+#include "NameKey.h"
+#include "NameIntern.h"
 
 // **
 // File attributes considered for duplicate determination are
@@ -23,33 +25,88 @@
 #define FDUP_DATE_MATCH     0x04
 #define FDUP_HASH_MATCH     0x08
 
+// Set on a folder (and the files under it) whose whole
+// sub tree matched a sub tree in the other directory.
+#define FDUP_TREE_MATCH     0x10
+
+// Read size of CompareFileContents(), a multiple of the page size
+#define COMPARE_CHUNK_BYTES (1024 * 1024)
+
 // Structure to hold information about a file
+// The values that every pass over the files reads (compare, clear flags, delete,
+// list) come first, in FILEINFO_HOT_BYTES. The folder path and the filename are not
+// stored here, both point into the name pool (see NameIntern.h), which keeps each
+// folder path once for all the files in it. That keeps a FILEINFO at 80 bytes instead
+// of over 600, so a pass over many files reads one or two cache lines of each: the
+// FILEINFOs are not cache line aligned, since the CHL containers that own them
+// release them with free().
 typedef struct _FileInfo {
-    BOOL fIsDirectory;
-    BOOL fAccessDenied;
-
     // This structure must know about the duplicacy of a file
     // because otherwise the directory must hold an additional
     // list of duplicate files.
-    BYTE bDupInfo;
+    // bDupInfo (below) is valid only if dwDupEpoch is the current compare epoch,
+    // always access it through the DupInfo macros below.
+    DWORD dwDupEpoch;
+
+    BOOL fIsDirectory;
+    BOOL fAccessDenied;
+
+    // abHash holds the hash of the whole file. Set when the file was walked with
+    // hash compare or hashed since, so that no file is hashed twice.
+    BOOL fHashValid;
 
     LARGE_INTEGER llFilesize;
-    BYTE abHash[HASHLEN_SHA1];
-    SYSTEMTIME stModifiedTime;
+
+    // Last write time, UTC. See GetModifiedTimeMs() and GetModifiedLocalTime().
     FILETIME ftModifiedTime;
 
-    WCHAR szPath[MAX_PATH];
-    WCHAR szFilename[MAX_PATH];
+    // Id of pszFilename in the name pool, equal for names that differ only in case
+    DWORD dwNameId;
+
+    BYTE abHash[HASHLEN_SHA1];
+    BYTE bDupInfo;
+
+    // Item id (LVM_MAPINDEXTOID) + 1 of the list view row showing the file, 0 if
+    // the file has no row. Set when the list is filled, see PopulateFileList().
+    DWORD dwListItemId;
+
+    // Stored in the name pool, valid while the DIRINFO of the file is alive
+    PCWSTR pszFilename;
+
+    // Folder of the file, with the trailing '\'. Stored in the name pool too.
+    PCWSTR pszPath;
 
 }FILEINFO, *PFILEINFO;
 
-#define ClearDuplicateAttr(pFileInfo)   (pFileInfo->bDupInfo = FDUP_NO_MATCH)
+#define FILEINFO_HOT_BYTES  64
+
+// Case insensitive equality of the names of two files
+#define IsSameFilename(pLeftFile, pRightFile)    ((pLeftFile)->dwNameId == (pRightFile)->dwNameId)
+
+// Modified times are compared at millisecond resolution, that of the time shown
+#define GetModifiedTimeMs(pFileInfo) \
+    (((((UINT64)(pFileInfo)->ftModifiedTime.dwHighDateTime) << 32) | (pFileInfo)->ftModifiedTime.dwLowDateTime) / 10000)
+
+// Duplicate flags set before the last NewDupEpoch() read as FDUP_NO_MATCH. So all flags
+// of all files are cleared at once by starting a new epoch, without visiting any file.
+extern DWORD g_dwDupEpoch;
+
+#define GetDupInfo(pFileInfo)           (((pFileInfo)->dwDupEpoch == g_dwDupEpoch) ? (pFileInfo)->bDupInfo : (BYTE)FDUP_NO_MATCH)
+#define SetDupInfo(pFileInfo, bDup)     ((pFileInfo)->bDupInfo = (BYTE)(bDup), (pFileInfo)->dwDupEpoch = g_dwDupEpoch)
+#define AddDupInfo(pFileInfo, bDup)     SetDupInfo((pFileInfo), (GetDupInfo(pFileInfo) | (bDup)))
+#define ClearDuplicateAttr(pFileInfo)   SetDupInfo((pFileInfo), FDUP_NO_MATCH)
 
 // Functions
 
 HRESULT FileInfoInit(_In_ BOOL fComputeHash);
 void FileInfoDestroy();
 
+// Invalidate the duplicate flags of all files
+void NewDupEpoch();
+
+// Modified time of the file in local time, to show
+void GetModifiedLocalTime(_In_ PFILEINFO pFileInfo, _Out_ SYSTEMTIME *pstLocal);
+
 // Populate file info for the specified file in the caller specified memory location
 BOOL CreateFileInfo(_In_ PCWSTR pszFullpathToFile, _In_ BOOL fComputeHash, _In_ PFILEINFO pFileInfo);
 
@@ -57,6 +114,19 @@ BOOL CreateFileInfo(_In_ PCWSTR pszFullpathToFile, _In_ BOOL fComputeHash, _In_
 // and return the pointer to this location to the caller.
 BOOL CreateFileInfo(_In_ PCWSTR pszFullpathToFile, _In_ BOOL fComputeHash, _Out_ PFILEINFO* ppFileInfo);
 
+// Hash the contents of a file whose file info was created without the hash. If cbMax is
+// non-zero, only the first cbMax bytes are hashed. FileInfoInit(TRUE) must have succeeded.
+HRESULT HashFileContents(_In_ PFILEINFO pFileInfo, _In_ DWORD cbMax, _Out_bytecap_c_(HASHLEN_SHA1) PBYTE pbHash);
+
+// Hash the whole file into abHash unless fHashValid says it already is.
+// FileInfoInit(TRUE) must have succeeded.
+HRESULT EnsureFileHash(_In_ PFILEINFO pFileInfo);
+
+// Byte by byte compare of the contents of two files, reading both side by side in
+// COMPARE_CHUNK_BYTES chunks and stopping at the first chunk that differs.
+HRESULT CompareFileContents(_In_ PFILEINFO pLeftFile, _In_ PFILEINFO pRightFile, _Out_ BOOL *pfEqual);
+HRESULT CompareFileContentsByPath(_In_z_ PCWSTR pszLeftFile, _In_z_ PCWSTR pszRightFile, _Out_ BOOL *pfEqual);
+
 // Compare two file info structs and say whether they are equal or not,
 // also set duplicate flag in the file info structs.
 BOOL CompareFileInfoAndMark(_In_ const PFILEINFO pLeftFile, _In_ const PFILEINFO pRightFile, _In_ BOOL fCompareHashes);
@@ -89,6 +89,94 @@ fend:
     return hr;
 }
 
+HRESULT CalculatePartialSHA1(_In_ HCRYPTPROV hCrypt, _In_ HANDLE hFile, _In_ DWORD cbMax, _Out_bytecap_c_(HASHLEN_SHA1) PBYTE pbHash)
+{
+    SB_ASSERT(hCrypt != NULL);
+    SB_ASSERT(cbMax <= (16 * MBYTES));
+
+    HRESULT hr = S_OK;
+    void* pBuffer = NULL;
+    HCRYPTHASH hHash = NULL;
+    DWORD cbRead = 0;
+
+    hr = CHL_MmAlloc(&pBuffer, cbMax, NULL);
+    if (FAILED(hr))
+    {
+        goto fend;
+    }
+
+    // Returns fewer bytes, without failing, if the file is smaller
+    if (!ReadFile(hFile, pBuffer, cbMax, &cbRead, NULL))
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        logerr(L"ReadFile failed, hr: %x", hr);
+        goto fend;
+    }
+
+    hr = BeginSHA1(hCrypt, &hHash);
+    if (FAILED(hr))
+    {
+        goto fend;
+    }
+
+    hr = UpdateSHA1(hHash, (const BYTE*)pBuffer, cbRead);
+    if (FAILED(hr))
+    {
+        goto fend;
+    }
+
+    hr = FinishSHA1(hHash, pbHash);
+    hHash = NULL;
+
+fend:
+    if (hHash != NULL)
+    {
+        CryptDestroyHash(hHash);
+        hHash = NULL;
+    }
+    CHL_MmFree(&pBuffer);
+    return hr;
+}
+
+HRESULT BeginSHA1(_In_ HCRYPTPROV hCrypt, _Out_ HCRYPTHASH *phHash)
+{
+    SB_ASSERT(hCrypt != NULL);
+
+    HRESULT hr = S_OK;
+    *phHash = NULL;
+    if (!CryptCreateHash(hCrypt, CALG_SHA1, NULL, 0, phHash))
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        logerr(L"CryptCreateHash() failed, hr: %x", hr);
+    }
+    return hr;
+}
+
+HRESULT UpdateSHA1(_In_ HCRYPTHASH hHash, _In_bytecount_(cbData) const BYTE *pbData, _In_ DWORD cbData)
+{
+    HRESULT hr = S_OK;
+    if (!CryptHashData(hHash, pbData, cbData, 0))
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        logerr(L"CryptHashData failed, hr: %x", hr);
+    }
+    return hr;
+}
+
+HRESULT FinishSHA1(_In_ HCRYPTHASH hHash, _Out_bytecap_c_(HASHLEN_SHA1) PBYTE pbHash)
+{
+    HRESULT hr = S_OK;
+    DWORD dwHashSize = HASHLEN_SHA1;
+    if (!CryptGetHashParam(hHash, HP_HASHVAL, pbHash, &dwHashSize, 0))
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        logerr(L"CryptGetHashParam failed, hr: %x", hr);
+    }
+
+    CryptDestroyHash(hHash);
+    return hr;
+}
+
 void HashValueToString(_In_bytecount_c_(HASHLEN_SHA1) PBYTE pbHash, _Inout_z_ PSTR pszHashValue)
 {
     for (int i = 0; i < HASHLEN_SHA1; ++i)
@@ -222,3 +310,15 @@ fend:
     CHL_MmFree(&pBuffer);
     return hr;
 }
+
+UINT64 HashBytesFNV1a(_In_bytecount_(cbData) const void *pvData, _In_ int cbData)
+{
+    const BYTE *pb = (const BYTE*)pvData;
+    UINT64 ullHash = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < cbData; ++i)
+    {
+        ullHash ^= pb[i];
+        ullHash *= 0x100000001b3ULL;
+    }
+    return ullHash;
+}
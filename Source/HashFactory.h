@@ -18,4 +18,17 @@ HRESULT HashFactoryInit(_Out_ HCRYPTPROV *phCrypt);
 void HashFactoryDestroy(_In_ HCRYPTPROV hCrypt);
 
 HRESULT CalculateSHA1(_In_ HCRYPTPROV hCrypt, _In_ HANDLE hFile, _Out_bytecap_c_(HASHLEN_SHA1) PBYTE pbHash);
+
+// SHA1 of only the first cbMax bytes of the file (or the whole file, if it is smaller).
+// cbMax must be small enough to be read in one go.
+HRESULT CalculatePartialSHA1(_In_ HCRYPTPROV hCrypt, _In_ HANDLE hFile, _In_ DWORD cbMax, _Out_bytecap_c_(HASHLEN_SHA1) PBYTE pbHash);
+// Incremental SHA1 over caller supplied data. FinishSHA1() writes out the hash
+// and destroys the hash object, whether it succeeds or not.
+HRESULT BeginSHA1(_In_ HCRYPTPROV hCrypt, _Out_ HCRYPTHASH *phHash);
+HRESULT UpdateSHA1(_In_ HCRYPTHASH hHash, _In_bytecount_(cbData) const BYTE *pbData, _In_ DWORD cbData);
+HRESULT FinishSHA1(_In_ HCRYPTHASH hHash, _Out_bytecap_c_(HASHLEN_SHA1) PBYTE pbHash);
+
 void HashValueToString(_In_bytecount_c_(HASHLEN_SHA1) PBYTE pbHash, _Inout_z_ PSTR pszHash);
+
+// 64-bit FNV-1a of a byte string, for filter and sort keys. Not a content hash.
+UINT64 HashBytesFNV1a(_In_bytecount_(cbData) const void *pvData, _In_ int cbData);
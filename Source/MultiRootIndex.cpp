@@ -0,0 +1,146 @@
+
+// ---------------------------------------------------
+// The FDiffDelete Project
+// Github: https://github.com/shishir993/fdiffdelete
+// Author: Shishir Bhat
+// The MIT License (MIT)
+// Copyright (c) 2014
+//
+
+#include "MultiRootIndex.h"
+
+HRESULT BuildMultiRootIndex(
+    _In_count_(nRoots) PCWSTR *apszRoots,
+    _In_ int nRoots,
+    _In_ BOOL fCompareHashes,
+    _In_opt_ PDUPSEARCH_OPTIONS pOptions,
+    _Out_ PMULTIROOT_INDEX *ppIndex)
+{
+    SB_ASSERT(apszRoots);
+    SB_ASSERT(ppIndex);
+
+    HRESULT hr = S_OK;
+    PMULTIROOT_INDEX pIndex = NULL;
+
+    if ((nRoots < 1) || (nRoots > MAX_DUP_ROOTS))
+    {
+        logerr(L"Cannot index %d folders, at most %d are supported", nRoots, MAX_DUP_ROOTS);
+        hr = E_INVALIDARG;
+        goto error_return;
+    }
+
+    if (fCompareHashes)
+    {
+        hr = FileInfoInit(TRUE);
+        if (FAILED(hr))
+        {
+            logerr(L"Cannot initialize FileInfo for hash comparisons, hr: %x", hr);
+            goto error_return;
+        }
+    }
+
+    pIndex = (PMULTIROOT_INDEX)malloc(sizeof(MULTIROOT_INDEX));
+    if (pIndex == NULL)
+    {
+        hr = E_OUTOFMEMORY;
+        goto error_return;
+    }
+    ZeroMemory(pIndex, sizeof(*pIndex));
+
+    for (int iRoot = 0; iRoot < nRoots; ++iRoot)
+    {
+        loginfo(L"Indexing root %d: %s", iRoot, apszRoots[iRoot]);
+        if (!BuildDirTree(apszRoots[iRoot], fCompareHashes, &pIndex->apRoots[iRoot]))
+        {
+            logerr(L"Cannot recursive build files in folder: %s", apszRoots[iRoot]);
+            hr = E_FAIL;
+            goto error_return;
+        }
+        ++(pIndex->nRoots);
+    }
+
+    hr = FindDupFilesInDirs(pIndex->apRoots, pIndex->nRoots, pOptions, &pIndex->pGroups);
+    if (FAILED(hr))
+    {
+        logerr(L"Cannot find duplicate files across %d folders, hr: %x", nRoots, hr);
+        goto error_return;
+    }
+
+    *ppIndex = pIndex;
+    return hr;
+
+error_return:
+    if (pIndex != NULL)
+    {
+        DestroyMultiRootIndex(pIndex);
+    }
+
+    *ppIndex = NULL;
+    return hr;
+}
+
+void DestroyMultiRootIndex(_In_ PMULTIROOT_INDEX pIndex)
+{
+    SB_ASSERT(pIndex);
+
+    if (pIndex->pGroups != NULL)
+    {
+        DestroyDupGroups(pIndex->pGroups);
+    }
+
+    for (int iRoot = 0; iRoot < pIndex->nRoots; ++iRoot)
+    {
+        DestroyDirInfo(pIndex->apRoots[iRoot]);
+    }
+    free(pIndex);
+}
+
+void PrintMultiRootIndex(_In_ PMULTIROOT_INDEX pIndex)
+{
+    SB_ASSERT(pIndex);
+    SB_ASSERT(pIndex->pGroups);
+
+    PDUPGROUPS pGroups = pIndex->pGroups;
+
+    // Per root: files that have a copy elsewhere (in any root), and their bytes
+    int anDupFiles[MAX_DUP_ROOTS] = {};
+    LONGLONG allDupBytes[MAX_DUP_ROOTS] = {};
+
+    for (int iRoot = 0; iRoot < pIndex->nRoots; ++iRoot)
+    {
+        wprintf(L"[%d] %s\n", iRoot, pIndex->apRoots[iRoot]->pszPath);
+    }
+    wprintf(L"\n");
+
+    for (int iGroup = 0; iGroup < pGroups->nGroups; ++iGroup)
+    {
+        PDUPGROUP pGroup = &pGroups->aGroups[iGroup];
+        wprintf(L"%d files of %lld bytes in roots:", pGroup->nFiles, pGroup->llFilesize);
+        for (int iRoot = 0; iRoot < pIndex->nRoots; ++iRoot)
+        {
+            if (pGroup->dwRootMask & (1UL << iRoot))
+            {
+                wprintf(L" [%d]", iRoot);
+            }
+        }
+        wprintf(L"\n");
+
+        for (int i = 0; i < pGroup->nFiles; ++i)
+        {
+            PFILEINFO pFile = pGroups->apFiles[pGroup->iFirst + i];
+            int iRoot = pGroups->abRoots[pGroup->iFirst + i];
+            wprintf(L"  [%d] %s%s\n", iRoot, pFile->pszPath, pFile->pszFilename);
+
+            ++anDupFiles[iRoot];
+            allDupBytes[iRoot] += pGroup->llFilesize;
+        }
+        wprintf(L"\n");
+    }
+
+    wprintf(L"  Root  DupFiles  DupBytes\n");
+    for (int iRoot = 0; iRoot < pIndex->nRoots; ++iRoot)
+    {
+        wprintf(L"  [%2d]  %8d  %lld\n", iRoot, anDupFiles[iRoot], allDupBytes[iRoot]);
+    }
+    wprintf(L"%d duplicate groups, %lld bytes reclaimable\n\n", pGroups->nGroups, pGroups->llReclaimable);
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+// ---------------------------------------------------
+// The FDiffDelete Project
+// Github: https://github.com/shishir993/fdiffdelete
+// Author: Shishir Bhat
+// The MIT License (MIT)
+// Copyright (c) 2014
+//
+
+#include "Common.h"
+#include "DirectoryWalker_Interface.h"
+#include "DupFinder.h"
+
+// Content index over more than two dir trees (roots).
+// Every root is walked once and all files of all roots are grouped by content in a
+// single pass of the duplicate finder, instead of comparing each pair of roots.
+// Each duplicate group records the roots it occurs in.
+
+typedef struct _MultiRootIndex
+{
+    int nRoots;
+    PDIRINFO apRoots[MAX_DUP_ROOTS];
+
+    // Groups of files with identical contents across all roots
+    PDUPGROUPS pGroups;
+
+} MULTIROOT_INDEX, *PMULTIROOT_INDEX;
+
+// Walk each of the specified folders (recursively) and build the index.
+// Returns S_FALSE with a partial index if the search was stopped through pOptions.
+HRESULT BuildMultiRootIndex(
+    _In_count_(nRoots) PCWSTR *apszRoots,
+    _In_ int nRoots,
+    _In_ BOOL fCompareHashes,
+    _In_opt_ PDUPSEARCH_OPTIONS pOptions,
+    _Out_ PMULTIROOT_INDEX *ppIndex);
+
+void DestroyMultiRootIndex(_In_ PMULTIROOT_INDEX pIndex);
+
+// Print the duplicate groups with the roots each occurs in, followed by
+// the number of duplicate files and bytes within each root.
+void PrintMultiRootIndex(_In_ PMULTIROOT_INDEX pIndex);
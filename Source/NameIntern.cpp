@@ -0,0 +1,424 @@
+
+// ---------------------------------------------------
+// The FDiffDelete Project
+// Github: https://github.com/shishir993/fdiffdelete
+// Author: Shishir Bhat
+// The MIT License (MIT)
+// Copyright (c) 2014
+//
+
+#include "NameIntern.h"
+#include "NameKey.h"
+#include "HashFactory.h"
+
+#define NAME_BLOCK_CHARS    (32 * 1024)
+#define INIT_NAME_SLOTS     4096
+
+// Names are stored one after the other, each null terminated, in blocks
+typedef struct _NameBlock
+{
+    struct _NameBlock *pNext;
+    int cchUsed;
+    WCHAR achNames[NAME_BLOCK_CHARS];
+
+} NAME_BLOCK, *PNAME_BLOCK;
+
+// A stored spelling of a name or of a folder path
+typedef struct _SpellingSlot
+{
+    // NULL if the slot is free
+    PCWSTR pszName;
+    DWORD dwHash;
+
+    // 0 for a folder path
+    DWORD dwNameId;
+
+} SPELLING_SLOT, *PSPELLING_SLOT;
+
+// A name id, by the spelling it was first added in
+typedef struct _NameIdInfo
+{
+    PCWSTR pszName;
+    UINT64 ullNameKey;
+
+} NAME_ID_INFO, *PNAME_ID_INFO;
+
+// Both tables are open addressed with a power of 2 slots, at most half of them used
+typedef struct _NamePool
+{
+    PNAME_BLOCK pBlocks;
+
+    // By the exact spelling
+    PSPELLING_SLOT aSpellings;
+    DWORD nSpellingSlots;
+    DWORD nSpellings;
+
+    // Ids by the name key, 0 is a free slot
+    DWORD *adwIdSlots;
+    DWORD nIdSlots;
+
+    // Indexed by id, entry 0 is not used
+    PNAME_ID_INFO aIds;
+    DWORD nIds;
+    DWORD nIdCapacity;
+
+} NAME_POOL;
+
+static NAME_POOL g_stNamePool;
+static SRWLOCK g_srwNamePool = SRWLOCK_INIT;
+
+// Live DIRINFOs, see NameInternAddRef()
+static LONG g_nPoolRefs;
+
+static DWORD _HashSpelling(_In_z_ PCWSTR pszName, _In_ int cchName)
+{
+    return (DWORD)HashBytesFNV1a(pszName, cchName * sizeof(WCHAR));
+}
+
+static DWORD _IdSlotOf(_In_ UINT64 ullNameKey)
+{
+    return (DWORD)(ullNameKey ^ (ullNameKey >> 32));
+}
+
+// Pool must be locked, shared or exclusive
+static PSPELLING_SLOT _FindSpelling(_In_z_ PCWSTR pszName, _In_ DWORD dwHash, _In_ BOOL fPath)
+{
+    if (g_stNamePool.nSpellingSlots == 0)
+    {
+        return NULL;
+    }
+
+    DWORD dwMask = g_stNamePool.nSpellingSlots - 1;
+    for (DWORD i = dwHash & dwMask; g_stNamePool.aSpellings[i].pszName != NULL; i = (i + 1) & dwMask)
+    {
+        PSPELLING_SLOT pSlot = &g_stNamePool.aSpellings[i];
+        if ((pSlot->dwHash == dwHash) && (!fPath == (pSlot->dwNameId != 0)) && (wcscmp(pSlot->pszName, pszName) == 0))
+        {
+            return pSlot;
+        }
+    }
+    return NULL;
+}
+
+// Pool must be locked, shared or exclusive
+static DWORD _FindId(_In_z_ PCWSTR pszName, _In_ UINT64 ullNameKey)
+{
+    if (g_stNamePool.nIdSlots == 0)
+    {
+        return 0;
+    }
+
+    DWORD dwMask = g_stNamePool.nIdSlots - 1;
+    for (DWORD i = _IdSlotOf(ullNameKey) & dwMask; g_stNamePool.adwIdSlots[i] != 0; i = (i + 1) & dwMask)
+    {
+        PNAME_ID_INFO pId = &g_stNamePool.aIds[g_stNamePool.adwIdSlots[i]];
+        if (IsSameName(pszName, ullNameKey, pId->pszName, pId->ullNameKey))
+        {
+            return g_stNamePool.adwIdSlots[i];
+        }
+    }
+    return 0;
+}
+
+static void _InsertSpellingSlot(_In_ PCWSTR pszName, _In_ DWORD dwHash, _In_ DWORD dwNameId)
+{
+    DWORD dwMask = g_stNamePool.nSpellingSlots - 1;
+    DWORD i = dwHash & dwMask;
+    while (g_stNamePool.aSpellings[i].pszName != NULL)
+    {
+        i = (i + 1) & dwMask;
+    }
+
+    g_stNamePool.aSpellings[i].pszName = pszName;
+    g_stNamePool.aSpellings[i].dwHash = dwHash;
+    g_stNamePool.aSpellings[i].dwNameId = dwNameId;
+}
+
+static void _InsertIdSlot(_In_ DWORD dwNameId)
+{
+    DWORD dwMask = g_stNamePool.nIdSlots - 1;
+    DWORD i = _IdSlotOf(g_stNamePool.aIds[dwNameId].ullNameKey) & dwMask;
+    while (g_stNamePool.adwIdSlots[i] != 0)
+    {
+        i = (i + 1) & dwMask;
+    }
+    g_stNamePool.adwIdSlots[i] = dwNameId;
+}
+
+// Make room for one more spelling and one more id. Pool must be locked exclusive.
+static HRESULT _ReserveSlots()
+{
+    if ((g_stNamePool.nSpellings + 1) * 2 > g_stNamePool.nSpellingSlots)
+    {
+        DWORD nSlots = (g_stNamePool.nSpellingSlots > 0) ? (g_stNamePool.nSpellingSlots * 2) : INIT_NAME_SLOTS;
+        PSPELLING_SLOT aOld = g_stNamePool.aSpellings;
+        DWORD nOldSlots = g_stNamePool.nSpellingSlots;
+
+        g_stNamePool.aSpellings = (PSPELLING_SLOT)calloc(nSlots, sizeof(SPELLING_SLOT));
+        if (g_stNamePool.aSpellings == NULL)
+        {
+            g_stNamePool.aSpellings = aOld;
+            return E_OUTOFMEMORY;
+        }
+
+        g_stNamePool.nSpellingSlots = nSlots;
+        for (DWORD i = 0; i < nOldSlots; ++i)
+        {
+            if (aOld[i].pszName != NULL)
+            {
+                _InsertSpellingSlot(aOld[i].pszName, aOld[i].dwHash, aOld[i].dwNameId);
+            }
+        }
+        free(aOld);
+    }
+
+    if (g_stNamePool.nIds + 2 > g_stNamePool.nIdCapacity)
+    {
+        DWORD nCapacity = (g_stNamePool.nIdCapacity > 0) ? (g_stNamePool.nIdCapacity * 2) : INIT_NAME_SLOTS;
+        PNAME_ID_INFO aNew = (PNAME_ID_INFO)realloc(g_stNamePool.aIds, nCapacity * sizeof(NAME_ID_INFO));
+        if (aNew == NULL)
+        {
+            return E_OUTOFMEMORY;
+        }
+
+        g_stNamePool.aIds = aNew;
+        g_stNamePool.nIdCapacity = nCapacity;
+    }
+
+    if ((g_stNamePool.nIds + 1) * 2 > g_stNamePool.nIdSlots)
+    {
+        DWORD nSlots = (g_stNamePool.nIdSlots > 0) ? (g_stNamePool.nIdSlots * 2) : INIT_NAME_SLOTS;
+        DWORD *adwNew = (DWORD*)calloc(nSlots, sizeof(DWORD));
+        if (adwNew == NULL)
+        {
+            return E_OUTOFMEMORY;
+        }
+
+        free(g_stNamePool.adwIdSlots);
+        g_stNamePool.adwIdSlots = adwNew;
+        g_stNamePool.nIdSlots = nSlots;
+        for (DWORD dwNameId = 1; dwNameId <= g_stNamePool.nIds; ++dwNameId)
+        {
+            _InsertIdSlot(dwNameId);
+        }
+    }
+    return S_OK;
+}
+
+// Copy a name into the blocks. Pool must be locked exclusive.
+static PCWSTR _StoreName(_In_z_ PCWSTR pszName, _In_ int cchName)
+{
+    PNAME_BLOCK pBlock = g_stNamePool.pBlocks;
+    if ((pBlock == NULL) || (pBlock->cchUsed + cchName + 1 > NAME_BLOCK_CHARS))
+    {
+        pBlock = (PNAME_BLOCK)malloc(sizeof(NAME_BLOCK));
+        if (pBlock == NULL)
+        {
+            return NULL;
+        }
+
+        pBlock->pNext = g_stNamePool.pBlocks;
+        pBlock->cchUsed = 0;
+        g_stNamePool.pBlocks = pBlock;
+    }
+
+    PWSTR pszStored = pBlock->achNames + pBlock->cchUsed;
+    CopyMemory(pszStored, pszName, cchName * sizeof(WCHAR));
+    pszStored[cchName] = 0;
+    pBlock->cchUsed += cchName + 1;
+    return pszStored;
+}
+
+// Add a spelling that is not in the pool. Pool must be locked exclusive.
+static HRESULT _AddSpelling(_In_z_ PCWSTR pszName, _In_ int cchName, _In_ DWORD dwHash, _Out_ PCWSTR *ppszInterned, _Out_ DWORD *pdwNameId)
+{
+    HRESULT hr = _ReserveSlots();
+    if (FAILED(hr))
+    {
+        logerr(L"Out of memory growing the name pool, %u names", g_stNamePool.nSpellings);
+        return hr;
+    }
+
+    PCWSTR pszStored = _StoreName(pszName, cchName);
+    if (pszStored == NULL)
+    {
+        logerr(L"Out of memory storing name: %s", pszName);
+        return E_OUTOFMEMORY;
+    }
+
+    // Another case of a known name shares its id
+    UINT64 ullNameKey = GetNameKey(pszName);
+    DWORD dwNameId = _FindId(pszName, ullNameKey);
+    if (dwNameId == 0)
+    {
+        dwNameId = ++(g_stNamePool.nIds);
+        g_stNamePool.aIds[dwNameId].pszName = pszStored;
+        g_stNamePool.aIds[dwNameId].ullNameKey = ullNameKey;
+        _InsertIdSlot(dwNameId);
+    }
+
+    _InsertSpellingSlot(pszStored, dwHash, dwNameId);
+    ++(g_stNamePool.nSpellings);
+
+    *ppszInterned = pszStored;
+    *pdwNameId = dwNameId;
+    return S_OK;
+}
+
+HRESULT InternName(_In_z_ PCWSTR pszName, _Out_ PCWSTR *ppszInterned, _Out_ DWORD *pdwNameId)
+{
+    SB_ASSERT(pszName);
+    SB_ASSERT(ppszInterned);
+    SB_ASSERT(pdwNameId);
+
+    int cchName = (int)wcsnlen(pszName, MAX_PATH - 1);
+    DWORD dwHash = _HashSpelling(pszName, cchName);
+    HRESULT hr = S_OK;
+
+    // Most names are already in the pool, which many threads can look up at once
+    AcquireSRWLockShared(&g_srwNamePool);
+    PSPELLING_SLOT pSlot = _FindSpelling(pszName, dwHash, FALSE);
+    if (pSlot != NULL)
+    {
+        *ppszInterned = pSlot->pszName;
+        *pdwNameId = pSlot->dwNameId;
+    }
+    ReleaseSRWLockShared(&g_srwNamePool);
+
+    if (pSlot != NULL)
+    {
+        return S_OK;
+    }
+
+    // Look again, another thread may have added the name in between
+    AcquireSRWLockExclusive(&g_srwNamePool);
+    pSlot = _FindSpelling(pszName, dwHash, FALSE);
+    if (pSlot != NULL)
+    {
+        *ppszInterned = pSlot->pszName;
+        *pdwNameId = pSlot->dwNameId;
+    }
+    else
+    {
+        hr = _AddSpelling(pszName, cchName, dwHash, ppszInterned, pdwNameId);
+    }
+    ReleaseSRWLockExclusive(&g_srwNamePool);
+
+    return hr;
+}
+
+HRESULT InternPath(_In_z_ PCWSTR pszPath, _Out_ PCWSTR *ppszInterned)
+{
+    SB_ASSERT(pszPath);
+    SB_ASSERT(ppszInterned);
+
+    int cchPath = (int)wcsnlen(pszPath, MAX_PATH - 1);
+    DWORD dwHash = _HashSpelling(pszPath, cchPath);
+    HRESULT hr = S_OK;
+
+    AcquireSRWLockShared(&g_srwNamePool);
+    PSPELLING_SLOT pSlot = _FindSpelling(pszPath, dwHash, TRUE);
+    if (pSlot != NULL)
+    {
+        *ppszInterned = pSlot->pszName;
+    }
+    ReleaseSRWLockShared(&g_srwNamePool);
+
+    if (pSlot != NULL)
+    {
+        return S_OK;
+    }
+
+    AcquireSRWLockExclusive(&g_srwNamePool);
+    pSlot = _FindSpelling(pszPath, dwHash, TRUE);
+    if (pSlot != NULL)
+    {
+        *ppszInterned = pSlot->pszName;
+    }
+    else
+    {
+        hr = _ReserveSlots();
+
+        PCWSTR pszStored = SUCCEEDED(hr) ? _StoreName(pszPath, cchPath) : NULL;
+        if (pszStored != NULL)
+        {
+            _InsertSpellingSlot(pszStored, dwHash, 0);
+            ++(g_stNamePool.nSpellings);
+            *ppszInterned = pszStored;
+        }
+        else
+        {
+            logerr(L"Out of memory storing folder path: %s", pszPath);
+            hr = E_OUTOFMEMORY;
+        }
+    }
+    ReleaseSRWLockExclusive(&g_srwNamePool);
+
+    return hr;
+}
+
+DWORD FindNameId(_In_z_ PCWSTR pszName)
+{
+    SB_ASSERT(pszName);
+
+    UINT64 ullNameKey = GetNameKey(pszName);
+
+    AcquireSRWLockShared(&g_srwNamePool);
+    DWORD dwNameId = _FindId(pszName, ullNameKey);
+    ReleaseSRWLockShared(&g_srwNamePool);
+
+    return dwNameId;
+}
+
+UINT64 GetNameIdKey(_In_ DWORD dwNameId)
+{
+    AcquireSRWLockShared(&g_srwNamePool);
+    SB_ASSERT((dwNameId > 0) && (dwNameId <= g_stNamePool.nIds));
+    UINT64 ullNameKey = g_stNamePool.aIds[dwNameId].ullNameKey;
+    ReleaseSRWLockShared(&g_srwNamePool);
+
+    return ullNameKey;
+}
+
+// Pool must be locked exclusive
+static void _FreePool()
+{
+    while (g_stNamePool.pBlocks != NULL)
+    {
+        PNAME_BLOCK pNext = g_stNamePool.pBlocks->pNext;
+        free(g_stNamePool.pBlocks);
+        g_stNamePool.pBlocks = pNext;
+    }
+
+    free(g_stNamePool.aSpellings);
+    free(g_stNamePool.adwIdSlots);
+    free(g_stNamePool.aIds);
+    ZeroMemory(&g_stNamePool, sizeof(g_stNamePool));
+}
+
+void NameInternAddRef()
+{
+    AcquireSRWLockExclusive(&g_srwNamePool);
+    ++g_nPoolRefs;
+    ReleaseSRWLockExclusive(&g_srwNamePool);
+}
+
+void NameInternRelease()
+{
+    AcquireSRWLockExclusive(&g_srwNamePool);
+    SB_ASSERT(g_nPoolRefs > 0);
+    if (--g_nPoolRefs == 0)
+    {
+        logdbg(L"Freeing name pool of %u names", g_stNamePool.nIds);
+        _FreePool();
+    }
+    ReleaseSRWLockExclusive(&g_srwNamePool);
+}
+
+void NameInternDestroy()
+{
+    AcquireSRWLockExclusive(&g_srwNamePool);
+    _FreePool();
+    g_nPoolRefs = 0;
+    ReleaseSRWLockExclusive(&g_srwNamePool);
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+// ---------------------------------------------------
+// The FDiffDelete Project
+// Github: https://github.com/shishir993/fdiffdelete
+// Author: Shishir Bhat
+// The MIT License (MIT)
+// Copyright (c) 2014
+//
+
+#include "Common.h"
+
+// Pool of the filenames of all FILEINFOs of the process, of both trees.
+// Each spelling of a name is stored once and every FILEINFO of that name points to
+// it. Names that differ only in case (see NameKey.h) get the same name id, so two
+// files have the same name exactly when their ids are equal. Ids start at 1.
+// The folder paths of the FILEINFOs are kept in the pool too, once per exact spelling,
+// so the files of a folder share one copy of its path. Paths get no id.
+// The pool may be used from any thread. Each DIRINFO holds a reference on the pool
+// from when it is created until it is destroyed, and the pool is emptied when the last
+// one is gone, so a rescan starts over with an empty pool. Names and ids stay valid
+// only as long as some DIRINFO is alive; ids start again at 1 after the pool is emptied.
+
+// Get the stored copy and the id of a name, adding the name if it is new
+HRESULT InternName(_In_z_ PCWSTR pszName, _Out_ PCWSTR *ppszInterned, _Out_ DWORD *pdwNameId);
+
+// Get the stored copy of a folder path, adding the path if it is new
+HRESULT InternPath(_In_z_ PCWSTR pszPath, _Out_ PCWSTR *ppszInterned);
+
+// Id of a name in any case, 0 if no file of that name was ever added
+DWORD FindNameId(_In_z_ PCWSTR pszName);
+
+// Name key (see NameKey.h) of the names of an id. Unlike the id, the key is the
+// same from run to run.
+UINT64 GetNameIdKey(_In_ DWORD dwNameId);
+
+// Taken by each DIRINFO for as long as it is alive. Release of the last reference
+// frees all names.
+void NameInternAddRef();
+void NameInternRelease();
+
+// Free all names whatever the references. No FILEINFO may be in use.
+void NameInternDestroy();
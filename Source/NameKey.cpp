@@ -0,0 +1,96 @@
+
+// ---------------------------------------------------
+// The FDiffDelete Project
+// Github: https://github.com/shishir993/fdiffdelete
+// Author: Shishir Bhat
+// The MIT License (MIT)
+// Copyright (c) 2014
+//
+
+#include "NameKey.h"
+#include "HashFactory.h"
+#include <emmintrin.h>
+
+// Characters per SSE2 register
+#define FOLD_BLOCK_CHARS    8
+
+// Upper case a-z of a block of eight characters. Returns FALSE, leaving the block
+// as it is, if any of them is not ASCII.
+static BOOL _FoldAsciiBlock(_Inout_updates_(FOLD_BLOCK_CHARS) PWSTR pch)
+{
+    __m128i xmmChars = _mm_loadu_si128((const __m128i*)pch);
+
+    // Any bit above the low 7 means not ASCII
+    __m128i xmmHigh = _mm_and_si128(xmmChars, _mm_set1_epi16((short)0xFF80));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi16(xmmHigh, _mm_setzero_si128())) != 0xFFFF)
+    {
+        return FALSE;
+    }
+
+    // All values are below 0x80, so signed compares work
+    __m128i xmmLower = _mm_and_si128(
+        _mm_cmpgt_epi16(xmmChars, _mm_set1_epi16(L'a' - 1)),
+        _mm_cmplt_epi16(xmmChars, _mm_set1_epi16(L'z' + 1)));
+
+    xmmChars = _mm_sub_epi16(xmmChars, _mm_and_si128(xmmLower, _mm_set1_epi16(L'a' - L'A')));
+    _mm_storeu_si128((__m128i*)pch, xmmChars);
+    return TRUE;
+}
+
+int FoldName(_In_z_ PCWSTR pszName, _Out_writes_(cchFolded) PWSTR pszFolded, _In_ int cchFolded)
+{
+    SB_ASSERT(cchFolded > 0);
+
+    int cch = (int)wcsnlen(pszName, cchFolded - 1);
+    CopyMemory(pszFolded, pszName, cch * sizeof(WCHAR));
+    pszFolded[cch] = 0;
+
+    BOOL fAscii = TRUE;
+    int i = 0;
+    for (; fAscii && (i + FOLD_BLOCK_CHARS <= cch); i += FOLD_BLOCK_CHARS)
+    {
+        fAscii = _FoldAsciiBlock(pszFolded + i);
+    }
+
+    for (; fAscii && (i < cch); ++i)
+    {
+        WCHAR ch = pszFolded[i];
+        if (ch >= 0x80)
+        {
+            fAscii = FALSE;
+        }
+        else if ((ch >= L'a') && (ch <= L'z'))
+        {
+            pszFolded[i] = ch - (L'a' - L'A');
+        }
+    }
+
+    // The invariant upper case is the one CompareStringOrdinal() ignores case by
+    if (!fAscii && (LCMapStringEx(LOCALE_NAME_INVARIANT, LCMAP_UPPERCASE, pszName, cch, pszFolded, cch, NULL, NULL, 0) != cch))
+    {
+        logwarn(L"Cannot fold name: %s", pszName);
+        CopyMemory(pszFolded, pszName, cch * sizeof(WCHAR));
+    }
+    return cch;
+}
+
+UINT64 GetNameKey(_In_z_ PCWSTR pszName)
+{
+    WCHAR szFolded[MAX_PATH];
+    int cch = FoldName(pszName, szFolded, ARRAYSIZE(szFolded));
+    return HashBytesFNV1a(szFolded, cch * sizeof(WCHAR));
+}
+
+BOOL IsSameName(_In_z_ PCWSTR pszLeft, _In_ UINT64 ullLeftKey, _In_z_ PCWSTR pszRight, _In_ UINT64 ullRightKey)
+{
+    if (ullLeftKey != ullRightKey)
+    {
+        return FALSE;
+    }
+    return (CompareStringOrdinal(pszLeft, -1, pszRight, -1, TRUE) == CSTR_EQUAL);
+}
+
+int CompareNames(_In_z_ PCWSTR pszLeft, _In_z_ PCWSTR pszRight)
+{
+    return CompareStringOrdinal(pszLeft, -1, pszRight, -1, TRUE) - CSTR_EQUAL;
+}
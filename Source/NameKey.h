@@ -0,0 +1,32 @@
+#pragma once
+
+// ---------------------------------------------------
+// The FDiffDelete Project
+// Github: https://github.com/shishir993/fdiffdelete
+// Author: Shishir Bhat
+// The MIT License (MIT)
+// Copyright (c) 2014
+//
+
+#include "Common.h"
+
+// Case insensitive keys of filenames.
+// A name is folded to upper case once, when its FILEINFO is created, and the 64-bit
+// FNV-1a hash of the folded name is kept as its key. Names with different keys are
+// different. Names with equal keys are confirmed with CompareStringOrdinal(), which
+// ignores case the same way the file system does.
+// Folding converts eight ASCII characters at a time with SSE2. A name with any
+// character outside ASCII is folded by the invariant locale's upper case instead.
+
+// Fold a name into pszFolded. Returns the number of characters, not counting the
+// terminating null. Names longer than cchFolded - 1 are cut short.
+int FoldName(_In_z_ PCWSTR pszName, _Out_writes_(cchFolded) PWSTR pszFolded, _In_ int cchFolded);
+
+UINT64 GetNameKey(_In_z_ PCWSTR pszName);
+
+// Case insensitive equality of two names with their keys
+BOOL IsSameName(_In_z_ PCWSTR pszLeft, _In_ UINT64 ullLeftKey, _In_z_ PCWSTR pszRight, _In_ UINT64 ullRightKey);
+
+// Case insensitive order of two names or paths, < 0, 0 or > 0 like wcscmp(). Equal
+// exactly when IsSameName() is TRUE, unlike _wcsicmp(), which only folds by the C locale.
+int CompareNames(_In_z_ PCWSTR pszLeft, _In_z_ PCWSTR pszRight);
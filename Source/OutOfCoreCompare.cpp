@@ -0,0 +1,915 @@
+
+// ---------------------------------------------------
+// The FDiffDelete Project
+// Github: https://github.com/shishir993/fdiffdelete
+// Author: Shishir Bhat
+// The MIT License (MIT)
+// Copyright (c) 2014
+//
+
+#include "OutOfCoreCompare.h"
+#include "DirectoryWalker_Util.h"
+#include "NameKey.h"
+#include "FileFormatUtil.h"
+
+// Pending relative paths are written to the paths file in blocks of this size
+#define OOC_PATHBUF_BYTES       (64 * 1024)
+
+// Largest read buffer of a run, writes are chunked by WriteAllToFile()
+#define OOC_IO_CHUNK_BYTES      (16 * 1024 * 1024)
+
+#define OOC_FILETIME_PER_MS     10000
+
+// A sorted run in a temporary file, read back through a small buffer during the merge
+typedef struct _OocRun
+{
+    HANDLE hFile;
+    UINT64 nRecords;
+    UINT64 nRead;
+
+    POOC_RECORD aBuf;
+    DWORD nBufCap;
+    DWORD nBuf;
+    DWORD iBuf;
+
+} OOC_RUN, *POOC_RUN;
+
+// Everything written for one of the two trees
+typedef struct _OocSide
+{
+    int iSide;
+    PCWSTR pszRoot;
+
+    // Relative paths, each one a WORD count of characters followed by the characters
+    HANDLE hPaths;
+    UINT64 cbPaths;
+    PBYTE pbPathBuf;
+    DWORD cbPathBuf;
+
+    int nRuns;
+    int nMaxRuns;
+    POOC_RUN aRuns;
+
+    // Indexes of the runs not read to the end yet, as a heap with
+    // the run of the smallest current record on top
+    int nHeap;
+    int *aiHeap;
+
+} OOC_SIDE, *POOC_SIDE;
+
+// A record of a same-key run together with its path, for confirming name matches
+typedef struct _OocNamedRecord
+{
+    OOC_RECORD stRecord;
+    WCHAR szPath[MAX_PATH];
+
+} OOC_NAMED_RECORD, *POOC_NAMED_RECORD;
+
+typedef struct _OocScan
+{
+    POOC_OPTIONS pOptions;
+    POOC_STATS pStats;
+    HCRYPTPROV hCrypt;
+
+    // Records not written to a run yet
+    POOC_RECORD aRecords;
+    SIZE_T nRecords;
+    SIZE_T nMaxRecords;
+
+    // Same-key runs of each side being matched by name, reused from run to run
+    POOC_NAMED_RECORD aaNamed[2];
+    int anNamed[2];
+    int anMaxNamed[2];
+
+} OOC_SCAN, *POOC_SCAN;
+
+static HRESULT _CreateTempFile(_In_ POOC_OPTIONS pOptions, _Out_ HANDLE *phFile);
+static HRESULT _ReadAll(_In_ HANDLE hFile, _Out_bytecap_(cbData) void *pvData, _In_ DWORD cbData);
+static HRESULT _ScanTree(_In_ POOC_SCAN pScan, _In_ POOC_SIDE pSide);
+static HRESULT _ScanFolder(_In_ POOC_SCAN pScan, _In_ POOC_SIDE pSide, _In_z_ PCWSTR pszRelFolder, _In_ PCHL_QUEUE pqFolders);
+static HRESULT _AddFileRecord(
+    _In_ POOC_SCAN pScan,
+    _In_ POOC_SIDE pSide,
+    _In_z_ PCWSTR pszFolder,
+    _In_z_ PCWSTR pszRelPath,
+    _In_ WIN32_FIND_DATA *pFindData);
+static HRESULT _AppendPath(_In_ POOC_SIDE pSide, _In_z_ PCWSTR pszRelPath, _Out_ UINT64 *pullPathRef);
+static HRESULT _FlushPaths(_In_ POOC_SIDE pSide);
+static HRESULT _ReadPath(_In_ POOC_SIDE pSide, _In_ UINT64 ullPathRef, _Out_writes_(MAX_PATH) PWSTR pszPath);
+static HRESULT _WriteRun(_In_ POOC_SCAN pScan, _In_ POOC_SIDE pSide);
+static HRESULT _StartMerge(_In_ POOC_SIDE pSide, _In_ DWORD nBufRecords);
+static HRESULT _FillRun(_In_ POOC_RUN pRun);
+static POOC_RECORD _PeekSide(_In_ POOC_SIDE pSide);
+static HRESULT _PopSide(_In_ POOC_SIDE pSide);
+static void _SiftDown(_In_ POOC_SIDE pSide, _In_ int iHeap);
+static HRESULT _MergeSides(_In_ POOC_SCAN pScan, _In_ POOC_SIDE pLeft, _In_ POOC_SIDE pRight);
+static HRESULT _ReportRun(_In_ POOC_SCAN pScan, _In_ POOC_SIDE pSide, _In_ POOC_RECORD pKey);
+static HRESULT _MarkNameRun(_In_ POOC_SCAN pScan, _In_ POOC_SIDE pLeft, _In_ POOC_SIDE pRight, _In_ POOC_RECORD pKey);
+static HRESULT _CollectRun(_In_ POOC_SCAN pScan, _In_ POOC_SIDE pSide, _In_ POOC_RECORD pKey);
+static void _Report(_In_ POOC_SCAN pScan, _In_ int iSide, _In_ POOC_RECORD pRecord, _In_z_ PCWSTR pszPath);
+static void _DestroySide(_In_ POOC_SIDE pSide);
+static int _CompareMatchKeys(_In_ BOOL fCompareHashes, _In_ const OOC_RECORD *pLeft, _In_ const OOC_RECORD *pRight);
+static int __cdecl _CmpRecords(const void *pvLeft, const void *pvRight);
+
+HRESULT CompareTreesOutOfCore(
+    _In_z_ PCWSTR pszLeftRoot,
+    _In_z_ PCWSTR pszRightRoot,
+    _In_ POOC_OPTIONS pOptions,
+    _Out_opt_ POOC_STATS pStats)
+{
+    SB_ASSERT(pszLeftRoot);
+    SB_ASSERT(pszRightRoot);
+    SB_ASSERT(pOptions);
+
+    HRESULT hr = S_OK;
+    OOC_STATS stStats;
+    OOC_SCAN stScan;
+    OOC_SIDE aSides[2];
+    SIZE_T cbCap;
+    SIZE_T nBufRecords;
+
+    ZeroMemory(&stStats, sizeof(stStats));
+    ZeroMemory(&stScan, sizeof(stScan));
+    ZeroMemory(aSides, sizeof(aSides));
+
+    stScan.pOptions = pOptions;
+    stScan.pStats = &stStats;
+
+    aSides[OOC_LEFT].iSide = OOC_LEFT;
+    aSides[OOC_LEFT].pszRoot = pszLeftRoot;
+    aSides[OOC_RIGHT].iSide = OOC_RIGHT;
+    aSides[OOC_RIGHT].pszRoot = pszRightRoot;
+
+    cbCap = (pOptions->cbMemoryCap > 0) ? pOptions->cbMemoryCap : ((SIZE_T)OOC_DEFAULT_MEMORY_MB * 1024 * 1024);
+    stScan.nMaxRecords = max(cbCap / sizeof(OOC_RECORD), OOC_MIN_READ_RECORDS);
+    stScan.aRecords = (POOC_RECORD)malloc(stScan.nMaxRecords * sizeof(OOC_RECORD));
+    if (stScan.aRecords == NULL)
+    {
+        hr = E_OUTOFMEMORY;
+        goto done;
+    }
+
+    if (pOptions->fCompareHashes)
+    {
+        hr = HashFactoryInit(&stScan.hCrypt);
+        if (FAILED(hr))
+        {
+            goto done;
+        }
+    }
+
+    // Walk the trees one after the other, both through the same sort buffer
+    for (int iSide = 0; iSide < ARRAYSIZE(aSides); ++iSide)
+    {
+        POOC_SIDE pSide = &aSides[iSide];
+
+        pSide->pbPathBuf = (PBYTE)malloc(OOC_PATHBUF_BYTES);
+        if (pSide->pbPathBuf == NULL)
+        {
+            hr = E_OUTOFMEMORY;
+            goto done;
+        }
+
+        hr = _CreateTempFile(pOptions, &pSide->hPaths);
+        if (FAILED(hr))
+        {
+            goto done;
+        }
+
+        loginfo(L"Out-of-core scan of tree: %s", pSide->pszRoot);
+        hr = _ScanTree(&stScan, pSide);
+        if (FAILED(hr))
+        {
+            logerr(L"Cannot scan tree: %s, hr: %x", pSide->pszRoot, hr);
+            goto done;
+        }
+
+        stStats.anRuns[iSide] = pSide->nRuns;
+    }
+
+    // The sort buffer is done with, its share of the cap goes to the read buffers of the runs
+    free(stScan.aRecords);
+    stScan.aRecords = NULL;
+
+    nBufRecords = cbCap / sizeof(OOC_RECORD) / max(aSides[OOC_LEFT].nRuns + aSides[OOC_RIGHT].nRuns, 1);
+    nBufRecords = max(nBufRecords, OOC_MIN_READ_RECORDS);
+    nBufRecords = min(nBufRecords, OOC_IO_CHUNK_BYTES / sizeof(OOC_RECORD));
+
+    for (int iSide = 0; iSide < ARRAYSIZE(aSides); ++iSide)
+    {
+        hr = _StartMerge(&aSides[iSide], (DWORD)nBufRecords);
+        if (FAILED(hr))
+        {
+            goto done;
+        }
+    }
+
+    hr = _MergeSides(&stScan, &aSides[OOC_LEFT], &aSides[OOC_RIGHT]);
+    if (SUCCEEDED(hr))
+    {
+        loginfo(L"Out-of-core compare of %lld and %lld files in %d and %d runs found %lld and %lld duplicates",
+            stStats.anFiles[OOC_LEFT], stStats.anFiles[OOC_RIGHT], stStats.anRuns[OOC_LEFT], stStats.anRuns[OOC_RIGHT],
+            stStats.anDups[OOC_LEFT], stStats.anDups[OOC_RIGHT]);
+    }
+
+done:
+    // Closing the temporary files deletes them
+    _DestroySide(&aSides[OOC_LEFT]);
+    _DestroySide(&aSides[OOC_RIGHT]);
+
+    free(stScan.aRecords);
+    free(stScan.aaNamed[OOC_LEFT]);
+    free(stScan.aaNamed[OOC_RIGHT]);
+    if (stScan.hCrypt != NULL)
+    {
+        HashFactoryDestroy(stScan.hCrypt);
+    }
+
+    if (pStats != NULL)
+    {
+        *pStats = stStats;
+    }
+    return hr;
+}
+
+static HRESULT _CreateTempFile(_In_ POOC_OPTIONS pOptions, _Out_ HANDLE *phFile)
+{
+    HRESULT hr = S_OK;
+    WCHAR szTempDir[MAX_PATH];
+    WCHAR szTempFile[MAX_PATH];
+
+    *phFile = NULL;
+
+    PCWSTR pszTempDir = pOptions->pszTempDir;
+    if (pszTempDir == NULL)
+    {
+        if (GetTempPath(ARRAYSIZE(szTempDir), szTempDir) == 0)
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            logerr(L"Cannot get the temp folder, hr: %x", hr);
+            return hr;
+        }
+        pszTempDir = szTempDir;
+    }
+
+    if (GetTempFileName(pszTempDir, L"ooc", 0, szTempFile) == 0)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        logerr(L"Cannot create a temporary file in %s, hr: %x", pszTempDir, hr);
+        return hr;
+    }
+
+    HANDLE hFile = CreateFileW(szTempFile, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+        FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        logerr(L"Cannot open temporary file %s, hr: %x", szTempFile, hr);
+        DeleteFile(szTempFile);
+        return hr;
+    }
+
+    *phFile = hFile;
+    return S_OK;
+}
+
+static HRESULT _ReadAll(_In_ HANDLE hFile, _Out_bytecap_(cbData) void *pvData, _In_ DWORD cbData)
+{
+    DWORD cbRead;
+    if (!ReadFile(hFile, pvData, cbData, &cbRead, NULL))
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+    return (cbRead == cbData) ? S_OK : HRESULT_FROM_WIN32(ERROR_HANDLE_EOF);
+}
+
+// Breadth first, like BuildDirTree(), but the queue holds relative folder paths
+// instead of DIRINFOs and nothing of a folder is kept once it has been listed.
+static HRESULT _ScanTree(_In_ POOC_SCAN pScan, _In_ POOC_SIDE pSide)
+{
+    HRESULT hr;
+    PCHL_QUEUE pqFolders;
+    PWSTR pszRelFolder;
+
+    hr = CHL_DsCreateQ(&pqFolders, CHL_VT_POINTER, 20);
+    if (FAILED(hr))
+    {
+        logerr(L"Could not create queue for BFS. Rootpath: %s", pSide->pszRoot);
+        return hr;
+    }
+
+    pszRelFolder = _wcsdup(L"");
+    if (pszRelFolder == NULL)
+    {
+        hr = E_OUTOFMEMORY;
+        goto done;
+    }
+
+    do
+    {
+        hr = _ScanFolder(pScan, pSide, pszRelFolder, pqFolders);
+        free(pszRelFolder);
+        pszRelFolder = NULL;
+        if (FAILED(hr))
+        {
+            goto done;
+        }
+    } while (SUCCEEDED(pqFolders->Delete(pqFolders, &pszRelFolder, NULL, FALSE)));
+
+    // Whatever is left in the sort buffer is the last run
+    if (pScan->nRecords > 0)
+    {
+        hr = _WriteRun(pScan, pSide);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = _FlushPaths(pSide);
+    }
+
+done:
+    // Folders still queued after an error
+    while (SUCCEEDED(pqFolders->Delete(pqFolders, &pszRelFolder, NULL, FALSE)))
+    {
+        free(pszRelFolder);
+    }
+    pqFolders->Destroy(pqFolders);
+    return hr;
+}
+
+// A folder that cannot be listed is skipped with a warning, same as in BuildDirTree().
+// Only a failure to write the records fails the scan.
+static HRESULT _ScanFolder(_In_ POOC_SCAN pScan, _In_ POOC_SIDE pSide, _In_z_ PCWSTR pszRelFolder, _In_ PCHL_QUEUE pqFolders)
+{
+    WCHAR szFolder[MAX_PATH];
+    WCHAR szSearchpath[MAX_PATH];
+    WCHAR szRelPath[MAX_PATH];
+
+    if (FAILED(PathCchCombine(szFolder, ARRAYSIZE(szFolder), pSide->pszRoot, pszRelFolder))
+        || FAILED(PathCchCombine(szSearchpath, ARRAYSIZE(szSearchpath), szFolder, L"*")))
+    {
+        logwarn(L"Path too long, skipping folder %s under: %s", pszRelFolder, pSide->pszRoot);
+        return S_OK;
+    }
+
+    WIN32_FIND_DATA findData;
+    HANDLE hFindFile = FindFirstFile(szSearchpath, &findData);
+    if (hFindFile == INVALID_HANDLE_VALUE)
+    {
+        if (GetLastError() != ERROR_FILE_NOT_FOUND)
+        {
+            logwarn(L"Cannot list folder: %s", szFolder);
+        }
+        return S_OK;
+    }
+
+    HRESULT hr = S_OK;
+    do
+    {
+        // Skip banned files and folders
+        if (IsFileFolderBanned(findData.cFileName, ARRAYSIZE(findData.cFileName)))
+        {
+            continue;
+        }
+
+        if (FAILED(PathCchCombine(szRelPath, ARRAYSIZE(szRelPath), pszRelFolder, findData.cFileName)))
+        {
+            logwarn(L"PathCchCombine() failed for %s and %s", pszRelFolder, findData.cFileName);
+            continue;
+        }
+
+        if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+        {
+            PWSTR pszSubFolder = _wcsdup(szRelPath);
+            if ((pszSubFolder == NULL) || FAILED(pqFolders->Insert(pqFolders, pszSubFolder, sizeof pszSubFolder)))
+            {
+                logwarn(L"Unable to add sub dir [%s] to traversal queue, cur dir: %s", findData.cFileName, szFolder);
+                free(pszSubFolder);
+            }
+            continue;
+        }
+
+        hr = _AddFileRecord(pScan, pSide, szFolder, szRelPath, &findData);
+
+    } while (SUCCEEDED(hr) && FindNextFile(hFindFile, &findData));
+
+    FindClose(hFindFile);
+    return hr;
+}
+
+static HRESULT _AddFileRecord(
+    _In_ POOC_SCAN pScan,
+    _In_ POOC_SIDE pSide,
+    _In_z_ PCWSTR pszFolder,
+    _In_z_ PCWSTR pszRelPath,
+    _In_ WIN32_FIND_DATA *pFindData)
+{
+    HRESULT hr;
+    OOC_RECORD stRecord;
+
+    ZeroMemory(&stRecord, sizeof(stRecord));
+
+    // Names are matched case insensitively, by the same key as in memory
+    stRecord.ullNameHash = GetNameKey(pFindData->cFileName);
+
+    LARGE_INTEGER llSize;
+    llSize.HighPart = pFindData->nFileSizeHigh;
+    llSize.LowPart = pFindData->nFileSizeLow;
+    stRecord.llSize = llSize.QuadPart;
+
+    ULARGE_INTEGER ullModified;
+    ullModified.HighPart = pFindData->ftLastWriteTime.dwHighDateTime;
+    ullModified.LowPart = pFindData->ftLastWriteTime.dwLowDateTime;
+    stRecord.ullModified = ullModified.QuadPart - (ullModified.QuadPart % OOC_FILETIME_PER_MS);
+
+    if (pScan->pOptions->fCompareHashes)
+    {
+        WCHAR szFilepath[MAX_PATH];
+        if (FAILED(PathCchCombine(szFilepath, ARRAYSIZE(szFilepath), pszFolder, pFindData->cFileName)))
+        {
+            logwarn(L"PathCchCombine() failed for %s and %s", pszFolder, pFindData->cFileName);
+            return S_OK;
+        }
+
+        HANDLE hFile = CreateFileW(szFilepath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hFile == INVALID_HANDLE_VALUE)
+        {
+            logwarn(L"Failed to open file %s", szFilepath);
+            return S_OK;
+        }
+
+        hr = CalculateSHA1(pScan->hCrypt, hFile, stRecord.abHash);
+        CloseHandle(hFile);
+        if (FAILED(hr))
+        {
+            logwarn(L"Failed to compute hash (0x%08x) for file: %s", hr, szFilepath);
+            return S_OK;
+        }
+    }
+
+    hr = _AppendPath(pSide, pszRelPath, &stRecord.ullPathRef);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    if (pScan->nRecords == pScan->nMaxRecords)
+    {
+        hr = _WriteRun(pScan, pSide);
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+    }
+
+    pScan->aRecords[pScan->nRecords++] = stRecord;
+    ++(pScan->pStats->anFiles[pSide->iSide]);
+    return S_OK;
+}
+
+static HRESULT _AppendPath(_In_ POOC_SIDE pSide, _In_z_ PCWSTR pszRelPath, _Out_ UINT64 *pullPathRef)
+{
+    WORD cchPath = (WORD)wcsnlen(pszRelPath, MAX_PATH - 1);
+    DWORD cbEntry = sizeof(WORD) + (cchPath * sizeof(WCHAR));
+
+    if (pSide->cbPathBuf + cbEntry > OOC_PATHBUF_BYTES)
+    {
+        HRESULT hr = _FlushPaths(pSide);
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+    }
+
+    *pullPathRef = pSide->cbPaths + pSide->cbPathBuf;
+    memcpy(pSide->pbPathBuf + pSide->cbPathBuf, &cchPath, sizeof(WORD));
+    memcpy(pSide->pbPathBuf + pSide->cbPathBuf + sizeof(WORD), pszRelPath, cchPath * sizeof(WCHAR));
+    pSide->cbPathBuf += cbEntry;
+    return S_OK;
+}
+
+static HRESULT _FlushPaths(_In_ POOC_SIDE pSide)
+{
+    HRESULT hr = WriteAllToFile(pSide->hPaths, pSide->pbPathBuf, pSide->cbPathBuf);
+    if (FAILED(hr))
+    {
+        logerr(L"Cannot write paths of tree: %s, hr: %x", pSide->pszRoot, hr);
+        return hr;
+    }
+
+    pSide->cbPaths += pSide->cbPathBuf;
+    pSide->cbPathBuf = 0;
+    return S_OK;
+}
+
+static HRESULT _ReadPath(_In_ POOC_SIDE pSide, _In_ UINT64 ullPathRef, _Out_writes_(MAX_PATH) PWSTR pszPath)
+{
+    HRESULT hr;
+    LARGE_INTEGER llOffset;
+    WORD cchPath;
+
+    pszPath[0] = 0;
+
+    llOffset.QuadPart = (LONGLONG)ullPathRef;
+    if (!SetFilePointerEx(pSide->hPaths, llOffset, NULL, FILE_BEGIN))
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    hr = _ReadAll(pSide->hPaths, &cchPath, sizeof(cchPath));
+    if (SUCCEEDED(hr) && (cchPath >= MAX_PATH))
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = _ReadAll(pSide->hPaths, pszPath, cchPath * sizeof(WCHAR));
+    }
+
+    if (FAILED(hr))
+    {
+        logerr(L"Cannot read path at %llu of tree: %s, hr: %x", ullPathRef, pSide->pszRoot, hr);
+        return hr;
+    }
+
+    pszPath[cchPath] = 0;
+    return S_OK;
+}
+
+static HRESULT _WriteRun(_In_ POOC_SCAN pScan, _In_ POOC_SIDE pSide)
+{
+    HRESULT hr;
+    HANDLE hFile;
+
+    if (pSide->nRuns == pSide->nMaxRuns)
+    {
+        int nMaxRuns = (pSide->nMaxRuns > 0) ? (pSide->nMaxRuns * 2) : 16;
+        POOC_RUN aRuns = (POOC_RUN)realloc(pSide->aRuns, nMaxRuns * sizeof(OOC_RUN));
+        if (aRuns == NULL)
+        {
+            return E_OUTOFMEMORY;
+        }
+
+        pSide->aRuns = aRuns;
+        pSide->nMaxRuns = nMaxRuns;
+    }
+
+    qsort(pScan->aRecords, pScan->nRecords, sizeof(OOC_RECORD), _CmpRecords);
+
+    hr = _CreateTempFile(pScan->pOptions, &hFile);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    hr = WriteAllToFile(hFile, pScan->aRecords, pScan->nRecords * sizeof(OOC_RECORD));
+    if (FAILED(hr))
+    {
+        logerr(L"Cannot write run %d of tree: %s, hr: %x", pSide->nRuns, pSide->pszRoot, hr);
+        CloseHandle(hFile);
+        return hr;
+    }
+
+    POOC_RUN pRun = &pSide->aRuns[pSide->nRuns++];
+    ZeroMemory(pRun, sizeof(*pRun));
+    pRun->hFile = hFile;
+    pRun->nRecords = pScan->nRecords;
+
+    logdbg(L"Wrote run %d of %Iu files of tree: %s", pSide->nRuns, pScan->nRecords, pSide->pszRoot);
+    pScan->nRecords = 0;
+    return S_OK;
+}
+
+static HRESULT _StartMerge(_In_ POOC_SIDE pSide, _In_ DWORD nBufRecords)
+{
+    pSide->aiHeap = (int*)malloc(max(pSide->nRuns, 1) * sizeof(int));
+    if (pSide->aiHeap == NULL)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    for (int iRun = 0; iRun < pSide->nRuns; ++iRun)
+    {
+        POOC_RUN pRun = &pSide->aRuns[iRun];
+
+        pRun->aBuf = (POOC_RECORD)malloc(nBufRecords * sizeof(OOC_RECORD));
+        if (pRun->aBuf == NULL)
+        {
+            return E_OUTOFMEMORY;
+        }
+        pRun->nBufCap = nBufRecords;
+
+        LARGE_INTEGER llStart;
+        llStart.QuadPart = 0;
+        if (!SetFilePointerEx(pRun->hFile, llStart, NULL, FILE_BEGIN))
+        {
+            return HRESULT_FROM_WIN32(GetLastError());
+        }
+
+        HRESULT hr = _FillRun(pRun);
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+
+        if (pRun->nBuf > 0)
+        {
+            pSide->aiHeap[pSide->nHeap++] = iRun;
+        }
+    }
+
+    for (int iHeap = (pSide->nHeap / 2) - 1; iHeap >= 0; --iHeap)
+    {
+        _SiftDown(pSide, iHeap);
+    }
+    return S_OK;
+}
+
+// Read the next records of the run. nBuf is 0 once the run is read to the end.
+static HRESULT _FillRun(_In_ POOC_RUN pRun)
+{
+    DWORD nRecords = (DWORD)min((UINT64)pRun->nBufCap, pRun->nRecords - pRun->nRead);
+    if (nRecords > 0)
+    {
+        HRESULT hr = _ReadAll(pRun->hFile, pRun->aBuf, nRecords * sizeof(OOC_RECORD));
+        if (FAILED(hr))
+        {
+            logerr(L"Cannot read run, hr: %x", hr);
+            return hr;
+        }
+    }
+
+    pRun->nRead += nRecords;
+    pRun->nBuf = nRecords;
+    pRun->iBuf = 0;
+    return S_OK;
+}
+
+// Smallest record of the side not consumed yet, NULL once all runs are consumed
+static POOC_RECORD _PeekSide(_In_ POOC_SIDE pSide)
+{
+    if (pSide->nHeap == 0)
+    {
+        return NULL;
+    }
+
+    POOC_RUN pRun = &pSide->aRuns[pSide->aiHeap[0]];
+    return &pRun->aBuf[pRun->iBuf];
+}
+
+static HRESULT _PopSide(_In_ POOC_SIDE pSide)
+{
+    SB_ASSERT(pSide->nHeap > 0);
+
+    POOC_RUN pRun = &pSide->aRuns[pSide->aiHeap[0]];
+    if (++(pRun->iBuf) == pRun->nBuf)
+    {
+        HRESULT hr = _FillRun(pRun);
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+
+        if (pRun->nBuf == 0)
+        {
+            pSide->aiHeap[0] = pSide->aiHeap[--(pSide->nHeap)];
+        }
+    }
+
+    if (pSide->nHeap > 1)
+    {
+        _SiftDown(pSide, 0);
+    }
+    return S_OK;
+}
+
+static void _SiftDown(_In_ POOC_SIDE pSide, _In_ int iHeap)
+{
+    int *aiHeap = pSide->aiHeap;
+    for (;;)
+    {
+        int iSmallest = iHeap;
+        int iChild = (iHeap * 2) + 1;
+        for (int i = iChild; (i < iChild + 2) && (i < pSide->nHeap); ++i)
+        {
+            POOC_RUN pChild = &pSide->aRuns[aiHeap[i]];
+            POOC_RUN pSmallest = &pSide->aRuns[aiHeap[iSmallest]];
+            if (_CmpRecords(&pChild->aBuf[pChild->iBuf], &pSmallest->aBuf[pSmallest->iBuf]) < 0)
+            {
+                iSmallest = i;
+            }
+        }
+
+        if (iSmallest == iHeap)
+        {
+            break;
+        }
+
+        int iTemp = aiHeap[iHeap];
+        aiHeap[iHeap] = aiHeap[iSmallest];
+        aiHeap[iSmallest] = iTemp;
+        iHeap = iSmallest;
+    }
+}
+
+// Walk the two merged sides together, the same way MergeSortedFiles() walks two arrays
+static HRESULT _MergeSides(_In_ POOC_SCAN pScan, _In_ POOC_SIDE pLeft, _In_ POOC_SIDE pRight)
+{
+    HRESULT hr = S_OK;
+    BOOL fCompareHashes = pScan->pOptions->fCompareHashes;
+    POOC_RECORD pLeftRecord;
+    POOC_RECORD pRightRecord;
+
+    while (SUCCEEDED(hr) && ((pLeftRecord = _PeekSide(pLeft)) != NULL) && ((pRightRecord = _PeekSide(pRight)) != NULL))
+    {
+        int iCmp = _CompareMatchKeys(fCompareHashes, pLeftRecord, pRightRecord);
+        if (iCmp < 0)
+        {
+            hr = _PopSide(pLeft);
+        }
+        else if (iCmp > 0)
+        {
+            hr = _PopSide(pRight);
+        }
+        else
+        {
+            // Copy the key, the record it is in may be overwritten by a refill
+            OOC_RECORD stKey = *pLeftRecord;
+            if (fCompareHashes)
+            {
+                hr = _ReportRun(pScan, pLeft, &stKey);
+                if (SUCCEEDED(hr))
+                {
+                    hr = _ReportRun(pScan, pRight, &stKey);
+                }
+            }
+            else
+            {
+                hr = _MarkNameRun(pScan, pLeft, pRight, &stKey);
+            }
+        }
+    }
+    return hr;
+}
+
+// Files with the same hash are all duplicates, so a run is reported as it is consumed
+// and can be of any length.
+static HRESULT _ReportRun(_In_ POOC_SCAN pScan, _In_ POOC_SIDE pSide, _In_ POOC_RECORD pKey)
+{
+    HRESULT hr = S_OK;
+    POOC_RECORD pRecord;
+    WCHAR szPath[MAX_PATH];
+
+    while (SUCCEEDED(hr) && ((pRecord = _PeekSide(pSide)) != NULL) && (_CompareMatchKeys(TRUE, pRecord, pKey) == 0))
+    {
+        hr = _ReadPath(pSide, pRecord->ullPathRef, szPath);
+        if (SUCCEEDED(hr))
+        {
+            _Report(pScan, pSide->iSide, pRecord, szPath);
+            hr = _PopSide(pSide);
+        }
+    }
+    return hr;
+}
+
+// Same name hash, size and modified time. Almost always the names are the same too,
+// but a file is reported only if a file of the other side has exactly its name.
+static HRESULT _MarkNameRun(_In_ POOC_SCAN pScan, _In_ POOC_SIDE pLeft, _In_ POOC_SIDE pRight, _In_ POOC_RECORD pKey)
+{
+    HRESULT hr = _CollectRun(pScan, pLeft, pKey);
+    if (SUCCEEDED(hr))
+    {
+        hr = _CollectRun(pScan, pRight, pKey);
+    }
+
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    for (int iSide = 0; iSide < 2; ++iSide)
+    {
+        POOC_NAMED_RECORD aThis = pScan->aaNamed[iSide];
+        POOC_NAMED_RECORD aOther = pScan->aaNamed[1 - iSide];
+
+        for (int i = 0; i < pScan->anNamed[iSide]; ++i)
+        {
+            PCWSTR pszName = CHL_SzGetFilenameFromPath(aThis[i].szPath, (int)wcslen(aThis[i].szPath));
+            for (int j = 0; j < pScan->anNamed[1 - iSide]; ++j)
+            {
+                PCWSTR pszOtherName = CHL_SzGetFilenameFromPath(aOther[j].szPath, (int)wcslen(aOther[j].szPath));
+                if (CompareNames(pszName, pszOtherName) == 0)
+                {
+                    _Report(pScan, iSide, &aThis[i].stRecord, aThis[i].szPath);
+                    break;
+                }
+            }
+        }
+    }
+    return S_OK;
+}
+
+// Consume the records of the side with the specified key into aaNamed, along with their paths
+static HRESULT _CollectRun(_In_ POOC_SCAN pScan, _In_ POOC_SIDE pSide, _In_ POOC_RECORD pKey)
+{
+    HRESULT hr = S_OK;
+    int iSide = pSide->iSide;
+    POOC_RECORD pRecord;
+
+    pScan->anNamed[iSide] = 0;
+    while (SUCCEEDED(hr) && ((pRecord = _PeekSide(pSide)) != NULL) && (_CompareMatchKeys(FALSE, pRecord, pKey) == 0))
+    {
+        if (pScan->anNamed[iSide] == pScan->anMaxNamed[iSide])
+        {
+            int nMaxNamed = (pScan->anMaxNamed[iSide] > 0) ? (pScan->anMaxNamed[iSide] * 2) : 8;
+            POOC_NAMED_RECORD aNamed = (POOC_NAMED_RECORD)realloc(pScan->aaNamed[iSide], nMaxNamed * sizeof(OOC_NAMED_RECORD));
+            if (aNamed == NULL)
+            {
+                return E_OUTOFMEMORY;
+            }
+
+            pScan->aaNamed[iSide] = aNamed;
+            pScan->anMaxNamed[iSide] = nMaxNamed;
+        }
+
+        POOC_NAMED_RECORD pNamed = &pScan->aaNamed[iSide][pScan->anNamed[iSide]];
+        pNamed->stRecord = *pRecord;
+        hr = _ReadPath(pSide, pRecord->ullPathRef, pNamed->szPath);
+        if (SUCCEEDED(hr))
+        {
+            ++(pScan->anNamed[iSide]);
+            hr = _PopSide(pSide);
+        }
+    }
+    return hr;
+}
+
+static void _Report(_In_ POOC_SCAN pScan, _In_ int iSide, _In_ POOC_RECORD pRecord, _In_z_ PCWSTR pszPath)
+{
+    ++(pScan->pStats->anDups[iSide]);
+    pScan->pStats->allDupBytes[iSide] += pRecord->llSize;
+
+    if (pScan->pOptions->pfnDuplicate != NULL)
+    {
+        pScan->pOptions->pfnDuplicate(iSide, pszPath, pRecord->llSize, pScan->pOptions->pvContext);
+    }
+}
+
+static void _DestroySide(_In_ POOC_SIDE pSide)
+{
+    for (int iRun = 0; iRun < pSide->nRuns; ++iRun)
+    {
+        CloseHandle(pSide->aRuns[iRun].hFile);
+        free(pSide->aRuns[iRun].aBuf);
+    }
+
+    if (pSide->hPaths != NULL)
+    {
+        CloseHandle(pSide->hPaths);
+    }
+
+    free(pSide->aRuns);
+    free(pSide->aiHeap);
+    free(pSide->pbPathBuf);
+    ZeroMemory(pSide, sizeof(*pSide));
+}
+
+// With hash compare only the hash has to match. Otherwise the whole key has to,
+// and the hash part is zero on both sides.
+static int _CompareMatchKeys(_In_ BOOL fCompareHashes, _In_ const OOC_RECORD *pLeft, _In_ const OOC_RECORD *pRight)
+{
+    if (fCompareHashes)
+    {
+        return memcmp(pLeft->abHash, pRight->abHash, HASHLEN_SHA1);
+    }
+    return _CmpRecords(pLeft, pRight);
+}
+
+static int __cdecl _CmpRecords(const void *pvLeft, const void *pvRight)
+{
+    const OOC_RECORD *pLeft = (const OOC_RECORD*)pvLeft;
+    const OOC_RECORD *pRight = (const OOC_RECORD*)pvRight;
+
+    int iCmp = memcmp(pLeft->abHash, pRight->abHash, HASHLEN_SHA1);
+    if (iCmp != 0)
+    {
+        return iCmp;
+    }
+
+    if (pLeft->ullNameHash != pRight->ullNameHash)
+    {
+        return (pLeft->ullNameHash < pRight->ullNameHash) ? -1 : 1;
+    }
+
+    if (pLeft->llSize != pRight->llSize)
+    {
+        return (pLeft->llSize < pRight->llSize) ? -1 : 1;
+    }
+
+    if (pLeft->ullModified != pRight->ullModified)
+    {
+        return (pLeft->ullModified < pRight->ullModified) ? -1 : 1;
+    }
+    return 0;
+}
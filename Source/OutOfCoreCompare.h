@@ -0,0 +1,87 @@
+#pragma once
+
+// ---------------------------------------------------
+// The FDiffDelete Project
+// Github: https://github.com/shishir993/fdiffdelete
+// Author: Shishir Bhat
+// The MIT License (MIT)
+// Copyright (c) 2014
+//
+
+#include "Common.h"
+#include "HashFactory.h"
+
+// Out-of-core compare of two dir trees that do not fit in memory as DIRINFOs.
+// No FILEINFO is built. The walk writes one small fixed-size record per file into
+// a buffer of at most cbMemoryCap bytes, and the relative path of the file into a
+// paths file. Each time the buffer fills up it is sorted and written out as a run.
+// The runs of each tree are then merged, and both merged streams are walked together
+// just like the sort-merge engine walks two sorted arrays.
+// Matching is the same as the in-memory engines: by hash with hash compare, else by
+// name (case insensitive), size and modified time. Only files are reported, folders
+// are walked but not matched.
+// All run and paths files are temporary and are deleted when the compare is done.
+
+#define OOC_DEFAULT_MEMORY_MB   256
+
+// Smallest read buffer of a run during the merge, however low the memory cap
+#define OOC_MIN_READ_RECORDS    1024
+
+#define OOC_LEFT                0
+#define OOC_RIGHT               1
+
+// On-disk record of one file. The runs are sorted by abHash, then name hash,
+// then size and then modified time.
+typedef struct _OocRecord
+{
+    // Hash of the file contents, zero unless comparing hashes
+    BYTE abHash[HASHLEN_SHA1];
+
+    // Name key of the filename, see NameKey.h. Equal keys are confirmed with the names.
+    UINT64 ullNameHash;
+
+    LONGLONG llSize;
+
+    // Last write time, truncated to milliseconds like the SYSTEMTIME of a FILEINFO
+    UINT64 ullModified;
+
+    // Offset of the file's relative path in the paths file of its tree
+    UINT64 ullPathRef;
+
+} OOC_RECORD, *POOC_RECORD;
+
+// Called once for every file that has a duplicate in the other tree
+typedef void (*PFN_OOC_DUPLICATE)(_In_ int iSide, _In_z_ PCWSTR pszRelPath, _In_ LONGLONG llSize, _In_opt_ PVOID pvContext);
+
+typedef struct _OocOptions
+{
+    BOOL fCompareHashes;
+
+    // Bytes of records held in memory at once, while sorting and while merging.
+    // The folders waiting to be walked are not counted.
+    SIZE_T cbMemoryCap;
+
+    // Folder for the temporary files, the user's temp folder if NULL
+    PCWSTR pszTempDir;
+
+    PFN_OOC_DUPLICATE pfnDuplicate;
+    PVOID pvContext;
+
+} OOC_OPTIONS, *POOC_OPTIONS;
+
+typedef struct _OocStats
+{
+    // Indexed by OOC_LEFT and OOC_RIGHT
+    LONGLONG anFiles[2];
+    int anRuns[2];
+    LONGLONG anDups[2];
+    LONGLONG allDupBytes[2];
+
+} OOC_STATS, *POOC_STATS;
+
+// Walk both trees and report every file that has a duplicate in the other tree
+HRESULT CompareTreesOutOfCore(
+    _In_z_ PCWSTR pszLeftRoot,
+    _In_z_ PCWSTR pszRightRoot,
+    _In_ POOC_OPTIONS pOptions,
+    _Out_opt_ POOC_STATS pStats);
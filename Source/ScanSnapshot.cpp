@@ -0,0 +1,1194 @@
+
+// ---------------------------------------------------
+// The FDiffDelete Project
+// Github: https://github.com/shishir993/fdiffdelete
+// Author: Shishir Bhat
+// The MIT License (MIT)
+// Copyright (c) 2014
+//
+
+#include "ScanSnapshot.h"
+#include "DirectoryWalker_SortMerge.h"
+#include "DirectoryWalker_Util.h"
+#include "DirectoryWalker.h"
+#include "DirectoryWalker_Hashes.h"
+#include "DirectoryWalker_Merkle.h"
+#include "NameKey.h"
+#include "BloomFilter.h"
+#include "FileFormatUtil.h"
+
+#define INIT_SNAPSHOT_ENTRIES       1024
+
+#define SNAPSHOT_ALIGN(cb)          (((cb) + 7) & ~((UINT64)7))
+
+// Tables of a snapshot being built
+struct _SnapshotBuilder
+{
+    // Relative folder path to its index
+    PCHL_HTABLE phtFolders;
+
+    // Exact spelling of a filename to its index
+    PCHL_HTABLE phtNames;
+
+    DWORD *aichFolders;
+    DWORD nFolders;
+    DWORD nMaxFolders;
+
+    PSNAPSHOT_NAME aNames;
+    DWORD nNames;
+    DWORD nMaxNames;
+
+    PWSTR pszStrings;
+    DWORD cchStrings;
+    DWORD cchMaxStrings;
+
+    PSNAPSHOT_FILE aFiles;
+    DWORD nFiles;
+    DWORD nMaxFiles;
+
+    // Built by FinishSnapshotBuilder()
+    DWORD *aiByHash;
+    DWORD nHashed;
+};
+
+typedef struct _SnapshotBuilder SNAPSHOT_BUILDER;
+
+static HRESULT _AddString(_In_ PSNAPSHOT_BUILDER pBuilder, _In_z_ PCWSTR psz, _Out_ DWORD *pichString, _Out_ DWORD *pcchString)
+{
+    DWORD cch = (DWORD)wcsnlen(psz, MAX_PATH);
+    HRESULT hr = GrowArray((void**)&pBuilder->pszStrings, &pBuilder->cchMaxStrings, pBuilder->cchStrings + cch + 1, INIT_SNAPSHOT_ENTRIES, sizeof(WCHAR));
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    CopyMemory(pBuilder->pszStrings + pBuilder->cchStrings, psz, cch * sizeof(WCHAR));
+    pBuilder->pszStrings[pBuilder->cchStrings + cch] = 0;
+
+    *pichString = pBuilder->cchStrings;
+    *pcchString = cch;
+    pBuilder->cchStrings += cch + 1;
+    return S_OK;
+}
+
+static HRESULT _GetFolderIndex(_In_ PSNAPSHOT_BUILDER pBuilder, _In_z_ PCWSTR pszRelFolder, _Out_ DWORD *piFolder)
+{
+    int iFolder;
+    if (SUCCEEDED(CHL_DsFindHT(pBuilder->phtFolders, pszRelFolder, StringSizeBytes(pszRelFolder), &iFolder, NULL, FALSE)))
+    {
+        *piFolder = (DWORD)iFolder;
+        return S_OK;
+    }
+
+    HRESULT hr = GrowArray((void**)&pBuilder->aichFolders, &pBuilder->nMaxFolders, pBuilder->nFolders + 1, INIT_SNAPSHOT_ENTRIES, sizeof(DWORD));
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    DWORD cchFolder;
+    hr = _AddString(pBuilder, pszRelFolder, &pBuilder->aichFolders[pBuilder->nFolders], &cchFolder);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    iFolder = (int)pBuilder->nFolders;
+    hr = CHL_DsInsertHT(pBuilder->phtFolders, pszRelFolder, StringSizeBytes(pszRelFolder), (PCVOID)(INT_PTR)iFolder, sizeof(iFolder));
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    ++(pBuilder->nFolders);
+    *piFolder = (DWORD)iFolder;
+    return S_OK;
+}
+
+static HRESULT _GetNameIndex(_In_ PSNAPSHOT_BUILDER pBuilder, _In_z_ PCWSTR pszName, _Out_ DWORD *piName)
+{
+    int iName;
+    if (SUCCEEDED(CHL_DsFindHT(pBuilder->phtNames, pszName, StringSizeBytes(pszName), &iName, NULL, FALSE)))
+    {
+        *piName = (DWORD)iName;
+        return S_OK;
+    }
+
+    HRESULT hr = GrowArray((void**)&pBuilder->aNames, &pBuilder->nMaxNames, pBuilder->nNames + 1, INIT_SNAPSHOT_ENTRIES, sizeof(SNAPSHOT_NAME));
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    PSNAPSHOT_NAME pName = &pBuilder->aNames[pBuilder->nNames];
+    hr = _AddString(pBuilder, pszName, &pName->ichName, &pName->cchName);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+    pName->ullNameKey = GetNameKey(pszName);
+
+    iName = (int)pBuilder->nNames;
+    hr = CHL_DsInsertHT(pBuilder->phtNames, pszName, StringSizeBytes(pszName), (PCVOID)(INT_PTR)iName, sizeof(iName));
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    ++(pBuilder->nNames);
+    *piName = (DWORD)iName;
+    return S_OK;
+}
+
+// Name key, then folder, then name, both ignoring case. See SNAPSHOT_FILE.
+static int __cdecl _CmpFilesByName(_In_ void *pvContext, _In_ const void *pvLeft, _In_ const void *pvRight)
+{
+    PSNAPSHOT_BUILDER pBuilder = (PSNAPSHOT_BUILDER)pvContext;
+    const SNAPSHOT_FILE *pLeft = (const SNAPSHOT_FILE*)pvLeft;
+    const SNAPSHOT_FILE *pRight = (const SNAPSHOT_FILE*)pvRight;
+
+    UINT64 ullLeftKey = pBuilder->aNames[pLeft->iName].ullNameKey;
+    UINT64 ullRightKey = pBuilder->aNames[pRight->iName].ullNameKey;
+    if (ullLeftKey != ullRightKey)
+    {
+        return (ullLeftKey < ullRightKey) ? -1 : 1;
+    }
+
+    return CompareSnapshotPaths(
+        pBuilder->pszStrings + pBuilder->aichFolders[pLeft->iFolder],
+        pBuilder->pszStrings + pBuilder->aNames[pLeft->iName].ichName,
+        pBuilder->pszStrings + pBuilder->aichFolders[pRight->iFolder],
+        pBuilder->pszStrings + pBuilder->aNames[pRight->iName].ichName);
+}
+
+// Hash, then position in the name order
+static int __cdecl _CmpIndexesByHash(_In_ void *pvContext, _In_ const void *pvLeft, _In_ const void *pvRight)
+{
+    const SNAPSHOT_FILE *aFiles = (const SNAPSHOT_FILE*)pvContext;
+    DWORD iLeft = *(const DWORD*)pvLeft;
+    DWORD iRight = *(const DWORD*)pvRight;
+
+    int cmp = memcmp(aFiles[iLeft].abHash, aFiles[iRight].abHash, HASHLEN_SHA1);
+    if (cmp == 0)
+    {
+        cmp = (iLeft < iRight) ? -1 : ((iLeft > iRight) ? 1 : 0);
+    }
+    return cmp;
+}
+
+HRESULT CreateSnapshotBuilder(_Out_ PSNAPSHOT_BUILDER *ppBuilder)
+{
+    SB_ASSERT(ppBuilder);
+
+    PSNAPSHOT_BUILDER pBuilder = (PSNAPSHOT_BUILDER)malloc(sizeof(SNAPSHOT_BUILDER));
+    if (pBuilder == NULL)
+    {
+        *ppBuilder = NULL;
+        return E_OUTOFMEMORY;
+    }
+
+    ZeroMemory(pBuilder, sizeof(*pBuilder));
+    HRESULT hr = CHL_DsCreateHT(&pBuilder->phtFolders, INIT_SNAPSHOT_ENTRIES, CHL_KT_WSTRING, CHL_VT_INT32, FALSE);
+    if (SUCCEEDED(hr))
+    {
+        hr = CHL_DsCreateHT(&pBuilder->phtNames, INIT_SNAPSHOT_ENTRIES, CHL_KT_WSTRING, CHL_VT_INT32, FALSE);
+    }
+
+    if (FAILED(hr))
+    {
+        logerr(L"Cannot create snapshot tables, hr: %x", hr);
+        DestroySnapshotBuilder(pBuilder);
+        pBuilder = NULL;
+    }
+
+    *ppBuilder = pBuilder;
+    return hr;
+}
+
+HRESULT AddSnapshotFile(
+    _In_ PSNAPSHOT_BUILDER pBuilder,
+    _In_z_ PCWSTR pszRelFolder,
+    _In_z_ PCWSTR pszName,
+    _In_ const SNAPSHOT_FILE *pFile)
+{
+    SB_ASSERT(pBuilder);
+    SB_ASSERT(pszRelFolder);
+    SB_ASSERT(pszName);
+    SB_ASSERT(pFile);
+
+    HRESULT hr = GrowArray((void**)&pBuilder->aFiles, &pBuilder->nMaxFiles, pBuilder->nFiles + 1, INIT_SNAPSHOT_ENTRIES, sizeof(SNAPSHOT_FILE));
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    PSNAPSHOT_FILE pRecord = &pBuilder->aFiles[pBuilder->nFiles];
+    *pRecord = *pFile;
+
+    hr = _GetFolderIndex(pBuilder, pszRelFolder, &pRecord->iFolder);
+    if (SUCCEEDED(hr))
+    {
+        hr = _GetNameIndex(pBuilder, pszName, &pRecord->iName);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        ++(pBuilder->nFiles);
+    }
+    return hr;
+}
+
+void DestroySnapshotBuilder(_In_ PSNAPSHOT_BUILDER pBuilder)
+{
+    SB_ASSERT(pBuilder);
+
+    if (pBuilder->phtFolders != NULL)
+    {
+        CHL_DsDestroyHT(pBuilder->phtFolders);
+    }
+    if (pBuilder->phtNames != NULL)
+    {
+        CHL_DsDestroyHT(pBuilder->phtNames);
+    }
+
+    free(pBuilder->aichFolders);
+    free(pBuilder->aNames);
+    free(pBuilder->pszStrings);
+    free(pBuilder->aFiles);
+    free(pBuilder->aiByHash);
+    free(pBuilder);
+}
+
+// Sort the files into the name order and build the hash index
+static HRESULT _SortBuilder(_In_ PSNAPSHOT_BUILDER pBuilder, _In_ BOOL fHashes)
+{
+    qsort_s(pBuilder->aFiles, pBuilder->nFiles, sizeof(SNAPSHOT_FILE), _CmpFilesByName, pBuilder);
+
+    if (!fHashes)
+    {
+        return S_OK;
+    }
+
+    pBuilder->aiByHash = (DWORD*)malloc(max(pBuilder->nFiles, 1) * sizeof(DWORD));
+    if (pBuilder->aiByHash == NULL)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    for (DWORD i = 0; i < pBuilder->nFiles; ++i)
+    {
+        if ((pBuilder->aFiles[i].dwFlags & (SNAPSHOT_FILE_DIRECTORY | SNAPSHOT_FILE_HASH_VALID)) == SNAPSHOT_FILE_HASH_VALID)
+        {
+            pBuilder->aiByHash[pBuilder->nHashed++] = i;
+        }
+    }
+    qsort_s(pBuilder->aiByHash, pBuilder->nHashed, sizeof(DWORD), _CmpIndexesByHash, pBuilder->aFiles);
+    return S_OK;
+}
+
+// Lay out the sections of a built snapshot in one buffer, as they are in the file
+static HRESULT _CreateImage(
+    _In_ PSNAPSHOT_BUILDER pBuilder,
+    _In_z_ PCWSTR pszRoot,
+    _In_ DWORD dwFlags,
+    _Out_ PBYTE *ppbImage,
+    _Out_ UINT64 *pcbImage)
+{
+    SNAPSHOT_HEADER stHeader;
+    ZeroMemory(&stHeader, sizeof(stHeader));
+
+    stHeader.dwMagic = SNAPSHOT_MAGIC;
+    stHeader.dwVersion = SNAPSHOT_VERSION;
+    stHeader.cbHeader = sizeof(stHeader);
+    stHeader.dwFlags = dwFlags;
+    GetSystemTimeAsFileTime(&stHeader.ftSaved);
+    stHeader.nFiles = pBuilder->nFiles;
+    stHeader.nFolders = pBuilder->nFolders;
+    stHeader.nNames = pBuilder->nNames;
+    stHeader.cchStrings = pBuilder->cchStrings;
+    stHeader.nHashed = pBuilder->nHashed;
+    StringCchCopy(stHeader.szRoot, ARRAYSIZE(stHeader.szRoot), pszRoot);
+
+    UINT64 cbImage = SNAPSHOT_ALIGN(sizeof(stHeader));
+    stHeader.ullFilesOffset = cbImage;
+    cbImage += SNAPSHOT_ALIGN((UINT64)pBuilder->nFiles * sizeof(SNAPSHOT_FILE));
+    stHeader.ullFoldersOffset = cbImage;
+    cbImage += SNAPSHOT_ALIGN((UINT64)pBuilder->nFolders * sizeof(DWORD));
+    stHeader.ullNamesOffset = cbImage;
+    cbImage += SNAPSHOT_ALIGN((UINT64)pBuilder->nNames * sizeof(SNAPSHOT_NAME));
+    stHeader.ullStringsOffset = cbImage;
+    cbImage += SNAPSHOT_ALIGN((UINT64)pBuilder->cchStrings * sizeof(WCHAR));
+    if (dwFlags & SNAPSHOT_FLAG_HASHES)
+    {
+        stHeader.ullHashIndexOffset = cbImage;
+        cbImage += SNAPSHOT_ALIGN((UINT64)pBuilder->nHashed * sizeof(DWORD));
+    }
+
+    // Padding between the sections is zero
+    PBYTE pbImage = (cbImage <= (SIZE_T)-1) ? (PBYTE)calloc((SIZE_T)cbImage, 1) : NULL;
+    if (pbImage == NULL)
+    {
+        logerr(L"Out of memory for snapshot of %I64u bytes", cbImage);
+        return E_OUTOFMEMORY;
+    }
+
+    CopyMemory(pbImage, &stHeader, sizeof(stHeader));
+    CopyMemory(pbImage + stHeader.ullFilesOffset, pBuilder->aFiles, (SIZE_T)pBuilder->nFiles * sizeof(SNAPSHOT_FILE));
+    CopyMemory(pbImage + stHeader.ullFoldersOffset, pBuilder->aichFolders, (SIZE_T)pBuilder->nFolders * sizeof(DWORD));
+    CopyMemory(pbImage + stHeader.ullNamesOffset, pBuilder->aNames, (SIZE_T)pBuilder->nNames * sizeof(SNAPSHOT_NAME));
+    CopyMemory(pbImage + stHeader.ullStringsOffset, pBuilder->pszStrings, (SIZE_T)pBuilder->cchStrings * sizeof(WCHAR));
+    if (dwFlags & SNAPSHOT_FLAG_HASHES)
+    {
+        CopyMemory(pbImage + stHeader.ullHashIndexOffset, pBuilder->aiByHash, (SIZE_T)pBuilder->nHashed * sizeof(DWORD));
+    }
+
+    *ppbImage = pbImage;
+    *pcbImage = cbImage;
+    return S_OK;
+}
+
+// Point an open snapshot into its view, which must have been checked
+static void _AttachView(_Inout_ PSCAN_SNAPSHOT pSnapshot, _In_ PVOID pvView, _In_ UINT64 cbView)
+{
+    const BYTE *pbView = (const BYTE*)pvView;
+    const SNAPSHOT_HEADER *pHeader = (const SNAPSHOT_HEADER*)pvView;
+
+    pSnapshot->pHeader = pHeader;
+    pSnapshot->aFiles = (const SNAPSHOT_FILE*)(pbView + pHeader->ullFilesOffset);
+    pSnapshot->aichFolders = (const DWORD*)(pbView + pHeader->ullFoldersOffset);
+    pSnapshot->aNames = (const SNAPSHOT_NAME*)(pbView + pHeader->ullNamesOffset);
+    pSnapshot->pszStrings = (PCWSTR)(pbView + pHeader->ullStringsOffset);
+    pSnapshot->aiByHash = (pHeader->dwFlags & SNAPSHOT_FLAG_HASHES) ? (const DWORD*)(pbView + pHeader->ullHashIndexOffset) : NULL;
+    pSnapshot->pvView = pvView;
+    pSnapshot->cbView = cbView;
+    pSnapshot->pBloomFilter = NULL;
+}
+
+HRESULT FinishSnapshotBuilder(
+    _In_ PSNAPSHOT_BUILDER pBuilder,
+    _In_z_ PCWSTR pszRoot,
+    _In_ DWORD dwFlags,
+    _Out_ PSCAN_SNAPSHOT *ppSnapshot)
+{
+    SB_ASSERT(pBuilder);
+    SB_ASSERT(pszRoot);
+    SB_ASSERT(ppSnapshot);
+
+    PBYTE pbImage = NULL;
+    UINT64 cbImage = 0;
+    PSCAN_SNAPSHOT pSnapshot = NULL;
+
+    *ppSnapshot = NULL;
+
+    HRESULT hr = _SortBuilder(pBuilder, (dwFlags & SNAPSHOT_FLAG_HASHES) != 0);
+    if (SUCCEEDED(hr))
+    {
+        hr = _CreateImage(pBuilder, pszRoot, dwFlags, &pbImage, &cbImage);
+    }
+
+    if (FAILED(hr))
+    {
+        logerr(L"Cannot build snapshot of %s, hr: %x", pszRoot, hr);
+        goto fend;
+    }
+
+    pSnapshot = (PSCAN_SNAPSHOT)malloc(sizeof(SCAN_SNAPSHOT));
+    if (pSnapshot == NULL)
+    {
+        hr = E_OUTOFMEMORY;
+        goto fend;
+    }
+
+    pSnapshot->hFile = INVALID_HANDLE_VALUE;
+    pSnapshot->hMapping = NULL;
+    _AttachView(pSnapshot, pbImage, cbImage);
+    pbImage = NULL;
+    *ppSnapshot = pSnapshot;
+
+fend:
+    free(pbImage);
+    DestroySnapshotBuilder(pBuilder);
+    return hr;
+}
+
+HRESULT CreateScanSnapshot(_In_ PDIRINFO pDirInfo, _Out_ PSCAN_SNAPSHOT *ppSnapshot)
+{
+    SB_ASSERT(pDirInfo);
+    SB_ASSERT(ppSnapshot);
+
+    PFILEINFO *apFiles = NULL;
+    int nFiles = 0;
+    PSNAPSHOT_BUILDER pBuilder = NULL;
+    int cchRootPath = (int)wcsnlen(pDirInfo->pszPath, ARRAYSIZE(pDirInfo->pszPath));
+
+    *ppSnapshot = NULL;
+
+    HRESULT hr = CreateSnapshotBuilder(&pBuilder);
+    if (SUCCEEDED(hr))
+    {
+        hr = GetAllFilesInDir(pDirInfo, &apFiles, &nFiles);
+    }
+
+    for (int i = 0; SUCCEEDED(hr) && (i < nFiles); ++i)
+    {
+        PFILEINFO pFile = apFiles[i];
+
+        SNAPSHOT_FILE stRecord;
+        ZeroMemory(&stRecord, sizeof(stRecord));
+        stRecord.llSize = pFile->llFilesize.QuadPart;
+        stRecord.ftModified = pFile->ftModifiedTime;
+        CopyMemory(stRecord.abHash, pFile->abHash, sizeof(stRecord.abHash));
+        stRecord.dwFlags = (pFile->fIsDirectory ? SNAPSHOT_FILE_DIRECTORY : 0)
+            | (pFile->fHashValid ? SNAPSHOT_FILE_HASH_VALID : 0)
+            | (pFile->fAccessDenied ? SNAPSHOT_FILE_ACCESS_DENIED : 0);
+
+        hr = AddSnapshotFile(pBuilder, GetRelativeFolder(pFile, cchRootPath), pFile->pszFilename, &stRecord);
+    }
+
+    free(apFiles);
+    if (FAILED(hr))
+    {
+        logerr(L"Cannot build snapshot of dir %s, hr: %x", pDirInfo->pszPath, hr);
+        if (pBuilder != NULL)
+        {
+            DestroySnapshotBuilder(pBuilder);
+        }
+        return hr;
+    }
+
+    DWORD dwFlags = (pDirInfo->fHashCompare ? SNAPSHOT_FLAG_HASHES : 0) | (pDirInfo->fRecursive ? SNAPSHOT_FLAG_RECURSIVE : 0);
+    return FinishSnapshotBuilder(pBuilder, pDirInfo->pszPath, dwFlags, ppSnapshot);
+}
+
+// Tag of the files saved along with a snapshot, to tell the version of the snapshot they are of
+static UINT64 _GetSnapshotTag(_In_ const SNAPSHOT_HEADER *pHeader)
+{
+    ULARGE_INTEGER ullTag;
+    ullTag.LowPart = pHeader->ftSaved.dwLowDateTime;
+    ullTag.HighPart = pHeader->ftSaved.dwHighDateTime;
+    return ullTag.QuadPart;
+}
+
+// Filter of the keys of the files, tagged with the time the snapshot was saved, see _GetSnapshotTag()
+static HRESULT _BuildSnapshotFilter(_In_ PSCAN_SNAPSHOT pSnapshot, _Out_ PBLOOM_FILTER *ppFilter)
+{
+    const SNAPSHOT_HEADER *pHeader = pSnapshot->pHeader;
+    BOOL fHashes = (pHeader->dwFlags & SNAPSHOT_FLAG_HASHES) != 0;
+
+    HRESULT hr = CreateBloomFilter(fHashes ? pHeader->nHashed : pHeader->nFiles, ppFilter);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    if (fHashes)
+    {
+        for (DWORD i = 0; i < pHeader->nHashed; ++i)
+        {
+            BloomFilterAdd(*ppFilter, pSnapshot->aFiles[pSnapshot->aiByHash[i]].abHash, HASHLEN_SHA1);
+        }
+    }
+    else
+    {
+        for (DWORD i = 0; i < pHeader->nFiles; ++i)
+        {
+            UINT64 ullNameKey = GetSnapshotNameKey(pSnapshot, &pSnapshot->aFiles[i]);
+            BloomFilterAdd(*ppFilter, &ullNameKey, sizeof(ullNameKey));
+        }
+    }
+
+    (*ppFilter)->ullTag = _GetSnapshotTag(pHeader);
+    return S_OK;
+}
+
+// Index of the record of each file of the dir's digests, in the order of the digests
+static HRESULT _GetDigestFileIndexes(_In_ PSCAN_SNAPSHOT pSnapshot, _In_ PDIRINFO pDirInfo, _Out_ DWORD **paiFileIndexes)
+{
+    PSORTED_FILES pFiles = &pDirInfo->pDirDigests->stFiles;
+
+    *paiFileIndexes = NULL;
+    DWORD *aiFileIndexes = (DWORD*)malloc(max(pFiles->nFiles, 1) * sizeof(DWORD));
+    if (aiFileIndexes == NULL)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    for (int i = 0; i < pFiles->nFiles; ++i)
+    {
+        PFILEINFO pFile = pFiles->apFiles[i];
+        PCWSTR pszFolder = GetRelativeFolder(pFile, pFiles->cchRootPath);
+
+        // Within a name key the records are in path order
+        int iFirst;
+        int nSameKey = FindSnapshotFilesByName(pSnapshot, GetNameIdKey(pFile->dwNameId), &iFirst);
+        int iEnd = iFirst + nSameKey;
+        int iLow = iFirst;
+        int iHigh = iEnd;
+        while (iLow < iHigh)
+        {
+            int iMid = iLow + ((iHigh - iLow) / 2);
+            const SNAPSHOT_FILE *pRecord = &pSnapshot->aFiles[iMid];
+            if (CompareSnapshotPaths(GetSnapshotFolder(pSnapshot, pRecord), GetSnapshotFileName(pSnapshot, pRecord), pszFolder, pFile->pszFilename) < 0)
+            {
+                iLow = iMid + 1;
+            }
+            else
+            {
+                iHigh = iMid;
+            }
+        }
+
+        if ((iLow == iEnd)
+            || (CompareSnapshotPaths(GetSnapshotFolder(pSnapshot, &pSnapshot->aFiles[iLow]), GetSnapshotFileName(pSnapshot, &pSnapshot->aFiles[iLow]),
+                pszFolder, pFile->pszFilename) != 0))
+        {
+            logerr(L"File %s%s of the digests is not in the snapshot", pFile->pszPath, pFile->pszFilename);
+            free(aiFileIndexes);
+            return HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+        }
+
+        aiFileIndexes[i] = (DWORD)iLow;
+    }
+
+    *paiFileIndexes = aiFileIndexes;
+    return S_OK;
+}
+
+HRESULT SaveScanSnapshot(_In_ PDIRINFO pDirInfo, _In_z_ PCWSTR pszFilepath)
+{
+    SB_ASSERT(pDirInfo);
+    SB_ASSERT(pszFilepath);
+
+    PSCAN_SNAPSHOT pSnapshot = NULL;
+    PBLOOM_FILTER pFilter = NULL;
+    DWORD *aiDigestFiles = NULL;
+    WCHAR szTempPath[MAX_PATH];
+    WCHAR szFilterPath[MAX_PATH];
+    WCHAR szDigestsPath[MAX_PATH];
+
+    HRESULT hr = StringCchPrintf(szTempPath, ARRAYSIZE(szTempPath), L"%s.tmp", pszFilepath);
+    if (FAILED(hr))
+    {
+        logerr(L"Snapshot path too long: %s", pszFilepath);
+        goto fend;
+    }
+
+    hr = StringCchPrintf(szFilterPath, ARRAYSIZE(szFilterPath), L"%s%s", pszFilepath, SNAPSHOT_FILTER_SUFFIX);
+    if (SUCCEEDED(hr))
+    {
+        hr = StringCchPrintf(szDigestsPath, ARRAYSIZE(szDigestsPath), L"%s%s", pszFilepath, SNAPSHOT_DIGESTS_SUFFIX);
+    }
+    if (FAILED(hr))
+    {
+        logerr(L"Snapshot path too long: %s", pszFilepath);
+        goto fend;
+    }
+
+    hr = CreateScanSnapshot(pDirInfo, &pSnapshot);
+    if (FAILED(hr))
+    {
+        goto fend;
+    }
+
+    // The filter and digests of the snapshot being replaced must not outlive it
+    if (!DeleteFile(szFilterPath) && (GetLastError() != ERROR_FILE_NOT_FOUND))
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        logerr(L"Cannot remove old snapshot filter %s, hr: %x", szFilterPath, hr);
+        goto fend;
+    }
+
+    if (!DeleteFile(szDigestsPath) && (GetLastError() != ERROR_FILE_NOT_FOUND))
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        logerr(L"Cannot remove old snapshot digests %s, hr: %x", szDigestsPath, hr);
+        goto fend;
+    }
+
+    HANDLE hFile = CreateFileW(szTempPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        logerr(L"Cannot create snapshot file %s, hr: %x", szTempPath, hr);
+        goto fend;
+    }
+
+    hr = WriteAllToFile(hFile, pSnapshot->pvView, pSnapshot->cbView);
+    CloseHandle(hFile);
+    if (FAILED(hr))
+    {
+        logerr(L"Cannot write snapshot file %s, hr: %x", szTempPath, hr);
+        DeleteFile(szTempPath);
+        goto fend;
+    }
+
+    if (!MoveFileEx(szTempPath, pszFilepath, MOVEFILE_REPLACE_EXISTING))
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        logerr(L"Cannot replace snapshot file %s, hr: %x", pszFilepath, hr);
+        DeleteFile(szTempPath);
+        goto fend;
+    }
+
+    loginfo(L"Saved snapshot of %u files in %u folders of %s to %s",
+        pSnapshot->pHeader->nFiles, pSnapshot->pHeader->nFolders, pDirInfo->pszPath, pszFilepath);
+
+    // The snapshot is usable without its filter
+    if (FAILED(_BuildSnapshotFilter(pSnapshot, &pFilter)) || FAILED(SaveBloomFilter(pFilter, szFilterPath)))
+    {
+        logwarn(L"Snapshot %s is saved without its filter", pszFilepath);
+    }
+
+    // Nor do the folder digests have to be saved, a dir loaded without them computes them
+    if ((pDirInfo->pDirDigests != NULL)
+        && (FAILED(_GetDigestFileIndexes(pSnapshot, pDirInfo, &aiDigestFiles))
+            || FAILED(SaveDirDigests(pDirInfo, aiDigestFiles, _GetSnapshotTag(pSnapshot->pHeader), szDigestsPath))))
+    {
+        logwarn(L"Snapshot %s is saved without its folder digests", pszFilepath);
+    }
+
+fend:
+    free(aiDigestFiles);
+    if (pFilter != NULL)
+    {
+        DestroyBloomFilter(pFilter);
+    }
+
+    if (pSnapshot != NULL)
+    {
+        CloseScanSnapshot(pSnapshot);
+    }
+    return hr;
+}
+
+// Open the filter saved with the snapshot, if any, and keep it only if it was built
+// from this version of the snapshot file
+static void _OpenSnapshotFilter(_Inout_ PSCAN_SNAPSHOT pSnapshot, _In_z_ PCWSTR pszFilepath)
+{
+    const SNAPSHOT_HEADER *pHeader = pSnapshot->pHeader;
+    WCHAR szFilterPath[MAX_PATH];
+
+    if (FAILED(StringCchPrintf(szFilterPath, ARRAYSIZE(szFilterPath), L"%s%s", pszFilepath, SNAPSHOT_FILTER_SUFFIX))
+        || (GetFileAttributes(szFilterPath) == INVALID_FILE_ATTRIBUTES))
+    {
+        return;
+    }
+
+    PBLOOM_FILTER pFilter;
+    if (FAILED(OpenBloomFilter(szFilterPath, &pFilter)))
+    {
+        return;
+    }
+
+    DWORD nKeys = (pHeader->dwFlags & SNAPSHOT_FLAG_HASHES) ? pHeader->nHashed : pHeader->nFiles;
+    if ((pFilter->ullTag != _GetSnapshotTag(pHeader)) || (pFilter->nKeys != nKeys))
+    {
+        logwarn(L"Ignoring filter %s, it is not of the snapshot", szFilterPath);
+        DestroyBloomFilter(pFilter);
+        return;
+    }
+
+    pSnapshot->pBloomFilter = pFilter;
+}
+
+HRESULT OpenScanSnapshot(_In_z_ PCWSTR pszFilepath, _Out_ PSCAN_SNAPSHOT *ppSnapshot)
+{
+    SB_ASSERT(pszFilepath);
+    SB_ASSERT(ppSnapshot);
+
+    HRESULT hr = S_OK;
+    HANDLE hMapping = NULL;
+    PVOID pvView = NULL;
+    PSCAN_SNAPSHOT pSnapshot = NULL;
+    LARGE_INTEGER llFileSize;
+
+    HANDLE hFile = CreateFileW(pszFilepath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        logerr(L"Cannot open snapshot file %s, hr: %x", pszFilepath, hr);
+        goto error_return;
+    }
+
+    if (!GetFileSizeEx(hFile, &llFileSize) || (llFileSize.QuadPart < sizeof(SNAPSHOT_HEADER)))
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        goto error_return;
+    }
+
+    hMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (hMapping == NULL)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        logerr(L"Cannot map snapshot file %s, hr: %x", pszFilepath, hr);
+        goto error_return;
+    }
+
+    pvView = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+    if (pvView == NULL)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        logerr(L"Cannot map view of snapshot file %s, hr: %x", pszFilepath, hr);
+        goto error_return;
+    }
+
+    // Only the header and the bounds of the sections are checked. The indexes
+    // in the records are checked as they are used, see GetSnapshotFileName().
+    UINT64 cbFile = (UINT64)llFileSize.QuadPart;
+    const SNAPSHOT_HEADER *pHeader = (const SNAPSHOT_HEADER*)pvView;
+    BOOL fHashes = (pHeader->dwFlags & SNAPSHOT_FLAG_HASHES) != 0;
+    if ((pHeader->dwMagic != SNAPSHOT_MAGIC)
+        || (pHeader->dwVersion != SNAPSHOT_VERSION)
+        || (pHeader->cbHeader != sizeof(SNAPSHOT_HEADER))
+        || (wcsnlen(pHeader->szRoot, ARRAYSIZE(pHeader->szRoot)) >= ARRAYSIZE(pHeader->szRoot))
+        || !IsSectionInFile(pHeader->ullFilesOffset, pHeader->nFiles, sizeof(SNAPSHOT_FILE), sizeof(SNAPSHOT_HEADER), cbFile)
+        || !IsSectionInFile(pHeader->ullFoldersOffset, pHeader->nFolders, sizeof(DWORD), sizeof(SNAPSHOT_HEADER), cbFile)
+        || !IsSectionInFile(pHeader->ullNamesOffset, pHeader->nNames, sizeof(SNAPSHOT_NAME), sizeof(SNAPSHOT_HEADER), cbFile)
+        || !IsSectionInFile(pHeader->ullStringsOffset, pHeader->cchStrings, sizeof(WCHAR), sizeof(SNAPSHOT_HEADER), cbFile)
+        || (pHeader->cchStrings == 0)
+        || (((PCWSTR)((const BYTE*)pvView + pHeader->ullStringsOffset))[pHeader->cchStrings - 1] != 0)
+        || (fHashes && !IsSectionInFile(pHeader->ullHashIndexOffset, pHeader->nHashed, sizeof(DWORD), sizeof(SNAPSHOT_HEADER), cbFile))
+        || (pHeader->nHashed > pHeader->nFiles))
+    {
+        logerr(L"Not a valid snapshot file: %s", pszFilepath);
+        hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        goto error_return;
+    }
+
+    pSnapshot = (PSCAN_SNAPSHOT)malloc(sizeof(SCAN_SNAPSHOT));
+    if (pSnapshot == NULL)
+    {
+        hr = E_OUTOFMEMORY;
+        goto error_return;
+    }
+
+    pSnapshot->hFile = hFile;
+    pSnapshot->hMapping = hMapping;
+    _AttachView(pSnapshot, pvView, cbFile);
+    _OpenSnapshotFilter(pSnapshot, pszFilepath);
+
+    *ppSnapshot = pSnapshot;
+    return S_OK;
+
+error_return:
+    if (pvView != NULL)
+    {
+        UnmapViewOfFile(pvView);
+    }
+    if (hMapping != NULL)
+    {
+        CloseHandle(hMapping);
+    }
+    if (hFile != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(hFile);
+    }
+
+    *ppSnapshot = NULL;
+    return hr;
+}
+
+BOOL IsScanSnapshotFile(_In_z_ PCWSTR pszFilepath)
+{
+    SB_ASSERT(pszFilepath);
+
+    HANDLE hFile = CreateFileW(pszFilepath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        return FALSE;
+    }
+
+    DWORD dwMagic = 0;
+    DWORD cbRead;
+    BOOL fSnapshot = ReadFile(hFile, &dwMagic, sizeof(dwMagic), &cbRead, NULL)
+        && (cbRead == sizeof(dwMagic))
+        && (dwMagic == SNAPSHOT_MAGIC);
+
+    CloseHandle(hFile);
+    return fSnapshot;
+}
+
+void CloseScanSnapshot(_In_ PSCAN_SNAPSHOT pSnapshot)
+{
+    SB_ASSERT(pSnapshot);
+
+    if (pSnapshot->pBloomFilter != NULL)
+    {
+        DestroyBloomFilter(pSnapshot->pBloomFilter);
+    }
+
+    // A snapshot created in memory has no file
+    if (pSnapshot->hMapping == NULL)
+    {
+        free(pSnapshot->pvView);
+    }
+    else
+    {
+        UnmapViewOfFile(pSnapshot->pvView);
+        CloseHandle(pSnapshot->hMapping);
+        CloseHandle(pSnapshot->hFile);
+    }
+    free(pSnapshot);
+}
+
+int CompareSnapshotPaths(_In_z_ PCWSTR pszLeftFolder, _In_z_ PCWSTR pszLeftName, _In_z_ PCWSTR pszRightFolder, _In_z_ PCWSTR pszRightName)
+{
+    int cmp = CompareStringOrdinal(pszLeftFolder, -1, pszRightFolder, -1, TRUE);
+    if (cmp == CSTR_EQUAL)
+    {
+        cmp = CompareStringOrdinal(pszLeftName, -1, pszRightName, -1, TRUE);
+    }
+    return cmp - CSTR_EQUAL;
+}
+
+// The strings end with a null, so any offset inside them is a terminated string
+static PCWSTR _GetString(_In_ PSCAN_SNAPSHOT pSnapshot, _In_ DWORD ichString)
+{
+    return (ichString < pSnapshot->pHeader->cchStrings) ? (pSnapshot->pszStrings + ichString) : L"";
+}
+
+PCWSTR GetSnapshotFileName(_In_ PSCAN_SNAPSHOT pSnapshot, _In_ const SNAPSHOT_FILE *pFile)
+{
+    if (pFile->iName >= pSnapshot->pHeader->nNames)
+    {
+        return L"";
+    }
+    return _GetString(pSnapshot, pSnapshot->aNames[pFile->iName].ichName);
+}
+
+PCWSTR GetSnapshotFolder(_In_ PSCAN_SNAPSHOT pSnapshot, _In_ const SNAPSHOT_FILE *pFile)
+{
+    if (pFile->iFolder >= pSnapshot->pHeader->nFolders)
+    {
+        return L"";
+    }
+    return _GetString(pSnapshot, pSnapshot->aichFolders[pFile->iFolder]);
+}
+
+PBLOOM_FILTER TakeSnapshotFilter(_In_ PSCAN_SNAPSHOT pSnapshot)
+{
+    PBLOOM_FILTER pFilter = pSnapshot->pBloomFilter;
+    pSnapshot->pBloomFilter = NULL;
+    return pFilter;
+}
+
+UINT64 GetSnapshotNameKey(_In_ PSCAN_SNAPSHOT pSnapshot, _In_ const SNAPSHOT_FILE *pFile)
+{
+    return (pFile->iName < pSnapshot->pHeader->nNames) ? pSnapshot->aNames[pFile->iName].ullNameKey : 0;
+}
+
+int FindSnapshotFilesByName(_In_ PSCAN_SNAPSHOT pSnapshot, _In_ UINT64 ullNameKey, _Out_ int *piFirst)
+{
+    *piFirst = 0;
+    if ((pSnapshot->pBloomFilter != NULL) && !(pSnapshot->pHeader->dwFlags & SNAPSHOT_FLAG_HASHES)
+        && !BloomFilterMayContain(pSnapshot->pBloomFilter, &ullNameKey, sizeof(ullNameKey)))
+    {
+        return 0;
+    }
+
+    int nFiles = (int)pSnapshot->pHeader->nFiles;
+
+    // First file with a key not less than the one searched
+    int iLow = 0;
+    int iHigh = nFiles;
+    while (iLow < iHigh)
+    {
+        int iMid = iLow + ((iHigh - iLow) / 2);
+        if (GetSnapshotNameKey(pSnapshot, &pSnapshot->aFiles[iMid]) < ullNameKey)
+        {
+            iLow = iMid + 1;
+        }
+        else
+        {
+            iHigh = iMid;
+        }
+    }
+
+    int iEnd = iLow;
+    while ((iEnd < nFiles) && (GetSnapshotNameKey(pSnapshot, &pSnapshot->aFiles[iEnd]) == ullNameKey))
+    {
+        ++iEnd;
+    }
+
+    *piFirst = iLow;
+    return iEnd - iLow;
+}
+
+// Hash of the file at a position of the hash index, NULL if the index is damaged
+static const BYTE* _HashAt(_In_ PSCAN_SNAPSHOT pSnapshot, _In_ int iPos)
+{
+    DWORD iFile = pSnapshot->aiByHash[iPos];
+    return (iFile < pSnapshot->pHeader->nFiles) ? pSnapshot->aFiles[iFile].abHash : NULL;
+}
+
+int FindSnapshotFilesByHash(_In_ PSCAN_SNAPSHOT pSnapshot, _In_bytecount_(HASHLEN_SHA1) const BYTE *pbHash, _Out_ int *piFirst)
+{
+    *piFirst = 0;
+    if (pSnapshot->aiByHash == NULL)
+    {
+        return 0;
+    }
+
+    if ((pSnapshot->pBloomFilter != NULL) && !BloomFilterMayContain(pSnapshot->pBloomFilter, pbHash, HASHLEN_SHA1))
+    {
+        return 0;
+    }
+
+    int nHashed = (int)pSnapshot->pHeader->nHashed;
+    int iLow = 0;
+    int iHigh = nHashed;
+    while (iLow < iHigh)
+    {
+        int iMid = iLow + ((iHigh - iLow) / 2);
+        const BYTE *pbMid = _HashAt(pSnapshot, iMid);
+        if ((pbMid == NULL) || (memcmp(pbMid, pbHash, HASHLEN_SHA1) < 0))
+        {
+            iLow = iMid + 1;
+        }
+        else
+        {
+            iHigh = iMid;
+        }
+    }
+
+    int iEnd = iLow;
+    const BYTE *pbEnd;
+    while ((iEnd < nHashed) && ((pbEnd = _HashAt(pSnapshot, iEnd)) != NULL) && (memcmp(pbEnd, pbHash, HASHLEN_SHA1) == 0))
+    {
+        ++iEnd;
+    }
+
+    *piFirst = iLow;
+    return iEnd - iLow;
+}
+
+HRESULT LoadDirInfoFromSnapshot(_In_z_ PCWSTR pszFilepath, _In_ BOOL fCompareHashes, _Out_ PDIRINFO *ppDirInfo)
+{
+    SB_ASSERT(pszFilepath);
+    SB_ASSERT(ppDirInfo);
+
+    PSCAN_SNAPSHOT pSnapshot = NULL;
+    PDIRINFO pDirInfo = NULL;
+    WCHAR szFolder[MAX_PATH];
+    WCHAR szDigestsPath[MAX_PATH];
+    int cchRoot;
+    int nFolders = 0;
+    int nHashed = 0;
+
+    // The FILEINFO of each record, NULL if it is not in the dir
+    PFILEINFO *apByRecord = NULL;
+
+    // Interned folder paths and names by their index in the snapshot, so that each
+    // is looked up in the name pool once and not once per file
+    PCWSTR *apszFolders = NULL;
+    PCWSTR *apszNames = NULL;
+    DWORD *adwNameIds = NULL;
+
+    *ppDirInfo = NULL;
+
+    HRESULT hr = OpenScanSnapshot(pszFilepath, &pSnapshot);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    const SNAPSHOT_HEADER *pHeader = pSnapshot->pHeader;
+    BOOL fRecursive = (pHeader->dwFlags & SNAPSHOT_FLAG_RECURSIVE) != 0;
+    BOOL fHashes = (pHeader->dwFlags & SNAPSHOT_FLAG_HASHES) != 0;
+
+    // A name compare needs the sizes and the folder entries, see SwitchDirInfoLayout()
+    if (!fCompareHashes && ((pHeader->dwFlags & SNAPSHOT_FLAG_HASHES_ONLY) || (fHashes && !fRecursive)))
+    {
+        logerr(L"Snapshot %s can only be compared by hash", pszFilepath);
+        hr = HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED);
+        goto error_return;
+    }
+
+    if (fCompareHashes)
+    {
+        hr = FileInfoInit(TRUE);
+        if (SUCCEEDED(hr))
+        {
+            hr = CreateDirInfo_Hash(pHeader->szRoot, fRecursive, &pDirInfo);
+        }
+    }
+    else
+    {
+        hr = CreateDirInfo_NoHash(pHeader->szRoot, fRecursive, &pDirInfo);
+    }
+
+    if (FAILED(hr))
+    {
+        goto error_return;
+    }
+
+    pDirInfo->fRecursive = fRecursive;
+
+    apByRecord = (PFILEINFO*)calloc(max(pHeader->nFiles, 1), sizeof(PFILEINFO));
+    apszFolders = (PCWSTR*)calloc(max(pHeader->nFolders, 1), sizeof(PCWSTR));
+    apszNames = (PCWSTR*)calloc(max(pHeader->nNames, 1), sizeof(PCWSTR));
+    adwNameIds = (DWORD*)calloc(max(pHeader->nNames, 1), sizeof(DWORD));
+    if ((apByRecord == NULL) || (apszFolders == NULL) || (apszNames == NULL) || (adwNameIds == NULL))
+    {
+        hr = E_OUTOFMEMORY;
+        goto error_return;
+    }
+
+    // Folder of a file as a walk of the root has it: the root, a '\' and the relative folder
+    hr = StringCchCopy(szFolder, ARRAYSIZE(szFolder), pHeader->szRoot);
+    cchRoot = (int)wcsnlen(szFolder, ARRAYSIZE(szFolder));
+    if (SUCCEEDED(hr) && (cchRoot > 0) && (szFolder[cchRoot - 1] != L'\\'))
+    {
+        hr = StringCchCat(szFolder, ARRAYSIZE(szFolder), L"\\");
+        ++cchRoot;
+    }
+
+    for (DWORD i = 0; SUCCEEDED(hr) && (i < pHeader->nFiles); ++i)
+    {
+        const SNAPSHOT_FILE *pRecord = &pSnapshot->aFiles[i];
+        BOOL fIsDirectory = (pRecord->dwFlags & SNAPSHOT_FILE_DIRECTORY) != 0;
+        if (fIsDirectory)
+        {
+            ++nFolders;
+
+            // A hash dir has no folder entries
+            if (fCompareHashes)
+            {
+                continue;
+            }
+        }
+
+        PFILEINFO pFile = (PFILEINFO)malloc(sizeof(FILEINFO));
+        if (pFile == NULL)
+        {
+            hr = E_OUTOFMEMORY;
+            break;
+        }
+
+        ZeroMemory(pFile, sizeof(*pFile));
+        pFile->fIsDirectory = fIsDirectory;
+        pFile->fAccessDenied = (pRecord->dwFlags & SNAPSHOT_FILE_ACCESS_DENIED) != 0;
+        pFile->fHashValid = (pRecord->dwFlags & SNAPSHOT_FILE_HASH_VALID) != 0;
+        pFile->llFilesize.QuadPart = pRecord->llSize;
+        pFile->ftModifiedTime = pRecord->ftModified;
+        CopyMemory(pFile->abHash, pRecord->abHash, sizeof(pFile->abHash));
+
+        // Names are copied into the name pool, nothing points into the view once it is closed
+        BOOL fFolderIndex = (pRecord->iFolder < pHeader->nFolders);
+        if (fFolderIndex && (apszFolders[pRecord->iFolder] != NULL))
+        {
+            pFile->pszPath = apszFolders[pRecord->iFolder];
+        }
+        else
+        {
+            hr = StringCchCopy(szFolder + cchRoot, ARRAYSIZE(szFolder) - cchRoot, GetSnapshotFolder(pSnapshot, pRecord));
+            if (SUCCEEDED(hr))
+            {
+                hr = InternPath(szFolder, &pFile->pszPath);
+            }
+            if (SUCCEEDED(hr) && fFolderIndex)
+            {
+                apszFolders[pRecord->iFolder] = pFile->pszPath;
+            }
+        }
+
+        BOOL fNameIndex = (pRecord->iName < pHeader->nNames);
+        if (fNameIndex && (apszNames[pRecord->iName] != NULL))
+        {
+            pFile->pszFilename = apszNames[pRecord->iName];
+            pFile->dwNameId = adwNameIds[pRecord->iName];
+        }
+        else if (SUCCEEDED(hr))
+        {
+            hr = InternName(GetSnapshotFileName(pSnapshot, pRecord), &pFile->pszFilename, &pFile->dwNameId);
+            if (SUCCEEDED(hr) && fNameIndex)
+            {
+                apszNames[pRecord->iName] = pFile->pszFilename;
+                adwNameIds[pRecord->iName] = pFile->dwNameId;
+            }
+        }
+
+        if (FAILED(hr))
+        {
+            logerr(L"Cannot load %s%s from snapshot %s, hr: %x", GetSnapshotFolder(pSnapshot, pRecord), GetSnapshotFileName(pSnapshot, pRecord), pszFilepath, hr);
+            free(pFile);
+            break;
+        }
+
+        if (fCompareHashes && !pFile->fHashValid)
+        {
+            // Same as a file that cannot be hashed during the walk
+            if (FAILED(EnsureFileHash(pFile)))
+            {
+                logwarn(L"Unable to hash file: %s%s", pFile->pszPath, pFile->pszFilename);
+                free(pFile);
+                continue;
+            }
+            ++nHashed;
+        }
+
+        // The file is freed if it cannot be added
+        BOOL fAdded = fCompareHashes ? AddFileToDir_Hash(pDirInfo, pFile) : AddFileToDir_NoHash(pDirInfo, pFile);
+        apByRecord[i] = fAdded ? pFile : NULL;
+    }
+
+    if (FAILED(hr))
+    {
+        logerr(L"Cannot load dir from snapshot %s, hr: %x", pszFilepath, hr);
+        goto error_return;
+    }
+
+    pDirInfo->nDirs = nFolders;
+
+    // Saved digests are of the layout the snapshot was saved with, and of none of the
+    // files hashed just now. LoadDirDigests() checks that they are of all the files.
+    if (fRecursive && (!fHashes == !fCompareHashes) && (nHashed == 0)
+        && SUCCEEDED(StringCchPrintf(szDigestsPath, ARRAYSIZE(szDigestsPath), L"%s%s", pszFilepath, SNAPSHOT_DIGESTS_SUFFIX))
+        && (GetFileAttributes(szDigestsPath) != INVALID_FILE_ATTRIBUTES))
+    {
+        hr = LoadDirDigests(szDigestsPath, pDirInfo, _GetSnapshotTag(pHeader), apByRecord, pHeader->nFiles, &pDirInfo->pDirDigests);
+        if (FAILED(hr))
+        {
+            logwarn(L"Ignoring digests %s, hr: %x", szDigestsPath, hr);
+        }
+    }
+
+    if (fRecursive && (pDirInfo->pDirDigests == NULL))
+    {
+        // Folder digests are keyed by the layout, see BuildDirTree()
+        hr = BuildDirDigests(pDirInfo, &pDirInfo->pDirDigests);
+        if (FAILED(hr))
+        {
+            logwarn(L"Cannot compute folder digests of %s, hr: %x", pDirInfo->pszPath, hr);
+        }
+    }
+
+    // The saved filter has the keys of the layout the snapshot was saved with, and
+    // none of the files hashed just now
+    if ((!fHashes == !fCompareHashes) && (nHashed == 0))
+    {
+        pDirInfo->pBloomFilter = TakeSnapshotFilter(pSnapshot);
+    }
+
+    loginfo(L"Loaded dir %s from snapshot %s, %d files, hashed %d", pDirInfo->pszPath, pszFilepath, pDirInfo->nFiles, nHashed);
+
+    free(apByRecord);
+    free(apszFolders);
+    free(apszNames);
+    free(adwNameIds);
+    CloseScanSnapshot(pSnapshot);
+    *ppDirInfo = pDirInfo;
+    return S_OK;
+
+error_return:
+    free(apByRecord);
+    free(apszFolders);
+    free(apszNames);
+    free(adwNameIds);
+    if (pDirInfo != NULL)
+    {
+        DestroyDirInfo(pDirInfo);
+    }
+    CloseScanSnapshot(pSnapshot);
+    return hr;
+}
@@ -0,0 +1,195 @@
+#pragma once
+
+// ---------------------------------------------------
+// The FDiffDelete Project
+// Github: https://github.com/shishir993/fdiffdelete
+// Author: Shishir Bhat
+// The MIT License (MIT)
+// Copyright (c) 2014
+//
+
+#include "Common.h"
+#include "HashFactory.h"
+#include "DirectoryWalker_Interface.h"
+
+// Saved scan of a dir tree.
+// The file is laid out exactly as it is used, so opening it maps it and checks the
+// header, and nothing is read or converted per file:
+//
+//  SNAPSHOT_HEADER
+//  SNAPSHOT_FILE       [nFiles]    sorted by name key, then folder and name ignoring case
+//  DWORD               [nFolders]  character offset of each folder path in the strings
+//  SNAPSHOT_NAME       [nNames]    each distinct spelling of a filename
+//  WCHAR               [cchStrings] null terminated folder paths and names
+//  DWORD               [nHashed]   indexes of the files with a hash, sorted by hash
+//
+// Each section starts 8-byte aligned. Folder paths are relative to szRoot, so two
+// snapshots can be compared even if the trees are no longer where they were.
+// Name keys are those of NameKey.h, which do not change from run to run.
+
+#define SNAPSHOT_MAGIC              0x53534446  // "FDSS"
+#define SNAPSHOT_VERSION            1
+
+// SNAPSHOT_HEADER.dwFlags
+#define SNAPSHOT_FLAG_HASHES        0x01
+#define SNAPSHOT_FLAG_RECURSIVE     0x02
+
+// Files have a hash and nothing else: no folders and no size or modified time.
+// Such as a snapshot of a manifest, see Sha1Manifest.h.
+#define SNAPSHOT_FLAG_HASHES_ONLY   0x04
+
+// A filter of the keys of the files is saved along with a snapshot, in a file of the
+// snapshot's path and this suffix. Keys are hashes with SNAPSHOT_FLAG_HASHES and name
+// keys otherwise, the same keys as the filter of a dir, see DirectoryWalker_Bloom.h
+#define SNAPSHOT_FILTER_SUFFIX      L".bloom"
+
+// The folder digests of a recursive dir are saved in a file of this suffix, see
+// SaveDirDigests(). Files are known in it by their index in SNAPSHOT_FILE order.
+#define SNAPSHOT_DIGESTS_SUFFIX     L".digests"
+
+// SNAPSHOT_FILE.dwFlags
+#define SNAPSHOT_FILE_DIRECTORY     0x01
+#define SNAPSHOT_FILE_HASH_VALID    0x02
+#define SNAPSHOT_FILE_ACCESS_DENIED 0x04
+
+typedef struct _SnapshotHeader
+{
+    DWORD dwMagic;
+    DWORD dwVersion;
+    DWORD cbHeader;
+    DWORD dwFlags;
+
+    // UTC time the snapshot was written
+    FILETIME ftSaved;
+
+    DWORD nFiles;
+    DWORD nFolders;
+    DWORD nNames;
+    DWORD cchStrings;
+
+    // Files in the hash index, folders and files without a hash are not
+    DWORD nHashed;
+    DWORD dwReserved;
+
+    // From the start of the file
+    UINT64 ullFilesOffset;
+    UINT64 ullFoldersOffset;
+    UINT64 ullNamesOffset;
+    UINT64 ullStringsOffset;
+
+    // 0 without SNAPSHOT_FLAG_HASHES
+    UINT64 ullHashIndexOffset;
+
+    WCHAR szRoot[MAX_PATH];
+
+} SNAPSHOT_HEADER, *PSNAPSHOT_HEADER;
+
+typedef struct _SnapshotFile
+{
+    LONGLONG llSize;
+    FILETIME ftModified;
+    BYTE abHash[HASHLEN_SHA1];
+    DWORD iFolder;
+    DWORD iName;
+    DWORD dwFlags;
+
+} SNAPSHOT_FILE, *PSNAPSHOT_FILE;
+
+typedef struct _SnapshotName
+{
+    UINT64 ullNameKey;
+    DWORD ichName;
+    DWORD cchName;
+
+} SNAPSHOT_NAME, *PSNAPSHOT_NAME;
+
+// An open snapshot, all pointers are into the read-only view of the file.
+// A snapshot created in memory has the same layout in a heap buffer.
+typedef struct _ScanSnapshot
+{
+    const SNAPSHOT_HEADER *pHeader;
+    const SNAPSHOT_FILE *aFiles;
+    const DWORD *aichFolders;
+    const SNAPSHOT_NAME *aNames;
+    PCWSTR pszStrings;
+
+    // NULL without SNAPSHOT_FLAG_HASHES
+    const DWORD *aiByHash;
+
+    // INVALID_HANDLE_VALUE and NULL if created in memory
+    HANDLE hFile;
+    HANDLE hMapping;
+    PVOID pvView;
+    UINT64 cbView;
+
+    // Filter saved with the snapshot file, NULL if there is none or it is not of
+    // this version of the file. Owned unless taken with TakeSnapshotFilter().
+    struct _BloomFilter *pBloomFilter;
+
+} SCAN_SNAPSHOT, *PSCAN_SNAPSHOT;
+
+// Write the files of a built dir to a snapshot file, replacing the file only once
+// the new one is complete. The hash index is written if the dir was built with
+// hash compare. The filter of the keys and the folder digests, if the dir has
+// them, are written after the snapshot file.
+HRESULT SaveScanSnapshot(_In_ PDIRINFO pDirInfo, _In_z_ PCWSTR pszFilepath);
+
+// Snapshot of a built dir in memory, without writing it. Closed with CloseScanSnapshot().
+HRESULT CreateScanSnapshot(_In_ PDIRINFO pDirInfo, _Out_ PSCAN_SNAPSHOT *ppSnapshot);
+
+// Builds a snapshot in memory from files that are not in a DIRINFO, such as the
+// lines of a manifest. Files can be added in any order.
+typedef struct _SnapshotBuilder *PSNAPSHOT_BUILDER;
+
+HRESULT CreateSnapshotBuilder(_Out_ PSNAPSHOT_BUILDER *ppBuilder);
+
+// The folder is relative to the root, with a trailing '\', empty for the root.
+// iFolder and iName of the record are set by the builder.
+HRESULT AddSnapshotFile(
+    _In_ PSNAPSHOT_BUILDER pBuilder,
+    _In_z_ PCWSTR pszRelFolder,
+    _In_z_ PCWSTR pszName,
+    _In_ const SNAPSHOT_FILE *pFile);
+
+// Sort the files and make the snapshot. dwFlags are the SNAPSHOT_FLAG_*, the hash
+// index is built with SNAPSHOT_FLAG_HASHES. The builder is destroyed either way.
+HRESULT FinishSnapshotBuilder(
+    _In_ PSNAPSHOT_BUILDER pBuilder,
+    _In_z_ PCWSTR pszRoot,
+    _In_ DWORD dwFlags,
+    _Out_ PSCAN_SNAPSHOT *ppSnapshot);
+
+void DestroySnapshotBuilder(_In_ PSNAPSHOT_BUILDER pBuilder);
+
+// Opens the saved filter too, if there is one
+HRESULT OpenScanSnapshot(_In_z_ PCWSTR pszFilepath, _Out_ PSCAN_SNAPSHOT *ppSnapshot);
+
+// The caller owns the filter of the snapshot from now on, NULL if it has none
+struct _BloomFilter* TakeSnapshotFilter(_In_ PSCAN_SNAPSHOT pSnapshot);
+
+// Build a dir from a snapshot file instead of walking the folder, for the compare dialog.
+// The dir is of the snapshot's root and as recursive as the snapshot. With hash compare,
+// files saved without a hash are hashed from the root, as SwitchDirInfoLayout() does.
+// The saved filter goes to the dir if it has the keys of the dir's layout, and so do
+// the saved folder digests, which are computed again only if they cannot be used.
+HRESULT LoadDirInfoFromSnapshot(_In_z_ PCWSTR pszFilepath, _In_ BOOL fCompareHashes, _Out_ PDIRINFO *ppDirInfo);
+
+// Does the file start like a snapshot? Only the magic is read.
+BOOL IsScanSnapshotFile(_In_z_ PCWSTR pszFilepath);
+void CloseScanSnapshot(_In_ PSCAN_SNAPSHOT pSnapshot);
+
+// Name of a file, and its folder relative to the root. Never NULL, an empty
+// string if the snapshot is damaged.
+PCWSTR GetSnapshotFileName(_In_ PSCAN_SNAPSHOT pSnapshot, _In_ const SNAPSHOT_FILE *pFile);
+PCWSTR GetSnapshotFolder(_In_ PSCAN_SNAPSHOT pSnapshot, _In_ const SNAPSHOT_FILE *pFile);
+UINT64 GetSnapshotNameKey(_In_ PSCAN_SNAPSHOT pSnapshot, _In_ const SNAPSHOT_FILE *pFile);
+
+// Order of two relative paths within the files of a name key: folder, then name,
+// both ignoring case. Zero if they are the same path.
+int CompareSnapshotPaths(_In_z_ PCWSTR pszLeftFolder, _In_z_ PCWSTR pszLeftName, _In_z_ PCWSTR pszRightFolder, _In_z_ PCWSTR pszRightName);
+
+// Binary searches of the two orders. Return the number of files with the key
+// and the position of the first in *piFirst: an index of aFiles for the name,
+// of aiByHash for the hash. Keys that the filter rules out are not searched.
+int FindSnapshotFilesByName(_In_ PSCAN_SNAPSHOT pSnapshot, _In_ UINT64 ullNameKey, _Out_ int *piFirst);
+int FindSnapshotFilesByHash(_In_ PSCAN_SNAPSHOT pSnapshot, _In_bytecount_(HASHLEN_SHA1) const BYTE *pbHash, _Out_ int *piFirst);
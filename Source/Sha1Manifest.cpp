@@ -0,0 +1,583 @@
+
+// ---------------------------------------------------
+// The FDiffDelete Project
+// Github: https://github.com/shishir993/fdiffdelete
+// Author: Shishir Bhat
+// The MIT License (MIT)
+// Copyright (c) 2014
+//
+
+#include "Sha1Manifest.h"
+
+// Hash in hex, then two characters: "  " or " *"
+#define MANIFEST_PATH_START         ((HASHLEN_SHA1 * 2) + 2)
+
+// UTF-8 takes at most three bytes per UTF-16 character
+#define MANIFEST_MAX_PATH_BYTES     (MAX_PATH * 3)
+
+#define MANIFEST_WRITE_BYTES        (1024 * 1024)
+
+// A parsed line, the offsets are into the paths of its chunk
+typedef struct _ManifestEntry
+{
+    BYTE abHash[HASHLEN_SHA1];
+    DWORD ichFolder;
+    DWORD ichName;
+
+} MANIFEST_ENTRY, *PMANIFEST_ENTRY;
+
+// Whole lines of a window, parsed by one thread
+typedef struct _ManifestChunk
+{
+    const char *pchStart;
+    const char *pchEnd;
+
+    PMANIFEST_ENTRY aEntries;
+    int nEntries;
+
+    // Folder and name of each entry, null terminated
+    PWSTR pszPaths;
+
+    int nBadLines;
+    HRESULT hr;
+
+} MANIFEST_CHUNK, *PMANIFEST_CHUNK;
+
+static int _HexValue(_In_ char ch)
+{
+    if ((ch >= '0') && (ch <= '9'))
+    {
+        return ch - '0';
+    }
+    if ((ch >= 'a') && (ch <= 'f'))
+    {
+        return ch - 'a' + 10;
+    }
+    if ((ch >= 'A') && (ch <= 'F'))
+    {
+        return ch - 'A' + 10;
+    }
+    return -1;
+}
+
+// Parse one line without its line break. The folder and the name are written to
+// pszPaths, which must have room for cchLine + 2 characters.
+static BOOL _ParseLine(
+    _In_count_(cchLine) const char *pchLine,
+    _In_ int cchLine,
+    _Out_ PMANIFEST_ENTRY pEntry,
+    _Out_ PWSTR pszPaths,
+    _Out_ DWORD *pcchPaths)
+{
+    // sha1sum escapes '\' and new lines in the path and marks such lines with a leading '\'
+    BOOL fEscaped = (cchLine > 0) && (pchLine[0] == '\\');
+    if (fEscaped)
+    {
+        ++pchLine;
+        --cchLine;
+    }
+
+    if (cchLine <= MANIFEST_PATH_START)
+    {
+        return FALSE;
+    }
+
+    for (int i = 0; i < HASHLEN_SHA1; ++i)
+    {
+        int iHigh = _HexValue(pchLine[i * 2]);
+        int iLow = _HexValue(pchLine[(i * 2) + 1]);
+        if ((iHigh < 0) || (iLow < 0))
+        {
+            return FALSE;
+        }
+        pEntry->abHash[i] = (BYTE)((iHigh << 4) | iLow);
+    }
+
+    if ((pchLine[HASHLEN_SHA1 * 2] != ' ') || ((pchLine[(HASHLEN_SHA1 * 2) + 1] != ' ') && (pchLine[(HASHLEN_SHA1 * 2) + 1] != '*')))
+    {
+        return FALSE;
+    }
+
+    const char *pchPath = pchLine + MANIFEST_PATH_START;
+    int cchPath = cchLine - MANIFEST_PATH_START;
+    if (cchPath >= MANIFEST_MAX_PATH_BYTES)
+    {
+        return FALSE;
+    }
+
+    char szPath[MANIFEST_MAX_PATH_BYTES];
+    int cbPath = 0;
+    for (int i = 0; i < cchPath; ++i)
+    {
+        char ch = pchPath[i];
+        if (fEscaped && (ch == '\\') && (i + 1 < cchPath))
+        {
+            ++i;
+            ch = (pchPath[i] == 'n') ? '\n' : pchPath[i];
+        }
+        szPath[cbPath++] = ch;
+    }
+
+    WCHAR szWide[MAX_PATH];
+    int cchWide = MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, szPath, cbPath, szWide, ARRAYSIZE(szWide) - 1);
+    if (cchWide <= 0)
+    {
+        return FALSE;
+    }
+    szWide[cchWide] = 0;
+
+    for (int i = 0; i < cchWide; ++i)
+    {
+        if (szWide[i] == L'/')
+        {
+            szWide[i] = L'\\';
+        }
+    }
+
+    // Paths are relative to the folder the manifest was made in
+    PCWSTR pszRelPath = szWide;
+    while ((pszRelPath[0] == L'.') && (pszRelPath[1] == L'\\'))
+    {
+        pszRelPath += 2;
+    }
+    while (pszRelPath[0] == L'\\')
+    {
+        ++pszRelPath;
+    }
+
+    PCWSTR pszLastSep = wcsrchr(pszRelPath, L'\\');
+    PCWSTR pszName = (pszLastSep != NULL) ? (pszLastSep + 1) : pszRelPath;
+    if (pszName[0] == 0)
+    {
+        return FALSE;
+    }
+
+    // Folder keeps its trailing '\', like the folders of a scan
+    DWORD cchFolder = (DWORD)(pszName - pszRelPath);
+    DWORD cchName = (DWORD)wcslen(pszName);
+    CopyMemory(pszPaths, pszRelPath, cchFolder * sizeof(WCHAR));
+    pszPaths[cchFolder] = 0;
+    CopyMemory(pszPaths + cchFolder + 1, pszName, (cchName + 1) * sizeof(WCHAR));
+
+    pEntry->ichFolder = 0;
+    pEntry->ichName = cchFolder + 1;
+    *pcchPaths = cchFolder + cchName + 2;
+    return TRUE;
+}
+
+static DWORD WINAPI _ParseChunk(_In_ LPVOID pvChunk)
+{
+    PMANIFEST_CHUNK pChunk = (PMANIFEST_CHUNK)pvChunk;
+    SIZE_T cbChunk = pChunk->pchEnd - pChunk->pchStart;
+
+    int nLines = 1;
+    for (const char *pch = pChunk->pchStart; (pch = (const char*)memchr(pch, '\n', pChunk->pchEnd - pch)) != NULL; ++pch)
+    {
+        ++nLines;
+    }
+
+    // Each path is at most as many characters as it has bytes, plus two nulls
+    pChunk->aEntries = (PMANIFEST_ENTRY)malloc(nLines * sizeof(MANIFEST_ENTRY));
+    pChunk->pszPaths = (PWSTR)malloc((cbChunk + (2 * nLines)) * sizeof(WCHAR));
+    if ((pChunk->aEntries == NULL) || (pChunk->pszPaths == NULL))
+    {
+        pChunk->hr = E_OUTOFMEMORY;
+        return 0;
+    }
+
+    DWORD ichPaths = 0;
+    const char *pchLine = pChunk->pchStart;
+    while (pchLine < pChunk->pchEnd)
+    {
+        const char *pchEol = (const char*)memchr(pchLine, '\n', pChunk->pchEnd - pchLine);
+        if (pchEol == NULL)
+        {
+            pchEol = pChunk->pchEnd;
+        }
+
+        const char *pchLineEnd = pchEol;
+        if ((pchLineEnd > pchLine) && (pchLineEnd[-1] == '\r'))
+        {
+            --pchLineEnd;
+        }
+
+        if (pchLineEnd > pchLine)
+        {
+            PMANIFEST_ENTRY pEntry = &pChunk->aEntries[pChunk->nEntries];
+            DWORD cchPaths;
+            if (_ParseLine(pchLine, (int)(pchLineEnd - pchLine), pEntry, pChunk->pszPaths + ichPaths, &cchPaths))
+            {
+                pEntry->ichFolder += ichPaths;
+                pEntry->ichName += ichPaths;
+                ichPaths += cchPaths;
+                ++(pChunk->nEntries);
+            }
+            else
+            {
+                ++(pChunk->nBadLines);
+            }
+        }
+
+        pchLine = pchEol + 1;
+    }
+
+    pChunk->hr = S_OK;
+    return 0;
+}
+
+// Parse the whole lines of a window on up to nThreads threads, then add them to
+// the snapshot in the order they are in the manifest.
+static HRESULT _ParseWindow(
+    _In_count_(cbLines) const char *pchLines,
+    _In_ DWORD cbLines,
+    _In_ int nThreads,
+    _In_ PSNAPSHOT_BUILDER pBuilder,
+    _Inout_ int *pnBadLines)
+{
+    HRESULT hr = S_OK;
+    MANIFEST_CHUNK aChunks[MANIFEST_MAX_THREADS];
+    HANDLE ahThreads[MANIFEST_MAX_THREADS];
+    int nStarted = 0;
+
+    ZeroMemory(aChunks, sizeof(aChunks));
+    int nChunks = (cbLines < MANIFEST_MIN_PARALLEL_BYTES) ? 1 : nThreads;
+
+    // Split at line breaks near equal sizes
+    const char *pchEnd = pchLines + cbLines;
+    const char *pchChunk = pchLines;
+    for (int i = 0; i < nChunks; ++i)
+    {
+        const char *pchSplit = pchEnd;
+        if (i < nChunks - 1)
+        {
+            pchSplit = max(pchLines + ((SIZE_T)cbLines / nChunks) * (i + 1), pchChunk);
+            const char *pchEol = (const char*)memchr(pchSplit, '\n', pchEnd - pchSplit);
+            pchSplit = (pchEol != NULL) ? (pchEol + 1) : pchEnd;
+        }
+
+        aChunks[i].pchStart = pchChunk;
+        aChunks[i].pchEnd = pchSplit;
+        aChunks[i].hr = E_FAIL;
+        pchChunk = pchSplit;
+    }
+
+    // The first chunk is parsed on this thread. A chunk whose thread cannot be
+    // started is parsed here too.
+    for (int i = 1; i < nChunks; ++i)
+    {
+        HANDLE hThread = CreateThread(NULL, 0, _ParseChunk, &aChunks[i], 0, NULL);
+        if (hThread != NULL)
+        {
+            ahThreads[nStarted++] = hThread;
+        }
+        else
+        {
+            logwarn(L"Cannot start manifest parse thread, error: %u", GetLastError());
+            _ParseChunk(&aChunks[i]);
+        }
+    }
+
+    _ParseChunk(&aChunks[0]);
+
+    if (nStarted > 0)
+    {
+        WaitForMultipleObjects(nStarted, ahThreads, TRUE, INFINITE);
+        for (int i = 0; i < nStarted; ++i)
+        {
+            CloseHandle(ahThreads[i]);
+        }
+    }
+
+    SNAPSHOT_FILE stRecord;
+    ZeroMemory(&stRecord, sizeof(stRecord));
+    stRecord.dwFlags = SNAPSHOT_FILE_HASH_VALID;
+
+    for (int i = 0; i < nChunks; ++i)
+    {
+        PMANIFEST_CHUNK pChunk = &aChunks[i];
+        if (SUCCEEDED(hr))
+        {
+            hr = pChunk->hr;
+        }
+
+        for (int iEntry = 0; SUCCEEDED(hr) && (iEntry < pChunk->nEntries); ++iEntry)
+        {
+            PMANIFEST_ENTRY pEntry = &pChunk->aEntries[iEntry];
+            CopyMemory(stRecord.abHash, pEntry->abHash, sizeof(stRecord.abHash));
+            hr = AddSnapshotFile(pBuilder, pChunk->pszPaths + pEntry->ichFolder, pChunk->pszPaths + pEntry->ichName, &stRecord);
+        }
+
+        *pnBadLines += pChunk->nBadLines;
+        free(pChunk->aEntries);
+        free(pChunk->pszPaths);
+    }
+    return hr;
+}
+
+HRESULT ImportSha1Manifest(_In_z_ PCWSTR pszManifest, _Out_ PSCAN_SNAPSHOT *ppSnapshot, _Out_opt_ int *pnBadLines)
+{
+    SB_ASSERT(pszManifest);
+    SB_ASSERT(ppSnapshot);
+
+    HRESULT hr = S_OK;
+    PSNAPSHOT_BUILDER pBuilder = NULL;
+    char *pchWindow = NULL;
+    int nBadLines = 0;
+
+    *ppSnapshot = NULL;
+
+    HANDLE hFile = CreateFileW(pszManifest, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        logerr(L"Cannot open manifest %s, hr: %x", pszManifest, hr);
+        goto fend;
+    }
+
+    pchWindow = (char*)malloc(MANIFEST_WINDOW_BYTES);
+    if (pchWindow == NULL)
+    {
+        hr = E_OUTOFMEMORY;
+        goto fend;
+    }
+
+    hr = CreateSnapshotBuilder(&pBuilder);
+    if (FAILED(hr))
+    {
+        goto fend;
+    }
+
+    SYSTEM_INFO stSysInfo;
+    GetSystemInfo(&stSysInfo);
+    int nThreads = (int)min(stSysInfo.dwNumberOfProcessors, MANIFEST_MAX_THREADS);
+    nThreads = max(nThreads, 1);
+
+    // A partial last line of a window is moved to the start of the next
+    DWORD cbCarry = 0;
+    BOOL fFirstWindow = TRUE;
+    BOOL fEndOfFile = FALSE;
+    while (!fEndOfFile)
+    {
+        DWORD cbRead;
+        if (!ReadFile(hFile, pchWindow + cbCarry, MANIFEST_WINDOW_BYTES - cbCarry, &cbRead, NULL))
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            logerr(L"Cannot read manifest %s, hr: %x", pszManifest, hr);
+            goto fend;
+        }
+
+        fEndOfFile = (cbRead == 0);
+        DWORD cbData = cbCarry + cbRead;
+        DWORD ibStart = 0;
+        if (fFirstWindow && (cbData >= 3) && (memcmp(pchWindow, "\xEF\xBB\xBF", 3) == 0))
+        {
+            ibStart = 3;
+        }
+        fFirstWindow = FALSE;
+
+        // Up to the last line break, or everything at the end of the file
+        DWORD cbLines = cbData;
+        if (!fEndOfFile)
+        {
+            while ((cbLines > ibStart) && (pchWindow[cbLines - 1] != '\n'))
+            {
+                --cbLines;
+            }
+
+            if ((cbLines == ibStart) && (cbData == MANIFEST_WINDOW_BYTES))
+            {
+                logerr(L"Line longer than %u bytes in manifest %s", MANIFEST_WINDOW_BYTES, pszManifest);
+                hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+                goto fend;
+            }
+        }
+
+        if (cbLines > ibStart)
+        {
+            hr = _ParseWindow(pchWindow + ibStart, cbLines - ibStart, nThreads, pBuilder, &nBadLines);
+            if (FAILED(hr))
+            {
+                logerr(L"Cannot parse manifest %s, hr: %x", pszManifest, hr);
+                goto fend;
+            }
+        }
+
+        cbCarry = cbData - cbLines;
+        MoveMemory(pchWindow, pchWindow + cbLines, cbCarry);
+    }
+
+    if (nBadLines > 0)
+    {
+        logwarn(L"Skipped %d lines that are not a hash and a path in manifest %s", nBadLines, pszManifest);
+    }
+
+    hr = FinishSnapshotBuilder(pBuilder, pszManifest, SNAPSHOT_FLAG_HASHES | SNAPSHOT_FLAG_RECURSIVE | SNAPSHOT_FLAG_HASHES_ONLY, ppSnapshot);
+    pBuilder = NULL;
+
+fend:
+    if (pBuilder != NULL)
+    {
+        DestroySnapshotBuilder(pBuilder);
+    }
+    if (hFile != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(hFile);
+    }
+    free(pchWindow);
+
+    if (pnBadLines != NULL)
+    {
+        *pnBadLines = nBadLines;
+    }
+    return hr;
+}
+
+static HRESULT _FlushManifest(_In_ HANDLE hFile, _In_count_(cbBuffer) const char *pchBuffer, _Inout_ DWORD *pcbBuffer)
+{
+    DWORD cbWritten;
+    if (!WriteFile(hFile, pchBuffer, *pcbBuffer, &cbWritten, NULL))
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+    if (cbWritten != *pcbBuffer)
+    {
+        return HRESULT_FROM_WIN32(ERROR_WRITE_FAULT);
+    }
+
+    *pcbBuffer = 0;
+    return S_OK;
+}
+
+HRESULT ExportSha1Manifest(_In_ PSCAN_SNAPSHOT pSnapshot, _In_z_ PCWSTR pszManifest, _Out_opt_ int *pnSkipped)
+{
+    SB_ASSERT(pSnapshot);
+    SB_ASSERT(pszManifest);
+
+    HRESULT hr = S_OK;
+    HANDLE hFile = INVALID_HANDLE_VALUE;
+    char *pchBuffer = NULL;
+    DWORD cbBuffer = 0;
+    int nSkipped = 0;
+    WCHAR szTempPath[MAX_PATH];
+
+    hr = StringCchPrintf(szTempPath, ARRAYSIZE(szTempPath), L"%s.tmp", pszManifest);
+    if (FAILED(hr))
+    {
+        logerr(L"Manifest path too long: %s", pszManifest);
+        goto fend;
+    }
+
+    pchBuffer = (char*)malloc(MANIFEST_WRITE_BYTES);
+    if (pchBuffer == NULL)
+    {
+        hr = E_OUTOFMEMORY;
+        goto fend;
+    }
+
+    hFile = CreateFileW(szTempPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        logerr(L"Cannot create manifest %s, hr: %x", szTempPath, hr);
+        goto fend;
+    }
+
+    for (DWORD i = 0; i < pSnapshot->pHeader->nFiles; ++i)
+    {
+        const SNAPSHOT_FILE *pFile = &pSnapshot->aFiles[i];
+        if (pFile->dwFlags & SNAPSHOT_FILE_DIRECTORY)
+        {
+            continue;
+        }
+        if (!(pFile->dwFlags & SNAPSHOT_FILE_HASH_VALID))
+        {
+            ++nSkipped;
+            continue;
+        }
+
+        WCHAR szPath[MAX_PATH];
+        if (FAILED(StringCchPrintf(szPath, ARRAYSIZE(szPath), L"%s%s", GetSnapshotFolder(pSnapshot, pFile), GetSnapshotFileName(pSnapshot, pFile))))
+        {
+            ++nSkipped;
+            continue;
+        }
+
+        for (PWSTR pch = szPath; *pch != 0; ++pch)
+        {
+            if (*pch == L'\\')
+            {
+                *pch = L'/';
+            }
+        }
+
+        char szLine[MANIFEST_PATH_START + MANIFEST_MAX_PATH_BYTES + 1];
+        BYTE abHash[HASHLEN_SHA1];
+        CopyMemory(abHash, pFile->abHash, sizeof(abHash));
+        HashValueToString(abHash, szLine);
+        szLine[HASHLEN_SHA1 * 2] = ' ';
+        szLine[(HASHLEN_SHA1 * 2) + 1] = ' ';
+
+        // The null the conversion writes is replaced by the line break
+        int cbPath = WideCharToMultiByte(CP_UTF8, 0, szPath, -1, szLine + MANIFEST_PATH_START, MANIFEST_MAX_PATH_BYTES, NULL, NULL);
+        if (cbPath <= 0)
+        {
+            ++nSkipped;
+            continue;
+        }
+
+        DWORD cbLine = MANIFEST_PATH_START + cbPath;
+        szLine[cbLine - 1] = '\n';
+
+        if (cbBuffer + cbLine > MANIFEST_WRITE_BYTES)
+        {
+            hr = _FlushManifest(hFile, pchBuffer, &cbBuffer);
+            if (FAILED(hr))
+            {
+                break;
+            }
+        }
+
+        CopyMemory(pchBuffer + cbBuffer, szLine, cbLine);
+        cbBuffer += cbLine;
+    }
+
+    if (SUCCEEDED(hr) && (cbBuffer > 0))
+    {
+        hr = _FlushManifest(hFile, pchBuffer, &cbBuffer);
+    }
+
+    CloseHandle(hFile);
+    hFile = INVALID_HANDLE_VALUE;
+    if (FAILED(hr))
+    {
+        logerr(L"Cannot write manifest %s, hr: %x", szTempPath, hr);
+        DeleteFile(szTempPath);
+        goto fend;
+    }
+
+    if (!MoveFileEx(szTempPath, pszManifest, MOVEFILE_REPLACE_EXISTING))
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        logerr(L"Cannot replace manifest %s, hr: %x", pszManifest, hr);
+        DeleteFile(szTempPath);
+        goto fend;
+    }
+
+    if (nSkipped > 0)
+    {
+        logwarn(L"%d files without a hash are not in manifest %s", nSkipped, pszManifest);
+    }
+
+fend:
+    if (hFile != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(hFile);
+    }
+    free(pchBuffer);
+
+    if (pnSkipped != NULL)
+    {
+        *pnSkipped = nSkipped;
+    }
+    return hr;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+// ---------------------------------------------------
+// The FDiffDelete Project
+// Github: https://github.com/shishir993/fdiffdelete
+// Author: Shishir Bhat
+// The MIT License (MIT)
+// Copyright (c) 2014
+//
+
+#include "Common.h"
+#include "ScanSnapshot.h"
+
+// Content manifests in the format of sha1sum: one "<sha1 in hex>  <path>" line per
+// file, UTF-8, with '/' or '\' between folders. "<sha1> *<path>" (binary mode) and
+// lines escaped with a leading '\' are also read.
+// A manifest is read into a snapshot in memory (see ScanSnapshot.h), so it can be
+// diffed against a folder or another snapshot with DiffScanSnapshots(). Such a
+// snapshot has only files, with a hash and no size or modified time, and is flagged
+// SNAPSHOT_FLAG_HASHES_ONLY.
+
+// The manifest is read in windows of this size, and the lines of each window are
+// parsed by several threads at once.
+#define MANIFEST_WINDOW_BYTES       (64 * 1024 * 1024)
+
+// Windows smaller than this are parsed on the calling thread
+#define MANIFEST_MIN_PARALLEL_BYTES (1024 * 1024)
+
+#define MANIFEST_MAX_THREADS        16
+
+// Lines that are not a hash and a path are skipped, and counted in *pnBadLines.
+HRESULT ImportSha1Manifest(_In_z_ PCWSTR pszManifest, _Out_ PSCAN_SNAPSHOT *ppSnapshot, _Out_opt_ int *pnBadLines);
+
+// Write a line for each file of the snapshot that has a hash, with '/' between
+// folders. Files without a hash are skipped, and counted in *pnSkipped.
+HRESULT ExportSha1Manifest(_In_ PSCAN_SNAPSHOT pSnapshot, _In_z_ PCWSTR pszManifest, _Out_opt_ int *pnSkipped);
@@ -0,0 +1,828 @@
+
+// ---------------------------------------------------
+// The FDiffDelete Project
+// Github: https://github.com/shishir993/fdiffdelete
+// Author: Shishir Bhat
+// The MIT License (MIT)
+// Copyright (c) 2014
+//
+
+#include "ShardIndex.h"
+#include "DirectoryWalker_Util.h"
+#include "FileFormatUtil.h"
+
+#define INIT_SHARD_ENTRIES          1024
+
+#define SHARD_ALIGN(cb)             (((cb) + 7) & ~((UINT64)7))
+
+// Shard files being merged, the next file of each and a heap of the shards not merged
+// to the end yet, smallest next file on top
+typedef struct _ShardHeap
+{
+    PSHARD_MERGE pMerge;
+    DWORD aiNext[MAX_DUP_ROOTS];
+    int aiHeap[MAX_DUP_ROOTS];
+    int nHeap;
+
+} SHARD_HEAP, *PSHARD_HEAP;
+
+// Same order as the duplicate finder: size, then hash with files without one last,
+// then path ignoring case.
+static int _CompareShardFiles(
+    _In_z_ PCWSTR pszLeftStrings,
+    _In_ const SHARD_FILE *pLeft,
+    _In_z_ PCWSTR pszRightStrings,
+    _In_ const SHARD_FILE *pRight)
+{
+    if (pLeft->llSize != pRight->llSize)
+    {
+        return (pLeft->llSize < pRight->llSize) ? -1 : 1;
+    }
+
+    BOOL fLeftHashed = (pLeft->dwFlags & SHARD_FILE_HASH_VALID) != 0;
+    BOOL fRightHashed = (pRight->dwFlags & SHARD_FILE_HASH_VALID) != 0;
+    if (fLeftHashed != fRightHashed)
+    {
+        return (fLeftHashed ? -1 : 1);
+    }
+
+    if (fLeftHashed)
+    {
+        int cmp = memcmp(pLeft->abHash, pRight->abHash, HASHLEN_SHA1);
+        if (cmp != 0)
+        {
+            return cmp;
+        }
+    }
+
+    int cmp = CompareNames(pszLeftStrings + pLeft->ichFolder, pszRightStrings + pRight->ichFolder);
+    if (cmp == 0)
+    {
+        cmp = CompareNames(pszLeftStrings + pLeft->ichName, pszRightStrings + pRight->ichName);
+    }
+    return cmp;
+}
+
+static int __cdecl _CmpShardFiles(_In_ void *pvContext, _In_ const void *pvLeft, _In_ const void *pvRight)
+{
+    PCWSTR pszStrings = (PCWSTR)pvContext;
+    return _CompareShardFiles(pszStrings, (const SHARD_FILE*)pvLeft, pszStrings, (const SHARD_FILE*)pvRight);
+}
+
+// Most wasted bytes first, then as the duplicate finder finds them
+static int __cdecl _CmpShardGroups(const void *pvLeft, const void *pvRight)
+{
+    PSHARD_GROUP pLeft = (PSHARD_GROUP)pvLeft;
+    PSHARD_GROUP pRight = (PSHARD_GROUP)pvRight;
+    if (pLeft->llWasted != pRight->llWasted)
+    {
+        return (pLeft->llWasted > pRight->llWasted) ? -1 : 1;
+    }
+    if (pLeft->llPotential != pRight->llPotential)
+    {
+        return (pLeft->llPotential > pRight->llPotential) ? -1 : 1;
+    }
+    return pLeft->iFirst - pRight->iFirst;
+}
+
+static HRESULT _AddString(
+    _Inout_ PWSTR *ppszStrings,
+    _Inout_ int *pcchStrings,
+    _Inout_ int *pcchMaxStrings,
+    _In_z_ PCWSTR psz,
+    _Out_ DWORD *pichString)
+{
+    int cch = (int)wcslen(psz) + 1;
+    HRESULT hr = GrowArray((void**)ppszStrings, pcchMaxStrings, *pcchStrings + cch, INIT_SHARD_ENTRIES, sizeof(WCHAR));
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    CopyMemory(*ppszStrings + *pcchStrings, psz, cch * sizeof(WCHAR));
+    *pichString = (DWORD)*pcchStrings;
+    *pcchStrings += cch;
+    return S_OK;
+}
+
+// Offset of a folder in the strings, which gets the folder the first time it is seen
+static HRESULT _GetFolderString(
+    _In_ PCHL_HTABLE phtFolders,
+    _Inout_ PWSTR *ppszStrings,
+    _Inout_ int *pcchStrings,
+    _Inout_ int *pcchMaxStrings,
+    _In_z_ PCWSTR pszFolder,
+    _Out_ DWORD *pichFolder)
+{
+    int ichFolder;
+    if (SUCCEEDED(CHL_DsFindHT(phtFolders, pszFolder, StringSizeBytes(pszFolder), &ichFolder, NULL, FALSE)))
+    {
+        *pichFolder = (DWORD)ichFolder;
+        return S_OK;
+    }
+
+    HRESULT hr = _AddString(ppszStrings, pcchStrings, pcchMaxStrings, pszFolder, pichFolder);
+    if (SUCCEEDED(hr))
+    {
+        ichFolder = (int)*pichFolder;
+        hr = CHL_DsInsertHT(phtFolders, pszFolder, StringSizeBytes(pszFolder), (PCVOID)(INT_PTR)ichFolder, sizeof(ichFolder));
+    }
+    return hr;
+}
+
+static HRESULT _WriteShardFile(
+    _In_z_ PCWSTR pszFilepath,
+    _In_ const SHARD_HEADER *pHeader,
+    _In_count_(pHeader->nFiles) const SHARD_FILE *aFiles,
+    _In_count_(pHeader->cchStrings) PCWSTR pszStrings)
+{
+    static const BYTE abPad[8] = {};
+    UINT64 cbFiles = (UINT64)pHeader->nFiles * sizeof(SHARD_FILE);
+
+    HANDLE hFile = CreateFileW(pszFilepath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    HRESULT hr = WriteAllToFile(hFile, pHeader, sizeof(SHARD_HEADER));
+    if (SUCCEEDED(hr))
+    {
+        hr = WriteAllToFile(hFile, abPad, pHeader->ullFilesOffset - sizeof(SHARD_HEADER));
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = WriteAllToFile(hFile, aFiles, cbFiles);
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = WriteAllToFile(hFile, abPad, pHeader->ullStringsOffset - (pHeader->ullFilesOffset + cbFiles));
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = WriteAllToFile(hFile, pszStrings, (UINT64)pHeader->cchStrings * sizeof(WCHAR));
+    }
+
+    CloseHandle(hFile);
+    return hr;
+}
+
+HRESULT SaveShardIndex(_In_ PDIRINFO pDirInfo, _In_ int iRoot, _In_z_ PCWSTR pszFilepath)
+{
+    SB_ASSERT(pDirInfo);
+    SB_ASSERT((iRoot >= 0) && (iRoot < MAX_DUP_ROOTS));
+    SB_ASSERT(pszFilepath);
+
+    PFILEINFO *apAll = NULL;
+    int nAll = 0;
+    PSHARD_FILE aFiles = NULL;
+    int nFiles = 0;
+    int nMaxFiles = 0;
+    PWSTR pszStrings = NULL;
+    int cchStrings = 0;
+    int cchMaxStrings = 0;
+    PCHL_HTABLE phtFolders = NULL;
+    DWORD ichEmpty;
+    SHARD_HEADER stHeader;
+    WCHAR szTempPath[MAX_PATH];
+
+    HRESULT hr = StringCchPrintf(szTempPath, ARRAYSIZE(szTempPath), L"%s.tmp", pszFilepath);
+    if (FAILED(hr))
+    {
+        logerr(L"Shard file path too long: %s", pszFilepath);
+        goto fend;
+    }
+
+    hr = GetAllFilesInDir(pDirInfo, &apAll, &nAll);
+    if (SUCCEEDED(hr))
+    {
+        hr = GrowArray((void**)&aFiles, &nMaxFiles, max(nAll, 1), INIT_SHARD_ENTRIES, sizeof(SHARD_FILE));
+    }
+
+    // The files come in the order of the dir's hashtable, not by folder, so the
+    // folders already stored are looked up to store each folder once
+    if (SUCCEEDED(hr))
+    {
+        hr = CHL_DsCreateHT(&phtFolders, INIT_SHARD_ENTRIES, CHL_KT_WSTRING, CHL_VT_INT32, FALSE);
+    }
+
+    for (int i = 0; SUCCEEDED(hr) && (i < nAll); ++i)
+    {
+        PFILEINFO pFile = apAll[i];
+        if (pFile->fIsDirectory || (pFile->llFilesize.QuadPart == 0))
+        {
+            continue;
+        }
+
+        PSHARD_FILE pRecord = &aFiles[nFiles];
+        ZeroMemory(pRecord, sizeof(*pRecord));
+        pRecord->llSize = pFile->llFilesize.QuadPart;
+        if (pFile->fHashValid)
+        {
+            CopyMemory(pRecord->abHash, pFile->abHash, sizeof(pRecord->abHash));
+            pRecord->dwFlags = SHARD_FILE_HASH_VALID;
+        }
+
+        hr = _GetFolderString(phtFolders, &pszStrings, &cchStrings, &cchMaxStrings, pFile->pszPath, &pRecord->ichFolder);
+        if (SUCCEEDED(hr))
+        {
+            hr = _AddString(&pszStrings, &cchStrings, &cchMaxStrings, pFile->pszFilename, &pRecord->ichName);
+        }
+        ++nFiles;
+    }
+
+    if (SUCCEEDED(hr) && (cchStrings == 0))
+    {
+        hr = _AddString(&pszStrings, &cchStrings, &cchMaxStrings, L"", &ichEmpty);
+    }
+
+    if (FAILED(hr))
+    {
+        logerr(L"Cannot build shard of dir %s, hr: %x", pDirInfo->pszPath, hr);
+        goto fend;
+    }
+
+    qsort_s(aFiles, nFiles, sizeof(SHARD_FILE), _CmpShardFiles, pszStrings);
+
+    ZeroMemory(&stHeader, sizeof(stHeader));
+    stHeader.dwMagic = SHARD_MAGIC;
+    stHeader.dwVersion = SHARD_VERSION;
+    stHeader.cbHeader = sizeof(SHARD_HEADER);
+    stHeader.iRoot = (DWORD)iRoot;
+    stHeader.nFiles = (DWORD)nFiles;
+    stHeader.cchStrings = (DWORD)cchStrings;
+    stHeader.ullFilesOffset = SHARD_ALIGN(sizeof(SHARD_HEADER));
+    stHeader.ullStringsOffset = SHARD_ALIGN(stHeader.ullFilesOffset + ((UINT64)nFiles * sizeof(SHARD_FILE)));
+    StringCchCopy(stHeader.szRoot, ARRAYSIZE(stHeader.szRoot), pDirInfo->pszPath);
+
+    hr = _WriteShardFile(szTempPath, &stHeader, aFiles, pszStrings);
+    if (FAILED(hr))
+    {
+        logerr(L"Cannot write shard file %s, hr: %x", szTempPath, hr);
+        DeleteFile(szTempPath);
+        goto fend;
+    }
+
+    if (!MoveFileEx(szTempPath, pszFilepath, MOVEFILE_REPLACE_EXISTING))
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        logerr(L"Cannot replace shard file %s, hr: %x", pszFilepath, hr);
+        DeleteFile(szTempPath);
+        goto fend;
+    }
+
+    loginfo(L"Saved shard %d of %d files of %s to %s", iRoot, nFiles, pDirInfo->pszPath, pszFilepath);
+
+fend:
+    if (phtFolders != NULL)
+    {
+        CHL_DsDestroyHT(phtFolders);
+    }
+    free(apAll);
+    free(aFiles);
+    free(pszStrings);
+    return hr;
+}
+
+HRESULT OpenShardIndex(_In_z_ PCWSTR pszFilepath, _Out_ PSHARD_INDEX *ppShard)
+{
+    SB_ASSERT(pszFilepath);
+    SB_ASSERT(ppShard);
+
+    HRESULT hr = S_OK;
+    HANDLE hMapping = NULL;
+    PVOID pvView = NULL;
+    PSHARD_INDEX pShard = NULL;
+    LARGE_INTEGER llFileSize;
+    const SHARD_HEADER *pHeader;
+    const SHARD_FILE *aFiles;
+    BOOL fValid;
+
+    HANDLE hFile = CreateFileW(pszFilepath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        logerr(L"Cannot open shard file %s, hr: %x", pszFilepath, hr);
+        goto error_return;
+    }
+
+    if (!GetFileSizeEx(hFile, &llFileSize) || (llFileSize.QuadPart < sizeof(SHARD_HEADER)))
+    {
+        logerr(L"Not a valid shard file: %s", pszFilepath);
+        hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        goto error_return;
+    }
+
+    hMapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (hMapping == NULL)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        logerr(L"Cannot map shard file %s, hr: %x", pszFilepath, hr);
+        goto error_return;
+    }
+
+    pvView = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+    if (pvView == NULL)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        logerr(L"Cannot map view of shard file %s, hr: %x", pszFilepath, hr);
+        goto error_return;
+    }
+
+    pHeader = (const SHARD_HEADER*)pvView;
+    fValid = (pHeader->dwMagic == SHARD_MAGIC)
+        && (pHeader->dwVersion == SHARD_VERSION)
+        && (pHeader->cbHeader == sizeof(SHARD_HEADER))
+        && (pHeader->iRoot < MAX_DUP_ROOTS)
+        && (wcsnlen(pHeader->szRoot, ARRAYSIZE(pHeader->szRoot)) < ARRAYSIZE(pHeader->szRoot))
+        && IsSectionInFile(pHeader->ullFilesOffset, pHeader->nFiles, sizeof(SHARD_FILE), sizeof(SHARD_HEADER), (UINT64)llFileSize.QuadPart)
+        && IsSectionInFile(pHeader->ullStringsOffset, pHeader->cchStrings, sizeof(WCHAR), sizeof(SHARD_HEADER), (UINT64)llFileSize.QuadPart)
+        && (pHeader->cchStrings > 0)
+        && (((PCWSTR)((const BYTE*)pvView + pHeader->ullStringsOffset))[pHeader->cchStrings - 1] == 0);
+
+    // Every string of a record must be in the strings, which end with a null
+    aFiles = (const SHARD_FILE*)((const BYTE*)pvView + pHeader->ullFilesOffset);
+    for (DWORD i = 0; fValid && (i < pHeader->nFiles); ++i)
+    {
+        fValid = (aFiles[i].ichFolder < pHeader->cchStrings) && (aFiles[i].ichName < pHeader->cchStrings);
+    }
+
+    if (!fValid)
+    {
+        logerr(L"Not a valid shard file: %s", pszFilepath);
+        hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        goto error_return;
+    }
+
+    pShard = (PSHARD_INDEX)malloc(sizeof(SHARD_INDEX));
+    if (pShard == NULL)
+    {
+        hr = E_OUTOFMEMORY;
+        goto error_return;
+    }
+
+    pShard->pHeader = pHeader;
+    pShard->aFiles = aFiles;
+    pShard->pszStrings = (PCWSTR)((const BYTE*)pvView + pHeader->ullStringsOffset);
+    pShard->hFile = hFile;
+    pShard->hMapping = hMapping;
+    pShard->pvView = pvView;
+
+    *ppShard = pShard;
+    return S_OK;
+
+error_return:
+    if (pvView != NULL)
+    {
+        UnmapViewOfFile(pvView);
+    }
+    if (hMapping != NULL)
+    {
+        CloseHandle(hMapping);
+    }
+    if (hFile != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(hFile);
+    }
+
+    *ppShard = NULL;
+    return hr;
+}
+
+void CloseShardIndex(_In_ PSHARD_INDEX pShard)
+{
+    SB_ASSERT(pShard);
+
+    UnmapViewOfFile(pShard->pvView);
+    CloseHandle(pShard->hMapping);
+    CloseHandle(pShard->hFile);
+    free(pShard);
+}
+
+static const SHARD_FILE* _PeekShard(_In_ PSHARD_HEAP pHeap, _In_ int iRoot)
+{
+    return &pHeap->pMerge->apShards[iRoot]->aFiles[pHeap->aiNext[iRoot]];
+}
+
+static void _SiftDown(_In_ PSHARD_HEAP pHeap, _In_ int iHeap)
+{
+    int *aiHeap = pHeap->aiHeap;
+    for (;;)
+    {
+        int iSmallest = iHeap;
+        int iChild = (iHeap * 2) + 1;
+        for (int i = iChild; (i < iChild + 2) && (i < pHeap->nHeap); ++i)
+        {
+            int cmp = _CompareShardFiles(
+                pHeap->pMerge->apShards[aiHeap[i]]->pszStrings, _PeekShard(pHeap, aiHeap[i]),
+                pHeap->pMerge->apShards[aiHeap[iSmallest]]->pszStrings, _PeekShard(pHeap, aiHeap[iSmallest]));
+            if (cmp < 0)
+            {
+                iSmallest = i;
+            }
+        }
+
+        if (iSmallest == iHeap)
+        {
+            break;
+        }
+
+        int iTemp = aiHeap[iHeap];
+        aiHeap[iHeap] = aiHeap[iSmallest];
+        aiHeap[iSmallest] = iTemp;
+        iHeap = iSmallest;
+    }
+}
+
+// Take the smallest next file of all shards
+static void _PopShardHeap(_In_ PSHARD_HEAP pHeap, _Out_ int *piRoot, _Out_ DWORD *piFile)
+{
+    SB_ASSERT(pHeap->nHeap > 0);
+
+    int iRoot = pHeap->aiHeap[0];
+    *piRoot = iRoot;
+    *piFile = (pHeap->aiNext[iRoot])++;
+
+    if (pHeap->aiNext[iRoot] == pHeap->pMerge->apShards[iRoot]->pHeader->nFiles)
+    {
+        pHeap->aiHeap[0] = pHeap->aiHeap[--(pHeap->nHeap)];
+    }
+
+    if (pHeap->nHeap > 1)
+    {
+        _SiftDown(pHeap, 0);
+    }
+}
+
+// Keep the group being built if it has two files or more
+static void _CloseShardGroup(_In_ PSHARD_MERGE pMerge, _Inout_ BOOL *pfOpen)
+{
+    if (!*pfOpen)
+    {
+        return;
+    }
+
+    PSHARD_GROUP pGroup = &pMerge->aGroups[pMerge->nGroups];
+    if (pGroup->nFiles >= 2)
+    {
+        pGroup->llWasted = pGroup->llFilesize * (pGroup->nFiles - 1);
+        pMerge->llReclaimable += pGroup->llWasted;
+        ++(pMerge->nGroups);
+    }
+    else
+    {
+        pMerge->nMembers = pGroup->iFirst;
+    }
+    *pfOpen = FALSE;
+}
+
+// One pass over the shards in merged order. Equal files are next to each other, and
+// all files of a size, with or without a hash, are counted for llPotential.
+static HRESULT _MergeShards(_In_ PSHARD_MERGE pMerge)
+{
+    HRESULT hr = S_OK;
+    SHARD_HEAP stHeap = {};
+    stHeap.pMerge = pMerge;
+
+    for (int iRoot = 0; iRoot < pMerge->nShards; ++iRoot)
+    {
+        if (pMerge->apShards[iRoot]->pHeader->nFiles > 0)
+        {
+            stHeap.aiHeap[stHeap.nHeap++] = iRoot;
+        }
+    }
+
+    for (int iHeap = (stHeap.nHeap / 2) - 1; iHeap >= 0; --iHeap)
+    {
+        _SiftDown(&stHeap, iHeap);
+    }
+
+    LONGLONG llRunSize = -1;
+    int nRunFiles = 0;
+    int iRunFirstGroup = 0;
+    BOOL fGroupOpen = FALSE;
+    const SHARD_FILE *pGroupFile = NULL;
+
+    for (;;)
+    {
+        int iRoot = -1;
+        DWORD iFile = 0;
+        const SHARD_FILE *pFile = NULL;
+        if (stHeap.nHeap > 0)
+        {
+            _PopShardHeap(&stHeap, &iRoot, &iFile);
+            pFile = &pMerge->apShards[iRoot]->aFiles[iFile];
+        }
+
+        // End of the files of a size
+        if ((pFile == NULL) || (pFile->llSize != llRunSize))
+        {
+            _CloseShardGroup(pMerge, &fGroupOpen);
+            for (int iGroup = iRunFirstGroup; iGroup < pMerge->nGroups; ++iGroup)
+            {
+                pMerge->aGroups[iGroup].llPotential = llRunSize * (nRunFiles - 1);
+            }
+
+            if (pFile == NULL)
+            {
+                break;
+            }
+
+            llRunSize = pFile->llSize;
+            nRunFiles = 0;
+            iRunFirstGroup = pMerge->nGroups;
+        }
+
+        ++nRunFiles;
+        if (!(pFile->dwFlags & SHARD_FILE_HASH_VALID))
+        {
+            _CloseShardGroup(pMerge, &fGroupOpen);
+            continue;
+        }
+
+        if (!fGroupOpen || (memcmp(pGroupFile->abHash, pFile->abHash, HASHLEN_SHA1) != 0))
+        {
+            _CloseShardGroup(pMerge, &fGroupOpen);
+
+            hr = GrowArray((void**)&pMerge->aGroups, &pMerge->nMaxGroups, pMerge->nGroups + 1, INIT_SHARD_ENTRIES, sizeof(SHARD_GROUP));
+            if (FAILED(hr))
+            {
+                break;
+            }
+
+            PSHARD_GROUP pGroup = &pMerge->aGroups[pMerge->nGroups];
+            ZeroMemory(pGroup, sizeof(*pGroup));
+            pGroup->iFirst = pMerge->nMembers;
+            pGroup->llFilesize = pFile->llSize;
+            pGroupFile = pFile;
+            fGroupOpen = TRUE;
+        }
+
+        hr = GrowArray((void**)&pMerge->aMembers, &pMerge->nMaxMembers, pMerge->nMembers + 1, INIT_SHARD_ENTRIES, sizeof(SHARD_MEMBER));
+        if (FAILED(hr))
+        {
+            break;
+        }
+
+        PSHARD_GROUP pGroup = &pMerge->aGroups[pMerge->nGroups];
+        pMerge->aMembers[pMerge->nMembers].iRoot = iRoot;
+        pMerge->aMembers[pMerge->nMembers].iFile = iFile;
+        ++(pMerge->nMembers);
+        ++(pGroup->nFiles);
+        pGroup->dwRootMask |= (1UL << iRoot);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        // Groups only refer to their members by range, so they can be reordered freely
+        qsort(pMerge->aGroups, pMerge->nGroups, sizeof(SHARD_GROUP), _CmpShardGroups);
+    }
+    return hr;
+}
+
+HRESULT MergeShardIndexes(_In_count_(nFiles) PCWSTR *apszFiles, _In_ int nFiles, _Out_ PSHARD_MERGE *ppMerge)
+{
+    SB_ASSERT(apszFiles);
+    SB_ASSERT(ppMerge);
+
+    HRESULT hr = S_OK;
+    PSHARD_MERGE pMerge = NULL;
+
+    if ((nFiles < 1) || (nFiles > MAX_DUP_ROOTS))
+    {
+        logerr(L"Cannot merge %d shard files, at most %d are supported", nFiles, MAX_DUP_ROOTS);
+        hr = E_INVALIDARG;
+        goto error_return;
+    }
+
+    pMerge = (PSHARD_MERGE)malloc(sizeof(SHARD_MERGE));
+    if (pMerge == NULL)
+    {
+        hr = E_OUTOFMEMORY;
+        goto error_return;
+    }
+    ZeroMemory(pMerge, sizeof(*pMerge));
+    pMerge->nShards = nFiles;
+
+    for (int i = 0; i < nFiles; ++i)
+    {
+        PSHARD_INDEX pShard;
+        hr = OpenShardIndex(apszFiles[i], &pShard);
+        if (FAILED(hr))
+        {
+            goto error_return;
+        }
+
+        int iRoot = (int)pShard->pHeader->iRoot;
+        if ((iRoot >= nFiles) || (pMerge->apShards[iRoot] != NULL))
+        {
+            logerr(L"Shard file %s is of root %d, the shards must be of roots 0 to %d once each", apszFiles[i], iRoot, nFiles - 1);
+            CloseShardIndex(pShard);
+            hr = E_INVALIDARG;
+            goto error_return;
+        }
+        pMerge->apShards[iRoot] = pShard;
+    }
+
+    hr = _MergeShards(pMerge);
+    if (FAILED(hr))
+    {
+        logerr(L"Cannot merge %d shard files, hr: %x", nFiles, hr);
+        goto error_return;
+    }
+
+    loginfo(L"Found %d duplicate groups in %d shards, %lld bytes reclaimable", pMerge->nGroups, nFiles, pMerge->llReclaimable);
+    *ppMerge = pMerge;
+    return S_OK;
+
+error_return:
+    if (pMerge != NULL)
+    {
+        DestroyShardMerge(pMerge);
+    }
+
+    *ppMerge = NULL;
+    return hr;
+}
+
+// Append an argument in quotes, as CommandLineToArgvW() reads it back
+static HRESULT _AppendQuotedArg(_Inout_count_(cchCmdLine) PWSTR pszCmdLine, _In_ size_t cchCmdLine, _In_z_ PCWSTR pszArg)
+{
+    // A backslash before the closing quote has to be doubled
+    size_t cchArg = wcslen(pszArg);
+    PCWSTR pszEnd = ((cchArg > 0) && (pszArg[cchArg - 1] == L'\\')) ? L"\\\"" : L"\"";
+    return StringCchPrintf(pszCmdLine + wcslen(pszCmdLine), cchCmdLine - wcslen(pszCmdLine), L" \"%s%s", pszArg, pszEnd);
+}
+
+HRESULT RunShardedScan(
+    _In_count_(nRoots) PCWSTR *apszRoots,
+    _In_ int nRoots,
+    _In_z_ PCWSTR pszShardDir,
+    _Out_ PSHARD_MERGE *ppMerge)
+{
+    SB_ASSERT(apszRoots);
+    SB_ASSERT(pszShardDir);
+    SB_ASSERT(ppMerge);
+
+    HRESULT hr = S_OK;
+    HANDLE ahProcesses[MAX_DUP_ROOTS] = {};
+    WCHAR aszShardFiles[MAX_DUP_ROOTS][MAX_PATH];
+    PCWSTR apszShardFiles[MAX_DUP_ROOTS];
+    WCHAR szExePath[MAX_PATH];
+    int nStarted = 0;
+
+    *ppMerge = NULL;
+    if ((nRoots < 1) || (nRoots > MAX_DUP_ROOTS))
+    {
+        logerr(L"Cannot scan %d folders, at most %d are supported", nRoots, MAX_DUP_ROOTS);
+        return E_INVALIDARG;
+    }
+
+    DWORD cchExePath = GetModuleFileName(NULL, szExePath, ARRAYSIZE(szExePath));
+    if ((cchExePath == 0) || (cchExePath >= ARRAYSIZE(szExePath)))
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+        logerr(L"Cannot get the path of this program, hr: %x", hr);
+        return FAILED(hr) ? hr : E_FAIL;
+    }
+
+    for (int iRoot = 0; iRoot < nRoots; ++iRoot)
+    {
+        WCHAR szCmdLine[MAX_PATH * 4];
+        szCmdLine[0] = 0;
+
+        hr = StringCchPrintf(aszShardFiles[iRoot], MAX_PATH, L"%s\\shard%d.fdsi", pszShardDir, iRoot);
+        apszShardFiles[iRoot] = aszShardFiles[iRoot];
+        if (SUCCEEDED(hr))
+        {
+            hr = _AppendQuotedArg(szCmdLine, ARRAYSIZE(szCmdLine), szExePath);
+        }
+        if (SUCCEEDED(hr))
+        {
+            size_t cch = wcslen(szCmdLine);
+            hr = StringCchPrintf(szCmdLine + cch, ARRAYSIZE(szCmdLine) - cch, L" %s %d", SHARD_WORKER_SWITCH, iRoot);
+        }
+        if (SUCCEEDED(hr))
+        {
+            hr = _AppendQuotedArg(szCmdLine, ARRAYSIZE(szCmdLine), aszShardFiles[iRoot]);
+        }
+        if (SUCCEEDED(hr))
+        {
+            hr = _AppendQuotedArg(szCmdLine, ARRAYSIZE(szCmdLine), apszRoots[iRoot]);
+        }
+
+        if (FAILED(hr))
+        {
+            logerr(L"Command line of shard worker %d too long, root: %s", iRoot, apszRoots[iRoot]);
+            goto fend;
+        }
+
+        // Remove what a previous scan left, so a worker that fails leaves no shard file
+        DeleteFile(aszShardFiles[iRoot]);
+
+        STARTUPINFO stStartup = {};
+        PROCESS_INFORMATION stProcess = {};
+        stStartup.cb = sizeof(stStartup);
+        if (!CreateProcess(szExePath, szCmdLine, NULL, NULL, FALSE, 0, NULL, NULL, &stStartup, &stProcess))
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            logerr(L"Cannot start shard worker %d for %s, hr: %x", iRoot, apszRoots[iRoot], hr);
+            goto fend;
+        }
+
+        CloseHandle(stProcess.hThread);
+        ahProcesses[nStarted++] = stProcess.hProcess;
+        loginfo(L"Started shard worker %d, process %u: %s", iRoot, stProcess.dwProcessId, apszRoots[iRoot]);
+    }
+
+fend:
+    // Wait even after a failure to start one, so no worker outlives the scan
+    if (nStarted > 0)
+    {
+        WaitForMultipleObjects(nStarted, ahProcesses, TRUE, INFINITE);
+    }
+
+    for (int i = 0; i < nStarted; ++i)
+    {
+        DWORD dwExitCode = 1;
+        GetExitCodeProcess(ahProcesses[i], &dwExitCode);
+        CloseHandle(ahProcesses[i]);
+
+        if (SUCCEEDED(hr) && (dwExitCode != 0))
+        {
+            logerr(L"Shard worker %d failed with exit code %u, root: %s", i, dwExitCode, apszRoots[i]);
+            hr = E_FAIL;
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = MergeShardIndexes(apszShardFiles, nRoots, ppMerge);
+    }
+    return hr;
+}
+
+void DestroyShardMerge(_In_ PSHARD_MERGE pMerge)
+{
+    SB_ASSERT(pMerge);
+
+    for (int iRoot = 0; iRoot < pMerge->nShards; ++iRoot)
+    {
+        if (pMerge->apShards[iRoot] != NULL)
+        {
+            CloseShardIndex(pMerge->apShards[iRoot]);
+        }
+    }
+
+    free(pMerge->aGroups);
+    free(pMerge->aMembers);
+    free(pMerge);
+}
+
+void PrintShardMerge(_In_ PSHARD_MERGE pMerge)
+{
+    SB_ASSERT(pMerge);
+
+    // Per root: files that have a copy elsewhere (in any root), and their bytes
+    int anDupFiles[MAX_DUP_ROOTS] = {};
+    LONGLONG allDupBytes[MAX_DUP_ROOTS] = {};
+
+    for (int iRoot = 0; iRoot < pMerge->nShards; ++iRoot)
+    {
+        wprintf(L"[%d] %s\n", iRoot, pMerge->apShards[iRoot]->pHeader->szRoot);
+    }
+    wprintf(L"\n");
+
+    for (int iGroup = 0; iGroup < pMerge->nGroups; ++iGroup)
+    {
+        PSHARD_GROUP pGroup = &pMerge->aGroups[iGroup];
+        wprintf(L"%d files of %lld bytes in roots:", pGroup->nFiles, pGroup->llFilesize);
+        for (int iRoot = 0; iRoot < pMerge->nShards; ++iRoot)
+        {
+            if (pGroup->dwRootMask & (1UL << iRoot))
+            {
+                wprintf(L" [%d]", iRoot);
+            }
+        }
+        wprintf(L"\n");
+
+        for (int i = 0; i < pGroup->nFiles; ++i)
+        {
+            PSHARD_MEMBER pMember = &pMerge->aMembers[pGroup->iFirst + i];
+            PSHARD_INDEX pShard = pMerge->apShards[pMember->iRoot];
+            const SHARD_FILE *pFile = &pShard->aFiles[pMember->iFile];
+            wprintf(L"  [%d] %s%s\n", pMember->iRoot, pShard->pszStrings + pFile->ichFolder, pShard->pszStrings + pFile->ichName);
+
+            ++anDupFiles[pMember->iRoot];
+            allDupBytes[pMember->iRoot] += pGroup->llFilesize;
+        }
+        wprintf(L"\n");
+    }
+
+    wprintf(L"  Root  DupFiles  DupBytes\n");
+    for (int iRoot = 0; iRoot < pMerge->nShards; ++iRoot)
+    {
+        wprintf(L"  [%2d]  %8d  %lld\n", iRoot, anDupFiles[iRoot], allDupBytes[iRoot]);
+    }
+    wprintf(L"%d duplicate groups, %lld bytes reclaimable\n\n", pMerge->nGroups, pMerge->llReclaimable);
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+// ---------------------------------------------------
+// The FDiffDelete Project
+// Github: https://github.com/shishir993/fdiffdelete
+// Author: Shishir Bhat
+// The MIT License (MIT)
+// Copyright (c) 2014
+//
+
+#include "Common.h"
+#include "HashFactory.h"
+#include "DirectoryWalker_Interface.h"
+#include "DupFinder.h"
+
+// Duplicate search split across worker processes, one per root (a subtree or a mount).
+// Each worker walks its root with hash compare and writes a shard file of the non-empty
+// files of the root, sorted by size, then hash, then path. Files without a hash sort
+// last among those of their size.
+// Merging the sorted shards k ways brings equal files next to each other, so the groups
+// are found in a single pass over the shards, without reading any file. The groups, their
+// order and their members are the same as those of BuildMultiRootIndex() over the same
+// roots with hash compare, and PrintShardMerge() prints them as PrintMultiRootIndex() does.
+
+#define SHARD_MAGIC             0x49534446  // "FDSI"
+#define SHARD_VERSION           1
+
+// SHARD_FILE.dwFlags
+#define SHARD_FILE_HASH_VALID   0x01
+
+// Command line of a worker process: "/shardscan <root index> <shard file> <folder>"
+#define SHARD_WORKER_SWITCH     L"/shardscan"
+
+// Layout of a shard file, each section 8-byte aligned:
+//  SHARD_HEADER
+//  SHARD_FILE      [nFiles]        sorted, see above
+//  WCHAR           [cchStrings]    null terminated folders and filenames
+typedef struct _ShardHeader
+{
+    DWORD dwMagic;
+    DWORD dwVersion;
+    DWORD cbHeader;
+
+    // Position of the root among the roots of the whole scan
+    DWORD iRoot;
+
+    DWORD nFiles;
+    DWORD cchStrings;
+    UINT64 ullFilesOffset;
+    UINT64 ullStringsOffset;
+
+    // As walked, see DIRINFO pszPath
+    WCHAR szRoot[MAX_PATH];
+
+} SHARD_HEADER, *PSHARD_HEADER;
+
+typedef struct _ShardFile
+{
+    LONGLONG llSize;
+    BYTE abHash[HASHLEN_SHA1];
+    DWORD dwFlags;
+
+    // Into the strings: the folder, as FILEINFO pszPath, and the filename
+    DWORD ichFolder;
+    DWORD ichName;
+
+} SHARD_FILE, *PSHARD_FILE;
+
+// An open shard file, all pointers are into its read-only view
+typedef struct _ShardIndex
+{
+    const SHARD_HEADER *pHeader;
+    const SHARD_FILE *aFiles;
+    PCWSTR pszStrings;
+
+    HANDLE hFile;
+    HANDLE hMapping;
+    PVOID pvView;
+
+} SHARD_INDEX, *PSHARD_INDEX;
+
+// A set of files with identical contents, see DUPGROUP
+typedef struct _ShardGroup
+{
+    // Range of the members in SHARD_MERGE aMembers
+    int iFirst;
+    int nFiles;
+
+    LONGLONG llFilesize;
+    LONGLONG llWasted;
+
+    // Bytes all files of this size could free. Orders the groups that waste the same
+    // number of bytes, as the duplicate finder hashes the sizes in this order.
+    LONGLONG llPotential;
+
+    DWORD dwRootMask;
+
+} SHARD_GROUP, *PSHARD_GROUP;
+
+typedef struct _ShardMember
+{
+    int iRoot;
+    DWORD iFile;
+
+} SHARD_MEMBER, *PSHARD_MEMBER;
+
+typedef struct _ShardMerge
+{
+    // By root index
+    int nShards;
+    PSHARD_INDEX apShards[MAX_DUP_ROOTS];
+
+    // Largest llWasted first. Members are in path order within a group.
+    int nGroups;
+    int nMaxGroups;
+    PSHARD_GROUP aGroups;
+
+    int nMembers;
+    int nMaxMembers;
+    PSHARD_MEMBER aMembers;
+
+    LONGLONG llReclaimable;
+
+} SHARD_MERGE, *PSHARD_MERGE;
+
+// Write the shard file of a dir built with hash compare, replacing the file only once
+// it is complete.
+HRESULT SaveShardIndex(_In_ PDIRINFO pDirInfo, _In_ int iRoot, _In_z_ PCWSTR pszFilepath);
+
+HRESULT OpenShardIndex(_In_z_ PCWSTR pszFilepath, _Out_ PSHARD_INDEX *ppShard);
+void CloseShardIndex(_In_ PSHARD_INDEX pShard);
+
+// Merge the shard files of all roots of a scan, in any order. Each root index from
+// 0 to nFiles - 1 must be in exactly one of the files.
+HRESULT MergeShardIndexes(_In_count_(nFiles) PCWSTR *apszFiles, _In_ int nFiles, _Out_ PSHARD_MERGE *ppMerge);
+
+// Start a worker process of this program for each root, all running at once, which
+// write the shard files into pszShardDir, then merge the shard files.
+HRESULT RunShardedScan(
+    _In_count_(nRoots) PCWSTR *apszRoots,
+    _In_ int nRoots,
+    _In_z_ PCWSTR pszShardDir,
+    _Out_ PSHARD_MERGE *ppMerge);
+
+void DestroyShardMerge(_In_ PSHARD_MERGE pMerge);
+
+// Print the groups the same way as PrintMultiRootIndex()
+void PrintShardMerge(_In_ PSHARD_MERGE pMerge);
@@ -0,0 +1,421 @@
+
+// ---------------------------------------------------
+// The FDiffDelete Project
+// Github: https://github.com/shishir993/fdiffdelete
+// Author: Shishir Bhat
+// The MIT License (MIT)
+// Copyright (c) 2014
+//
+
+#include "SnapshotDiff.h"
+
+// Order of two files, possibly of different snapshots
+typedef int (*PFN_SNAPDIFF_CMP)(
+    _In_ PSCAN_SNAPSHOT pLeft,
+    _In_ const SNAPSHOT_FILE *pLeftFile,
+    _In_ PSCAN_SNAPSHOT pRight,
+    _In_ const SNAPSHOT_FILE *pRightFile);
+
+// Modified times are compared at millisecond resolution, like GetModifiedTimeMs()
+static UINT64 _GetModifiedMs(_In_ const SNAPSHOT_FILE *pFile)
+{
+    return ((((UINT64)pFile->ftModified.dwHighDateTime) << 32) | pFile->ftModified.dwLowDateTime) / 10000;
+}
+
+static BOOL _IsDirectory(_In_ const SNAPSHOT_FILE *pFile)
+{
+    return (pFile->dwFlags & SNAPSHOT_FILE_DIRECTORY) != 0;
+}
+
+// Same order as the files of a snapshot are sorted in
+static int _CmpByPath(
+    _In_ PSCAN_SNAPSHOT pLeft,
+    _In_ const SNAPSHOT_FILE *pLeftFile,
+    _In_ PSCAN_SNAPSHOT pRight,
+    _In_ const SNAPSHOT_FILE *pRightFile)
+{
+    UINT64 ullLeftKey = GetSnapshotNameKey(pLeft, pLeftFile);
+    UINT64 ullRightKey = GetSnapshotNameKey(pRight, pRightFile);
+    if (ullLeftKey != ullRightKey)
+    {
+        return (ullLeftKey < ullRightKey) ? -1 : 1;
+    }
+
+    return CompareSnapshotPaths(
+        GetSnapshotFolder(pLeft, pLeftFile), GetSnapshotFileName(pLeft, pLeftFile),
+        GetSnapshotFolder(pRight, pRightFile), GetSnapshotFileName(pRight, pRightFile));
+}
+
+// Name ignoring case, then size, then modified time
+static int _CmpByNameSizeDate(
+    _In_ PSCAN_SNAPSHOT pLeft,
+    _In_ const SNAPSHOT_FILE *pLeftFile,
+    _In_ PSCAN_SNAPSHOT pRight,
+    _In_ const SNAPSHOT_FILE *pRightFile)
+{
+    UINT64 ullLeftKey = GetSnapshotNameKey(pLeft, pLeftFile);
+    UINT64 ullRightKey = GetSnapshotNameKey(pRight, pRightFile);
+    if (ullLeftKey != ullRightKey)
+    {
+        return (ullLeftKey < ullRightKey) ? -1 : 1;
+    }
+
+    int cmp = CompareStringOrdinal(GetSnapshotFileName(pLeft, pLeftFile), -1, GetSnapshotFileName(pRight, pRightFile), -1, TRUE);
+    if (cmp != CSTR_EQUAL)
+    {
+        return cmp - CSTR_EQUAL;
+    }
+
+    if (pLeftFile->llSize != pRightFile->llSize)
+    {
+        return (pLeftFile->llSize < pRightFile->llSize) ? -1 : 1;
+    }
+
+    UINT64 ullLeftMs = _GetModifiedMs(pLeftFile);
+    UINT64 ullRightMs = _GetModifiedMs(pRightFile);
+    if (ullLeftMs != ullRightMs)
+    {
+        return (ullLeftMs < ullRightMs) ? -1 : 1;
+    }
+    return 0;
+}
+
+static int _CmpByHash(
+    _In_ PSCAN_SNAPSHOT pLeft,
+    _In_ const SNAPSHOT_FILE *pLeftFile,
+    _In_ PSCAN_SNAPSHOT pRight,
+    _In_ const SNAPSHOT_FILE *pRightFile)
+{
+    DBG_UNREFERENCED_PARAMETER(pLeft);
+    DBG_UNREFERENCED_PARAMETER(pRight);
+
+    return memcmp(pLeftFile->abHash, pRightFile->abHash, HASHLEN_SHA1);
+}
+
+static int __cdecl _SortByNameSizeDate(_In_ void *pvContext, _In_ const void *pvLeft, _In_ const void *pvRight)
+{
+    PSCAN_SNAPSHOT pSnapshot = (PSCAN_SNAPSHOT)pvContext;
+    return _CmpByNameSizeDate(
+        pSnapshot, &pSnapshot->aFiles[*(const DWORD*)pvLeft],
+        pSnapshot, &pSnapshot->aFiles[*(const DWORD*)pvRight]);
+}
+
+// Indexes of the files of a snapshot that can be duplicates, in the order they
+// are matched in: the hash index as it is, or the files sorted by name, size and
+// modified time.
+static HRESULT _GetMatchOrder(_In_ PSCAN_SNAPSHOT pSnapshot, _In_ BOOL fCompareHashes, _Out_ DWORD **paiOrder, _Out_ int *pnOrder)
+{
+    DWORD nFiles = pSnapshot->pHeader->nFiles;
+    DWORD *aiOrder = (DWORD*)malloc(max(nFiles, 1) * sizeof(DWORD));
+    if (aiOrder == NULL)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    int nOrder = 0;
+    if (fCompareHashes)
+    {
+        for (DWORD i = 0; i < pSnapshot->pHeader->nHashed; ++i)
+        {
+            DWORD iFile = pSnapshot->aiByHash[i];
+            if ((iFile < nFiles) && !_IsDirectory(&pSnapshot->aFiles[iFile]))
+            {
+                aiOrder[nOrder++] = iFile;
+            }
+        }
+    }
+    else
+    {
+        for (DWORD iFile = 0; iFile < nFiles; ++iFile)
+        {
+            if (!_IsDirectory(&pSnapshot->aFiles[iFile]))
+            {
+                aiOrder[nOrder++] = iFile;
+            }
+        }
+        qsort_s(aiOrder, nOrder, sizeof(DWORD), _SortByNameSizeDate, pSnapshot);
+    }
+
+    *paiOrder = aiOrder;
+    *pnOrder = nOrder;
+    return S_OK;
+}
+
+static void _MarkDuplicate(_In_ PSNAPSHOT_DIFF pDiff, _In_ int iSide, _In_ DWORD iFile)
+{
+    pDiff->aabFiles[iSide][iFile] |= SNAPDIFF_DUPLICATE;
+    ++(pDiff->anDups[iSide]);
+    pDiff->allDupBytes[iSide] += pDiff->apSnapshots[iSide]->aFiles[iFile].llSize;
+}
+
+// Walk both match orders together. Each run of equal files found on both sides
+// is a group of duplicates.
+static void _MarkDuplicates(
+    _In_ PSNAPSHOT_DIFF pDiff,
+    _In_count_(nLeft) const DWORD *aiLeft,
+    _In_ int nLeft,
+    _In_count_(nRight) const DWORD *aiRight,
+    _In_ int nRight,
+    _In_ PFN_SNAPDIFF_CMP pfnCompare)
+{
+    PSCAN_SNAPSHOT pLeft = pDiff->apSnapshots[SNAPDIFF_LEFT];
+    PSCAN_SNAPSHOT pRight = pDiff->apSnapshots[SNAPDIFF_RIGHT];
+
+    int iLeft = 0;
+    int iRight = 0;
+    while ((iLeft < nLeft) && (iRight < nRight))
+    {
+        const SNAPSHOT_FILE *pLeftFile = &pLeft->aFiles[aiLeft[iLeft]];
+        const SNAPSHOT_FILE *pRightFile = &pRight->aFiles[aiRight[iRight]];
+
+        int cmp = pfnCompare(pLeft, pLeftFile, pRight, pRightFile);
+        if (cmp < 0)
+        {
+            ++iLeft;
+        }
+        else if (cmp > 0)
+        {
+            ++iRight;
+        }
+        else
+        {
+            do
+            {
+                _MarkDuplicate(pDiff, SNAPDIFF_LEFT, aiLeft[iLeft]);
+                ++iLeft;
+            } while ((iLeft < nLeft) && (pfnCompare(pLeft, &pLeft->aFiles[aiLeft[iLeft]], pRight, pRightFile) == 0));
+
+            do
+            {
+                _MarkDuplicate(pDiff, SNAPDIFF_RIGHT, aiRight[iRight]);
+                ++iRight;
+            } while ((iRight < nRight) && (pfnCompare(pLeft, pLeftFile, pRight, &pRight->aFiles[aiRight[iRight]]) == 0));
+        }
+    }
+}
+
+// Are two files at the same path the same? If both have a hash the hash decides,
+// since a snapshot of a manifest has no size or modified time.
+static BOOL _IsSameContent(_In_ BOOL fCompareHashes, _In_ const SNAPSHOT_FILE *pLeftFile, _In_ const SNAPSHOT_FILE *pRightFile)
+{
+    if (_IsDirectory(pLeftFile) || _IsDirectory(pRightFile))
+    {
+        return _IsDirectory(pLeftFile) && _IsDirectory(pRightFile);
+    }
+
+    if (fCompareHashes && (pLeftFile->dwFlags & pRightFile->dwFlags & SNAPSHOT_FILE_HASH_VALID))
+    {
+        return (memcmp(pLeftFile->abHash, pRightFile->abHash, HASHLEN_SHA1) == 0);
+    }
+
+    return (pLeftFile->llSize == pRightFile->llSize) && (_GetModifiedMs(pLeftFile) == _GetModifiedMs(pRightFile));
+}
+
+// One aligned walk over both snapshots in path order
+static HRESULT _DiffPaths(_In_ PSNAPSHOT_DIFF pDiff)
+{
+    PSCAN_SNAPSHOT pLeft = pDiff->apSnapshots[SNAPDIFF_LEFT];
+    PSCAN_SNAPSHOT pRight = pDiff->apSnapshots[SNAPDIFF_RIGHT];
+    DWORD nLeft = pLeft->pHeader->nFiles;
+    DWORD nRight = pRight->pHeader->nFiles;
+
+    // Folders are not compared if one side has none
+    BOOL fSkipFolders = ((pLeft->pHeader->dwFlags | pRight->pHeader->dwFlags) & SNAPSHOT_FLAG_HASHES_ONLY) != 0;
+
+    DWORD iLeft = 0;
+    DWORD iRight = 0;
+    while ((iLeft < nLeft) || (iRight < nRight))
+    {
+        if (fSkipFolders && (iLeft < nLeft) && _IsDirectory(&pLeft->aFiles[iLeft]))
+        {
+            ++iLeft;
+            continue;
+        }
+        if (fSkipFolders && (iRight < nRight) && _IsDirectory(&pRight->aFiles[iRight]))
+        {
+            ++iRight;
+            continue;
+        }
+
+        const SNAPSHOT_FILE *pLeftFile = (iLeft < nLeft) ? &pLeft->aFiles[iLeft] : NULL;
+        const SNAPSHOT_FILE *pRightFile = (iRight < nRight) ? &pRight->aFiles[iRight] : NULL;
+
+        int cmp;
+        if (pLeftFile == NULL)
+        {
+            cmp = 1;
+        }
+        else if (pRightFile == NULL)
+        {
+            cmp = -1;
+        }
+        else
+        {
+            cmp = _CmpByPath(pLeft, pLeftFile, pRight, pRightFile);
+        }
+
+        PCWSTR pszRelFolder = (cmp <= 0) ? GetSnapshotFolder(pLeft, pLeftFile) : GetSnapshotFolder(pRight, pRightFile);
+
+        TREEDIFF_RESULT result;
+        if (cmp < 0)
+        {
+            result = TDR_REMOVED;
+            pDiff->aabFiles[SNAPDIFF_LEFT][iLeft] |= SNAPDIFF_ONE_SIDE;
+            ++iLeft;
+        }
+        else if (cmp > 0)
+        {
+            result = TDR_ADDED;
+            pDiff->aabFiles[SNAPDIFF_RIGHT][iRight] |= SNAPDIFF_ONE_SIDE;
+            ++iRight;
+        }
+        else
+        {
+            result = TDR_IDENTICAL;
+            if (!_IsSameContent(pDiff->fCompareHashes, pLeftFile, pRightFile))
+            {
+                result = TDR_CHANGED;
+                pDiff->aabFiles[SNAPDIFF_LEFT][iLeft] |= SNAPDIFF_CHANGED;
+                pDiff->aabFiles[SNAPDIFF_RIGHT][iRight] |= SNAPDIFF_CHANGED;
+            }
+            ++iLeft;
+            ++iRight;
+        }
+
+        HRESULT hr = CountTreeDiffFile(pDiff->pTreeDiff, pszRelFolder, result);
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+    }
+    return S_OK;
+}
+
+HRESULT DiffScanSnapshots(_In_ PSCAN_SNAPSHOT pLeft, _In_ PSCAN_SNAPSHOT pRight, _Out_ PSNAPSHOT_DIFF *ppDiff)
+{
+    SB_ASSERT(pLeft);
+    SB_ASSERT(pRight);
+    SB_ASSERT(ppDiff);
+
+    HRESULT hr = S_OK;
+    DWORD *aiLeftOrder = NULL;
+    DWORD *aiRightOrder = NULL;
+    int nLeftOrder = 0;
+    int nRightOrder = 0;
+
+    PSNAPSHOT_DIFF pDiff = (PSNAPSHOT_DIFF)malloc(sizeof(SNAPSHOT_DIFF));
+    if (pDiff == NULL)
+    {
+        hr = E_OUTOFMEMORY;
+        goto error_return;
+    }
+
+    ZeroMemory(pDiff, sizeof(*pDiff));
+    pDiff->apSnapshots[SNAPDIFF_LEFT] = pLeft;
+    pDiff->apSnapshots[SNAPDIFF_RIGHT] = pRight;
+    pDiff->fCompareHashes = (pLeft->aiByHash != NULL) && (pRight->aiByHash != NULL);
+
+    pDiff->aabFiles[SNAPDIFF_LEFT] = (PBYTE)calloc(max(pLeft->pHeader->nFiles, 1), sizeof(BYTE));
+    pDiff->aabFiles[SNAPDIFF_RIGHT] = (PBYTE)calloc(max(pRight->pHeader->nFiles, 1), sizeof(BYTE));
+    if ((pDiff->aabFiles[SNAPDIFF_LEFT] == NULL) || (pDiff->aabFiles[SNAPDIFF_RIGHT] == NULL))
+    {
+        hr = E_OUTOFMEMORY;
+        goto error_return;
+    }
+
+    logdbg(L"Snapshot diff of %s and %s, hash compare: %d", pLeft->pHeader->szRoot, pRight->pHeader->szRoot, pDiff->fCompareHashes);
+
+    hr = _GetMatchOrder(pLeft, pDiff->fCompareHashes, &aiLeftOrder, &nLeftOrder);
+    if (SUCCEEDED(hr))
+    {
+        hr = _GetMatchOrder(pRight, pDiff->fCompareHashes, &aiRightOrder, &nRightOrder);
+    }
+
+    if (FAILED(hr))
+    {
+        goto error_return;
+    }
+
+    _MarkDuplicates(pDiff, aiLeftOrder, nLeftOrder, aiRightOrder, nRightOrder,
+        pDiff->fCompareHashes ? _CmpByHash : _CmpByNameSizeDate);
+
+    hr = CreateTreeDiff(&pDiff->pTreeDiff);
+    if (SUCCEEDED(hr))
+    {
+        hr = _DiffPaths(pDiff);
+    }
+
+    if (FAILED(hr))
+    {
+        logerr(L"Cannot diff snapshots of %s and %s, hr: %x", pLeft->pHeader->szRoot, pRight->pHeader->szRoot, hr);
+        goto error_return;
+    }
+
+    free(aiLeftOrder);
+    free(aiRightOrder);
+
+    *ppDiff = pDiff;
+    return S_OK;
+
+error_return:
+    free(aiLeftOrder);
+    free(aiRightOrder);
+    if (pDiff != NULL)
+    {
+        DestroySnapshotDiff(pDiff);
+    }
+    *ppDiff = NULL;
+    return hr;
+}
+
+void DestroySnapshotDiff(_In_ PSNAPSHOT_DIFF pDiff)
+{
+    SB_ASSERT(pDiff);
+
+    if (pDiff->pTreeDiff != NULL)
+    {
+        DestroyTreeDiff(pDiff->pTreeDiff);
+    }
+
+    free(pDiff->aabFiles[SNAPDIFF_LEFT]);
+    free(pDiff->aabFiles[SNAPDIFF_RIGHT]);
+    free(pDiff);
+}
+
+// Print the files of one side that have any of the result flags
+static void _PrintFiles(_In_ PSNAPSHOT_DIFF pDiff, _In_ int iSide, _In_ BYTE bResult, _In_z_ PCWSTR pszMark)
+{
+    PSCAN_SNAPSHOT pSnapshot = pDiff->apSnapshots[iSide];
+    for (DWORD i = 0; i < pSnapshot->pHeader->nFiles; ++i)
+    {
+        if (pDiff->aabFiles[iSide][i] & bResult)
+        {
+            const SNAPSHOT_FILE *pFile = &pSnapshot->aFiles[i];
+            wprintf(L"%s %12lld %s%s\n", pszMark, pFile->llSize, GetSnapshotFolder(pSnapshot, pFile), GetSnapshotFileName(pSnapshot, pFile));
+        }
+    }
+}
+
+void PrintSnapshotDiff(_In_ PSNAPSHOT_DIFF pDiff)
+{
+    SB_ASSERT(pDiff);
+
+    wprintf(L"Duplicates of %s and %s, by %s:\n",
+        pDiff->apSnapshots[SNAPDIFF_LEFT]->pHeader->szRoot,
+        pDiff->apSnapshots[SNAPDIFF_RIGHT]->pHeader->szRoot,
+        pDiff->fCompareHashes ? L"hash" : L"name, size and modified time");
+    _PrintFiles(pDiff, SNAPDIFF_LEFT, SNAPDIFF_DUPLICATE, L"<");
+    _PrintFiles(pDiff, SNAPDIFF_RIGHT, SNAPDIFF_DUPLICATE, L">");
+
+    wprintf(L"\nRemoved (-), added (+) and changed (*) files:\n");
+    _PrintFiles(pDiff, SNAPDIFF_LEFT, SNAPDIFF_ONE_SIDE, L"-");
+    _PrintFiles(pDiff, SNAPDIFF_RIGHT, SNAPDIFF_ONE_SIDE, L"+");
+    _PrintFiles(pDiff, SNAPDIFF_RIGHT, SNAPDIFF_CHANGED, L"*");
+    wprintf(L"\n");
+
+    PrintTreeDiff(pDiff->pTreeDiff);
+
+    wprintf(L"%d of %u left files (%lld bytes) and %d of %u right files (%lld bytes) are duplicates\n",
+        pDiff->anDups[SNAPDIFF_LEFT], pDiff->apSnapshots[SNAPDIFF_LEFT]->pHeader->nFiles, pDiff->allDupBytes[SNAPDIFF_LEFT],
+        pDiff->anDups[SNAPDIFF_RIGHT], pDiff->apSnapshots[SNAPDIFF_RIGHT]->pHeader->nFiles, pDiff->allDupBytes[SNAPDIFF_RIGHT]);
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+// ---------------------------------------------------
+// The FDiffDelete Project
+// Github: https://github.com/shishir993/fdiffdelete
+// Author: Shishir Bhat
+// The MIT License (MIT)
+// Copyright (c) 2014
+//
+
+#include "Common.h"
+#include "ScanSnapshot.h"
+#include "DirectoryWalker_TreeDiff.h"
+
+// Diff of two scan snapshots, see ScanSnapshot.h. Only the snapshots are read, so
+// either tree may be offline. A live tree is diffed by taking a snapshot of it in
+// memory with CreateScanSnapshot().
+// Two reports are made in one pass over the sorted records of both snapshots:
+//  - Duplicates, matched like CompareDirsAndMarkFiles(): by hash if both snapshots
+//    have hashes, else by name (case insensitive), size and modified time.
+//    Only files are matched, not folders.
+//  - Added, removed and changed files, matched by path relative to the root.
+
+#define SNAPDIFF_LEFT           0
+#define SNAPDIFF_RIGHT          1
+
+// Per file result, SNAPSHOT_DIFF.aabFiles
+#define SNAPDIFF_DUPLICATE      0x01
+
+// No file at the same path in the other snapshot: removed on the left side,
+// added on the right side.
+#define SNAPDIFF_ONE_SIDE       0x02
+
+// The file at the same path in the other snapshot is different
+#define SNAPDIFF_CHANGED        0x04
+
+typedef struct _SnapshotDiff
+{
+    // Indexed by SNAPDIFF_LEFT and SNAPDIFF_RIGHT. The snapshots are not owned
+    // by the diff and must stay open while it is used.
+    PSCAN_SNAPSHOT apSnapshots[2];
+
+    // Result of each file, parallel to aFiles of its snapshot
+    PBYTE aabFiles[2];
+
+    int anDups[2];
+    LONGLONG allDupBytes[2];
+
+    BOOL fCompareHashes;
+
+    // Path report per folder
+    PTREEDIFF pTreeDiff;
+
+} SNAPSHOT_DIFF, *PSNAPSHOT_DIFF;
+
+HRESULT DiffScanSnapshots(_In_ PSCAN_SNAPSHOT pLeft, _In_ PSCAN_SNAPSHOT pRight, _Out_ PSNAPSHOT_DIFF *ppDiff);
+void DestroySnapshotDiff(_In_ PSNAPSHOT_DIFF pDiff);
+
+// Print the duplicates, then the added, removed and changed files and the per
+// folder report.
+void PrintSnapshotDiff(_In_ PSNAPSHOT_DIFF pDiff);
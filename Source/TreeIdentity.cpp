@@ -0,0 +1,367 @@
+
+// ---------------------------------------------------
+// The FDiffDelete Project
+// Github: https://github.com/shishir993/fdiffdelete
+// Author: Shishir Bhat
+// The MIT License (MIT)
+// Copyright (c) 2014
+//
+
+#include "TreeIdentity.h"
+#include "FileInfo.h"
+#include "DirectoryWalker_Util.h"
+
+// One entry of a listed folder
+typedef struct _TreeIdEntry
+{
+    WCHAR szName[MAX_PATH];
+    BOOL fIsDirectory;
+    LONGLONG llSize;
+
+    // At millisecond resolution, like GetModifiedTimeMs()
+    UINT64 ullModifiedMs;
+
+} TREEID_ENTRY, *PTREEID_ENTRY;
+
+typedef struct _TreeIdList
+{
+    int nEntries;
+    int nMaxEntries;
+    PTREEID_ENTRY aEntries;
+
+} TREEID_LIST, *PTREEID_LIST;
+
+typedef struct _TreeIdWalk
+{
+    PCWSTR pszLeftRoot;
+    PCWSTR pszRightRoot;
+    DWORD dwFlags;
+    PTREE_IDENTITY pIdentity;
+
+} TREEID_WALK, *PTREEID_WALK;
+
+static HRESULT _CheckFolder(_In_ PTREEID_WALK pWalk, _In_z_ PCWSTR pszRelFolder);
+static HRESULT _CompareEntries(
+    _In_ PTREEID_WALK pWalk,
+    _In_z_ PCWSTR pszRelFolder,
+    _In_ PTREEID_LIST pLeftList,
+    _In_ PTREEID_LIST pRightList);
+static HRESULT _CompareContents(
+    _In_ PTREEID_WALK pWalk,
+    _In_z_ PCWSTR pszRelFolder,
+    _In_ PTREEID_LIST pLeftList,
+    _In_ PTREEID_LIST pRightList);
+static HRESULT _ListFolder(_In_z_ PCWSTR pszRoot, _In_z_ PCWSTR pszRelFolder, _Out_ PTREEID_LIST pList);
+static HRESULT _SetDifference(
+    _In_ PTREEID_WALK pWalk,
+    _In_ TREEID_RESULT result,
+    _In_z_ PCWSTR pszRelFolder,
+    _In_z_ PCWSTR pszName);
+static int __cdecl _CmpEntryNames(const void *pvLeft, const void *pvRight);
+
+HRESULT CheckTreesIdentical(
+    _In_z_ PCWSTR pszLeftRoot,
+    _In_z_ PCWSTR pszRightRoot,
+    _In_ DWORD dwFlags,
+    _Out_ PTREE_IDENTITY pIdentity)
+{
+    SB_ASSERT(pszLeftRoot);
+    SB_ASSERT(pszRightRoot);
+    SB_ASSERT(pIdentity);
+
+    ZeroMemory(pIdentity, sizeof(*pIdentity));
+    pIdentity->result = TREEID_IDENTICAL;
+
+    TREEID_WALK stWalk = { pszLeftRoot, pszRightRoot, dwFlags, pIdentity };
+    HRESULT hr = _CheckFolder(&stWalk, L"");
+    if (FAILED(hr))
+    {
+        logerr(L"Cannot check %s against %s, hr: %x", pszLeftRoot, pszRightRoot, hr);
+    }
+    else
+    {
+        loginfo(L"Checked %d folders, %lld files (%lld read): %s %s",
+            pIdentity->nFolders, pIdentity->nFiles, pIdentity->nFilesRead,
+            GetTreeIdentityResultString(pIdentity->result), pIdentity->szRelPath);
+    }
+    return hr;
+}
+
+PCWSTR GetTreeIdentityResultString(_In_ TREEID_RESULT result)
+{
+    switch (result)
+    {
+    case TREEID_IDENTICAL:  return L"identical";
+    case TREEID_ONLY_LEFT:  return L"only in left";
+    case TREEID_ONLY_RIGHT: return L"only in right";
+    case TREEID_TYPE:       return L"file in one, folder in other";
+    case TREEID_SIZE:       return L"sizes differ";
+    case TREEID_MODIFIED:   return L"modified dates differ";
+    case TREEID_CONTENTS:   return L"contents differ";
+    }
+    return L"";
+}
+
+// Returns S_FALSE as soon as a difference is found in this folder or below it
+static HRESULT _CheckFolder(_In_ PTREEID_WALK pWalk, _In_z_ PCWSTR pszRelFolder)
+{
+    HRESULT hr;
+    TREEID_LIST stLeftList = {};
+    TREEID_LIST stRightList = {};
+    WCHAR szRelPath[MAX_PATH];
+
+    ++(pWalk->pIdentity->nFolders);
+
+    hr = _ListFolder(pWalk->pszLeftRoot, pszRelFolder, &stLeftList);
+    if (SUCCEEDED(hr))
+    {
+        hr = _ListFolder(pWalk->pszRightRoot, pszRelFolder, &stRightList);
+    }
+
+    if (FAILED(hr))
+    {
+        goto done;
+    }
+
+    // Cheapest first: names and metadata of the whole folder, then contents, then sub folders
+    hr = _CompareEntries(pWalk, pszRelFolder, &stLeftList, &stRightList);
+    if ((hr == S_OK) && !(pWalk->dwFlags & TREEID_SKIP_CONTENTS))
+    {
+        hr = _CompareContents(pWalk, pszRelFolder, &stLeftList, &stRightList);
+    }
+
+    // Both lists have the same names in the same order by now
+    for (int i = 0; (hr == S_OK) && (i < stLeftList.nEntries); ++i)
+    {
+        if (!stLeftList.aEntries[i].fIsDirectory)
+        {
+            continue;
+        }
+
+        hr = PathCchCombine(szRelPath, ARRAYSIZE(szRelPath), pszRelFolder, stLeftList.aEntries[i].szName);
+        if (FAILED(hr))
+        {
+            logerr(L"PathCchCombine() failed for %s and %s", pszRelFolder, stLeftList.aEntries[i].szName);
+            break;
+        }
+
+        hr = _CheckFolder(pWalk, szRelPath);
+    }
+
+done:
+    free(stLeftList.aEntries);
+    free(stRightList.aEntries);
+    return hr;
+}
+
+static HRESULT _CompareEntries(
+    _In_ PTREEID_WALK pWalk,
+    _In_z_ PCWSTR pszRelFolder,
+    _In_ PTREEID_LIST pLeftList,
+    _In_ PTREEID_LIST pRightList)
+{
+    int nCommon = min(pLeftList->nEntries, pRightList->nEntries);
+    for (int i = 0; i < nCommon; ++i)
+    {
+        PTREEID_ENTRY pLeft = &pLeftList->aEntries[i];
+        PTREEID_ENTRY pRight = &pRightList->aEntries[i];
+
+        // The smaller name is missing from the other side
+        int iCmp = CompareNames(pLeft->szName, pRight->szName);
+        if (iCmp < 0)
+        {
+            return _SetDifference(pWalk, TREEID_ONLY_LEFT, pszRelFolder, pLeft->szName);
+        }
+        if (iCmp > 0)
+        {
+            return _SetDifference(pWalk, TREEID_ONLY_RIGHT, pszRelFolder, pRight->szName);
+        }
+
+        if (pLeft->fIsDirectory != pRight->fIsDirectory)
+        {
+            return _SetDifference(pWalk, TREEID_TYPE, pszRelFolder, pLeft->szName);
+        }
+
+        if (pLeft->fIsDirectory)
+        {
+            continue;
+        }
+
+        ++(pWalk->pIdentity->nFiles);
+        if (pLeft->llSize != pRight->llSize)
+        {
+            return _SetDifference(pWalk, TREEID_SIZE, pszRelFolder, pLeft->szName);
+        }
+
+        if ((pWalk->dwFlags & TREEID_CHECK_MODIFIED) && (pLeft->ullModifiedMs != pRight->ullModifiedMs))
+        {
+            return _SetDifference(pWalk, TREEID_MODIFIED, pszRelFolder, pLeft->szName);
+        }
+    }
+
+    if (pLeftList->nEntries > nCommon)
+    {
+        return _SetDifference(pWalk, TREEID_ONLY_LEFT, pszRelFolder, pLeftList->aEntries[nCommon].szName);
+    }
+    if (pRightList->nEntries > nCommon)
+    {
+        return _SetDifference(pWalk, TREEID_ONLY_RIGHT, pszRelFolder, pRightList->aEntries[nCommon].szName);
+    }
+    return S_OK;
+}
+
+// Called only once the names and sizes all match, so the two lists line up
+static HRESULT _CompareContents(
+    _In_ PTREEID_WALK pWalk,
+    _In_z_ PCWSTR pszRelFolder,
+    _In_ PTREEID_LIST pLeftList,
+    _In_ PTREEID_LIST pRightList)
+{
+    WCHAR szLeftFolder[MAX_PATH];
+    WCHAR szRightFolder[MAX_PATH];
+    WCHAR szLeftFile[MAX_PATH];
+    WCHAR szRightFile[MAX_PATH];
+
+    HRESULT hr = PathCchCombine(szLeftFolder, ARRAYSIZE(szLeftFolder), pWalk->pszLeftRoot, pszRelFolder);
+    if (SUCCEEDED(hr))
+    {
+        hr = PathCchCombine(szRightFolder, ARRAYSIZE(szRightFolder), pWalk->pszRightRoot, pszRelFolder);
+    }
+
+    for (int i = 0; SUCCEEDED(hr) && (i < pLeftList->nEntries); ++i)
+    {
+        PTREEID_ENTRY pLeft = &pLeftList->aEntries[i];
+        PTREEID_ENTRY pRight = &pRightList->aEntries[i];
+
+        // Empty files need not be opened
+        if (pLeft->fIsDirectory || (pLeft->llSize == 0))
+        {
+            continue;
+        }
+
+        hr = PathCchCombine(szLeftFile, ARRAYSIZE(szLeftFile), szLeftFolder, pLeft->szName);
+        if (SUCCEEDED(hr))
+        {
+            hr = PathCchCombine(szRightFile, ARRAYSIZE(szRightFile), szRightFolder, pRight->szName);
+        }
+
+        BOOL fEqual;
+        if (SUCCEEDED(hr))
+        {
+            hr = CompareFileContentsByPath(szLeftFile, szRightFile, &fEqual);
+        }
+
+        if (FAILED(hr))
+        {
+            break;
+        }
+
+        ++(pWalk->pIdentity->nFilesRead);
+        if (!fEqual)
+        {
+            return _SetDifference(pWalk, TREEID_CONTENTS, pszRelFolder, pLeft->szName);
+        }
+    }
+    return hr;
+}
+
+// List the entries of one folder, sorted by name
+static HRESULT _ListFolder(_In_z_ PCWSTR pszRoot, _In_z_ PCWSTR pszRelFolder, _Out_ PTREEID_LIST pList)
+{
+    HRESULT hr;
+    WCHAR szFolder[MAX_PATH];
+    WCHAR szSearchpath[MAX_PATH];
+
+    ZeroMemory(pList, sizeof(*pList));
+
+    hr = PathCchCombine(szFolder, ARRAYSIZE(szFolder), pszRoot, pszRelFolder);
+    if (SUCCEEDED(hr))
+    {
+        hr = PathCchCombine(szSearchpath, ARRAYSIZE(szSearchpath), szFolder, L"*");
+    }
+
+    if (FAILED(hr))
+    {
+        logerr(L"Path too long: %s under %s", pszRelFolder, pszRoot);
+        return hr;
+    }
+
+    WIN32_FIND_DATA findData;
+    HANDLE hFindFile = FindFirstFile(szSearchpath, &findData);
+    if (hFindFile == INVALID_HANDLE_VALUE)
+    {
+        // A folder that cannot be listed cannot be said to be identical
+        DWORD dwError = GetLastError();
+        if (dwError == ERROR_FILE_NOT_FOUND)
+        {
+            return S_OK;
+        }
+
+        hr = HRESULT_FROM_WIN32(dwError);
+        logerr(L"Cannot list folder: %s, hr: %x", szFolder, hr);
+        return hr;
+    }
+
+    do
+    {
+        // Skip banned files and folders
+        if (IsFileFolderBanned(findData.cFileName, ARRAYSIZE(findData.cFileName)))
+        {
+            continue;
+        }
+
+        if (pList->nEntries == pList->nMaxEntries)
+        {
+            int nMaxEntries = (pList->nMaxEntries > 0) ? (pList->nMaxEntries * 2) : 32;
+            PTREEID_ENTRY aEntries = (PTREEID_ENTRY)realloc(pList->aEntries, nMaxEntries * sizeof(TREEID_ENTRY));
+            if (aEntries == NULL)
+            {
+                hr = E_OUTOFMEMORY;
+                break;
+            }
+
+            pList->aEntries = aEntries;
+            pList->nMaxEntries = nMaxEntries;
+        }
+
+        PTREEID_ENTRY pEntry = &pList->aEntries[pList->nEntries++];
+        wcscpy_s(pEntry->szName, ARRAYSIZE(pEntry->szName), findData.cFileName);
+        pEntry->fIsDirectory = ((findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0);
+
+        LARGE_INTEGER llSize;
+        llSize.HighPart = findData.nFileSizeHigh;
+        llSize.LowPart = findData.nFileSizeLow;
+        pEntry->llSize = llSize.QuadPart;
+        pEntry->ullModifiedMs = ((((UINT64)findData.ftLastWriteTime.dwHighDateTime) << 32) | findData.ftLastWriteTime.dwLowDateTime) / 10000;
+
+    } while (FindNextFile(hFindFile, &findData));
+
+    FindClose(hFindFile);
+
+    if (SUCCEEDED(hr))
+    {
+        qsort(pList->aEntries, pList->nEntries, sizeof(TREEID_ENTRY), _CmpEntryNames);
+    }
+    return hr;
+}
+
+static HRESULT _SetDifference(
+    _In_ PTREEID_WALK pWalk,
+    _In_ TREEID_RESULT result,
+    _In_z_ PCWSTR pszRelFolder,
+    _In_z_ PCWSTR pszName)
+{
+    PTREE_IDENTITY pIdentity = pWalk->pIdentity;
+
+    pIdentity->result = result;
+    if (FAILED(PathCchCombine(pIdentity->szRelPath, ARRAYSIZE(pIdentity->szRelPath), pszRelFolder, pszName)))
+    {
+        wcscpy_s(pIdentity->szRelPath, ARRAYSIZE(pIdentity->szRelPath), pszName);
+    }
+    return S_FALSE;
+}
+
+static int __cdecl _CmpEntryNames(const void *pvLeft, const void *pvRight)
+{
+    return CompareNames(((PTREEID_ENTRY)pvLeft)->szName, ((PTREEID_ENTRY)pvRight)->szName);
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+// ---------------------------------------------------
+// The FDiffDelete Project
+// Github: https://github.com/shishir993/fdiffdelete
+// Author: Shishir Bhat
+// The MIT License (MIT)
+// Copyright (c) 2014
+//
+
+#include "Common.h"
+
+// Yes/no check of whether two dir trees are identical, e.g. a restored tree
+// against its source. No DIRINFO is built and no file is marked. Both trees are
+// walked together, one folder at a time, depth first and in name order, and the
+// walk stops at the first difference. Within a folder:
+//  1. The entries are listed on both sides and matched by name, ignoring case as CompareNames() does.
+//     A name on one side only, or a file on one side and a folder on the other,
+//     is a difference.
+//  2. The sizes (and modified times if asked for) of all matched files are compared.
+//  3. Only then are the contents of the files compared, one pair at a time.
+//  4. The sub folders are checked the same way.
+// So the time taken is proportional to how far into the walk the first difference is.
+
+// Flags of CheckTreesIdentical()
+#define TREEID_CHECK_MODIFIED   0x1     // Modified times must match too, to the millisecond as in a diff
+#define TREEID_SKIP_CONTENTS    0x2     // Metadata only, no file is read
+
+typedef enum
+{
+    TREEID_IDENTICAL,
+    TREEID_ONLY_LEFT,
+    TREEID_ONLY_RIGHT,
+    TREEID_TYPE,        // A file on one side and a folder on the other
+    TREEID_SIZE,
+    TREEID_MODIFIED,
+    TREEID_CONTENTS
+
+} TREEID_RESULT;
+
+typedef struct _TreeIdentity
+{
+    TREEID_RESULT result;
+
+    // Path of the first differing file or folder relative to the roots
+    WCHAR szRelPath[MAX_PATH];
+
+    // Work done before the walk stopped
+    int nFolders;
+    LONGLONG nFiles;
+    LONGLONG nFilesRead;
+
+} TREE_IDENTITY, *PTREE_IDENTITY;
+
+// Returns S_OK if the trees are identical, S_FALSE with the first difference otherwise.
+HRESULT CheckTreesIdentical(
+    _In_z_ PCWSTR pszLeftRoot,
+    _In_z_ PCWSTR pszRightRoot,
+    _In_ DWORD dwFlags,
+    _Out_ PTREE_IDENTITY pIdentity);
+
+// Short description of the result, e.g. "contents differ"
+PCWSTR GetTreeIdentityResultString(_In_ TREEID_RESULT result);
@@ -11,6 +11,8 @@
 #include <Shobjidl.h>
 #include <ShellAPI.h>
 #include "FileInfo.h"
+#include "DirectoryWalker_Merkle.h"
+#include "ScanSnapshot.h"
 
 #define ONE_KBYTES    1024ll
 #define ONE_MBYTES    (ONE_KBYTES * 1024ll)
@@ -18,8 +20,11 @@
 
 static BOOL PopulateFileList(_In_ HWND hList, _In_ PDIRINFO pDirInfo);
 static void ConstructListViewRow(_In_ PFILEINFO pFileInfo, _In_ PWSTR *apsz);
+static BOOL AddDupFolderRows(_In_ HWND hList, _In_ PDIRINFO pDirInfo, _In_ PWSTR *apszListRow, _In_ int nColumns);
+static void SetListItemIds(_In_ HWND hList);
 
-HRESULT GetFolderToOpen(_Out_z_cap_(MAX_PATH) PWSTR pszFolderpath)
+// Show the Open dialog to pick a folder, or a file of the given type
+static HRESULT _GetPathToOpen(_In_opt_ const COMDLG_FILTERSPEC *pFileType, _Out_z_cap_(MAX_PATH) PWSTR pszFolderpath)
 {
     // Sample from: http://msdn.microsoft.com/en-us/library/windows/desktop/ff485843%28v=vs.85%29.aspx
 
@@ -32,15 +37,20 @@ HRESULT GetFolderToOpen(_Out_z_cap_(MAX_PATH) PWSTR pszFolderpath)
             IID_IFileOpenDialog, reinterpret_cast<void**>(&pFileOpen));
         if (SUCCEEDED(hr))
         {
-            // Set to pick a folder (not a file)
+            // Set to pick a folder unless a file type is given
             FILEOPENDIALOGOPTIONS fos;
             hr = pFileOpen->GetOptions(&fos);
             if (SUCCEEDED(hr))
             {
-                fos |= FOS_PICKFOLDERS;
+                fos |= ((pFileType == NULL) ? FOS_PICKFOLDERS : FOS_FILEMUSTEXIST);
                 hr = pFileOpen->SetOptions(fos);
             }
 
+            if (SUCCEEDED(hr) && (pFileType != NULL))
+            {
+                hr = pFileOpen->SetFileTypes(1, pFileType);
+            }
+
             // Show the Open dialog box.
             if (SUCCEEDED(hr))
             {
@@ -81,6 +91,17 @@ HRESULT GetFolderToOpen(_Out_z_cap_(MAX_PATH) PWSTR pszFolderpath)
     return hr;
 }
 
+HRESULT GetFolderToOpen(_Out_z_cap_(MAX_PATH) PWSTR pszFolderpath)
+{
+    return _GetPathToOpen(NULL, pszFolderpath);
+}
+
+HRESULT GetSnapshotToOpen(_Out_z_cap_(MAX_PATH) PWSTR pszFilepath)
+{
+    COMDLG_FILTERSPEC stFileType = { L"Scan snapshot", L"*.*" };
+    return _GetPathToOpen(&stFileType, pszFilepath);
+}
+
 BOOL GetTextFromEditControl(_In_ HWND hEditControl, _Inout_z_ WCHAR* pszFolderpath, _In_ int nMaxElements)
 {
     // Unselect the edit control first
@@ -199,7 +220,7 @@ BOOL GetSelectedLvItemsText_Hash(
         SendMessage(hListView, LVM_GETITEM, 0, (LPARAM)&lvItem);
 
         PFILEINFO pFileSel = (PFILEINFO)lvItem.lParam;
-        logdbg(L"Selected item: %s", pFileSel->szFilename);
+        logdbg(L"Selected item: %s", pFileSel->pszFilename);
 
         ppaFiles[iIdx++] = pFileSel;
     }
@@ -227,6 +248,18 @@ BOOL BuildDirInfo(
         return FALSE;
     }
 
+    // A saved scan instead of a folder is loaded as it was saved
+    if (IsScanSnapshotFile(pszFolderpath))
+    {
+        HRESULT hr = LoadDirInfoFromSnapshot(pszFolderpath, fCompareHashes, ppDirInfo);
+        if (FAILED(hr))
+        {
+            logerr(L"Cannot load snapshot %s, hr: %x", pszFolderpath, hr);
+            return FALSE;
+        }
+        return TRUE;
+    }
+
     if (fCompareHashes)
     {
         if (FAILED(FileInfoInit(TRUE)))
@@ -271,11 +304,10 @@ static BOOL PopulateFileList(_In_ HWND hList, _In_ PDIRINFO pDirInfo)
 {
     ListView_DeleteAllItems(hList);
 
-    char* pszKey;
     PFILEINFO pFileInfo;
-    int nKeySize, nValSize;
+    int nValSize;
 
-    WCHAR szDupType[10];    // N,S,D,H (name, size, date, hash)
+    WCHAR szDupType[10];    // N,S,D,H,T (name, size, date, hash, tree)
     WCHAR szDateTime[32];   // 08/13/2014 5:55 PM
     WCHAR szSize[16];       // formatted to show KB, MB, GB
 
@@ -286,9 +318,17 @@ static BOOL PopulateFileList(_In_ HWND hList, _In_ PDIRINFO pDirInfo)
     BOOL fRetVal = TRUE;
     CHL_HT_ITERATOR itr;
     CHL_DsInitIteratorHT(pDirInfo->phtFiles, &itr);
-    while (SUCCEEDED(itr.GetCurrent(&itr, &pszKey, &nKeySize, &pFileInfo, &nValSize, TRUE)))
+    while (SUCCEEDED(itr.GetCurrent(&itr, NULL, NULL, &pFileInfo, &nValSize, TRUE)))
     {
         itr.MoveNext(&itr);
+
+        // Shown as part of its duplicate folder
+        pFileInfo->dwListItemId = 0;
+        if (GetDupInfo(pFileInfo) & FDUP_TREE_MATCH)
+        {
+            continue;
+        }
+
         ConstructListViewRow(pFileInfo, apszListRow);
         if (FAILED(CHL_GuiAddListViewRow(hList, apszListRow, ARRAYSIZE(apszListRow), (LPARAM)pFileInfo)))
         {
@@ -301,7 +341,14 @@ static BOOL PopulateFileList(_In_ HWND hList, _In_ PDIRINFO pDirInfo)
     // Insert the name-duplicate files now.
     for (int i = 0; i < pDirInfo->stDupFilesInTree.nCurFiles; ++i)
     {
-        if (FAILED(CHL_DsReadRA(&pDirInfo->stDupFilesInTree.aFiles, i, &pFileInfo, NULL, TRUE)))
+        pFileInfo = pDirInfo->stDupFilesInTree.apFiles[i];
+        if (pFileInfo == NULL)
+        {
+            continue;
+        }
+
+        pFileInfo->dwListItemId = 0;
+        if (GetDupInfo(pFileInfo) & FDUP_TREE_MATCH)
         {
             continue;
         }
@@ -315,6 +362,16 @@ static BOOL PopulateFileList(_In_ HWND hList, _In_ PDIRINFO pDirInfo)
         }
     }
 
+    if (fRetVal)
+    {
+        fRetVal = AddDupFolderRows(hList, pDirInfo, apszListRow, ARRAYSIZE(apszListRow));
+    }
+
+    if (fRetVal)
+    {
+        SetListItemIds(hList);
+    }
+
     // Clear list view if there was an error.
     if (!fRetVal)
     {
@@ -333,7 +390,7 @@ BOOL PopulateFileList(_In_ HWND hList, _In_ PDIRINFO pDirInfo, _In_ BOOL fCompar
 
     ListView_DeleteAllItems(hList);
 
-    WCHAR szDupType[10];    // N,S,D,H (name, size, date, hash)
+    WCHAR szDupType[10];    // N,S,D,H,T (name, size, date, hash, tree)
     WCHAR szDateTime[32];   // 08/13/2014 5:55 PM
     WCHAR szSize[16];       // formatted to show KB, MB, GB
 
@@ -363,6 +420,13 @@ BOOL PopulateFileList(_In_ HWND hList, _In_ PDIRINFO pDirInfo, _In_ BOOL fCompar
                 continue;
             }
 
+            // Shown as part of its duplicate folder
+            pFileInfo->dwListItemId = 0;
+            if (GetDupInfo(pFileInfo) & FDUP_TREE_MATCH)
+            {
+                continue;
+            }
+
             ConstructListViewRow(pFileInfo, apszListRow);
             if (FAILED(CHL_GuiAddListViewRow(hList, apszListRow, ARRAYSIZE(apszListRow), (LPARAM)pFileInfo)))
             {
@@ -373,6 +437,16 @@ BOOL PopulateFileList(_In_ HWND hList, _In_ PDIRINFO pDirInfo, _In_ BOOL fCompar
         }
     }
 
+    if (fRetVal)
+    {
+        fRetVal = AddDupFolderRows(hList, pDirInfo, apszListRow, ARRAYSIZE(apszListRow));
+    }
+
+    if (fRetVal)
+    {
+        SetListItemIds(hList);
+    }
+
     // Clear list view if there was an error.
     if (!fRetVal)
     {
@@ -382,20 +456,69 @@ BOOL PopulateFileList(_In_ HWND hList, _In_ PDIRINFO pDirInfo, _In_ BOOL fCompar
     return fRetVal;
 }
 
+void ApplyDeleteChanges(_In_ HWND hListFrom, _In_ HWND hListOther, _In_ PDELETE_CHANGES pChanges)
+{
+    SB_ASSERT(pChanges);
+    SB_ASSERT(!pChanges->fRebuildRequired);
+
+    // Rows are found by their item ids, which stay the same when the list is sorted
+    for (int i = 0; i < pChanges->nDeleted; ++i)
+    {
+        DWORD dwListItemId = pChanges->aDeleted[i].dwListItemId;
+        int iItem = (dwListItemId > 0) ? (int)ListView_MapIDToIndex(hListFrom, dwListItemId - 1) : -1;
+        if (iItem >= 0)
+        {
+            ListView_DeleteItem(hListFrom, iItem);
+        }
+    }
+
+    WCHAR szDupType[10];
+    for (int i = 0; i < pChanges->nUpdated; ++i)
+    {
+        PFILEINFO pFileInfo = pChanges->apUpdated[i];
+        int iItem = (pFileInfo->dwListItemId > 0) ? (int)ListView_MapIDToIndex(hListOther, pFileInfo->dwListItemId - 1) : -1;
+        if (iItem >= 0)
+        {
+            GetDupTypeString(pFileInfo, szDupType);
+            ListView_SetItemText(hListOther, iItem, 1, szDupType);
+        }
+    }
+}
+
+// Give the FILEINFO of each row the item id of the row, see FILEINFO.dwListItemId
+static void SetListItemIds(_In_ HWND hList)
+{
+    LVITEM lvItem = {};
+    lvItem.mask = LVIF_PARAM;
+
+    int nItems = ListView_GetItemCount(hList);
+    for (int iItem = 0; iItem < nItems; ++iItem)
+    {
+        lvItem.iItem = iItem;
+        if (ListView_GetItem(hList, &lvItem) && (lvItem.lParam != 0))
+        {
+            ((PFILEINFO)lvItem.lParam)->dwListItemId = ListView_MapIndexToID(hList, iItem) + 1;
+        }
+    }
+}
+
 static void ConstructListViewRow(_In_ PFILEINFO pFileInfo, _In_ PWSTR *apsz)
 {
-    apsz[0] = pFileInfo->szFilename;
+    apsz[0] = pFileInfo->pszFilename;
     GetDupTypeString(pFileInfo, apsz[1]);
-    apsz[2] = pFileInfo->szPath;
+    apsz[2] = pFileInfo->pszPath;
 
+    SYSTEMTIME stModified;
+    GetModifiedLocalTime(pFileInfo, &stModified);
     swprintf_s(apsz[3], 32, L"%02d/%02d/%d  %02d:%02d",
-        pFileInfo->stModifiedTime.wMonth, pFileInfo->stModifiedTime.wDay, pFileInfo->stModifiedTime.wYear,
-        pFileInfo->stModifiedTime.wHour, pFileInfo->stModifiedTime.wMinute);
+        stModified.wMonth, stModified.wDay, stModified.wYear,
+        stModified.wHour, stModified.wMinute);
 
     LONGLONG llFileSize = pFileInfo->llFilesize.QuadPart;
 
+    // A duplicate folder shows the size of all the files under it
     PWCHAR pszSizeMarker;
-    if (pFileInfo->fIsDirectory)
+    if (pFileInfo->fIsDirectory && !(GetDupInfo(pFileInfo) & FDUP_TREE_MATCH))
     {
         *(apsz[4]) = 0;
     }
@@ -426,6 +549,33 @@ static void ConstructListViewRow(_In_ PFILEINFO pFileInfo, _In_ PWSTR *apsz)
     }
 }
 
+// One row for each duplicate folder, in place of the files under it
+static BOOL AddDupFolderRows(_In_ HWND hList, _In_ PDIRINFO pDirInfo, _In_ PWSTR *apszListRow, _In_ int nColumns)
+{
+    PDIRDIGESTS pDigests = pDirInfo->pDirDigests;
+    if (pDigests == NULL)
+    {
+        return TRUE;
+    }
+
+    for (int i = 0; i < pDigests->nFolders; ++i)
+    {
+        PFILEINFO pFolderInfo = &pDigests->aFolders[i].stFolderInfo;
+        if (!(GetDupInfo(pFolderInfo) & FDUP_TREE_MATCH))
+        {
+            continue;
+        }
+
+        ConstructListViewRow(pFolderInfo, apszListRow);
+        if (FAILED(CHL_GuiAddListViewRow(hList, apszListRow, nColumns, (LPARAM)pFolderInfo)))
+        {
+            logerr(L"Error inserting into file list");
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
 #pragma region LvCompares
 
 // ** Listview sorting Callbacks
@@ -454,7 +604,7 @@ int CALLBACK lvCmpName(LPARAM lParam1, LPARAM lParam2, LPARAM lParamSort)
     SendMessage(hList, LVM_GETITEM, 0, (LPARAM)&lv1);
     SendMessage(hList, LVM_GETITEM, 0, (LPARAM)&lv2);
 
-    return _wcsnicmp(((PFILEINFO)lv1.lParam)->szFilename, ((PFILEINFO)lv2.lParam)->szFilename, MAX_PATH);
+    return _wcsnicmp(((PFILEINFO)lv1.lParam)->pszFilename, ((PFILEINFO)lv2.lParam)->pszFilename, MAX_PATH);
 }
 
 int CALLBACK lvCmpDupType(LPARAM lParam1, LPARAM lParam2, LPARAM lParamSort)
@@ -477,7 +627,7 @@ int CALLBACK lvCmpDupType(LPARAM lParam1, LPARAM lParam2, LPARAM lParamSort)
 
     PFILEINFO pf1 = (PFILEINFO)lv1.lParam;
     PFILEINFO pf2 = (PFILEINFO)lv2.lParam;
-    if (pf1->bDupInfo == pf2->bDupInfo)
+    if (GetDupInfo(pf1) == GetDupInfo(pf2))
         return 0;
 
     // Duplicate file must be higher than non-dup
@@ -505,7 +655,7 @@ int CALLBACK lvCmpPath(LPARAM lParam1, LPARAM lParam2, LPARAM lParamSort)
     SendMessage(hList, LVM_GETITEM, 0, (LPARAM)&lv1);
     SendMessage(hList, LVM_GETITEM, 0, (LPARAM)&lv2);
 
-    return _wcsnicmp(((PFILEINFO)lv1.lParam)->szPath, ((PFILEINFO)lv2.lParam)->szPath, MAX_PATH);
+    return _wcsnicmp(((PFILEINFO)lv1.lParam)->pszPath, ((PFILEINFO)lv2.lParam)->pszPath, MAX_PATH);
 }
 
 int CALLBACK lvCmpDate(LPARAM lParam1, LPARAM lParam2, LPARAM lParamSort)
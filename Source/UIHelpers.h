@@ -12,6 +12,7 @@
 #include "DirectoryWalker_Interface.h"
 
 HRESULT GetFolderToOpen(_Out_z_cap_(MAX_PATH) PWSTR pszFolderpath);
+HRESULT GetSnapshotToOpen(_Out_z_cap_(MAX_PATH) PWSTR pszFilepath);
 BOOL GetTextFromEditControl(_In_ HWND hEditControl, _Inout_z_ WCHAR* pszFolderpath, _In_ int nMaxElements);
 BOOL IsMenuItemChecked(_In_ HMENU hMenu, _In_ UINT uiItemId);
 
@@ -26,6 +27,7 @@ BOOL GetSelectedLvItemsText_Hash(
     _Out_ PFILEINFO **pppaFileInfo,
     _Out_ PINT pnItems);
 
+// The folder can also be a scan snapshot file, see LoadDirInfoFromSnapshot()
 BOOL BuildDirInfo(
     _In_z_ PCWSTR pszFolderpath,
     _In_ BOOL fRecursive,
@@ -34,6 +36,10 @@ BOOL BuildDirInfo(
 
 BOOL PopulateFileList(_In_ HWND hList, _In_ PDIRINFO pDirInfo, _In_ BOOL fCompareHashes);
 
+// Remove the rows of the deleted files and refresh the duplicate type of the
+// updated files, instead of populating the file lists again.
+void ApplyDeleteChanges(_In_ HWND hListFrom, _In_ HWND hListOther, _In_ PDELETE_CHANGES pChanges);
+
 int CALLBACK lvCmpName(LPARAM lParam1, LPARAM lParam2, LPARAM lParamSort);
 int CALLBACK lvCmpDupType(LPARAM lParam1, LPARAM lParam2, LPARAM lParamSort);
 int CALLBACK lvCmpPath(LPARAM lParam1, LPARAM lParam2, LPARAM lParamSort);
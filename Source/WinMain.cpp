@@ -13,6 +13,13 @@
 
 #include "resource.h"
 #include "DialogProc.h"
+#include "MultiRootIndex.h"
+#include "OutOfCoreCompare.h"
+#include "ScanSnapshot.h"
+#include "SnapshotDiff.h"
+#include "Sha1Manifest.h"
+#include "ContentCatalog.h"
+#include "ShardIndex.h"
 
 HINSTANCE g_hMainInstance;
 
@@ -22,15 +29,42 @@ static int iConInHandle = -1;
 static int iConOutHandle = -1;
 static int iConErrHandle = -1;
 
+// Set by Ctrl+C while the command line folders are being indexed
+static volatile LONG s_lStopIndex = 0;
+
 static BOOL CreateConsoleWindow();
+static BOOL RunCmdLineShardWorker(_In_z_ PCWSTR pszCmdLine, _Out_ int *piExitCode);
+static BOOL IndexCmdLineRoots(_In_z_ PCWSTR pszCmdLine);
+static BOOL CompareCmdLineTreesOutOfCore(_In_ int nArgs, _In_count_(nArgs) PWSTR *apszArgs);
+static BOOL SaveCmdLineSnapshot(_In_ int nArgs, _In_count_(nArgs) PWSTR *apszArgs);
+static BOOL DiffCmdLineSnapshots(_In_ int nArgs, _In_count_(nArgs) PWSTR *apszArgs);
+static BOOL ExportCmdLineManifest(_In_ int nArgs, _In_count_(nArgs) PWSTR *apszArgs);
+static BOOL RunCmdLineCatalog(_In_ int nArgs, _In_count_(nArgs) PWSTR *apszArgs);
+static BOOL MergeCmdLineShards(_In_ int nArgs, _In_count_(nArgs) PWSTR *apszArgs);
+static HRESULT OpenCmdLineSnapshot(_In_z_ PCWSTR pszPath, _In_ BOOL fCompareHashes, _Out_ PSCAN_SNAPSHOT *ppSnapshot);
+static BOOL WINAPI StopIndexCtrlHandler(DWORD dwCtrlType);
+static void PrintFoundGroup(_In_ PDUPGROUPS pGroups, _In_ PDUPGROUP pGroup, _In_opt_ PVOID pvContext);
+static void PrintOutOfCoreDuplicate(_In_ int iSide, _In_z_ PCWSTR pszRelPath, _In_ LONGLONG llSize, _In_opt_ PVOID pvContext);
+static void PrintCatalogResult(
+    _In_ PCONTENT_CATALOG pCatalog,
+    _In_ PSCAN_SNAPSHOT pSnapshot,
+    _In_ const SNAPSHOT_FILE *pFile,
+    _In_opt_ const CATALOG_ENTRY *pEntry,
+    _In_opt_ PVOID pvContext);
 
 int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR szCmdLine, int iCmdShow)
 {
-    DBG_UNREFERENCED_PARAMETER(szCmdLine);
     DBG_UNREFERENCED_PARAMETER(hPrevInstance);
 
     g_hMainInstance = hInstance;
 
+    // A shard worker started by /shards has no window and no console
+    int iExitCode;
+    if (RunCmdLineShardWorker(szCmdLine, &iExitCode))
+    {
+        return iExitCode;
+    }
+
     // Initialize common controls
     InitCommonControls();
 
@@ -39,6 +73,15 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR szCmdLi
         MessageBox(NULL, L"Cannot create console window.", L"Warning", MB_OK | MB_ICONWARNING);
     }
 
+    // A command line is run in the console instead of showing the dialog, which
+    // would be left open after every command
+    if (IndexCmdLineRoots(szCmdLine))
+    {
+        wprintf(L"\nPress Enter to exit\n");
+        getwchar();
+        return 0;
+    }
+
     INT_PTR iptr = DialogBox(hInstance, MAKEINTRESOURCE(IDD_DLG_FDIFF), NULL, FolderDiffDP);
     if (iptr == -1)
     {
@@ -104,3 +147,525 @@ static BOOL CreateConsoleWindow()
 
     return !fError;
 }
+
+// Folders specified on the command line are indexed together and the duplicates
+// across all of them are printed to the console. The other commands are run the
+// same way. Returns FALSE if there is no command line, so the dialog is shown.
+static BOOL IndexCmdLineRoots(_In_z_ PCWSTR pszCmdLine)
+{
+    if ((pszCmdLine == NULL) || (pszCmdLine[0] == 0))
+    {
+        return FALSE;
+    }
+
+    int nArgs;
+    PWSTR *apszArgs = CommandLineToArgvW(pszCmdLine, &nArgs);
+    if (apszArgs == NULL)
+    {
+        logerr(L"Cannot parse command line, error: %u", GetLastError());
+        return FALSE;
+    }
+
+    if ((nArgs == 0) || CompareCmdLineTreesOutOfCore(nArgs, apszArgs) || SaveCmdLineSnapshot(nArgs, apszArgs)
+        || DiffCmdLineSnapshots(nArgs, apszArgs) || ExportCmdLineManifest(nArgs, apszArgs)
+        || RunCmdLineCatalog(nArgs, apszArgs) || MergeCmdLineShards(nArgs, apszArgs))
+    {
+        LocalFree(apszArgs);
+        return (nArgs > 0);
+    }
+
+    // "/hash <folders>" hashes every file during the walk, the same as each worker of /shards.
+    // Any other switch is a mistake, not a folder.
+    BOOL fCompareHashes = (_wcsicmp(apszArgs[0], L"/hash") == 0);
+    PCWSTR *apszRoots = (PCWSTR*)apszArgs + (fCompareHashes ? 1 : 0);
+    int nRoots = nArgs - (fCompareHashes ? 1 : 0);
+
+    BOOL fUsage = (nRoots < 1);
+    for (int iRoot = 0; iRoot < nRoots; ++iRoot)
+    {
+        if (apszRoots[iRoot][0] == L'/')
+        {
+            wprintf(L"Unknown switch: %s\n", apszRoots[iRoot]);
+            fUsage = TRUE;
+        }
+    }
+
+    if (fUsage)
+    {
+        wprintf(L"Usage: [/hash] <folders>\n"
+            L"       /ooc[:<MB>] [/hash] <left folder> <right folder>\n"
+            L"       /snapshot <snapshot file> [/hash] <folder>\n"
+            L"       /snapdiff [/hash] <left snapshot or folder> <right snapshot or folder>\n"
+            L"       /manifest <manifest file> <folder or snapshot>\n"
+            L"       /catalog <catalog file> /add|/query <folder, snapshot or manifest>\n"
+            L"       /shards <shard folder> <folders>\n"
+            L"       /shardmerge <shard files>\n");
+        LocalFree(apszArgs);
+        return TRUE;
+    }
+
+    // Groups are printed as they are found, biggest first, and Ctrl+C
+    // stops the search with what was found until then.
+    DUPSEARCH_OPTIONS stOptions = {};
+    stOptions.pfnGroupFound = PrintFoundGroup;
+    stOptions.plStop = &s_lStopIndex;
+    SetConsoleCtrlHandler(StopIndexCtrlHandler, TRUE);
+
+    wprintf(L"Indexing %d folders, press Ctrl+C to stop early\n", nRoots);
+
+    PMULTIROOT_INDEX pIndex;
+    HRESULT hr = BuildMultiRootIndex(apszRoots, nRoots, fCompareHashes, &stOptions, &pIndex);
+    SetConsoleCtrlHandler(StopIndexCtrlHandler, FALSE);
+    if (SUCCEEDED(hr))
+    {
+        if (hr == S_FALSE)
+        {
+            wprintf(L"Stopped early, the index below is partial\n\n");
+        }
+
+        PrintMultiRootIndex(pIndex);
+        DestroyMultiRootIndex(pIndex);
+    }
+    else
+    {
+        wprintf(L"Cannot index the %d folders on the command line, hr: %x\n", nRoots, hr);
+    }
+
+    LocalFree(apszArgs);
+    return TRUE;
+}
+
+// "/ooc[:<MB>] [/hash] <left> <right>" compares two trees too big to be held in memory,
+// with at most MB megabytes of file records in memory at once.
+// Returns FALSE if the command line is not an out-of-core compare.
+static BOOL CompareCmdLineTreesOutOfCore(_In_ int nArgs, _In_count_(nArgs) PWSTR *apszArgs)
+{
+    if (nArgs < 1)
+    {
+        return FALSE;
+    }
+
+    // The switch is "/ooc" alone or followed by ":<MB>", nothing else
+    PCWSTR pszCap = wcschr(apszArgs[0], L':');
+    size_t cchSwitch = (pszCap != NULL) ? (size_t)(pszCap - apszArgs[0]) : wcslen(apszArgs[0]);
+    if ((cchSwitch != 4) || (_wcsnicmp(apszArgs[0], L"/ooc", 4) != 0))
+    {
+        return FALSE;
+    }
+
+    OOC_OPTIONS stOptions = {};
+    stOptions.pfnDuplicate = PrintOutOfCoreDuplicate;
+
+    BOOL fUsage = FALSE;
+    if (pszCap != NULL)
+    {
+        PWSTR pszEnd;
+        ULONG ulMB = wcstoul(pszCap + 1, &pszEnd, 10);
+        fUsage = (ulMB == 0) || (*pszEnd != 0);
+        stOptions.cbMemoryCap = (SIZE_T)ulMB * 1024 * 1024;
+    }
+
+    int iArg = 1;
+    if ((iArg < nArgs) && (_wcsicmp(apszArgs[iArg], L"/hash") == 0))
+    {
+        stOptions.fCompareHashes = TRUE;
+        ++iArg;
+    }
+
+    if (fUsage || (nArgs - iArg != 2))
+    {
+        wprintf(L"Usage: /ooc[:<MB>] [/hash] <left folder> <right folder>\n");
+        return TRUE;
+    }
+
+    OOC_STATS stStats;
+    HRESULT hr = CompareTreesOutOfCore(apszArgs[iArg], apszArgs[iArg + 1], &stOptions, &stStats);
+    if (SUCCEEDED(hr))
+    {
+        wprintf(L"\n%lld of %lld left files (%lld bytes) and %lld of %lld right files (%lld bytes) are duplicates\n",
+            stStats.anDups[OOC_LEFT], stStats.anFiles[OOC_LEFT], stStats.allDupBytes[OOC_LEFT],
+            stStats.anDups[OOC_RIGHT], stStats.anFiles[OOC_RIGHT], stStats.allDupBytes[OOC_RIGHT]);
+    }
+    else
+    {
+        wprintf(L"Cannot compare %s and %s out-of-core, hr: %x\n", apszArgs[iArg], apszArgs[iArg + 1], hr);
+    }
+    return TRUE;
+}
+
+// "/snapshot <file> [/hash] <folder>" walks a tree and saves it to a snapshot file.
+// Returns FALSE if the command line is not a snapshot.
+static BOOL SaveCmdLineSnapshot(_In_ int nArgs, _In_count_(nArgs) PWSTR *apszArgs)
+{
+    if ((nArgs < 1) || (_wcsicmp(apszArgs[0], L"/snapshot") != 0))
+    {
+        return FALSE;
+    }
+
+    BOOL fCompareHashes = FALSE;
+    int iArg = 2;
+    if ((iArg < nArgs) && (_wcsicmp(apszArgs[iArg], L"/hash") == 0))
+    {
+        fCompareHashes = TRUE;
+        ++iArg;
+    }
+
+    if (nArgs - iArg != 1)
+    {
+        wprintf(L"Usage: /snapshot <snapshot file> [/hash] <folder>\n");
+        return TRUE;
+    }
+
+    PDIRINFO pDirInfo;
+    if (!BuildDirTree(apszArgs[iArg], fCompareHashes, &pDirInfo))
+    {
+        wprintf(L"Cannot walk %s\n", apszArgs[iArg]);
+        return TRUE;
+    }
+
+    HRESULT hr = SaveScanSnapshot(pDirInfo, apszArgs[1]);
+    if (SUCCEEDED(hr))
+    {
+        wprintf(L"Saved %d files and %d folders of %s to %s\n", pDirInfo->nFiles, pDirInfo->nDirs, apszArgs[iArg], apszArgs[1]);
+    }
+    else
+    {
+        wprintf(L"Cannot save snapshot of %s to %s, hr: %x\n", apszArgs[iArg], apszArgs[1], hr);
+    }
+
+    DestroyDirInfo(pDirInfo);
+    return TRUE;
+}
+
+// "/snapdiff [/hash] <left> <right>" diffs two snapshots. Either side may be a sha1sum
+// manifest or a folder instead, which is walked and diffed as a snapshot held in memory.
+// Returns FALSE if the command line is not a snapshot diff.
+static BOOL DiffCmdLineSnapshots(_In_ int nArgs, _In_count_(nArgs) PWSTR *apszArgs)
+{
+    if ((nArgs < 1) || (_wcsicmp(apszArgs[0], L"/snapdiff") != 0))
+    {
+        return FALSE;
+    }
+
+    BOOL fCompareHashes = FALSE;
+    int iArg = 1;
+    if ((iArg < nArgs) && (_wcsicmp(apszArgs[iArg], L"/hash") == 0))
+    {
+        fCompareHashes = TRUE;
+        ++iArg;
+    }
+
+    if (nArgs - iArg != 2)
+    {
+        wprintf(L"Usage: /snapdiff [/hash] <left snapshot or folder> <right snapshot or folder>\n");
+        return TRUE;
+    }
+
+    PSCAN_SNAPSHOT pLeft = NULL;
+    PSCAN_SNAPSHOT pRight = NULL;
+    PSNAPSHOT_DIFF pDiff = NULL;
+
+    HRESULT hr = OpenCmdLineSnapshot(apszArgs[iArg], fCompareHashes, &pLeft);
+    if (SUCCEEDED(hr))
+    {
+        hr = OpenCmdLineSnapshot(apszArgs[iArg + 1], fCompareHashes, &pRight);
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = DiffScanSnapshots(pLeft, pRight, &pDiff);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        PrintSnapshotDiff(pDiff);
+        DestroySnapshotDiff(pDiff);
+    }
+    else
+    {
+        wprintf(L"Cannot diff %s and %s, hr: %x\n", apszArgs[iArg], apszArgs[iArg + 1], hr);
+    }
+
+    if (pLeft != NULL)
+    {
+        CloseScanSnapshot(pLeft);
+    }
+    if (pRight != NULL)
+    {
+        CloseScanSnapshot(pRight);
+    }
+    return TRUE;
+}
+
+// "/manifest <manifest file> <folder or snapshot>" writes a sha1sum manifest of a
+// folder, which is walked with hash compare, or of a snapshot taken with /hash.
+// Returns FALSE if the command line is not a manifest export.
+static BOOL ExportCmdLineManifest(_In_ int nArgs, _In_count_(nArgs) PWSTR *apszArgs)
+{
+    if ((nArgs < 1) || (_wcsicmp(apszArgs[0], L"/manifest") != 0))
+    {
+        return FALSE;
+    }
+
+    if (nArgs != 3)
+    {
+        wprintf(L"Usage: /manifest <manifest file> <folder or snapshot>\n");
+        return TRUE;
+    }
+
+    PSCAN_SNAPSHOT pSnapshot;
+    HRESULT hr = OpenCmdLineSnapshot(apszArgs[2], TRUE, &pSnapshot);
+    if (SUCCEEDED(hr))
+    {
+        int nSkipped;
+        hr = ExportSha1Manifest(pSnapshot, apszArgs[1], &nSkipped);
+        if (SUCCEEDED(hr))
+        {
+            wprintf(L"Wrote manifest %s of %s, %d files without a hash skipped\n", apszArgs[1], apszArgs[2], nSkipped);
+        }
+        CloseScanSnapshot(pSnapshot);
+    }
+
+    if (FAILED(hr))
+    {
+        wprintf(L"Cannot write manifest %s of %s, hr: %x\n", apszArgs[1], apszArgs[2], hr);
+    }
+    return TRUE;
+}
+
+// "/catalog <catalog file> /add <folder, snapshot or manifest>" adds a scan to a
+// content catalog, creating the catalog if there is none. "/catalog <catalog file>
+// /query <...>" prints where each file was seen before. Folders are walked with hash compare.
+// Returns FALSE if the command line is not a catalog command.
+static BOOL RunCmdLineCatalog(_In_ int nArgs, _In_count_(nArgs) PWSTR *apszArgs)
+{
+    if ((nArgs < 1) || (_wcsicmp(apszArgs[0], L"/catalog") != 0))
+    {
+        return FALSE;
+    }
+
+    BOOL fAdd = (nArgs == 4) && (_wcsicmp(apszArgs[2], L"/add") == 0);
+    BOOL fQuery = (nArgs == 4) && (_wcsicmp(apszArgs[2], L"/query") == 0);
+    if (!fAdd && !fQuery)
+    {
+        wprintf(L"Usage: /catalog <catalog file> /add|/query <folder, snapshot or manifest>\n");
+        return TRUE;
+    }
+
+    PCONTENT_CATALOG pCatalog = NULL;
+    PSCAN_SNAPSHOT pSnapshot = NULL;
+    HRESULT hr = OpenContentCatalog(apszArgs[1], &pCatalog);
+    if (SUCCEEDED(hr))
+    {
+        hr = OpenCmdLineSnapshot(apszArgs[3], TRUE, &pSnapshot);
+    }
+
+    if (SUCCEEDED(hr) && fAdd)
+    {
+        DWORD dwScanId;
+        hr = AddScanToCatalog(pCatalog, pSnapshot, &dwScanId);
+        if (SUCCEEDED(hr))
+        {
+            wprintf(L"Added %s to catalog %s as scan %u, %d contents at %d locations\n",
+                apszArgs[3], apszArgs[1], dwScanId, pCatalog->nEntries, pCatalog->nLocations);
+        }
+    }
+    else if (SUCCEEDED(hr))
+    {
+        int nFound, nQueried;
+        hr = QueryCatalog(pCatalog, pSnapshot, PrintCatalogResult, NULL, &nFound, &nQueried);
+        if (SUCCEEDED(hr))
+        {
+            wprintf(L"\n%d of %d files of %s are in catalog %s\n", nFound, nQueried, apszArgs[3], apszArgs[1]);
+        }
+    }
+
+    if (FAILED(hr))
+    {
+        wprintf(L"Cannot %s %s with catalog %s, hr: %x\n", (fAdd ? L"add" : L"query"), apszArgs[3], apszArgs[1], hr);
+    }
+
+    if (pSnapshot != NULL)
+    {
+        CloseScanSnapshot(pSnapshot);
+    }
+    if (pCatalog != NULL)
+    {
+        CloseContentCatalog(pCatalog);
+    }
+    return TRUE;
+}
+
+// "/shards <shard folder> <folders>" scans each folder in a worker process of its own, all
+// at once, and merges the shard files they write into the shard folder. The duplicates
+// printed are the same as those of "/hash <folders>" in a single process.
+// "/shardmerge <shard files>" merges the shard files of an earlier scan again.
+// Returns FALSE if the command line is neither.
+static BOOL MergeCmdLineShards(_In_ int nArgs, _In_count_(nArgs) PWSTR *apszArgs)
+{
+    if (nArgs < 1)
+    {
+        return FALSE;
+    }
+
+    BOOL fScan = (_wcsicmp(apszArgs[0], L"/shards") == 0);
+    if (!fScan && (_wcsicmp(apszArgs[0], L"/shardmerge") != 0))
+    {
+        return FALSE;
+    }
+
+    if (nArgs < (fScan ? 3 : 2))
+    {
+        wprintf(L"Usage: /shards <shard folder> <folders>\n       /shardmerge <shard files>\n");
+        return TRUE;
+    }
+
+    PSHARD_MERGE pMerge;
+    HRESULT hr;
+    if (fScan)
+    {
+        wprintf(L"Scanning %d folders in worker processes\n", nArgs - 2);
+        hr = RunShardedScan((PCWSTR*)apszArgs + 2, nArgs - 2, apszArgs[1], &pMerge);
+    }
+    else
+    {
+        hr = MergeShardIndexes((PCWSTR*)apszArgs + 1, nArgs - 1, &pMerge);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        PrintShardMerge(pMerge);
+        DestroyShardMerge(pMerge);
+    }
+    else
+    {
+        wprintf(L"Cannot %s %d shards, hr: %x\n", (fScan ? L"scan" : L"merge"), nArgs - (fScan ? 2 : 1), hr);
+    }
+    return TRUE;
+}
+
+// "/shardscan <root index> <shard file> <folder>", as started by RunShardedScan(): walk
+// the folder with hash compare and write its shard file. The exit code is 0 on success.
+// Returns FALSE if the command line is not that of a shard worker.
+static BOOL RunCmdLineShardWorker(_In_z_ PCWSTR pszCmdLine, _Out_ int *piExitCode)
+{
+    *piExitCode = 1;
+    if ((pszCmdLine == NULL) || (_wcsnicmp(pszCmdLine, SHARD_WORKER_SWITCH, wcslen(SHARD_WORKER_SWITCH)) != 0))
+    {
+        return FALSE;
+    }
+
+    int nArgs;
+    PWSTR *apszArgs = CommandLineToArgvW(pszCmdLine, &nArgs);
+    if (apszArgs == NULL)
+    {
+        return FALSE;
+    }
+
+    if ((nArgs != 4) || (_wcsicmp(apszArgs[0], SHARD_WORKER_SWITCH) != 0))
+    {
+        LocalFree(apszArgs);
+        return FALSE;
+    }
+
+    int iRoot = _wtoi(apszArgs[1]);
+    PDIRINFO pDirInfo;
+    if ((iRoot < 0) || (iRoot >= MAX_DUP_ROOTS))
+    {
+        logerr(L"Shard root index out of range: %s", apszArgs[1]);
+    }
+    else if (!BuildDirTree(apszArgs[3], TRUE, &pDirInfo))
+    {
+        logerr(L"Cannot recursive build files in folder: %s", apszArgs[3]);
+    }
+    else
+    {
+        if (SUCCEEDED(SaveShardIndex(pDirInfo, iRoot, apszArgs[2])))
+        {
+            *piExitCode = 0;
+        }
+        DestroyDirInfo(pDirInfo);
+    }
+
+    LocalFree(apszArgs);
+    return TRUE;
+}
+
+// Open a snapshot file or read a manifest, or walk a folder into a snapshot in memory
+static HRESULT OpenCmdLineSnapshot(_In_z_ PCWSTR pszPath, _In_ BOOL fCompareHashes, _Out_ PSCAN_SNAPSHOT *ppSnapshot)
+{
+    DWORD dwAttributes = GetFileAttributes(pszPath);
+    if ((dwAttributes == INVALID_FILE_ATTRIBUTES) || !(dwAttributes & FILE_ATTRIBUTE_DIRECTORY))
+    {
+        if ((dwAttributes == INVALID_FILE_ATTRIBUTES) || IsScanSnapshotFile(pszPath))
+        {
+            return OpenScanSnapshot(pszPath, ppSnapshot);
+        }
+        return ImportSha1Manifest(pszPath, ppSnapshot, NULL);
+    }
+
+    PDIRINFO pDirInfo;
+    if (!BuildDirTree(pszPath, fCompareHashes, &pDirInfo))
+    {
+        *ppSnapshot = NULL;
+        return E_FAIL;
+    }
+
+    // The snapshot holds copies of all it needs
+    HRESULT hr = CreateScanSnapshot(pDirInfo, ppSnapshot);
+    DestroyDirInfo(pDirInfo);
+    return hr;
+}
+
+static BOOL WINAPI StopIndexCtrlHandler(DWORD dwCtrlType)
+{
+    if ((dwCtrlType == CTRL_C_EVENT) || (dwCtrlType == CTRL_BREAK_EVENT))
+    {
+        InterlockedExchange(&s_lStopIndex, 1);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static void PrintFoundGroup(_In_ PDUPGROUPS pGroups, _In_ PDUPGROUP pGroup, _In_opt_ PVOID pvContext)
+{
+    DBG_UNREFERENCED_PARAMETER(pvContext);
+
+    PFILEINFO pFile = pGroups->apFiles[pGroup->iFirst];
+    wprintf(L"Found %d copies of %lld bytes: %s%s\n", pGroup->nFiles, pGroup->llFilesize, pFile->pszPath, pFile->pszFilename);
+}
+
+static void PrintOutOfCoreDuplicate(_In_ int iSide, _In_z_ PCWSTR pszRelPath, _In_ LONGLONG llSize, _In_opt_ PVOID pvContext)
+{
+    DBG_UNREFERENCED_PARAMETER(pvContext);
+
+    wprintf(L"%s %12lld %s\n", ((iSide == OOC_LEFT) ? L"<" : L">"), llSize, pszRelPath);
+}
+
+static void PrintCatalogResult(
+    _In_ PCONTENT_CATALOG pCatalog,
+    _In_ PSCAN_SNAPSHOT pSnapshot,
+    _In_ const SNAPSHOT_FILE *pFile,
+    _In_opt_ const CATALOG_ENTRY *pEntry,
+    _In_opt_ PVOID pvContext)
+{
+    DBG_UNREFERENCED_PARAMETER(pvContext);
+
+    if (pEntry == NULL)
+    {
+        return;
+    }
+
+    // Print the location seen most recently
+    const CATALOG_LOCATION *pLocation = &pCatalog->aLocations[pEntry->iFirstLocation];
+    for (int i = pLocation->iNext; i >= 0; i = pCatalog->aLocations[i].iNext)
+    {
+        if (pCatalog->aLocations[i].dwLastScanId > pLocation->dwLastScanId)
+        {
+            pLocation = &pCatalog->aLocations[i];
+        }
+    }
+
+    wprintf(L"%s%s: %d locations, last seen in scan %u at %s\n",
+        GetSnapshotFolder(pSnapshot, pFile), GetSnapshotFileName(pSnapshot, pFile),
+        pEntry->nLocations, pLocation->dwLastScanId, pCatalog->pszPaths + pLocation->ichPath);
+}